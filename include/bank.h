@@ -0,0 +1,101 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_BANK_H
+#define GRAVES_BANK_H
+
+#include <sigutils/types.h>
+
+#include <graves.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Detector bank: several detectors (channels) run as a pipeline on a pool
+ * of worker threads. Each detector is split in its two halves
+ * (graves_det_feed_front and graves_det_feed_back), and every half of
+ * every channel is a task. Samples are fed in blocks to a lock-free queue
+ * per channel, the front end turns them into blocks of a second queue, and
+ * the back end takes those. Tasks are spread over the workers, and a worker
+ * with nothing left to do runs the tasks of the others (work stealing).
+ *
+ * A task only runs on one thread at a time and takes its blocks in order,
+ * so whatever the number of threads and however the tasks are scheduled,
+ * each channel produces exactly the chirps of graves_det_feed_block on the
+ * same samples. The chirp callbacks run on the workers: those of a channel
+ * one after the other, those of different channels concurrently.
+ *
+ * The detectors still belong to the caller, who must not touch them (nor
+ * read their levels or save their state) until graves_bank_sync() returns.
+ * Gated detectors are not accepted.
+ *
+ * The bank itself is opaque: its queues and task flags are atomics private
+ * to bank.c, so that this header can be included from C++.
+ */
+
+#define GRAVES_BANK_MAX_THREADS 64
+
+struct graves_bank_params {
+  unsigned int threads;       /* Workers (0: the caller runs the tasks) */
+  unsigned int queue_blocks;  /* Blocks of GRAVES_DET_MIX_BLOCK per queue */
+};
+
+#define graves_bank_params_INITIALIZER \
+{                                      \
+  2,  /* threads */                    \
+  16, /* queue_blocks */               \
+}
+
+typedef struct graves_bank graves_bank_t;
+
+unsigned int graves_bank_get_channel_count(const graves_bank_t *bank);
+
+/*
+ * Queue samples for a channel, splitting them in blocks like
+ * graves_det_feed_block. If its input queue is full, the caller runs tasks
+ * until there is room. Fails if the channel has failed.
+ */
+SUBOOL graves_bank_feed(
+    graves_bank_t *bank,
+    unsigned int channel,
+    const SUCOMPLEX *x,
+    SUSCOUNT len);
+
+/*
+ * Wait until every sample fed so far has gone through its detector (the
+ * caller helps). Fails if any channel has failed.
+ */
+SUBOOL graves_bank_sync(graves_bank_t *bank);
+
+/* Does not sync: samples still queued are dropped */
+void graves_bank_destroy(graves_bank_t *bank);
+
+graves_bank_t *graves_bank_new(
+    const struct graves_bank_params *params,
+    graves_det_t *const *dets,
+    unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_BANK_H */
@@ -0,0 +1,121 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_CHIRP_H
+#define GRAVES_CHIRP_H
+
+#include <util/util.h>
+#include <sigutils/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Chirp buffers. The detector records every chirp into a refcounted
+ * handle taken from a pool. The data passed to the chirp callback lives
+ * in that handle: a consumer that wants to keep it beyond the callback
+ * takes a reference (graves_chirp_ref) instead of copying it, and drops
+ * it (graves_chirp_unref) when done, which gives the buffers back to the
+ * pool. The detector only reuses a handle nobody else references, so it
+ * moves to a fresh one from the pool whenever the consumer kept the last.
+ *
+ * Pools are thread safe and can be shared by many detectors. They are
+ * refcounted too: every detector and every outstanding chirp keeps its
+ * pool alive, so the creator may drop its reference at any time. The
+ * counts are atomics private to chirp.c, so that this header can be
+ * included from C++.
+ */
+
+struct graves_chirp_info {
+  SUSCOUNT t0;  /* Start time */
+  SUFLOAT t0f;  /* Decimal part of the start time */
+
+  SUSCOUNT fs;
+  SUFLOAT  rbw; /* Bandwidth ratio */
+
+  /* Unsigned int length */
+  unsigned int length;
+
+  /* Chirp data */
+  const SUCOMPLEX *x;
+
+  /* Quotient data */
+  const SUFLOAT   *q;
+
+  /* Narrow channel power data */
+  const SUFLOAT   *p_n;
+
+  /* Wide channel power data */
+  const SUFLOAT   *p_w;
+
+  /* Handle owning all of the above */
+  struct graves_chirp *chirp;
+};
+
+/* What the detector records. Handles are always allocated by the pool. */
+struct graves_chirp {
+  struct graves_chirp_info info;
+
+  grow_buf_t x;
+  grow_buf_t q;
+  grow_buf_t p_n;
+  grow_buf_t p_w;
+};
+
+typedef struct graves_chirp graves_chirp_t;
+
+typedef struct graves_chirp_pool graves_chirp_pool_t;
+
+SUINLINE const struct graves_chirp_info *
+graves_chirp_get_info(const graves_chirp_t *chirp)
+{
+  return &chirp->info;
+}
+
+graves_chirp_t *graves_chirp_ref(graves_chirp_t *chirp);
+
+/* Returns the handle to its pool when the last reference is dropped */
+void graves_chirp_unref(graves_chirp_t *chirp);
+
+/* A handle with its buffers emptied (but still allocated), refs = 1 */
+graves_chirp_t *graves_chirp_pool_acquire(graves_chirp_pool_t *pool);
+
+/*
+ * Make sure the pool holds at least `count` free handles whose buffers
+ * can take chirps of `samples` samples without allocating.
+ */
+SUBOOL graves_chirp_pool_reserve(
+    graves_chirp_pool_t *pool,
+    unsigned int count,
+    SUSCOUNT samples);
+
+graves_chirp_pool_t *graves_chirp_pool_ref(graves_chirp_pool_t *pool);
+
+void graves_chirp_pool_unref(graves_chirp_pool_t *pool);
+
+/* Starts with a reference owned by the caller */
+graves_chirp_pool_t *graves_chirp_pool_new(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_CHIRP_H */
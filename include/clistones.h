@@ -22,11 +22,38 @@
 #define _CLISTONES_CLISTONES_H
 
 #include <graves.h>
-#include <alsa/asoundlib.h>
+#include <waterfall.h>
+#include <doppler.h>
+#include <evfile.h>
+#include <ring.h>
+#include <rt.h>
+#include <feed.h>
+#include <recorder.h>
+#include <writer.h>
+#include <stats.h>
+#include <console.h>
+#include <source.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 #define CLISTONES_SAMP_RATE 8000
 #define CLISTONES_READ_SIZE  128
+#define CLISTONES_CAPTURE_RING_SLOTS 64
+
+/* --gate without a level: the first stage triggers at 0.8 x threshold SNR */
+#define CLISTONES_DEFAULT_GATE SU_ADDSFX(.8)
+
+#define CLISTONES_CHECKPOINT_MAGIC   "CLSTCKPT"
+#define CLISTONES_CHECKPOINT_VERSION 1
+
+/* Followed by the detector state */
+struct clistones_checkpoint_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t event_count;
+};
 
 struct clistones_params {
   const char *output_dir;
@@ -35,6 +62,33 @@ struct clistones_params {
   SUFLOAT snr_threshold;
   SUFLOAT duration_threshold;
   unsigned int cycle_len;
+  SUBOOL waterfall;
+  SUBOOL adaptive;
+  SUBOOL realtime;
+  struct clistones_rt_params rt;
+  const char *feed_name;
+  unsigned int feed_decim;
+  SUBOOL record;
+  uint64_t record_segment_size;
+  SUFLOAT record_keep_hours;
+  uint64_t record_keep_bytes;
+  SUBOOL record_direct;
+  enum clistones_writer_backend output_backend;
+  unsigned int stats_interval;
+  SUBOOL headless;
+  const char *input;
+  enum clistones_sample_format input_format;
+  SUBOOL input_format_set;  /* Also applies to the capture device */
+  SUFLOAT stall_timeout;
+  SUBOOL iq;  /* Stereo input is complex baseband (I left, Q right) */
+  const char *checkpoint;            /* Detector state file (NULL: none) */
+  unsigned int checkpoint_interval;  /* Seconds */
+  enum graves_est_type estimator;
+  SUFLOAT gate;  /* Two-tier trigger level (0: disabled) */
+  SUFLOAT stop;     /* Chirp end level, times the trigger SNR (0: 1) */
+  SUFLOAT holdoff;  /* Gaps that do not end a chirp, in seconds */
+  const struct clistones_synth_params *synth;  /* Synthetic source */
+  SUBOOL compact_events;  /* I/Q and q only, see evfile.h */
 };
 
 #define clistones_params_INITIALIZER    \
@@ -44,7 +98,34 @@ struct clistones_params {
   1000.,     /* freq_offset */          \
   1,         /* snr_threshold */        \
   0.25,      /* duration_threshold */   \
-  10         /* cycle_len */            \
+  10,        /* cycle_len */            \
+  SU_FALSE,  /* waterfall */            \
+  SU_FALSE,  /* adaptive */             \
+  SU_FALSE,  /* realtime */             \
+  clistones_rt_params_INITIALIZER,      \
+  NULL,      /* feed_name */            \
+  CLISTONES_FEED_DEFAULT_DECIM,         \
+  SU_FALSE,  /* record */               \
+  64ull << 20, /* record_segment */     \
+  0,         /* record_keep_hours */    \
+  0,         /* record_keep_bytes */    \
+  SU_FALSE,  /* record_direct */        \
+  CLISTONES_WRITER_BACKEND_AUTO,        \
+  60,        /* stats_interval */       \
+  SU_FALSE,  /* headless */             \
+  NULL,      /* input */                \
+  CLISTONES_SAMPLE_FORMAT_S16_LE,       \
+  SU_FALSE,  /* input_format_set */     \
+  5,         /* stall_timeout */        \
+  SU_FALSE,  /* iq */                   \
+  NULL,      /* checkpoint */           \
+  60,        /* checkpoint_interval */  \
+  GRAVES_EST_IIR, /* estimator */       \
+  0,         /* gate */                 \
+  0,         /* stop */                 \
+  0,         /* holdoff */              \
+  NULL,      /* synth */                \
+  SU_FALSE,  /* compact_events */       \
 }
 
 struct clistones_chirp_summary {
@@ -57,19 +138,64 @@ struct clistones_chirp_summary {
   SUBOOL  weak;
 };
 
+typedef SUBOOL (*clistones_event_cb_t)(
+    void *privdata,
+    const struct clistones_chirp_summary *summary);
+
 struct clistones {
   struct clistones_params params;
   struct graves_det_params det_params;
   char *directory;
   graves_det_t *detector;
-  snd_pcm_t *pcm;
-  FILE *logfp;
+  graves_wf_t *waterfall;
+  graves_doppler_t *doppler;
+  clistones_source_t *source;
+
+  /* Asynchronous output */
+  clistones_writer_t *writer;
+  int log;
+  grow_buf_t event_buf;
+
+  /* Event statistics */
+  clistones_stats_t *stats;
+  grow_buf_t summary_buf;
+  SUSCOUNT stats_samples;
+
+  /* Detector state checkpoints */
+  grow_buf_t checkpoint_buf;
+  SUSCOUNT checkpoint_samples;
+
+  /* Console rendering (NULL in headless mode) */
+  clistones_console_t *console;
 
   unsigned int event_count;
 
-  uint16_t *buffer;
-  SUBOOL cancelled;
+  void *buffer;         /* Block in the native format of the source */
+  SUCOMPLEX *samples;   /* Same block, converted */
+  struct timespec block_time;  /* When that block was captured */
+  atomic_bool cancelled;  /* Set by the capture thread and signal handlers */
   struct timeval first;
+
+  /* Shared memory live feed */
+  clistones_feed_t *feed;
+  unsigned int feed_count;
+
+  /* Continuous raw capture */
+  clistones_recorder_t *recorder;
+
+  /* Called for every accepted event (soak tests) */
+  clistones_event_cb_t on_event;
+  void *on_event_data;
+
+  /* Realtime mode */
+  clistones_ring_t *capture_ring;
+  struct timespec *capture_times;  /* Per ring slot */
+  pthread_t capture_thread;
+  sem_t capture_avail;
+  sem_t capture_ready;
+  SUBOOL have_sems;
+  SUBOOL capture_failed;
+  struct clistones_rt_report capture_report;
 };
 
 typedef struct clistones clistones_t;
@@ -80,6 +206,19 @@ clistones_data_directory(const clistones_t *self)
   return self->directory;
 }
 
+/* Capture time (CLOCK_MONOTONIC) of the block being processed */
+SUINLINE const struct timespec *
+clistones_get_block_time(const clistones_t *self)
+{
+  return &self->block_time;
+}
+
+/* Run from the detection thread, after the event was queued for writing */
+void clistones_set_event_callback(
+    clistones_t *self,
+    clistones_event_cb_t on_event,
+    void *privdata);
+
 clistones_t *clistones_new(const struct clistones_params *params);
 void clistones_cancel(clistones_t *self);
 SUBOOL clistones_loop(clistones_t *self);
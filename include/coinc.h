@@ -0,0 +1,209 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+#ifndef _CLISTONES_COINC_H
+#define _CLISTONES_COINC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <feed.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Coincidence engine. Matches the events of several stations that happened
+ * at about the same time, as needed for triangulation. Like the live feed,
+ * it only depends on the C library.
+ *
+ * Events are pushed per station, in any order within a station (they are
+ * kept sorted), and released to a streaming merge once no station can
+ * send anything earlier: every station that is not finished has sent
+ * something more than `reorder` seconds later, or the caller moved the
+ * watermark past them (see clistones_coinc_advance). Logs are written when
+ * echoes end but events are matched by their start, so `reorder` must
+ * cover the longest echo. The merge keeps the released events of the
+ * last `window` seconds in a time-sorted ring, which is the only place
+ * where each new event is looked for matches, so the cost per event only
+ * depends on the number of events inside one window.
+ *
+ * Every pair of events from different stations less than `window` apart
+ * is scored with the agreement of their times, Doppler velocities and
+ * SNRs (gaussian weights of width vel_sigma and snr_sigma, the latter in
+ * dB), and reported if the product of the three is at least min_score.
+ * Each pair is reported once, when its later event is released.
+ */
+
+struct clistones_coinc_event {
+  int64_t  time;      /* Start, microseconds since the epoch */
+  uint32_t index;     /* Event index at its station */
+  float    duration;  /* Seconds */
+  float    mean_snr;
+  float    max_snr;
+  float    mean_vel;  /* m/s */
+};
+
+struct clistones_coinc_match {
+  unsigned int station[2];  /* Earlier event first */
+  struct clistones_coinc_event event[2];
+  double   dt;              /* Seconds, event[1] - event[0] */
+  float    time_score;
+  float    vel_score;
+  float    snr_score;
+  float    score;           /* Product of the three */
+};
+
+struct clistones_coinc_params {
+  double window;     /* Seconds */
+  double reorder;    /* Seconds, disorder allowed within a station */
+  float  vel_sigma;  /* m/s */
+  float  snr_sigma;  /* dB */
+  float  min_score;
+};
+
+#define clistones_coinc_params_INITIALIZER  \
+{                                           \
+  1.,        /* window */                   \
+  10.,       /* reorder */                  \
+  15.,       /* vel_sigma */                \
+  6.,        /* snr_sigma */                \
+  0.,        /* min_score */                \
+}
+
+/* Return 0 to stop the engine (clistones_coinc_push fails then) */
+typedef int (*clistones_coinc_match_cb_t)(
+    void *privdata,
+    const struct clistones_coinc_match *match);
+
+struct clistones_coinc_entry {
+  struct clistones_coinc_event event;
+  unsigned int station;
+};
+
+/* Events of a station waiting for the watermark, sorted by time */
+struct clistones_coinc_station {
+  char    *name;
+  struct clistones_coinc_event *queue;
+  size_t   head;
+  size_t   count;
+  size_t   alloc;
+  int64_t  newest;    /* Latest time pushed */
+  int      has_data;
+  int      heap_pos;  /* Position in the merge heap, -1 if not there */
+  int      finished;
+  uint64_t late;      /* Events older than the watermark, dropped */
+};
+
+struct clistones_coinc {
+  struct clistones_coinc_params params;
+  clistones_coinc_match_cb_t on_match;
+  void *privdata;
+  int64_t window_us;
+  int64_t reorder_us;
+
+  struct clistones_coinc_station *stations;
+  unsigned int station_count;
+
+  /* Merge heap: stations with queued events, by time of the first one */
+  unsigned int *heap;
+  unsigned int heap_size;
+
+  /* Released events of the last window, oldest first */
+  struct clistones_coinc_entry *ring;
+  size_t   ring_head;
+  size_t   ring_count;
+  size_t   ring_alloc;
+
+  int64_t  limit;     /* Oldest newest event of the unfinished stations */
+  int64_t  advanced;  /* Set by clistones_coinc_advance */
+  int64_t  watermark; /* Everything up to here was released */
+  int      stopped;
+
+  uint64_t released;
+  uint64_t matches;
+};
+
+typedef struct clistones_coinc clistones_coinc_t;
+
+/*
+ * Parse a line of events.csv. Logs have the time of the end of each echo,
+ * events are matched by their start. Returns 1 on success, 0 otherwise.
+ */
+int clistones_coinc_event_from_csv(
+    const char *line,
+    struct clistones_coinc_event *event);
+
+/* Returns 0 for weak events, which are not matched */
+int clistones_coinc_event_from_feed(
+    const struct clistones_feed_event *record,
+    struct clistones_coinc_event *event);
+
+/* Returns the station number, or -1 (and sets errno) on failure */
+int clistones_coinc_add_station(clistones_coinc_t *coinc, const char *name);
+
+static inline const char *
+clistones_coinc_get_station_name(
+    const clistones_coinc_t *coinc,
+    unsigned int station)
+{
+  return coinc->stations[station].name;
+}
+
+static inline uint64_t
+clistones_coinc_get_late(const clistones_coinc_t *coinc, unsigned int station)
+{
+  return coinc->stations[station].late;
+}
+
+/*
+ * Queue an event and release whatever the watermark allows. Events older
+ * than the watermark are dropped and counted as late.
+ */
+int clistones_coinc_push(
+    clistones_coinc_t *coinc,
+    unsigned int station,
+    const struct clistones_coinc_event *event);
+
+/* The station will not send anything else (e.g. end of its log) */
+int clistones_coinc_finish(clistones_coinc_t *coinc, unsigned int station);
+
+/*
+ * Declare that nothing older than `time` will arrive from any station,
+ * so that quiet stations do not hold back the others (e.g. wall clock
+ * minus the longest expected delay, when following live logs).
+ */
+int clistones_coinc_advance(clistones_coinc_t *coinc, int64_t time);
+
+/* Release everything queued (end of a batch run) */
+int clistones_coinc_flush(clistones_coinc_t *coinc);
+
+void clistones_coinc_destroy(clistones_coinc_t *coinc);
+
+/* Returns NULL and sets errno on failure */
+clistones_coinc_t *clistones_coinc_new(
+    const struct clistones_coinc_params *params,
+    clistones_coinc_match_cb_t on_match,
+    void *privdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_COINC_H */
@@ -0,0 +1,151 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_CONSOLE_H
+#define _CLISTONES_CONSOLE_H
+
+#include <sigutils/types.h>
+#include <ring.h>
+#include <stats.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Console output. The detector only fills fixed-size messages in a
+ * lock-free ring; a low priority thread renders them. Rendering is rate
+ * limited (token bucket): events arriving faster than that are coalesced
+ * into a single line, and only the latest report is kept. If the terminal
+ * blocks, the ring fills up and messages are dropped, never the detector.
+ */
+
+#define CLISTONES_CONSOLE_FLUSH_MS 250
+
+enum clistones_console_msg_type {
+  CLISTONES_CONSOLE_MSG_EVENT,
+  CLISTONES_CONSOLE_MSG_REPORT
+};
+
+struct clistones_console_event {
+  unsigned int index;
+  struct timeval tv;
+  SUFLOAT duration;
+  SUFLOAT mean_snr;   /* Linear */
+  SUFLOAT max_snr;    /* Linear */
+  SUFLOAT mean_vel;
+};
+
+struct clistones_console_report {
+  struct timeval tv;
+  SUFLOAT zhr;
+  SUFLOAT rates[CLISTONES_STATS_WINDOW_COUNT];
+  SUFLOAT median_duration;
+  SUFLOAT median_snr;       /* dB */
+  SUFLOAT median_max_snr;   /* dB */
+  SUFLOAT median_vel;
+  SUBOOL  have_noise;
+  SUFLOAT noise_q;
+  SUFLOAT q_threshold;
+};
+
+struct clistones_console_msg {
+  enum clistones_console_msg_type type;
+  union {
+    struct clistones_console_event  event;
+    struct clistones_console_report report;
+  } u;
+};
+
+struct clistones_console_params {
+  unsigned int slots;          /* Messages in the queue */
+  SUFLOAT      lines_per_sec;  /* Sustained rendering rate */
+  unsigned int burst;          /* Lines that can be rendered at once */
+  SUBOOL       colors;         /* ANSI colors */
+};
+
+#define clistones_console_params_INITIALIZER    \
+{                                               \
+  256,      /* slots */                         \
+  10,       /* lines_per_sec */                 \
+  20,       /* burst */                         \
+  SU_TRUE,  /* colors */                        \
+}
+
+/* Events merged into a single line */
+struct clistones_console_coalesced {
+  unsigned int count;
+  unsigned int first;
+  SUFLOAT max_snr;
+  struct clistones_console_event last;
+};
+
+struct clistones_console {
+  struct clistones_console_params params;
+  clistones_ring_t *ring;
+
+  /* Consumer side */
+  pthread_t thread;
+  SUBOOL    thread_running;
+  sem_t     avail;
+  SUBOOL    have_sem;
+  atomic_bool halting;
+
+  SUFLOAT   tokens;
+  struct timespec last_refill;
+  struct clistones_console_coalesced coalesced;
+  struct clistones_console_report report;
+  SUBOOL    have_report;
+  unsigned long dropped_reported;
+};
+
+typedef struct clistones_console clistones_console_t;
+
+/* Producer side: never block */
+void clistones_console_push_event(
+    clistones_console_t *console,
+    const struct clistones_console_event *event);
+
+void clistones_console_push_report(
+    clistones_console_t *console,
+    const struct clistones_console_report *report);
+
+SUINLINE void
+clistones_console_prefault(clistones_console_t *console)
+{
+  clistones_ring_prefault(console->ring);
+}
+
+/* Renders everything still queued and stops the consumer */
+void clistones_console_destroy(clistones_console_t *console);
+
+clistones_console_t *clistones_console_new(
+    const struct clistones_console_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_CONSOLE_H */
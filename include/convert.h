@@ -0,0 +1,74 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_CONVERT_H
+#define _CLISTONES_CONVERT_H
+
+#include <sigutils/types.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sample format conversion. Turns blocks of frames in the native format of
+ * a source (mono or interleaved I/Q) into the complex samples taken by the
+ * detector. Integer formats are scaled to [-1, 1): the full scale of S16_LE
+ * and S32_LE is 2^15 and 2^31 respectively. Floats are taken as they are.
+ *
+ * Every kernel is a single pass over the block with one multiply per value,
+ * writing the real and imaginary parts of the output as a flat array of
+ * reals, so that the compiler can vectorize it.
+ */
+
+enum clistones_sample_format {
+  CLISTONES_SAMPLE_FORMAT_S16_LE,
+  CLISTONES_SAMPLE_FORMAT_S32_LE,
+  CLISTONES_SAMPLE_FORMAT_F32_LE
+};
+
+SUINLINE size_t
+clistones_sample_format_size(enum clistones_sample_format format)
+{
+  return format == CLISTONES_SAMPLE_FORMAT_S16_LE ? 2 : 4;
+}
+
+/* Format name, as used in the raw capture index */
+const char *clistones_sample_format_name(enum clistones_sample_format format);
+
+/* Accepts s16, s32 and f32, and the names of the raw capture index */
+SUBOOL clistones_sample_format_parse(
+    const char *name,
+    enum clistones_sample_format *format);
+
+/* Convert len frames of 1 (real) or 2 (I/Q) channels */
+void clistones_convert(
+    enum clistones_sample_format format,
+    unsigned int channels,
+    const void *src,
+    SUCOMPLEX *dst,
+    unsigned int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_CONVERT_H */
@@ -0,0 +1,119 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_DOPPLER_H
+#define GRAVES_DOPPLER_H
+
+#include <graves.h>
+#include <fftw3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Doppler estimator for registered chirps. Instead of differentiating the
+ * phase sample by sample, the chirp is split in overlapping FFT frames and
+ * the frequency of the spectral peak of each one is refined by parabolic
+ * interpolation. The result is a decimated velocity track (one point per
+ * hop) with a confidence value per point, and a robust velocity for the
+ * whole event (the confidence-weighted median of the track).
+ */
+
+struct graves_doppler_params {
+  SUSCOUNT     fs;
+  unsigned int fft_size;    /* Must be a power of 2 */
+  unsigned int hop;         /* Samples between track points */
+  SUFLOAT      max_doppler; /* Half width of the search band (Hz) */
+};
+
+#define graves_doppler_params_INITIALIZER     \
+{                                             \
+  8000,             /* fs */                  \
+  512,              /* fft_size */            \
+  128,              /* hop */                 \
+  SU_ADDSFX(300.),  /* max_doppler */         \
+}
+
+struct graves_doppler_point {
+  SUFLOAT t;          /* Seconds since the beginning of the chirp */
+  SUFLOAT vel;        /* Radial velocity (m/s) */
+  SUFLOAT confidence; /* Fraction of the band power around the peak (0-1) */
+  SUFLOAT snr;        /* Mean SNR of the frame (linear) */
+};
+
+struct graves_doppler {
+  struct graves_doppler_params params;
+
+  int half;           /* Bins at each side of DC */
+
+  SUFLOAT *window;
+  SU_FFTW(_complex) *fft_in;
+  SU_FFTW(_complex) *fft_out;
+  SU_FFTW(_plan)     plan;
+
+  grow_buf_t track;
+  grow_buf_t scratch;  /* Sorting space for the weighted median */
+
+  SUFLOAT velocity;    /* Robust velocity of the last chirp */
+};
+
+typedef struct graves_doppler graves_doppler_t;
+
+SUINLINE const struct graves_doppler_point *
+graves_doppler_get_track(const graves_doppler_t *est, unsigned int *len)
+{
+  *len = (unsigned int) (grow_buf_get_size(&est->track)
+      / sizeof(struct graves_doppler_point));
+
+  return (const struct graves_doppler_point *)
+      grow_buf_get_buffer(&est->track);
+}
+
+SUINLINE SUFLOAT
+graves_doppler_get_velocity(const graves_doppler_t *est)
+{
+  return est->velocity;
+}
+
+/*
+ * Compute the Doppler track of a chirp. The SNR of each point is derived
+ * from the quotient data, as in graves_det_q_to_snr.
+ */
+SUBOOL graves_doppler_estimate(
+    graves_doppler_t *est,
+    const SUCOMPLEX *x,
+    const SUFLOAT *q,
+    unsigned int length,
+    SUFLOAT ratio);
+
+/* Preallocate and touch the buffers needed for chirps up to `length` */
+SUBOOL graves_doppler_prefault(graves_doppler_t *est, unsigned int length);
+
+void graves_doppler_destroy(graves_doppler_t *est);
+
+graves_doppler_t *graves_doppler_new(
+    const struct graves_doppler_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_DOPPLER_H */
@@ -0,0 +1,158 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_ESTIMATOR_H
+#define GRAVES_ESTIMATOR_H
+
+#include <sigutils/types.h>
+#include <sigutils/iir.h>
+#include <util/util.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Channel filters of the power estimator. The detector feeds every
+ * (mixed down) sample through a wide and a narrow low pass filter and
+ * compares the power at their outputs. Two backends are available:
+ *
+ *   IIR:    4th order Butterworth filters. Sharp cutoff, but about twenty
+ *           multiply-adds per sample and filter.
+ *   BOXCAR: CIC filters made of GRAVES_BOXCAR_STAGES cascaded moving sums,
+ *           run on fixed point samples with integer adds and subtracts
+ *           only (which keeps them exact, free of drift). Their length is
+ *           chosen to match the 3 dB cutoff of the IIR filters, but the
+ *           sidelobes (-26 dB) are much higher: strong signals or
+ *           interference out of the narrow channel leak into it, which
+ *           lowers Q discrimination. Good enough for clean bands.
+ *
+ * `ratio` is the noise-only p_n / p_w of the chosen filters, calibrated
+ * from their equivalent noise bandwidths.
+ */
+
+#define GRAVES_BOXCAR_STAGES 2
+#define GRAVES_BOXCAR_SCALE  SU_ADDSFX(1048576.) /* 2^20 */
+
+enum graves_est_type {
+  GRAVES_EST_IIR,
+  GRAVES_EST_BOXCAR
+};
+
+struct graves_boxcar {
+  unsigned int length;
+  unsigned int p;
+  int64_t  sum[GRAVES_BOXCAR_STAGES][2];
+  int64_t *ring;   /* Stage inputs, length I/Q pairs per stage */
+  SUFLOAT  gain;   /* Back to float, with unity DC gain */
+};
+
+struct graves_est {
+  enum graves_est_type type;
+  SUFLOAT ratio;
+
+  /* IIR backend */
+  su_iir_filt_t lpf1;   /* Wide channel */
+  su_iir_filt_t lpf2;   /* Narrow channel */
+
+  /* BOXCAR backend */
+  struct graves_boxcar box1;
+  struct graves_boxcar box2;
+};
+
+typedef struct graves_est graves_est_t;
+
+SUINLINE SUCOMPLEX
+graves_boxcar_feed(struct graves_boxcar *box, SUCOMPLEX x)
+{
+  int64_t *slot = box->ring + 2 * box->p;
+  int64_t re = (int64_t) (SU_C_REAL(x) * GRAVES_BOXCAR_SCALE);
+  int64_t im = (int64_t) (SU_C_IMAG(x) * GRAVES_BOXCAR_SCALE);
+  int64_t old_re, old_im;
+  unsigned int k;
+
+  for (k = 0; k < GRAVES_BOXCAR_STAGES; ++k) {
+    old_re  = slot[0];
+    old_im  = slot[1];
+    slot[0] = re;
+    slot[1] = im;
+
+    box->sum[k][0] += re - old_re;
+    box->sum[k][1] += im - old_im;
+
+    re = box->sum[k][0];
+    im = box->sum[k][1];
+
+    slot += 2 * box->length;
+  }
+
+  if (++box->p == box->length)
+    box->p = 0;
+
+  return box->gain * ((SUFLOAT) re + SU_I * (SUFLOAT) im);
+}
+
+/* Filter one sample through both channels */
+SUINLINE void
+graves_est_feed(
+    graves_est_t *est,
+    SUCOMPLEX x,
+    SUCOMPLEX *y_w,
+    SUCOMPLEX *y_n)
+{
+  if (est->type == GRAVES_EST_BOXCAR) {
+    *y_w = graves_boxcar_feed(&est->box1, x);
+    *y_n = graves_boxcar_feed(&est->box2, x);
+  } else {
+    *y_w = su_iir_filt_feed(&est->lpf1, x);
+    *y_n = su_iir_filt_feed(&est->lpf2, x);
+  }
+}
+
+const char *graves_est_type_name(enum graves_est_type type);
+
+SUBOOL graves_est_type_from_name(const char *name, enum graves_est_type *type);
+
+/* Size of the filter memories, as saved by graves_est_save_state */
+size_t graves_est_state_size(const graves_est_t *est);
+
+SUBOOL graves_est_save_state(const graves_est_t *est, grow_buf_t *buf);
+
+/* Reads exactly graves_est_state_size() bytes */
+void graves_est_restore_state(graves_est_t *est, const void *data);
+
+/* Clear the filter memories, as if no sample had been fed */
+void graves_est_reset(graves_est_t *est);
+
+void graves_est_finalize(graves_est_t *est);
+
+/* Cutoff frequencies are normalized */
+SUBOOL graves_est_init(
+    graves_est_t *est,
+    enum graves_est_type type,
+    SUFLOAT lpf1,
+    SUFLOAT lpf2);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_ESTIMATOR_H */
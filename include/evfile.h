@@ -0,0 +1,154 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+#ifndef _CLISTONES_EVFILE_H
+#define _CLISTONES_EVFILE_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <sigutils/types.h>
+#include <doppler.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Event files (event_NNNNNN.dat). They start with a text header of 32
+ * byte "KEY =     VALUE" records ending in "DATA SECTION START", followed
+ * by binary blocks in native byte order. There are three kinds:
+ *
+ *   Chirp:     I/Q samples, SNR per sample, and the Doppler track (one
+ *              velocity and one confidence per DOPPLER_HOP samples).
+ *   Compact:   I/Q samples and the power quotient q per sample, coded in
+ *              16 bits. The header has everything needed to derive the SNR
+ *              and the Doppler track from them (Q_SCALE, SNR_RATIO,
+ *              CENTER_FREQ and the DOPPLER_ parameters).
+ *   Waterfall: the time, velocity and SNR blocks of an STFT track.
+ *
+ * Compact files are about a sixth smaller than chirp files (the I/Q block
+ * is most of both), and the station does not write the derived data. The
+ * reader computes it on the first access.
+ *
+ * q is coded as c = -Q_SCALE * log2(1 - q). Since 1 + SNR is proportional
+ * to 1 / (1 - q), it keeps a relative precision of 0.02% from the noise
+ * floor up to 96 dB.
+ */
+
+#define CLISTONES_EVFILE_RECORD_SIZE 32
+#define CLISTONES_EVFILE_Q_SCALE     2048
+#define CLISTONES_EVFILE_Q_OCTAVES   32 /* 65536 / Q_SCALE */
+
+enum clistones_evfile_type {
+  CLISTONES_EVFILE_CHIRP,
+  CLISTONES_EVFILE_COMPACT,
+  CLISTONES_EVFILE_WATERFALL
+};
+
+SUINLINE uint16_t
+clistones_evfile_q_to_code(SUFLOAT q)
+{
+  SUFLOAT c;
+
+  if (q <= 0)
+    return 0;
+
+  if (q >= 1)
+    return UINT16_MAX;
+
+  c = -CLISTONES_EVFILE_Q_SCALE * SU_LOG(1 - q) / SU_LOG(2) + SU_ADDSFX(.5);
+
+  return c >= UINT16_MAX ? UINT16_MAX : (uint16_t) c;
+}
+
+struct clistones_evfile {
+  enum clistones_evfile_type type;
+  int      index;
+  struct timeval tv;
+  SUSCOUNT fs;
+  unsigned int length;      /* Samples, or track points (waterfall) */
+
+  /* Compact files only */
+  SUFLOAT  ratio;           /* Filter bandwidth ratio, for the SNR */
+  SUFLOAT  center_freq;     /* Frequency shift of the detector */
+  struct graves_doppler_params doppler_params;
+
+  SUCOMPLEX *x;             /* NULL for waterfall files */
+  uint16_t *codes;          /* Coded q (compact) */
+  SUFLOAT  *q;              /* Decoded on the first access */
+  SUFLOAT  *snr;            /* Per sample, read or derived */
+
+  /* Doppler track, read or derived */
+  graves_doppler_t *doppler;
+  struct graves_doppler_point *track;
+  unsigned int track_len;
+  unsigned int hop;
+  SUFLOAT  velocity;
+  SUBOOL   have_track;
+};
+
+typedef struct clistones_evfile clistones_evfile_t;
+
+SUINLINE enum clistones_evfile_type
+clistones_evfile_get_type(const clistones_evfile_t *file)
+{
+  return file->type;
+}
+
+/* Chirp and compact files only */
+SUINLINE const SUCOMPLEX *
+clistones_evfile_get_iq(const clistones_evfile_t *file, unsigned int *len)
+{
+  *len = file->x != NULL ? file->length : 0;
+
+  return file->x;
+}
+
+/* Power quotient (compact files only) */
+const SUFLOAT *clistones_evfile_get_q(clistones_evfile_t *file);
+
+/* SNR per sample (chirp and compact files only) */
+const SUFLOAT *clistones_evfile_get_snr(clistones_evfile_t *file);
+
+/*
+ * Doppler track. Compact files get it from the same estimator as the
+ * program. Chirp files only store the smoothed velocity and the confidence
+ * of each point; times and SNRs are filled in from the SNR block.
+ */
+const struct graves_doppler_point *clistones_evfile_get_track(
+    clistones_evfile_t *file,
+    unsigned int *len);
+
+/*
+ * Velocity of the event. Exactly the one in events.csv for compact files,
+ * the weighted median of the smoothed track (within a fraction of a m/s)
+ * for chirp files.
+ */
+SUBOOL clistones_evfile_get_velocity(clistones_evfile_t *file, SUFLOAT *vel);
+
+void clistones_evfile_close(clistones_evfile_t *file);
+
+clistones_evfile_t *clistones_evfile_open(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_EVFILE_H */
@@ -0,0 +1,165 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_FEED_H
+#define _CLISTONES_FEED_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Live feed of detected events and detector power levels, published in a
+ * POSIX shared memory object. Each stream is a ring of slots protected by
+ * a per-slot sequence number (seqlock): the writer never waits for anyone,
+ * and readers detect both empty slots and slots overwritten while they
+ * were reading them. Any number of readers may attach; a reader that falls
+ * more than a ring behind skips ahead and accounts the lost records.
+ *
+ * This header (and feed.c) only depends on the C library, so that
+ * consumers can link against it without pulling sigutils in.
+ */
+
+#define CLISTONES_FEED_MAGIC         0x46534c43 /* "CLSF" */
+#define CLISTONES_FEED_VERSION       1
+#define CLISTONES_FEED_EVENT_SLOTS   256
+#define CLISTONES_FEED_POWER_SLOTS   4096
+#define CLISTONES_FEED_DEFAULT_DECIM 80
+#define CLISTONES_FEED_CACHE_LINE    64
+
+struct clistones_feed_event {
+  uint32_t index;
+  uint32_t weak;
+  int64_t  tv_sec;
+  int64_t  tv_usec;
+  float    duration;
+  float    mean_snr;
+  float    max_snr;
+  float    mean_vel;
+};
+
+struct clistones_feed_power {
+  uint64_t sample;    /* Sample counter of the detector */
+  float    p_n;       /* Narrow channel power */
+  float    p_w;       /* Wide channel power */
+  float    q;         /* Power quotient */
+  float    noise_q;   /* Noise floor estimate of Q */
+};
+
+struct clistones_feed_event_slot {
+  _Alignas(CLISTONES_FEED_CACHE_LINE) atomic_uint_fast64_t seq;
+  struct clistones_feed_event data;
+};
+
+struct clistones_feed_power_slot {
+  _Alignas(CLISTONES_FEED_CACHE_LINE) atomic_uint_fast64_t seq;
+  struct clistones_feed_power data;
+};
+
+struct clistones_feed_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t event_slots;
+  uint32_t power_slots;
+  uint64_t fs;
+  uint32_t power_decim;
+  uint32_t ratio_ppm;   /* Filter bandwidth ratio, in parts per million */
+
+  _Alignas(CLISTONES_FEED_CACHE_LINE) atomic_uint_fast64_t event_head;
+  _Alignas(CLISTONES_FEED_CACHE_LINE) atomic_uint_fast64_t power_head;
+};
+
+struct clistones_feed_shm {
+  struct clistones_feed_header header;
+  struct clistones_feed_event_slot events[CLISTONES_FEED_EVENT_SLOTS];
+  struct clistones_feed_power_slot power[CLISTONES_FEED_POWER_SLOTS];
+};
+
+/* Writer side */
+struct clistones_feed {
+  char *name;
+  struct clistones_feed_shm *shm;
+};
+
+typedef struct clistones_feed clistones_feed_t;
+
+/*
+ * Create (or take over) the shared memory object `name`. Returns NULL and
+ * sets errno on failure.
+ */
+clistones_feed_t *clistones_feed_new(
+    const char *name,
+    uint64_t fs,
+    uint32_t power_decim,
+    float ratio);
+
+void clistones_feed_publish_event(
+    clistones_feed_t *feed,
+    const struct clistones_feed_event *event);
+
+void clistones_feed_publish_power(
+    clistones_feed_t *feed,
+    const struct clistones_feed_power *power);
+
+void clistones_feed_destroy(clistones_feed_t *feed);
+
+/* Reader side */
+struct clistones_feed_reader {
+  const struct clistones_feed_shm *shm;
+  uint64_t next_event;
+  uint64_t next_power;
+  uint64_t lost_events;
+  uint64_t lost_power;
+};
+
+typedef struct clistones_feed_reader clistones_feed_reader_t;
+
+/*
+ * Attach to a running feed. Readers start at the current head, i.e. they
+ * only see records published after attaching. Returns NULL and sets errno
+ * on failure.
+ */
+clistones_feed_reader_t *clistones_feed_reader_open(const char *name);
+
+/* Return 1 if a record was copied to `out`, 0 if there is none pending */
+int clistones_feed_reader_next_event(
+    clistones_feed_reader_t *reader,
+    struct clistones_feed_event *out);
+
+int clistones_feed_reader_next_power(
+    clistones_feed_reader_t *reader,
+    struct clistones_feed_power *out);
+
+static inline const struct clistones_feed_header *
+clistones_feed_reader_get_header(const clistones_feed_reader_t *reader)
+{
+  return &reader->shm->header;
+}
+
+void clistones_feed_reader_close(clistones_feed_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_FEED_H */
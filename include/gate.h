@@ -0,0 +1,116 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_GATE_H
+#define GRAVES_GATE_H
+
+#include <sigutils/types.h>
+#include <util/util.h>
+#include <noisefloor.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * First tier of the detector: a cheap check for narrowband energy around
+ * 0 Hz that decides when the full detector needs to run. Mixed samples
+ * are integrated and dumped in blocks of `decim` samples (a boxcar channel
+ * about fs / decim wide) and, for every block, the power in that channel
+ * is divided by the total power:
+ *
+ *   r = |sum(x)|^2 / (decim * sum(|x|^2))
+ *
+ * which is around 1 / decim for noise and tends to 1 for a carrier. The
+ * mean of r over the last `window` blocks is compared to `level` times
+ * its median over the last `length` windows (the floor). The gate opens
+ * as soon as the mean goes above it, and closes after a whole window
+ * below it. It stays open until the floor has seen GRAVES_NF_MIN_BLOCKS
+ * windows.
+ */
+
+#define GRAVES_GATE_FLOOR_SPAN SU_ADDSFX(8.) /* Floor histogram, in 1 / decim */
+
+struct graves_gate {
+  SUSCOUNT decim;
+  SUSCOUNT window;
+  SUFLOAT  level;
+
+  /* Block accumulator */
+  SUCOMPLEX sum;
+  SUFLOAT   power;
+  SUSCOUNT  count;
+
+  /* Ratios of the last blocks */
+  SUFLOAT  *r;
+  SUSCOUNT  p;
+  SUFLOAT   r_sum;
+
+  graves_nf_t *floor;
+  SUSCOUNT quiet;  /* Windows below the level, in blocks */
+  SUBOOL   open;
+};
+
+typedef struct graves_gate graves_gate_t;
+
+SUINLINE SUBOOL
+graves_gate_is_open(const graves_gate_t *gate)
+{
+  return gate->open;
+}
+
+void graves_gate_push_block(graves_gate_t *gate);
+
+/* Returns SU_TRUE whenever a block ends (and the gate may change) */
+SUINLINE SUBOOL
+graves_gate_feed(graves_gate_t *gate, SUCOMPLEX x)
+{
+  gate->sum   += x;
+  gate->power += SU_C_REAL(x * SU_C_CONJ(x));
+
+  if (++gate->count == gate->decim) {
+    graves_gate_push_block(gate);
+    return SU_TRUE;
+  }
+
+  return SU_FALSE;
+}
+
+/* Size of the gate state, as saved by graves_gate_save_state */
+size_t graves_gate_state_size(const graves_gate_t *gate);
+
+SUBOOL graves_gate_save_state(const graves_gate_t *gate, grow_buf_t *buf);
+
+/* Reads exactly graves_gate_state_size() bytes */
+void graves_gate_restore_state(graves_gate_t *gate, const void *data);
+
+void graves_gate_destroy(graves_gate_t *gate);
+
+graves_gate_t *graves_gate_new(
+    SUSCOUNT decim,
+    SUSCOUNT window,
+    SUFLOAT level,
+    SUSCOUNT length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_GATE_H */
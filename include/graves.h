@@ -24,10 +24,15 @@
 #include <util/util.h>
 
 #include <sigutils/iir.h>
-#include <sigutils/ncqo.h>
 #include <sigutils/log.h>
 #include <sigutils/sampling.h>
 
+#include <noisefloor.h>
+#include <chirp.h>
+#include <estimator.h>
+#include <mixer.h>
+#include <gate.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -46,28 +51,10 @@ extern "C" {
 
 #define MIN_CHIRP_DURATION SU_ADDSFX(0.07)
 
-struct graves_chirp_info {
-  SUSCOUNT t0;  /* Start time */
-  SUFLOAT t0f;  /* Decimal part of the start time */
-
-  SUSCOUNT fs;
-  SUFLOAT  rbw; /* Bandwidth ratio */
-
-  /* Unsigned int length */
-  unsigned int length;
-
-  /* Chirp data */
-  const SUCOMPLEX *x;
+#define GRAVES_CACHE_LINE 64
 
-  /* Quotient data */
-  const SUFLOAT   *q;
-
-  /* Narrow channel power data */
-  const SUFLOAT   *p_n;
-
-  /* Wide channel power data */
-  const SUFLOAT   *p_w;
-};
+/* Samples mixed at once by graves_det_feed_block */
+#define GRAVES_DET_MIX_BLOCK 256
 
 typedef SUBOOL (*graves_chirp_cb_t) (
     void *privdata,
@@ -79,6 +66,13 @@ struct graves_det_params {
   SUFLOAT  lpf1;
   SUFLOAT  lpf2;
   SUFLOAT  threshold;
+  SUBOOL   adaptive;  /* Track the noise floor to adapt the threshold */
+  SUFLOAT  nf_window; /* Length of the noise floor window, in seconds */
+  graves_chirp_pool_t *pool; /* Chirp buffers (NULL: private pool) */
+  enum graves_est_type estimator;
+  SUFLOAT  gate;      /* First tier level, in units of the trigger SNR */
+  SUFLOAT  stop;      /* Chirps end below this times the trigger SNR (0: 1) */
+  SUFLOAT  holdoff;   /* Seconds below the stop level that do not end it */
 };
 
 #define graves_det_params_INITIALIZER \
@@ -88,34 +82,88 @@ struct graves_det_params {
   SU_ADDSFX(300.),  /* lpf1 */        \
   SU_ADDSFX(50.),   /* lpf2 */        \
   SU_ADDSFX(2.),    /* threshoid */   \
+  SU_FALSE,         /* adaptive */    \
+  SU_ADDSFX(120.),  /* nf_window */   \
+  NULL,             /* pool */        \
+  GRAVES_EST_IIR,   /* estimator */   \
+  0,                /* gate */        \
+  0,                /* stop */        \
+  0,                /* holdoff */     \
 }
 
 struct graves_det {
   struct graves_det_params params;
   SUFLOAT ratio;
   SUSCOUNT n;          /* Samples consumed */
-  su_iir_filt_t lpf1; /* Low pass filter 1. Used to detect noise power */
-  su_iir_filt_t lpf2; /* Low pass filter 2. Used to isolate chirps */
-  su_ncqo_t lo;
+  graves_est_t est;   /* Wide (noise power) and narrow (chirp) filters */
+  graves_mixer_t lo;
+  SUBOOL mix;    /* fc != 0: input must be mixed down */
   SUFLOAT alpha; /* Slow decay, used to detect chirps */
   SUFLOAT last_good_q;
   SUFLOAT p_w; /* Wide channel power */
   SUFLOAT p_n; /* Narrow channel power */
 
+  /*
+   * Delay line. Each quantity has its own plane (so that it can be copied
+   * out with memcpy) in a power-of-two ring, indexed by masking the free
+   * running write counter p. The planes are cache line aligned and live
+   * in the same allocation as the detector itself.
+   */
   SUSCOUNT hist_len;
+  SUSCOUNT hist_mask;
   SUSCOUNT p;
+  SUCOMPLEX *samp_hist;
+  SUFLOAT   *q_hist;
   SUFLOAT   *p_n_hist;
   SUFLOAT   *p_w_hist;
-  SUFLOAT   *q_hist;
-  SUCOMPLEX *samp_hist;
+  SUDOUBLE   energy;   /* Running sum of the last hist_len Qs */
 
   SUFLOAT   energy_thres;
   SUBOOL    in_chirp;
 
-  grow_buf_t chirp;
-  grow_buf_t q;
-  grow_buf_t p_n_buf;
-  grow_buf_t p_w_buf;
+  graves_nf_t *nf;     /* Noise floor of Q (adaptive mode only) */
+  SUFLOAT   snr_thres; /* Excess SNR over the noise floor that triggers */
+
+  /*
+   * Hysteresis and gap bridging. A chirp goes on until the energy stays
+   * below stop_thres for more than `holdoff` samples. Within that gap, only
+   * a new trigger (energy_thres) resumes it: the gap becomes part of the
+   * chirp instead of splitting it in two. `quiet` counts the samples of
+   * the current gap, which are recorded but cut off if the chirp ends.
+   */
+  SUFLOAT   stop_thres;
+  SUFLOAT   stop_snr_thres;
+  SUSCOUNT  holdoff;
+  SUSCOUNT  quiet;
+
+  /*
+   * Two-tier trigger (params.gate > 0). Mixed samples go through the gate
+   * and into a replay ring, and the stages above run over the ring only
+   * while the gate is open (or a chirp is being recorded), with n as the
+   * index of the next sample they take. After a short pause they just
+   * catch up. After a long one they restart replay_len samples back,
+   * with stale filters: Q is not trusted (no triggers, no noise floor
+   * updates) for the first `settle` samples, and the power averages
+   * start over as plain means (`fresh` samples so far).
+   *
+   * The noise floor must not see only what the gate lets through, so in
+   * adaptive mode it is fed by surveys instead: the full detector wakes
+   * up every few windows, whatever the gate says, for `survey` Qs.
+   */
+  graves_gate_t *gate;
+  SUCOMPLEX *replay;
+  SUSCOUNT   replay_len;
+  SUSCOUNT   replay_mask;
+  SUSCOUNT   fed;       /* Samples fed to the detector */
+  SUSCOUNT   processed; /* Samples through the full detector */
+  SUSCOUNT   settle;
+  SUSCOUNT   fresh;
+  SUSCOUNT   survey;
+  SUSCOUNT   since_survey; /* In gate blocks */
+  SUBOOL     awake;
+
+  graves_chirp_pool_t *pool;
+  graves_chirp_t *chirp; /* Being recorded */
 
   void *privdata;
 
@@ -157,6 +205,22 @@ graves_det_q_to_snr(SUFLOAT ratio, SUFLOAT q)
   return (q - ratio) / (SU_ADDSFX(1.) - q);
 }
 
+/*
+ * Radial velocity of the reflection point, given the Doppler shift (in Hz)
+ * of the echo with respect to the carrier.
+ */
+SUINLINE SUFLOAT
+graves_doppler_to_vel(SUFLOAT freq)
+{
+  return SU_ADDSFX(.5) * SPEED_OF_LIGHT * freq / GRAVES_CENTER_FREQ;
+}
+
+SUINLINE SUFLOAT
+graves_det_snr_to_q(SUFLOAT ratio, SUFLOAT snr)
+{
+  return (snr + ratio) / (SU_ADDSFX(1.) + snr);
+}
+
 SUINLINE SUFLOAT
 graves_det_get_N0(SUFLOAT ratio, SUFLOAT p_n, SUFLOAT snr)
 {
@@ -175,12 +239,129 @@ graves_det_get_params(const graves_det_t *det)
   return &det->params;
 }
 
+/* Instantaneous detector levels, for monitoring purposes */
+SUINLINE SUFLOAT
+graves_det_get_p_n(const graves_det_t *det)
+{
+  return det->p_n;
+}
+
+SUINLINE SUFLOAT
+graves_det_get_p_w(const graves_det_t *det)
+{
+  return det->p_w;
+}
+
+SUINLINE SUFLOAT
+graves_det_get_q(const graves_det_t *det)
+{
+  return det->last_good_q;
+}
+
+SUINLINE SUSCOUNT
+graves_det_get_samples(const graves_det_t *det)
+{
+  return det->gate != NULL ? det->fed : det->n;
+}
+
+/* Fraction of the samples that went through the full detector */
+SUINLINE SUFLOAT
+graves_det_get_duty_cycle(const graves_det_t *det)
+{
+  if (det->gate == NULL)
+    return 1;
+
+  return det->fed > 0 ? SU_ASFLOAT(det->processed) / det->fed : 0;
+}
+
+/* Current noise floor estimate of Q (the ratio itself if not adaptive) */
+SUINLINE SUFLOAT
+graves_det_get_noise_q(const graves_det_t *det)
+{
+  if (det->nf != NULL && graves_nf_is_ready(det->nf))
+    return graves_nf_get_estimate(det->nf);
+
+  return det->ratio;
+}
+
+/* Mean Q over the history window required to trigger */
+SUINLINE SUFLOAT
+graves_det_get_q_threshold(const graves_det_t *det)
+{
+  return det->energy_thres / det->hist_len;
+}
+
 void graves_det_destroy(graves_det_t *detect);
 
+/*
+ * Detector state checkpoints: filter memories, power averages, delay line,
+ * LO phase, noise floor and gate, so that a restarted detector produces valid
+ * Q values right away instead of settling for a few seconds. The state is
+ * a binary record for this build and configuration: restoring fails, and
+ * leaves the detector untouched, if it was saved with different
+ * parameters. Saving fails while a chirp is being recorded.
+ */
+#define GRAVES_DET_STATE_MAGIC   "GRVSTATE"
+#define GRAVES_DET_STATE_VERSION 3
+
+SUBOOL graves_det_save_state(const graves_det_t *md, grow_buf_t *buf);
+
+SUBOOL graves_det_restore_state(
+    graves_det_t *md,
+    const void *data,
+    size_t size);
+
+/* A chirp is being recorded */
+SUINLINE SUBOOL
+graves_det_in_chirp(const graves_det_t *det)
+{
+  return det->in_chirp;
+}
+
 void graves_det_set_center_freq(graves_det_t *md, SUFLOAT fc);
 
 SUBOOL graves_det_feed(graves_det_t *md, SUCOMPLEX x);
 
+/* Same as feeding the samples one by one, but mixes them down in blocks */
+SUBOOL graves_det_feed_block(
+    graves_det_t *md,
+    const SUCOMPLEX *x,
+    SUSCOUNT len);
+
+/*
+ * The detector in two halves, for pipelines (see bank.h). The front end
+ * mixes the samples down and computes the power averages and Q of each
+ * one. The back end takes those, runs the delay line, the noise floor and
+ * the trigger, and assembles the chirps. Each half only writes its own
+ * fields of the detector, so the two may run on different threads, and
+ * feeding the output of one to the other is the same as graves_det_feed_block.
+ * Not for gated detectors (the gate decides what the front end runs on).
+ */
+struct graves_det_sample {
+  SUCOMPLEX y;   /* Narrow channel output */
+  SUFLOAT   p_n;
+  SUFLOAT   p_w;
+  SUFLOAT   q;   /* After replacing invalid values */
+};
+
+void graves_det_feed_front(
+    graves_det_t *md,
+    const SUCOMPLEX *x,
+    struct graves_det_sample *out,
+    SUSCOUNT len);
+
+SUBOOL graves_det_feed_back(
+    graves_det_t *md,
+    const struct graves_det_sample *s,
+    SUSCOUNT len);
+
+/*
+ * Preallocate and touch the chirp buffers so that chirps up to `samples`
+ * long cause no allocations nor page faults (as long as the chirp callback
+ * does not keep them: see graves_chirp_pool_reserve).
+ */
+SUBOOL graves_det_prefault(graves_det_t *md, SUSCOUNT samples);
+
 graves_det_t *
 graves_det_new(
     const struct graves_det_params *params,
@@ -0,0 +1,116 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_MIXER_H
+#define GRAVES_MIXER_H
+
+#include <sigutils/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Block mixer. Shifts a block of samples down by a fixed frequency with a
+ * recursive complex rotator instead of evaluating the oscillator for every
+ * sample. The rotator is split in GRAVES_MIXER_LANES phasors, one sample
+ * apart, that advance GRAVES_MIXER_LANES samples at a time: the lanes are
+ * independent, so the inner loop is plain arithmetic on short arrays that
+ * the compiler turns into SIMD code. Rounding makes the phasors drift off
+ * the unit circle, so they are renormalized every GRAVES_MIXER_RENORM
+ * steps (and at the end of every block).
+ *
+ * The phase is kept across blocks and across frequency changes.
+ */
+
+#define GRAVES_MIXER_LANES   8
+#define GRAVES_MIXER_RENORM  64
+
+struct graves_mixer {
+  SUFLOAT   fnor;                         /* Normalized frequency */
+  SUCOMPLEX phasor;                       /* Next LO sample (conjugated) */
+  SUCOMPLEX step;                         /* One sample rotation */
+  SUCOMPLEX powers[GRAVES_MIXER_LANES];   /* step^0 ... step^(LANES - 1) */
+  SUCOMPLEX lane_step;                    /* step^LANES */
+  unsigned int count;                     /* Single steps since renorm */
+};
+
+typedef struct graves_mixer graves_mixer_t;
+
+/* Pull a phasor back to the unit circle (first order correction) */
+SUINLINE SUCOMPLEX
+graves_mixer_renorm(SUCOMPLEX p)
+{
+  SUFLOAT re = SU_C_REAL(p);
+  SUFLOAT im = SU_C_IMAG(p);
+  SUFLOAT g  = SU_ADDSFX(.5) * (3 - (re * re + im * im));
+
+  return g * re + SU_I * (g * im);
+}
+
+/* Mix a single sample */
+SUINLINE SUCOMPLEX
+graves_mixer_mix_one(graves_mixer_t *mixer, SUCOMPLEX x)
+{
+  SUFLOAT xr = SU_C_REAL(x), xi = SU_C_IMAG(x);
+  SUFLOAT pr = SU_C_REAL(mixer->phasor), pi = SU_C_IMAG(mixer->phasor);
+  SUFLOAT sr = SU_C_REAL(mixer->step), si = SU_C_IMAG(mixer->step);
+
+  mixer->phasor = (pr * sr - pi * si) + SU_I * (pr * si + pi * sr);
+
+  if (++mixer->count == GRAVES_MIXER_RENORM) {
+    mixer->count  = 0;
+    mixer->phasor = graves_mixer_renorm(mixer->phasor);
+  }
+
+  return (xr * pr - xi * pi) + SU_I * (xr * pi + xi * pr);
+}
+
+/* Mix len samples from x into y (which may be x itself) */
+void graves_mixer_mix(
+    graves_mixer_t *mixer,
+    const SUCOMPLEX *x,
+    SUCOMPLEX *y,
+    SUSCOUNT len);
+
+/* Keeps the phase */
+void graves_mixer_set_freq(graves_mixer_t *mixer, SUFLOAT fnor);
+
+SUINLINE SUFLOAT
+graves_mixer_get_freq(const graves_mixer_t *mixer)
+{
+  return mixer->fnor;
+}
+
+SUINLINE SUCOMPLEX
+graves_mixer_get_phasor(const graves_mixer_t *mixer)
+{
+  return mixer->phasor;
+}
+
+void graves_mixer_set_phasor(graves_mixer_t *mixer, SUCOMPLEX phasor);
+
+void graves_mixer_init(graves_mixer_t *mixer, SUFLOAT fnor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_MIXER_H */
@@ -0,0 +1,122 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_NOISEFLOOR_H
+#define GRAVES_NOISEFLOOR_H
+
+#include <sigutils/types.h>
+#include <util/util.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Rolling quantile estimator. Samples are averaged in blocks of `decim`
+ * values, and the last `length` block averages are kept in a histogram
+ * sketch over [min, max). A cursor into the histogram tracks the requested
+ * quantile: every insertion or removal moves it at most a few bins, so
+ * updates are O(1) amortized and the estimate can be read at any time.
+ */
+
+#define GRAVES_NF_BINS         1024
+#define GRAVES_NF_MIN_BLOCKS   16
+
+struct graves_nf {
+  SUFLOAT  min;
+  SUFLOAT  max;
+  SUFLOAT  quantile;
+  SUSCOUNT decim;
+
+  /* Block accumulator */
+  SUFLOAT  acc;
+  SUSCOUNT acc_count;
+
+  /* Ring of bin indices of the last blocks */
+  uint16_t *ring;
+  SUSCOUNT  length;
+  SUSCOUNT  p;
+  SUSCOUNT  count;
+
+  /* Histogram and quantile cursor */
+  SUSCOUNT hist[GRAVES_NF_BINS];
+  unsigned int cursor;
+  SUSCOUNT below;   /* Values in bins strictly below the cursor */
+
+  SUFLOAT estimate;
+};
+
+typedef struct graves_nf graves_nf_t;
+
+SUINLINE SUBOOL
+graves_nf_is_ready(const graves_nf_t *nf)
+{
+  return nf->count >= GRAVES_NF_MIN_BLOCKS;
+}
+
+SUINLINE SUFLOAT
+graves_nf_get_estimate(const graves_nf_t *nf)
+{
+  return nf->estimate;
+}
+
+void graves_nf_push_block(graves_nf_t *nf, SUFLOAT value);
+
+/* Returns SU_TRUE whenever a new block was pushed */
+SUINLINE SUBOOL
+graves_nf_feed(graves_nf_t *nf, SUFLOAT x)
+{
+  nf->acc += x;
+
+  if (++nf->acc_count == nf->decim) {
+    graves_nf_push_block(nf, nf->acc / nf->decim);
+    nf->acc = 0;
+    nf->acc_count = 0;
+    return SU_TRUE;
+  }
+
+  return SU_FALSE;
+}
+
+void graves_nf_reset(graves_nf_t *nf);
+
+/* Size of the estimator state, as saved by graves_nf_save_state */
+size_t graves_nf_state_size(const graves_nf_t *nf);
+
+SUBOOL graves_nf_save_state(const graves_nf_t *nf, grow_buf_t *buf);
+
+/* Reads exactly graves_nf_state_size() bytes */
+void graves_nf_restore_state(graves_nf_t *nf, const void *data);
+
+void graves_nf_destroy(graves_nf_t *nf);
+
+graves_nf_t *graves_nf_new(
+    SUFLOAT min,
+    SUFLOAT max,
+    SUFLOAT quantile,
+    SUSCOUNT decim,
+    SUSCOUNT length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_NOISEFLOOR_H */
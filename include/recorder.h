@@ -0,0 +1,166 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_RECORDER_H
+#define _CLISTONES_RECORDER_H
+
+#include <sigutils/types.h>
+#include <ring.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Continuous raw capture recorder. The capture path only copies samples
+ * into preallocated, page-aligned chunks; a write-behind thread writes
+ * full chunks to fixed-size segment files (raw_NNNNNN.bin) and appends a
+ * line per chunk to the segment's sidecar index (raw_NNNNNN.idx) mapping
+ * the sample counter to wall-clock time. Old segments are removed
+ * according to the retention policy.
+ */
+
+#define CLISTONES_RECORDER_ALIGN 4096
+
+struct clistones_recorder_params {
+  const char  *directory;
+  const char  *format;       /* Sample format name, for the index */
+  unsigned int frame_size;   /* Bytes per sample frame */
+  SUSCOUNT     fs;
+  size_t       chunk_size;   /* Write unit (multiple of 4096) */
+  unsigned int chunks;       /* Chunks in flight */
+  uint64_t     segment_size; /* Bytes per segment file */
+  SUFLOAT      keep_hours;   /* 0 means no time limit */
+  uint64_t     keep_bytes;   /* 0 means no size limit */
+  SUBOOL       direct;       /* Bypass the page cache (O_DIRECT) */
+};
+
+#define clistones_recorder_params_INITIALIZER   \
+{                                               \
+  NULL,               /* directory */           \
+  "S16_LE",           /* format */              \
+  2,                  /* frame_size */          \
+  8000,               /* fs */                  \
+  1 << 20,            /* chunk_size */          \
+  8,                  /* chunks */              \
+  64ull << 20,        /* segment_size */        \
+  0,                  /* keep_hours */          \
+  0,                  /* keep_bytes */          \
+  SU_FALSE,           /* direct */              \
+}
+
+struct clistones_recorder_chunk {
+  uint64_t first_sample;
+  struct timeval tv;
+  size_t   used;
+};
+
+struct clistones_recorder_segment {
+  unsigned int index;
+  uint64_t size;
+  time_t   closed;
+};
+
+struct clistones_recorder {
+  struct clistones_recorder_params params;
+  char *directory;
+
+  /* Producer side */
+  clistones_ring_t *ring;
+  struct clistones_recorder_chunk *current;
+  uint8_t *current_data;
+  uint64_t samples;
+  uint64_t dropped;  /* Frames lost because the writer fell behind */
+
+  /* Chunk data, one per ring slot */
+  uint8_t *pool;
+
+  /* Writer side */
+  pthread_t thread;
+  SUBOOL    thread_running;
+  sem_t     avail;
+  SUBOOL    have_sem;
+  atomic_bool halting;
+  SUBOOL    failed;
+
+  int       fd;
+  FILE     *index_fp;
+  unsigned int next_segment;
+  struct clistones_recorder_segment current_segment;
+
+  /* Closed segments, oldest first */
+  struct clistones_recorder_segment *segments;
+  unsigned int segment_count;
+  unsigned int segment_alloc;
+  uint64_t total_bytes;
+};
+
+typedef struct clistones_recorder clistones_recorder_t;
+
+void clistones_recorder_push_slow(
+    clistones_recorder_t *rec,
+    const void *data,
+    size_t frames);
+
+/*
+ * Called from the capture path. Never blocks: if the writer falls behind,
+ * samples are dropped and accounted.
+ */
+SUINLINE void
+clistones_recorder_push(
+    clistones_recorder_t *rec,
+    const void *data,
+    size_t frames)
+{
+  size_t size = frames * rec->params.frame_size;
+
+  if (rec->current != NULL
+      && rec->current->used + size < rec->params.chunk_size) {
+    memcpy(rec->current_data + rec->current->used, data, size);
+    rec->current->used += size;
+    rec->samples += frames;
+  } else {
+    clistones_recorder_push_slow(rec, data, frames);
+  }
+}
+
+SUINLINE uint64_t
+clistones_recorder_get_dropped(const clistones_recorder_t *rec)
+{
+  return rec->dropped;
+}
+
+/* Flushes the last partial chunk and waits for the writer to finish */
+void clistones_recorder_destroy(clistones_recorder_t *rec);
+
+clistones_recorder_t *clistones_recorder_new(
+    const struct clistones_recorder_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_RECORDER_H */
@@ -0,0 +1,151 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_RING_H
+#define _CLISTONES_RING_H
+
+#include <sigutils/types.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Lock-free single-producer, single-consumer ring of fixed-size slots.
+ * The producer acquires a slot, fills it in place and commits it; the
+ * consumer does the same on the other end. Neither side ever blocks: a
+ * full ring makes the producer's acquire fail (and counts an overflow),
+ * an empty ring makes the consumer's acquire fail.
+ */
+
+#define CLISTONES_RING_CACHE_LINE 64
+
+struct clistones_ring {
+  size_t   slot_size;
+  unsigned slot_count;  /* Power of 2 */
+  unsigned mask;
+  uint8_t *slots;
+
+  /* Producer and consumer indices live in separate cache lines */
+  _Alignas(CLISTONES_RING_CACHE_LINE) atomic_uint head;
+  _Alignas(CLISTONES_RING_CACHE_LINE) atomic_uint tail;
+
+  /* Statistics, written by the producer only */
+  _Alignas(CLISTONES_RING_CACHE_LINE) atomic_ulong overflows;
+  atomic_uint high_water;
+};
+
+typedef struct clistones_ring clistones_ring_t;
+
+SUINLINE unsigned int
+clistones_ring_used(const clistones_ring_t *ring)
+{
+  return atomic_load_explicit(&ring->head, memory_order_acquire)
+      - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+SUINLINE void *
+clistones_ring_acquire_write(clistones_ring_t *ring)
+{
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+  if (head - tail == ring->slot_count) {
+    atomic_fetch_add_explicit(&ring->overflows, 1, memory_order_relaxed);
+    return NULL;
+  }
+
+  return ring->slots + (head & ring->mask) * ring->slot_size;
+}
+
+SUINLINE void
+clistones_ring_commit_write(clistones_ring_t *ring)
+{
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  unsigned int used =
+      head + 1 - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  if (used > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+    atomic_store_explicit(&ring->high_water, used, memory_order_relaxed);
+
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+SUINLINE void *
+clistones_ring_acquire_read(clistones_ring_t *ring)
+{
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+  if (head == tail)
+    return NULL;
+
+  return ring->slots + (tail & ring->mask) * ring->slot_size;
+}
+
+SUINLINE void
+clistones_ring_release_read(clistones_ring_t *ring)
+{
+  unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/* Index (0 to slot_count - 1) of a slot returned by an acquire function */
+SUINLINE unsigned int
+clistones_ring_slot_index(const clistones_ring_t *ring, const void *slot)
+{
+  return (unsigned int)
+      (((const uint8_t *) slot - ring->slots) / ring->slot_size);
+}
+
+SUINLINE unsigned long
+clistones_ring_get_overflows(const clistones_ring_t *ring)
+{
+  return atomic_load_explicit(&ring->overflows, memory_order_relaxed);
+}
+
+SUINLINE unsigned int
+clistones_ring_get_high_water(const clistones_ring_t *ring)
+{
+  return atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+}
+
+SUINLINE unsigned int
+clistones_ring_get_slot_count(const clistones_ring_t *ring)
+{
+  return ring->slot_count;
+}
+
+/* Touch every slot so that no page faults happen in the hot path */
+void clistones_ring_prefault(clistones_ring_t *ring);
+
+void clistones_ring_destroy(clistones_ring_t *ring);
+
+/* slot_count is rounded up to the next power of 2 */
+clistones_ring_t *clistones_ring_new(size_t slot_size, unsigned int slot_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_RING_H */
@@ -0,0 +1,84 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_RT_H
+#define _CLISTONES_RT_H
+
+#include <sigutils/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Priorities and CPUs below zero mean "leave as is" */
+struct clistones_rt_params {
+  int capture_prio;
+  int detector_prio;
+  int capture_cpu;
+  int detector_cpu;
+  SUBOOL lock_memory;
+  SUFLOAT prefault_secs;  /* Longest chirp whose buffers are prefaulted */
+};
+
+#define clistones_rt_params_INITIALIZER   \
+{                                         \
+  80,        /* capture_prio */           \
+  70,        /* detector_prio */          \
+  -1,        /* capture_cpu */            \
+  -1,        /* detector_cpu */           \
+  SU_TRUE,   /* lock_memory */            \
+  30.,       /* prefault_secs */          \
+}
+
+/* Stack touched by every realtime thread before entering its loop */
+#define CLISTONES_RT_STACK_PREFAULT (256 * 1024)
+
+/*
+ * Every setting reports its outcome here, so that the caller can tell the
+ * user which ones actually took effect. errno values, 0 means success.
+ */
+struct clistones_rt_report {
+  const char *name;
+  int sched_err;
+  int affinity_err;
+  SUBOOL sched_requested;
+  SUBOOL affinity_requested;
+};
+
+void clistones_rt_print_report(const struct clistones_rt_report *report);
+
+/* Apply priority and CPU pinning to the calling thread */
+void clistones_rt_setup_thread(
+    const char *name,
+    int prio,
+    int cpu,
+    struct clistones_rt_report *report);
+
+/* Returns 0 or the errno of mlockall */
+int clistones_rt_lock_memory(void);
+
+/* Touch the calling thread's stack */
+void clistones_rt_prefault_stack(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_RT_H */
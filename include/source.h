@@ -0,0 +1,177 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_SOURCE_H
+#define _CLISTONES_SOURCE_H
+
+#include <sigutils/types.h>
+#include <alsa/asoundlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <convert.h>
+#include <synth.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Sample sources. Samples are delivered in fixed-size blocks of frames, in
+ * the native format of the source. Three backends are available: an ALSA
+ * capture device, a byte stream (standard input, a named pipe or a file)
+ * as produced by SDR pipelines (rtl_fm, csdr...), and a synthetic signal
+ * for soak tests (S16_LE mono, see synth.h).
+ *
+ * Sources have either one channel (real audio) or two (complex baseband,
+ * with I in the left channel and Q in the right one).
+ *
+ * Streams carry no format information, so theirs must be given. Capture
+ * devices are asked for the widest format they offer, in this order:
+ * S32_LE (which 24 bit interfaces use), FLOAT_LE and S16_LE, unless
+ * negotiate is off. The format in use is returned by
+ * clistones_source_get_format().
+ *
+ * Streams are read with large reads into an internal buffer, from which
+ * blocks are served. Nothing is ever dropped on the reading side: if the
+ * detector falls behind, the pipe fills up and the writer blocks. The pipe
+ * buffer is enlarged so that short hiccups do not stall the writer. If no
+ * data arrives for stall_timeout seconds, a stall is reported (and counted)
+ * once, and reading goes on. When the writer of a named pipe goes away,
+ * the pipe is reopened so that the pipeline upstream can be restarted.
+ */
+
+#define CLISTONES_SOURCE_STDIN          "-"
+#define CLISTONES_SOURCE_READ_SIZE      (64 << 10)
+#define CLISTONES_SOURCE_PIPE_SIZE      (1 << 20)
+
+enum clistones_source_type {
+  CLISTONES_SOURCE_ALSA,
+  CLISTONES_SOURCE_STREAM,
+  CLISTONES_SOURCE_SYNTH
+};
+
+struct clistones_source_params {
+  enum clistones_source_type type;
+  const char  *device;        /* ALSA: capture device */
+  const char  *path;          /* Stream: "-" for stdin, or a path */
+  enum clistones_sample_format format;
+  SUBOOL       negotiate;     /* ALSA: widest format offered, not format */
+  unsigned int channels;      /* 1: real, 2: I/Q */
+  unsigned int fs;
+  unsigned int block_size;    /* Frames per block */
+  SUFLOAT      stall_timeout; /* Stream: seconds */
+  struct clistones_synth_params synth;  /* Synth: fs is taken from above */
+};
+
+#define clistones_source_params_INITIALIZER                 \
+{                                                           \
+  CLISTONES_SOURCE_ALSA,           /* type */               \
+  "default",                       /* device */             \
+  CLISTONES_SOURCE_STDIN,          /* path */               \
+  CLISTONES_SAMPLE_FORMAT_S16_LE,  /* format */             \
+  SU_TRUE,                         /* negotiate */          \
+  1,                               /* channels */           \
+  8000,                            /* fs */                 \
+  128,                             /* block_size */         \
+  5,                               /* stall_timeout */      \
+  clistones_synth_params_INITIALIZER,                       \
+}
+
+struct clistones_source {
+  struct clistones_source_params params;
+  size_t   frame_size;
+
+  /* ALSA backend */
+  snd_pcm_t *pcm;
+
+  /* Synthetic backend */
+  clistones_synth_t *synth;
+
+  /* Stream backend */
+  int      fd;
+  SUBOOL   is_fifo;
+  uint8_t *buffer;
+  size_t   buf_len;
+  size_t   buf_pos;
+  SUBOOL   eof;
+  SUBOOL   stalled;
+  uint64_t stalls;
+  uint64_t reopens;
+};
+
+typedef struct clistones_source clistones_source_t;
+
+SUINLINE size_t
+clistones_source_get_frame_size(const clistones_source_t *source)
+{
+  return source->frame_size;
+}
+
+SUINLINE enum clistones_sample_format
+clistones_source_get_format(const clistones_source_t *source)
+{
+  return source->params.format;
+}
+
+SUINLINE SUBOOL
+clistones_source_is_iq(const clistones_source_t *source)
+{
+  return source->params.channels == 2;
+}
+
+/* The stream ended (a clean end of input, not an error) */
+SUINLINE SUBOOL
+clistones_source_is_eof(const clistones_source_t *source)
+{
+  return source->eof;
+}
+
+/* NULL unless this is a synthetic source */
+SUINLINE const clistones_synth_t *
+clistones_source_get_synth(const clistones_source_t *source)
+{
+  return source->synth;
+}
+
+SUINLINE uint64_t
+clistones_source_get_stalls(const clistones_source_t *source)
+{
+  return source->stalls;
+}
+
+/* Human-readable description of the source (for the banner) */
+void clistones_source_describe(
+    const clistones_source_t *source,
+    char *buf,
+    size_t size);
+
+/* Read a whole block. Fails on errors and at the end of the stream. */
+SUBOOL clistones_source_read(clistones_source_t *source, void *block);
+
+void clistones_source_destroy(clistones_source_t *source);
+
+clistones_source_t *clistones_source_new(
+    const struct clistones_source_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_SOURCE_H */
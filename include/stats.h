@@ -0,0 +1,135 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_STATS_H
+#define _CLISTONES_STATS_H
+
+#include <sigutils/types.h>
+#include <util/util.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Incremental event statistics. Hourly rates are kept over sliding windows
+ * (last 10 minutes, hour and day) as rings of fixed-width buckets with a
+ * running sum, so adding an event or reading a rate costs O(1) amortized.
+ * Distributions of duration, SNR and velocity are kept as fixed-bin
+ * histograms plus running moments (Welford), from which approximate
+ * quantiles are derived.
+ */
+
+#define CLISTONES_STATS_WINDOW_BUCKETS 60
+#define CLISTONES_STATS_HIST_BINS      64
+
+enum clistones_stats_window_id {
+  CLISTONES_STATS_WINDOW_10MIN,
+  CLISTONES_STATS_WINDOW_1H,
+  CLISTONES_STATS_WINDOW_24H,
+  CLISTONES_STATS_WINDOW_COUNT
+};
+
+enum clistones_stats_hist_id {
+  CLISTONES_STATS_HIST_DURATION,
+  CLISTONES_STATS_HIST_MEAN_SNR,
+  CLISTONES_STATS_HIST_MAX_SNR,
+  CLISTONES_STATS_HIST_VELOCITY,
+  CLISTONES_STATS_HIST_COUNT
+};
+
+struct clistones_stats_window {
+  const char *name;
+  double   span;          /* Seconds */
+  double   bucket_width;  /* Seconds */
+  int64_t  head_epoch;    /* Bucket number (time / bucket_width) of head */
+  unsigned int head;
+  uint64_t sum;
+  uint32_t buckets[CLISTONES_STATS_WINDOW_BUCKETS];
+};
+
+struct clistones_stats_hist {
+  const char *name;
+  const char *units;
+  SUFLOAT  min;
+  SUFLOAT  max;
+  SUBOOL   log_scale;      /* Logarithmically spaced bins */
+
+  uint64_t count;
+  SUFLOAT  mean;
+  SUFLOAT  m2;             /* Sum of squared deviations */
+  SUFLOAT  lowest;
+  SUFLOAT  highest;
+  uint64_t bins[CLISTONES_STATS_HIST_BINS];
+};
+
+struct clistones_stats {
+  struct timeval start;
+  uint64_t total;
+  struct clistones_stats_window windows[CLISTONES_STATS_WINDOW_COUNT];
+  struct clistones_stats_hist   hists[CLISTONES_STATS_HIST_COUNT];
+};
+
+typedef struct clistones_stats clistones_stats_t;
+
+SUINLINE uint64_t
+clistones_stats_get_total(const clistones_stats_t *stats)
+{
+  return stats->total;
+}
+
+/* SNRs in dB, velocity in m/s */
+void clistones_stats_add_event(
+    clistones_stats_t *stats,
+    const struct timeval *tv,
+    SUFLOAT duration,
+    SUFLOAT mean_snr_db,
+    SUFLOAT max_snr_db,
+    SUFLOAT velocity);
+
+/* Events per hour over a window, as seen at time `now` */
+SUFLOAT clistones_stats_get_rate(
+    clistones_stats_t *stats,
+    enum clistones_stats_window_id window,
+    const struct timeval *now);
+
+/* Approximate quantile (0-1) of a distribution */
+SUFLOAT clistones_stats_get_quantile(
+    const clistones_stats_t *stats,
+    enum clistones_stats_hist_id hist,
+    SUFLOAT q);
+
+/* Human-readable summary with every window and histogram */
+SUBOOL clistones_stats_format_summary(
+    clistones_stats_t *stats,
+    const struct timeval *now,
+    grow_buf_t *out);
+
+void clistones_stats_destroy(clistones_stats_t *stats);
+
+clistones_stats_t *clistones_stats_new(const struct timeval *start);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_STATS_H */
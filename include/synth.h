@@ -0,0 +1,115 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+#ifndef _CLISTONES_SYNTH_H
+#define _CLISTONES_SYNTH_H
+
+#include <sigutils/types.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Synthetic signal for soak tests: S16_LE mono noise with echoes at random
+ * times (a Poisson process with the given mean rate), lasting between
+ * CLISTONES_SYNTH_MIN_LEN and CLISTONES_SYNTH_MAX_LEN seconds, with random
+ * amplitudes and Doppler shifts. Echoes never overlap and are at least
+ * CLISTONES_SYNTH_MIN_GAP seconds apart, which caps the actual rate at
+ * about 3600 / (CLISTONES_SYNTH_MIN_GAP + mean length) echoes per hour.
+ *
+ * Samples are paced to `speed` times real time, so that the capture
+ * side behaves like a (fast) sound card. With speed 0 they are produced
+ * as fast as they are read.
+ */
+
+#define CLISTONES_SYNTH_MIN_LEN  SU_ADDSFX(.3)
+#define CLISTONES_SYNTH_MAX_LEN  SU_ADDSFX(1.)
+#define CLISTONES_SYNTH_MIN_GAP  SU_ADDSFX(.3)
+#define CLISTONES_SYNTH_NOISE    SU_ADDSFX(.3)   /* Peak to peak */
+#define CLISTONES_SYNTH_DOPPLER  SU_ADDSFX(40.)  /* Max shift, Hz */
+
+struct clistones_synth_params {
+  unsigned int fs;
+  SUFLOAT  fc;      /* Echo frequency before the Doppler shift, Hz */
+  SUFLOAT  rate;    /* Echoes per hour */
+  SUFLOAT  speed;   /* Times real time (0: unpaced) */
+  SUFLOAT  length;  /* Seconds of signal (0: endless) */
+  uint32_t seed;
+};
+
+#define clistones_synth_params_INITIALIZER  \
+{                                           \
+  8000,      /* fs */                       \
+  1000,      /* fc */                       \
+  3600,      /* rate */                     \
+  0,         /* speed */                    \
+  0,         /* length */                   \
+  1,         /* seed */                     \
+}
+
+struct clistones_synth {
+  struct clistones_synth_params params;
+  uint32_t seed;
+  SUSCOUNT n;         /* Samples produced */
+  SUSCOUNT total;     /* Samples to produce (0: endless) */
+
+  /* Current (or next) echo */
+  SUSCOUNT start;
+  SUSCOUNT end;
+  SUFLOAT  amplitude;
+  SUFLOAT  omega;     /* Radians per sample */
+  SUFLOAT  phase;
+  uint64_t echoes;    /* Echoes started so far */
+
+  struct timespec t0; /* Pacing reference */
+};
+
+typedef struct clistones_synth clistones_synth_t;
+
+SUINLINE uint64_t
+clistones_synth_get_echoes(const clistones_synth_t *synth)
+{
+  return synth->echoes;
+}
+
+SUINLINE SUBOOL
+clistones_synth_is_done(const clistones_synth_t *synth)
+{
+  return synth->total > 0 && synth->n >= synth->total;
+}
+
+/* Fill a block of len samples. Fails once the whole length was produced. */
+SUBOOL clistones_synth_read(
+    clistones_synth_t *synth,
+    int16_t *block,
+    unsigned int len);
+
+void clistones_synth_destroy(clistones_synth_t *synth);
+
+clistones_synth_t *clistones_synth_new(
+    const struct clistones_synth_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_SYNTH_H */
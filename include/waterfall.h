@@ -0,0 +1,180 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef GRAVES_WATERFALL_H
+#define GRAVES_WATERFALL_H
+
+#include <graves.h>
+#include <fftw3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Waterfall detector: instead of treating the band as a single channel,
+ * the mixed signal is split in overlapping FFT frames. Every bin keeps
+ * its own noise floor estimate, and bins above the floor are grouped in
+ * connected components in the time-frequency plane. Echoes overlapping
+ * in time but at different Doppler shifts end up in different components,
+ * and therefore in different events.
+ */
+
+#define GRAVES_WF_MAX_COMPONENTS 32
+#define GRAVES_WF_WARMUP_FRAMES  16
+
+struct graves_wf_params {
+  SUSCOUNT     fs;
+  SUFLOAT      fc;
+  unsigned int fft_size;     /* Must be a power of 2 */
+  unsigned int overlap;      /* Frames per FFT length (hop = size / overlap) */
+  SUFLOAT      max_doppler;  /* Half width of the search band (Hz) */
+  SUFLOAT      threshold;    /* Per-bin SNR threshold (linear) */
+  SUFLOAT      tau;          /* Noise floor time constant (seconds) */
+  unsigned int max_gap;      /* Missing frames before closing an event */
+  SUFLOAT      min_duration; /* Shortest event reported (seconds) */
+};
+
+#define graves_wf_params_INITIALIZER            \
+{                                               \
+  8000,              /* fs */                   \
+  SU_ADDSFX(1000.),  /* fc */                   \
+  256,               /* fft_size */             \
+  4,                 /* overlap */              \
+  SU_ADDSFX(300.),   /* max_doppler */          \
+  SU_ADDSFX(4.),     /* threshold */            \
+  SU_ADDSFX(10.),    /* tau */                  \
+  2,                 /* max_gap */              \
+  MIN_CHIRP_DURATION /* min_duration */         \
+}
+
+struct graves_wf_point {
+  SUFLOAT t;     /* Seconds since the beginning of the event */
+  SUFLOAT freq;  /* Peak frequency, relative to fc (Hz) */
+  SUFLOAT snr;   /* Peak SNR (linear) */
+};
+
+struct graves_wf_event_info {
+  SUSCOUNT t0;  /* Start time */
+  SUFLOAT t0f;  /* Decimal part of the start time */
+
+  SUSCOUNT fs;
+  unsigned int hop;    /* Samples between consecutive frames */
+
+  SUFLOAT f_lo;        /* Lowest frequency covered by the event (Hz) */
+  SUFLOAT f_hi;        /* Highest frequency covered by the event (Hz) */
+  SUFLOAT duration;    /* In seconds */
+
+  /* Doppler track, one point per frame in which the event was seen */
+  unsigned int length;
+  const struct graves_wf_point *track;
+};
+
+typedef SUBOOL (*graves_wf_event_cb_t) (
+    void *privdata,
+    const struct graves_wf_event_info *info);
+
+struct graves_wf_component {
+  SUBOOL   active;
+  SUSCOUNT first_frame;
+  SUSCOUNT last_frame;
+  unsigned int gap;
+
+  /* Extent and peak of the segment seen in the last frame, in bins */
+  int lo;
+  int hi;
+  int peak;
+
+  /* Whole extent, in bins */
+  int min_bin;
+  int max_bin;
+
+  grow_buf_t track;
+};
+
+struct graves_wf_segment {
+  int lo;
+  int hi;
+  int peak;
+  SUFLOAT freq;
+  SUFLOAT snr;
+  struct graves_wf_component *owner;
+};
+
+struct graves_wf {
+  struct graves_wf_params params;
+  SUSCOUNT n;            /* Samples consumed */
+  SUSCOUNT frames;       /* Frames processed */
+  graves_mixer_t lo;
+  SUBOOL mix;            /* fc != 0: input must be mixed down */
+
+  unsigned int hop;
+  unsigned int p;        /* Write position in the frame buffer */
+  unsigned int since_frame;
+
+  int half;              /* Bins at each side of DC */
+  int bins;              /* 2 * half + 1 */
+  SUFLOAT beta;          /* Noise floor update coefficient */
+
+  SUCOMPLEX *buffer;     /* Sliding input buffer */
+  SUFLOAT   *window;
+  SU_FFTW(_complex) *fft_in;
+  SU_FFTW(_complex) *fft_out;
+  SU_FFTW(_plan)     plan;
+
+  SUFLOAT *power;        /* Power in the search band, lowest bin first */
+  SUFLOAT *floor;        /* Per-bin noise floor */
+
+  struct graves_wf_segment   segments[GRAVES_WF_MAX_COMPONENTS];
+  unsigned int               segment_count;
+  struct graves_wf_component components[GRAVES_WF_MAX_COMPONENTS];
+
+  void *privdata;
+  graves_wf_event_cb_t on_event;
+};
+
+typedef struct graves_wf graves_wf_t;
+
+SUINLINE const struct graves_wf_params *
+graves_wf_get_params(const graves_wf_t *wf)
+{
+  return &wf->params;
+}
+
+void graves_wf_destroy(graves_wf_t *wf);
+
+void graves_wf_set_center_freq(graves_wf_t *wf, SUFLOAT fc);
+
+SUBOOL graves_wf_feed(graves_wf_t *wf, SUCOMPLEX x);
+
+/* Preallocate and touch the tracks of events up to `samples` long */
+SUBOOL graves_wf_prefault(graves_wf_t *wf, SUSCOUNT samples);
+
+graves_wf_t *
+graves_wf_new(
+    const struct graves_wf_params *params,
+    graves_wf_event_cb_t event_fn,
+    void *privdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* GRAVES_WATERFALL_H */
@@ -0,0 +1,216 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http: *www.gnu.org/licenses/>
+
+*/
+
+#ifndef _CLISTONES_WRITER_H
+#define _CLISTONES_WRITER_H
+
+#include <sigutils/types.h>
+#include <util/util.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#ifdef HAVE_LIBURING
+#  include <liburing.h>
+#endif /* HAVE_LIBURING */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Asynchronous output. The detection thread only queues requests (whole
+ * event files and appends to log files) in memory; they are handed to the
+ * backend in batches and their completions are reaped by
+ * clistones_writer_poll(), which the caller runs outside the hot path.
+ * Appends to the same log are coalesced and never reordered. Replacements
+ * of the same file are never in flight at the same time: a newer one waits
+ * for the current one to complete, and supersedes any other that waits.
+ *
+ * Two backends are available: io_uring (if built with liburing and
+ * supported by the kernel), which links open, write and close of each
+ * event file in a single submission, and a pool of worker threads doing
+ * plain blocking I/O.
+ */
+
+#define CLISTONES_WRITER_MAX_LOGS   8
+#define CLISTONES_WRITER_MAX_FILES  8    /* Distinct files replaced */
+#define CLISTONES_WRITER_MAX_LINE   512
+
+enum clistones_writer_backend {
+  CLISTONES_WRITER_BACKEND_AUTO,
+  CLISTONES_WRITER_BACKEND_THREADS,
+  CLISTONES_WRITER_BACKEND_URING
+};
+
+struct clistones_writer_params {
+  enum clistones_writer_backend backend;
+  unsigned int threads;  /* Workers of the thread pool backend */
+  unsigned int depth;    /* Maximum event files in flight */
+  unsigned int batch;    /* Queued requests that trigger a submission */
+};
+
+#define clistones_writer_params_INITIALIZER     \
+{                                               \
+  CLISTONES_WRITER_BACKEND_AUTO, /* backend */  \
+  2,                             /* threads */  \
+  32,                            /* depth */    \
+  8,                             /* batch */    \
+}
+
+enum clistones_writer_job_type {
+  CLISTONES_WRITER_JOB_CREATE,
+  CLISTONES_WRITER_JOB_APPEND,
+  CLISTONES_WRITER_JOB_RENAME   /* Second stage of a replacement */
+};
+
+struct clistones_writer_job {
+  enum clistones_writer_job_type type;
+  char    *path;         /* CREATE only */
+  char    *final_path;   /* CREATE only: rename to this when done */
+  int      file;         /* Replacements only, index in writer->files */
+  int      log;          /* APPEND only */
+  int      fd;           /* APPEND only */
+  void    *data;
+  size_t   size;
+  unsigned int slot;     /* io_uring fixed file slot */
+  unsigned int pending;  /* io_uring completions still to arrive */
+  int      err;          /* First error (errno value), 0 if none */
+  struct clistones_writer_job *next;
+};
+
+struct clistones_writer_log {
+  int        fd;
+  char      *path;
+  grow_buf_t staging;    /* Appends not yet submitted */
+  SUBOOL     busy;       /* An append of this log is in flight */
+};
+
+struct clistones_writer_file {
+  char      *path;
+  struct clistones_writer_job *next; /* Latest replacement not submitted */
+  SUBOOL     busy;       /* A replacement of this file is in flight */
+};
+
+struct clistones_writer {
+  struct clistones_writer_params params;
+  enum clistones_writer_backend backend;
+
+  /* Caller side */
+  struct clistones_writer_log logs[CLISTONES_WRITER_MAX_LOGS];
+  unsigned int log_count;
+  struct clistones_writer_file files[CLISTONES_WRITER_MAX_FILES];
+  unsigned int file_count;
+  struct clistones_writer_job *pending_head;
+  struct clistones_writer_job *pending_tail;
+  unsigned int pending_count;
+  unsigned int in_flight;
+  unsigned int peak_backlog;  /* Most requests pending and in flight */
+  uint64_t     errors;
+
+  /* Thread pool backend */
+  pthread_mutex_t mutex;
+  pthread_cond_t  queue_cond;
+  pthread_cond_t  done_cond;
+  SUBOOL          have_sync;
+  struct clistones_writer_job *queue_head;
+  struct clistones_writer_job *queue_tail;
+  struct clistones_writer_job *done;
+  pthread_t      *workers;
+  unsigned int    worker_count;
+  SUBOOL          halting;
+
+#ifdef HAVE_LIBURING
+  /* io_uring backend */
+  struct io_uring ring;
+  SUBOOL          have_ring;
+  unsigned int   *free_slots;
+  unsigned int    free_count;
+#endif /* HAVE_LIBURING */
+};
+
+typedef struct clistones_writer clistones_writer_t;
+
+SUINLINE uint64_t
+clistones_writer_get_errors(const clistones_writer_t *writer)
+{
+  return writer->errors;
+}
+
+SUINLINE unsigned int
+clistones_writer_get_peak_backlog(const clistones_writer_t *writer)
+{
+  return writer->peak_backlog;
+}
+
+const char *clistones_writer_get_backend_name(const clistones_writer_t *writer);
+
+/* Open (truncating) a log file. Not meant for the hot path. */
+int clistones_writer_open_log(clistones_writer_t *writer, const char *path);
+
+/* Queue the creation of a file with the given contents (copied) */
+SUBOOL clistones_writer_create_file(
+    clistones_writer_t *writer,
+    const char *path,
+    const void *data,
+    size_t size);
+
+/*
+ * Atomically replace a file: contents go to a temporary file that is
+ * renamed over `path` once completely written. If a replacement of the
+ * same file is still in flight, this one waits for it (only the latest
+ * waits, older ones are dropped).
+ */
+SUBOOL clistones_writer_replace_file(
+    clistones_writer_t *writer,
+    const char *path,
+    const void *data,
+    size_t size);
+
+SUBOOL clistones_writer_append(
+    clistones_writer_t *writer,
+    int log,
+    const void *data,
+    size_t size);
+
+SUBOOL clistones_writer_append_printf(
+    clistones_writer_t *writer,
+    int log,
+    const char *fmt,
+    ...);
+
+/* Hand queued requests to the backend */
+void clistones_writer_submit(clistones_writer_t *writer);
+
+/* Reap completed requests (reporting errors) and submit queued ones */
+void clistones_writer_poll(clistones_writer_t *writer);
+
+/* Wait for every queued request to complete */
+void clistones_writer_drain(clistones_writer_t *writer);
+
+void clistones_writer_destroy(clistones_writer_t *writer);
+
+clistones_writer_t *clistones_writer_new(
+    const struct clistones_writer_params *params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _CLISTONES_WRITER_H */
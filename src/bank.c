@@ -0,0 +1,612 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <bank.h>
+
+/* Whole cache lines, so that neighbouring slots are not shared */
+#define GRAVES_BANK_ALIGN(size) \
+  (((size) + GRAVES_CACHE_LINE - 1) & ~((size_t) GRAVES_CACHE_LINE - 1))
+
+/* Longest nap of an idle thread, in case a wakeup is missed */
+#define GRAVES_BANK_IDLE_NS 1000000
+
+struct graves_bank_input_block {
+  SUSCOUNT  len;
+  SUCOMPLEX x[GRAVES_DET_MIX_BLOCK];
+};
+
+struct graves_bank_mid_block {
+  SUSCOUNT len;
+  struct graves_det_sample s[GRAVES_DET_MIX_BLOCK];
+};
+
+/* Lock-free single-producer, single-consumer queue of blocks */
+struct graves_bank_queue {
+  size_t   slot_size;
+  unsigned slot_count;  /* Power of 2 */
+  unsigned mask;
+  uint8_t *slots;
+
+  _Alignas(GRAVES_CACHE_LINE) atomic_uint head;
+  _Alignas(GRAVES_CACHE_LINE) atomic_uint tail;
+};
+
+struct graves_bank_channel {
+  graves_det_t *det;
+  struct graves_bank_queue input;  /* Samples, to the front end */
+  struct graves_bank_queue mid;    /* Front end output, to the back end */
+
+  /* Taken by whoever runs each task */
+  _Alignas(GRAVES_CACHE_LINE) atomic_int front_busy;
+  _Alignas(GRAVES_CACHE_LINE) atomic_int back_busy;
+  atomic_int failed;  /* The chirp callback (or an allocation) failed */
+};
+
+struct graves_bank_worker {
+  struct graves_bank *bank;
+  pthread_t    thread;
+  unsigned int first;  /* Its own tasks start here */
+};
+
+struct graves_bank {
+  struct graves_bank_params params;
+  struct graves_bank_channel *channels;
+  unsigned int channel_count;
+
+  /* Idle workers sleep here until more blocks are queued */
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  SUBOOL          have_sync;
+  atomic_uint     sleepers;
+  atomic_int      halting;
+
+  struct graves_bank_worker *workers;
+  unsigned int worker_count;
+};
+
+/****************************** Block queues *********************************/
+SUPRIVATE SUBOOL
+graves_bank_queue_init(
+    struct graves_bank_queue *queue,
+    size_t slot_size,
+    unsigned int slot_count)
+{
+  unsigned int count = 1;
+
+  while (count < slot_count)
+    count <<= 1;
+
+  slot_size = GRAVES_BANK_ALIGN(slot_size);
+
+  queue->slot_size  = slot_size;
+  queue->slot_count = count;
+  queue->mask       = count - 1;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+
+  SU_TRYCATCH(
+      posix_memalign(
+          (void **) &queue->slots,
+          GRAVES_CACHE_LINE,
+          slot_size * count) == 0,
+      return SU_FALSE);
+
+  memset(queue->slots, 0, slot_size * count);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE void
+graves_bank_queue_finalize(struct graves_bank_queue *queue)
+{
+  if (queue->slots != NULL)
+    free(queue->slots);
+}
+
+SUINLINE SUBOOL
+graves_bank_queue_is_empty(struct graves_bank_queue *queue)
+{
+  return atomic_load_explicit(&queue->head, memory_order_acquire)
+      == atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
+
+SUINLINE SUBOOL
+graves_bank_queue_is_full(struct graves_bank_queue *queue)
+{
+  return atomic_load_explicit(&queue->head, memory_order_acquire)
+      - atomic_load_explicit(&queue->tail, memory_order_acquire)
+      == queue->slot_count;
+}
+
+SUINLINE void *
+graves_bank_queue_acquire_write(struct graves_bank_queue *queue)
+{
+  unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  if (head - tail == queue->slot_count)
+    return NULL;
+
+  return queue->slots + (head & queue->mask) * queue->slot_size;
+}
+
+SUINLINE void
+graves_bank_queue_commit_write(struct graves_bank_queue *queue)
+{
+  unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+}
+
+SUINLINE void *
+graves_bank_queue_acquire_read(struct graves_bank_queue *queue)
+{
+  unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+  if (head == tail)
+    return NULL;
+
+  return queue->slots + (tail & queue->mask) * queue->slot_size;
+}
+
+SUINLINE void
+graves_bank_queue_release_read(struct graves_bank_queue *queue)
+{
+  unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+/********************************* Tasks *************************************/
+SUINLINE SUBOOL
+graves_bank_claim(atomic_int *busy)
+{
+  int expected = 0;
+
+  return atomic_compare_exchange_strong_explicit(
+      busy,
+      &expected,
+      1,
+      memory_order_acquire,
+      memory_order_relaxed);
+}
+
+SUINLINE void
+graves_bank_release(atomic_int *busy)
+{
+  atomic_store_explicit(busy, 0, memory_order_release);
+}
+
+SUINLINE SUBOOL
+graves_bank_front_ready(struct graves_bank_channel *ch)
+{
+  return !graves_bank_queue_is_empty(&ch->input)
+      && !graves_bank_queue_is_full(&ch->mid);
+}
+
+SUINLINE SUBOOL
+graves_bank_back_ready(struct graves_bank_channel *ch)
+{
+  return !graves_bank_queue_is_empty(&ch->mid);
+}
+
+/* Something to do that nobody is doing */
+SUPRIVATE SUBOOL
+graves_bank_runnable(graves_bank_t *bank)
+{
+  struct graves_bank_channel *ch;
+  unsigned int i;
+
+  for (i = 0; i < bank->channel_count; ++i) {
+    ch = bank->channels + i;
+
+    if (graves_bank_front_ready(ch)
+        && !atomic_load_explicit(&ch->front_busy, memory_order_relaxed))
+      return SU_TRUE;
+
+    if (graves_bank_back_ready(ch)
+        && !atomic_load_explicit(&ch->back_busy, memory_order_relaxed))
+      return SU_TRUE;
+  }
+
+  return SU_FALSE;
+}
+
+/* Samples still queued */
+SUPRIVATE SUBOOL
+graves_bank_pending(graves_bank_t *bank)
+{
+  unsigned int i;
+
+  for (i = 0; i < bank->channel_count; ++i)
+    if (!graves_bank_queue_is_empty(&bank->channels[i].input)
+        || !graves_bank_queue_is_empty(&bank->channels[i].mid))
+      return SU_TRUE;
+
+  return SU_FALSE;
+}
+
+/*
+ * Run the front end over every block it can take. Blocks of a failed
+ * channel go through unprocessed, so that its queues still drain. After
+ * letting the task go, its queues are checked again: a block queued while
+ * it was still taken would be left behind otherwise.
+ */
+SUPRIVATE SUBOOL
+graves_bank_run_front(struct graves_bank_channel *ch)
+{
+  struct graves_bank_input_block *in;
+  struct graves_bank_mid_block *out;
+  SUBOOL ran = SU_FALSE;
+
+  while (graves_bank_front_ready(ch) && graves_bank_claim(&ch->front_busy)) {
+    while ((in = graves_bank_queue_acquire_read(&ch->input)) != NULL
+        && (out = graves_bank_queue_acquire_write(&ch->mid)) != NULL) {
+      if (!atomic_load_explicit(&ch->failed, memory_order_relaxed))
+        graves_det_feed_front(ch->det, in->x, out->s, in->len);
+
+      out->len = in->len;
+
+      /* Published before the input slot is given back: see sync */
+      graves_bank_queue_commit_write(&ch->mid);
+      graves_bank_queue_release_read(&ch->input);
+      ran = SU_TRUE;
+    }
+
+    graves_bank_release(&ch->front_busy);
+  }
+
+  return ran;
+}
+
+SUPRIVATE SUBOOL
+graves_bank_run_back(struct graves_bank_channel *ch)
+{
+  struct graves_bank_mid_block *in;
+  SUBOOL ran = SU_FALSE;
+
+  while (graves_bank_back_ready(ch) && graves_bank_claim(&ch->back_busy)) {
+    while ((in = graves_bank_queue_acquire_read(&ch->mid)) != NULL) {
+      if (!atomic_load_explicit(&ch->failed, memory_order_relaxed)
+          && !graves_det_feed_back(ch->det, in->s, in->len))
+        atomic_store_explicit(&ch->failed, 1, memory_order_relaxed);
+
+      graves_bank_queue_release_read(&ch->mid);
+      ran = SU_TRUE;
+    }
+
+    graves_bank_release(&ch->back_busy);
+  }
+
+  return ran;
+}
+
+/* Wake up idle threads, if any */
+SUPRIVATE void
+graves_bank_wake(graves_bank_t *bank)
+{
+  /* Pairs with the fence in graves_bank_idle */
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (atomic_load_explicit(&bank->sleepers, memory_order_relaxed) > 0) {
+    pthread_mutex_lock(&bank->mutex);
+    pthread_cond_broadcast(&bank->cond);
+    pthread_mutex_unlock(&bank->mutex);
+  }
+}
+
+/*
+ * Run every task that can run, starting at `first` (tasks 2i and 2i + 1
+ * are the front and back end of channel i). Returns SU_TRUE if any ran.
+ */
+SUPRIVATE SUBOOL
+graves_bank_run_tasks(graves_bank_t *bank, unsigned int first)
+{
+  struct graves_bank_channel *ch;
+  unsigned int i, task, tasks = 2 * bank->channel_count;
+  SUBOOL ran = SU_FALSE;
+
+  for (i = 0; i < tasks; ++i) {
+    task = (first + i) % tasks;
+    ch = bank->channels + task / 2;
+
+    if (task & 1)
+      ran |= graves_bank_run_back(ch);
+    else
+      ran |= graves_bank_run_front(ch);
+  }
+
+  if (ran)
+    graves_bank_wake(bank);
+
+  return ran;
+}
+
+/* Sleep until another thread makes progress (or for a short while) */
+SUPRIVATE void
+graves_bank_idle(graves_bank_t *bank)
+{
+  struct timespec ts;
+
+  atomic_fetch_add_explicit(&bank->sleepers, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  pthread_mutex_lock(&bank->mutex);
+
+  if (!atomic_load_explicit(&bank->halting, memory_order_relaxed)
+      && !graves_bank_runnable(bank)) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += GRAVES_BANK_IDLE_NS;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_nsec -= 1000000000;
+      ++ts.tv_sec;
+    }
+
+    (void) pthread_cond_timedwait(&bank->cond, &bank->mutex, &ts);
+  }
+
+  pthread_mutex_unlock(&bank->mutex);
+
+  atomic_fetch_sub_explicit(&bank->sleepers, 1, memory_order_relaxed);
+}
+
+SUPRIVATE void *
+graves_bank_worker(void *data)
+{
+  struct graves_bank_worker *worker = (struct graves_bank_worker *) data;
+  graves_bank_t *bank = worker->bank;
+
+  while (!atomic_load_explicit(&bank->halting, memory_order_relaxed))
+    if (!graves_bank_run_tasks(bank, worker->first))
+      graves_bank_idle(bank);
+
+  return NULL;
+}
+
+/******************************** Bank API ***********************************/
+unsigned int
+graves_bank_get_channel_count(const graves_bank_t *bank)
+{
+  return bank->channel_count;
+}
+
+SUBOOL
+graves_bank_feed(
+    graves_bank_t *bank,
+    unsigned int channel,
+    const SUCOMPLEX *x,
+    SUSCOUNT len)
+{
+  struct graves_bank_channel *ch;
+  struct graves_bank_input_block *block;
+  SUSCOUNT chunk;
+
+  SU_TRYCATCH(channel < bank->channel_count, return SU_FALSE);
+
+  ch = bank->channels + channel;
+
+  while (len > 0) {
+    if (atomic_load_explicit(&ch->failed, memory_order_relaxed))
+      return SU_FALSE;
+
+    /* Queue full: lend a hand, starting with this channel */
+    if ((block = graves_bank_queue_acquire_write(&ch->input)) == NULL) {
+      if (!graves_bank_run_tasks(bank, 2 * channel))
+        graves_bank_idle(bank);
+      continue;
+    }
+
+    chunk = len < GRAVES_DET_MIX_BLOCK ? len : GRAVES_DET_MIX_BLOCK;
+
+    memcpy(block->x, x, chunk * sizeof(SUCOMPLEX));
+    block->len = chunk;
+
+    graves_bank_queue_commit_write(&ch->input);
+    graves_bank_wake(bank);
+
+    x   += chunk;
+    len -= chunk;
+  }
+
+  return SU_TRUE;
+}
+
+SUBOOL
+graves_bank_sync(graves_bank_t *bank)
+{
+  unsigned int i;
+  SUBOOL ok = SU_TRUE;
+
+  /*
+   * A block leaves the input queue after its output is queued, and the mid
+   * queue after the back end is done with it: once both are empty, every
+   * sample has gone through (and the acquire loads make the detector
+   * state visible here).
+   */
+  while (graves_bank_pending(bank))
+    if (!graves_bank_run_tasks(bank, 0))
+      graves_bank_idle(bank);
+
+  for (i = 0; i < bank->channel_count; ++i)
+    if (atomic_load_explicit(&bank->channels[i].failed, memory_order_relaxed))
+      ok = SU_FALSE;
+
+  return ok;
+}
+
+void
+graves_bank_destroy(graves_bank_t *bank)
+{
+  unsigned int i;
+
+  if (bank->worker_count > 0) {
+    atomic_store_explicit(&bank->halting, 1, memory_order_relaxed);
+
+    pthread_mutex_lock(&bank->mutex);
+    pthread_cond_broadcast(&bank->cond);
+    pthread_mutex_unlock(&bank->mutex);
+
+    for (i = 0; i < bank->worker_count; ++i)
+      pthread_join(bank->workers[i].thread, NULL);
+  }
+
+  if (bank->workers != NULL)
+    free(bank->workers);
+
+  if (bank->have_sync) {
+    pthread_cond_destroy(&bank->cond);
+    pthread_mutex_destroy(&bank->mutex);
+  }
+
+  if (bank->channels != NULL) {
+    for (i = 0; i < bank->channel_count; ++i) {
+      graves_bank_queue_finalize(&bank->channels[i].input);
+      graves_bank_queue_finalize(&bank->channels[i].mid);
+    }
+
+    free(bank->channels);
+  }
+
+  free(bank);
+}
+
+graves_bank_t *
+graves_bank_new(
+    const struct graves_bank_params *params,
+    graves_det_t *const *dets,
+    unsigned int count)
+{
+  graves_bank_t *new = NULL;
+  struct graves_bank_channel *ch;
+  unsigned int i, tasks = 2 * count;
+  int err;
+
+  if (count == 0
+      || params->queue_blocks == 0
+      || params->threads > GRAVES_BANK_MAX_THREADS) {
+    SU_ERROR("Invalid detector bank parameters\n");
+    return NULL;
+  }
+
+  for (i = 0; i < count; ++i)
+    if (dets[i]->gate != NULL) {
+      SU_ERROR("Gated detectors cannot run in a bank\n");
+      return NULL;
+    }
+
+  /* Atomics are cache line aligned within these structures */
+  SU_TRYCATCH(
+      posix_memalign(
+          (void **) &new,
+          GRAVES_CACHE_LINE,
+          sizeof(graves_bank_t)) == 0,
+      goto fail);
+
+  memset(new, 0, sizeof(graves_bank_t));
+
+  new->params = *params;
+  atomic_init(&new->sleepers, 0);
+  atomic_init(&new->halting, 0);
+
+  SU_TRYCATCH(
+      posix_memalign(
+          (void **) &new->channels,
+          GRAVES_CACHE_LINE,
+          count * sizeof(struct graves_bank_channel)) == 0,
+      goto fail);
+
+  memset(new->channels, 0, count * sizeof(struct graves_bank_channel));
+  new->channel_count = count;
+
+  for (i = 0; i < count; ++i) {
+    ch = new->channels + i;
+    ch->det = dets[i];
+    atomic_init(&ch->front_busy, 0);
+    atomic_init(&ch->back_busy, 0);
+    atomic_init(&ch->failed, 0);
+
+    SU_TRYCATCH(
+        graves_bank_queue_init(
+            &ch->input,
+            sizeof(struct graves_bank_input_block),
+            params->queue_blocks),
+        goto fail);
+    SU_TRYCATCH(
+        graves_bank_queue_init(
+            &ch->mid,
+            sizeof(struct graves_bank_mid_block),
+            params->queue_blocks),
+        goto fail);
+  }
+
+  if (pthread_mutex_init(&new->mutex, NULL) != 0
+      || pthread_cond_init(&new->cond, NULL) != 0) {
+    SU_ERROR("Cannot initialize detector bank\n");
+    goto fail;
+  }
+
+  new->have_sync = SU_TRUE;
+
+  if (params->threads > 0) {
+    SU_TRYCATCH(
+        new->workers = calloc(
+            params->threads,
+            sizeof(struct graves_bank_worker)),
+        goto fail);
+
+    /* Tasks are dealt out evenly, the rest is stolen */
+    for (i = 0; i < params->threads; ++i) {
+      new->workers[i].bank  = new;
+      new->workers[i].first = (i * tasks / params->threads) % tasks;
+
+      if ((err = pthread_create(
+          &new->workers[i].thread,
+          NULL,
+          graves_bank_worker,
+          new->workers + i)) != 0) {
+        SU_ERROR("Cannot create detector bank thread: %s\n", strerror(err));
+        goto fail;
+      }
+
+      ++new->worker_count;
+    }
+  }
+
+  return new;
+
+fail:
+  if (new != NULL)
+    graves_bank_destroy(new);
+
+  return NULL;
+}
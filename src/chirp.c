@@ -0,0 +1,252 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <chirp.h>
+
+/* The public part comes first, so that handles convert both ways */
+struct graves_chirp_handle {
+  graves_chirp_t chirp;
+  atomic_uint    refs;
+  graves_chirp_pool_t *pool;
+  struct graves_chirp_handle *next;  /* In the free list */
+};
+
+struct graves_chirp_pool {
+  atomic_uint     refs;
+  pthread_mutex_t mutex;
+  struct graves_chirp_handle *free;
+  unsigned int    free_count;
+  unsigned int    allocated;
+};
+
+SUINLINE struct graves_chirp_handle *
+graves_chirp_to_handle(graves_chirp_t *chirp)
+{
+  return (struct graves_chirp_handle *) chirp;
+}
+
+SUPRIVATE void
+graves_chirp_destroy(struct graves_chirp_handle *handle)
+{
+  grow_buf_clear(&handle->chirp.x);
+  grow_buf_clear(&handle->chirp.q);
+  grow_buf_clear(&handle->chirp.p_n);
+  grow_buf_clear(&handle->chirp.p_w);
+
+  free(handle);
+}
+
+SUPRIVATE void
+graves_chirp_reset(graves_chirp_t *chirp)
+{
+  grow_buf_shrink(&chirp->x);
+  grow_buf_shrink(&chirp->q);
+  grow_buf_shrink(&chirp->p_n);
+  grow_buf_shrink(&chirp->p_w);
+
+  memset(&chirp->info, 0, sizeof(struct graves_chirp_info));
+  chirp->info.chirp = chirp;
+}
+
+SUPRIVATE SUBOOL
+graves_chirp_prefault_buf(grow_buf_t *buf, size_t size)
+{
+  void *data;
+
+  SU_TRYCATCH(data = grow_buf_alloc(buf, size), return SU_FALSE);
+  memset(data, 0, size);
+  grow_buf_shrink(buf);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+graves_chirp_prefault(graves_chirp_t *chirp, SUSCOUNT samples)
+{
+  SU_TRYCATCH(
+      graves_chirp_prefault_buf(&chirp->x, samples * sizeof(SUCOMPLEX)),
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_chirp_prefault_buf(&chirp->q, samples * sizeof(SUFLOAT)),
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_chirp_prefault_buf(&chirp->p_n, samples * sizeof(SUFLOAT)),
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_chirp_prefault_buf(&chirp->p_w, samples * sizeof(SUFLOAT)),
+      return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+graves_chirp_t *
+graves_chirp_ref(graves_chirp_t *chirp)
+{
+  atomic_fetch_add_explicit(
+      &graves_chirp_to_handle(chirp)->refs,
+      1,
+      memory_order_relaxed);
+
+  return chirp;
+}
+
+void
+graves_chirp_unref(graves_chirp_t *chirp)
+{
+  struct graves_chirp_handle *handle = graves_chirp_to_handle(chirp);
+  graves_chirp_pool_t *pool = handle->pool;
+
+  if (atomic_fetch_sub_explicit(&handle->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  pthread_mutex_lock(&pool->mutex);
+  handle->next = pool->free;
+  pool->free   = handle;
+  ++pool->free_count;
+  pthread_mutex_unlock(&pool->mutex);
+
+  graves_chirp_pool_unref(pool);
+}
+
+graves_chirp_t *
+graves_chirp_pool_acquire(graves_chirp_pool_t *pool)
+{
+  struct graves_chirp_handle *handle;
+
+  pthread_mutex_lock(&pool->mutex);
+  if ((handle = pool->free) != NULL) {
+    pool->free = handle->next;
+    --pool->free_count;
+  } else {
+    ++pool->allocated;
+  }
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (handle == NULL) {
+    SU_TRYCATCH(
+        handle = calloc(1, sizeof(struct graves_chirp_handle)),
+        goto fail);
+    handle->pool = pool;
+  }
+
+  handle->next = NULL;
+  atomic_init(&handle->refs, 1);
+  graves_chirp_reset(&handle->chirp);
+  graves_chirp_pool_ref(pool);
+
+  return &handle->chirp;
+
+fail:
+  pthread_mutex_lock(&pool->mutex);
+  --pool->allocated;
+  pthread_mutex_unlock(&pool->mutex);
+
+  return NULL;
+}
+
+SUBOOL
+graves_chirp_pool_reserve(
+    graves_chirp_pool_t *pool,
+    unsigned int count,
+    SUSCOUNT samples)
+{
+  struct graves_chirp_handle *list = NULL;
+  struct graves_chirp_handle *handle;
+  graves_chirp_t *chirp;
+  unsigned int i;
+  SUBOOL ok = SU_FALSE;
+
+  /* Take them all out, so that the free ones get prefaulted too */
+  for (i = 0; i < count; ++i) {
+    SU_TRYCATCH(chirp = graves_chirp_pool_acquire(pool), goto done);
+    handle = graves_chirp_to_handle(chirp);
+    handle->next = list;
+    list = handle;
+
+    SU_TRYCATCH(graves_chirp_prefault(chirp, samples), goto done);
+  }
+
+  ok = SU_TRUE;
+
+done:
+  while (list != NULL) {
+    handle = list;
+    list = list->next;
+    graves_chirp_unref(&handle->chirp);
+  }
+
+  return ok;
+}
+
+graves_chirp_pool_t *
+graves_chirp_pool_ref(graves_chirp_pool_t *pool)
+{
+  atomic_fetch_add_explicit(&pool->refs, 1, memory_order_relaxed);
+
+  return pool;
+}
+
+void
+graves_chirp_pool_unref(graves_chirp_pool_t *pool)
+{
+  struct graves_chirp_handle *handle;
+
+  if (atomic_fetch_sub_explicit(&pool->refs, 1, memory_order_acq_rel) != 1)
+    return;
+
+  /* No references left: every handle is back in the free list */
+  while ((handle = pool->free) != NULL) {
+    pool->free = handle->next;
+    graves_chirp_destroy(handle);
+  }
+
+  pthread_mutex_destroy(&pool->mutex);
+
+  free(pool);
+}
+
+graves_chirp_pool_t *
+graves_chirp_pool_new(void)
+{
+  graves_chirp_pool_t *new = NULL;
+
+  SU_TRYCATCH(new = calloc(1, sizeof(graves_chirp_pool_t)), return NULL);
+
+  atomic_init(&new->refs, 1);
+
+  if (pthread_mutex_init(&new->mutex, NULL) != 0) {
+    SU_ERROR("Cannot initialize chirp pool mutex\n");
+    free(new);
+    return NULL;
+  }
+
+  return new;
+}
@@ -0,0 +1,1330 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/sigutils.h>
+#include <clistones.h>
+
+/* Event files are serialized in memory and handed to the writer */
+SUPRIVATE SUBOOL
+clistones_event_printf(clistones_t *self, const char *fmt, ...)
+{
+  char field[64];
+  va_list ap;
+  int size;
+
+  va_start(ap, fmt);
+  size = vsnprintf(field, sizeof(field), fmt, ap);
+  va_end(ap);
+
+  SU_TRYCATCH(size > 0 && size < (int) sizeof(field), return SU_FALSE);
+
+  return grow_buf_append(&self->event_buf, field, size) != -1;
+}
+
+SUPRIVATE SUBOOL
+clistones_event_write(clistones_t *self, const void *data, size_t size)
+{
+  return grow_buf_append(&self->event_buf, data, size) != -1;
+}
+
+SUPRIVATE SUBOOL
+clistones_event_submit(clistones_t *self)
+{
+  char *path = NULL;
+  SUBOOL ok = SU_FALSE;
+
+  SU_TRYCATCH(
+      path = strbuild("%s/event_%06d.dat", self->directory, self->event_count),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_writer_create_file(
+          self->writer,
+          path,
+          grow_buf_get_buffer(&self->event_buf),
+          grow_buf_get_size(&self->event_buf)),
+      goto done);
+
+  ok = SU_TRUE;
+
+done:
+  if (path != NULL)
+    free(path);
+
+  return ok;
+}
+
+/* I/Q and coded q only, see evfile.h */
+SUPRIVATE SUBOOL
+clistones_register_compact(
+    clistones_t *self,
+    SUFLOAT ratio,
+    const struct graves_chirp_info *chirp)
+{
+  const struct graves_doppler_params *doppler = &self->doppler->params;
+  uint16_t *codes;
+  unsigned int i;
+
+  SU_TRYCATCH(
+      clistones_event_printf(
+          self,
+          "SAMPLE_RATE     =%15lu",
+          self->det_params.fs),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "CAPTURE_LEN     =%15d", chirp->length),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(
+          self,
+          "Q_SCALE         =%15d",
+          CLISTONES_EVFILE_Q_SCALE),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "SNR_RATIO       =%15.9e", ratio),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(
+          self,
+          "CENTER_FREQ     =%15.6f",
+          self->det_params.fc),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "DOPPLER_FFT     =%15u", doppler->fft_size),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "DOPPLER_HOP     =%15u", doppler->hop),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(
+          self,
+          "DOPPLER_MAXDOP  =%15.6f",
+          doppler->max_doppler),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "DATA SECTION START              "),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_event_write(
+          self,
+          chirp->x,
+          chirp->length * sizeof(SUCOMPLEX)),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      codes = grow_buf_alloc(
+          &self->event_buf,
+          chirp->length * sizeof(uint16_t)),
+      return SU_FALSE);
+
+  for (i = 0; i < chirp->length; ++i)
+    codes[i] = clistones_evfile_q_to_code(chirp->q[i]);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+clistones_register_chirp(
+    clistones_t *self,
+    struct clistones_chirp_summary *summary,
+    struct timeval tv,
+    const struct graves_chirp_info *chirp)
+{
+  unsigned int i, track_len;
+  const struct graves_doppler_point *track;
+  SUFLOAT ratio = chirp->rbw; /* As calibrated by the power estimator */
+  SUFLOAT snr;
+  SUFLOAT cum_snr = 0;
+  SUFLOAT max_snr = 0;
+  SUBOOL ok = SU_FALSE;
+
+  /* Do some post processing on the chirp data */
+  SU_TRYCATCH(
+      graves_doppler_estimate(
+          self->doppler,
+          chirp->x,
+          chirp->q,
+          chirp->length,
+          ratio),
+      goto done);
+
+  track = graves_doppler_get_track(self->doppler, &track_len);
+
+  grow_buf_shrink(&self->event_buf);
+
+  /* Save data */
+  SU_TRYCATCH(
+      clistones_event_printf(
+          self,
+          "EVENT_INDEX     =%15d",
+          (int) self->event_count),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "TIMESTAMP_SEC   =%15lu", tv.tv_sec),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "TIMESTAMP_USEC  =%15lu", tv.tv_usec),
+      goto done);
+
+  if (self->params.compact_events) {
+    SU_TRYCATCH(
+        clistones_register_compact(self, ratio, chirp),
+        goto done);
+  } else {
+    SU_TRYCATCH(
+        clistones_event_printf(
+            self,
+            "SAMPLE_RATE     =%15luu",
+            self->det_params.fs),
+        goto done);
+
+    SU_TRYCATCH(
+        clistones_event_printf(self, "CAPTURE_LEN     =%15d", chirp->length),
+        goto done);
+
+    SU_TRYCATCH(
+        clistones_event_printf(self, "DOPPLER_LEN     =%15d", track_len),
+        goto done);
+
+    SU_TRYCATCH(
+        clistones_event_printf(
+            self,
+            "DOPPLER_HOP     =%15d",
+            self->doppler->params.hop),
+        goto done);
+
+    SU_TRYCATCH(
+        clistones_event_printf(self, "DATA SECTION START              "),
+        goto done);
+
+    /* Save I/Q block */
+    SU_TRYCATCH(
+        clistones_event_write(
+            self,
+            chirp->x,
+            chirp->length * sizeof(SUCOMPLEX)),
+        goto done);
+  }
+
+  /* Save SNR block */
+  for (i = 0; i < chirp->length; ++i) {
+    snr = graves_det_q_to_snr(ratio, chirp->q[i]);
+    cum_snr += snr;
+    if (snr > max_snr)
+      max_snr = snr;
+
+    if (!self->params.compact_events)
+      SU_TRYCATCH(
+          clistones_event_write(self, &snr, sizeof(SUFLOAT)),
+          goto done);
+  }
+
+  /* Save decimated Doppler track: velocity and confidence blocks */
+  if (!self->params.compact_events) {
+    for (i = 0; i < track_len; ++i)
+      SU_TRYCATCH(
+          clistones_event_write(self, &track[i].vel, sizeof(SUFLOAT)),
+          goto done);
+
+    for (i = 0; i < track_len; ++i)
+      SU_TRYCATCH(
+          clistones_event_write(
+              self,
+              &track[i].confidence,
+              sizeof(SUFLOAT)),
+          goto done);
+  }
+
+  summary->index    = self->event_count;
+  summary->tv       = tv;
+  summary->duration = chirp->length / SU_ASFLOAT(self->det_params.fs);
+  summary->mean_snr = cum_snr / chirp->length;
+  summary->max_snr  = max_snr;
+  summary->mean_vel = graves_doppler_get_velocity(self->doppler);
+
+  summary->weak     = summary->max_snr < self->params.snr_threshold ||
+      summary->duration < self->params.duration_threshold;
+
+  /* Weak chirps never reach the disk */
+  if (!summary->weak)
+    SU_TRYCATCH(clistones_event_submit(self), goto done);
+
+  ok = SU_TRUE;
+
+done:
+  return ok;
+}
+
+void
+clistones_cancel(clistones_t *self)
+{
+  self->cancelled = SU_TRUE;
+}
+
+void
+clistones_set_event_callback(
+    clistones_t *self,
+    clistones_event_cb_t on_event,
+    void *privdata)
+{
+  self->on_event      = on_event;
+  self->on_event_data = privdata;
+}
+
+SUPRIVATE SUBOOL
+clistones_register_wf_event(
+    clistones_t *self,
+    struct clistones_chirp_summary *summary,
+    struct timeval tv,
+    const struct graves_wf_event_info *event)
+{
+  unsigned int i;
+  SUFLOAT vel;
+  SUFLOAT cum_vel = 0;
+  SUFLOAT cum_snr = 0;
+  SUFLOAT max_snr = 0;
+  SUBOOL ok = SU_FALSE;
+
+  for (i = 0; i < event->length; ++i) {
+    cum_snr += event->track[i].snr;
+    cum_vel += graves_doppler_to_vel(event->track[i].freq)
+        * event->track[i].snr;
+    if (event->track[i].snr > max_snr)
+      max_snr = event->track[i].snr;
+  }
+
+  summary->index    = self->event_count;
+  summary->tv       = tv;
+  summary->duration = event->duration;
+  summary->mean_snr = cum_snr / event->length;
+  summary->max_snr  = max_snr;
+  summary->mean_vel = cum_vel / cum_snr;
+
+  summary->weak     = summary->max_snr < self->params.snr_threshold ||
+      summary->duration < self->params.duration_threshold;
+
+  /* Weak events never reach the disk */
+  if (summary->weak) {
+    ok = SU_TRUE;
+    goto done;
+  }
+
+  grow_buf_shrink(&self->event_buf);
+
+  SU_TRYCATCH(
+      clistones_event_printf(
+          self,
+          "EVENT_INDEX     =%15d",
+          (int) self->event_count),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "TIMESTAMP_SEC   =%15lu", tv.tv_sec),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "TIMESTAMP_USEC  =%15lu", tv.tv_usec),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(
+          self,
+          "SAMPLE_RATE     =%15lu",
+          self->det_params.fs),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "TRACK_LEN       =%15d", event->length),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "TRACK_HOP       =%15d", event->hop),
+      goto done);
+
+  SU_TRYCATCH(
+      clistones_event_printf(self, "DATA SECTION START              "),
+      goto done);
+
+  /* Save time, Doppler and SNR blocks */
+  for (i = 0; i < event->length; ++i)
+    SU_TRYCATCH(
+        clistones_event_write(self, &event->track[i].t, sizeof(SUFLOAT)),
+        goto done);
+
+  for (i = 0; i < event->length; ++i) {
+    vel = graves_doppler_to_vel(event->track[i].freq);
+    SU_TRYCATCH(
+        clistones_event_write(self, &vel, sizeof(SUFLOAT)),
+        goto done);
+  }
+
+  for (i = 0; i < event->length; ++i)
+    SU_TRYCATCH(
+        clistones_event_write(self, &event->track[i].snr, sizeof(SUFLOAT)),
+        goto done);
+
+  SU_TRYCATCH(clistones_event_submit(self), goto done);
+
+  ok = SU_TRUE;
+
+done:
+  return ok;
+}
+
+SUPRIVATE void
+clistones_publish_event(
+    clistones_t *self,
+    const struct clistones_chirp_summary *summary)
+{
+  struct clistones_feed_event event;
+
+  event.index    = summary->index;
+  event.weak     = summary->weak;
+  event.tv_sec   = summary->tv.tv_sec;
+  event.tv_usec  = summary->tv.tv_usec;
+  event.duration = summary->duration;
+  event.mean_snr = summary->mean_snr;
+  event.max_snr  = summary->max_snr;
+  event.mean_vel = summary->mean_vel;
+
+  clistones_feed_publish_event(self->feed, &event);
+}
+
+SUPRIVATE void
+clistones_publish_power(clistones_t *self)
+{
+  struct clistones_feed_power power;
+
+  power.sample  = graves_det_get_samples(self->detector);
+  power.p_n     = graves_det_get_p_n(self->detector);
+  power.p_w     = graves_det_get_p_w(self->detector);
+  power.q       = graves_det_get_q(self->detector);
+  power.noise_q = graves_det_get_noise_q(self->detector);
+
+  clistones_feed_publish_power(self->feed, &power);
+}
+
+SUPRIVATE void
+clistones_show_event(
+    clistones_t *self,
+    const struct clistones_chirp_summary *summary)
+{
+  struct clistones_console_event event;
+
+  event.index    = summary->index;
+  event.tv       = summary->tv;
+  event.duration = summary->duration;
+  event.mean_snr = summary->mean_snr;
+  event.max_snr  = summary->max_snr;
+  event.mean_vel = summary->mean_vel;
+
+  clistones_console_push_event(self->console, &event);
+}
+
+SUPRIVATE void
+clistones_show_report(
+    clistones_t *self,
+    const struct timeval *now,
+    SUFLOAT zhr)
+{
+  struct clistones_console_report report;
+  unsigned int i;
+
+  report.tv  = *now;
+  report.zhr = zhr;
+
+  for (i = 0; i < CLISTONES_STATS_WINDOW_COUNT; ++i)
+    report.rates[i] = clistones_stats_get_rate(self->stats, i, now);
+
+  report.median_duration = clistones_stats_get_quantile(
+      self->stats,
+      CLISTONES_STATS_HIST_DURATION,
+      .5);
+  report.median_snr = clistones_stats_get_quantile(
+      self->stats,
+      CLISTONES_STATS_HIST_MEAN_SNR,
+      .5);
+  report.median_max_snr = clistones_stats_get_quantile(
+      self->stats,
+      CLISTONES_STATS_HIST_MAX_SNR,
+      .5);
+  report.median_vel = clistones_stats_get_quantile(
+      self->stats,
+      CLISTONES_STATS_HIST_VELOCITY,
+      .5);
+
+  report.have_noise = self->params.adaptive && self->detector != NULL;
+  if (report.have_noise) {
+    report.noise_q     = graves_det_get_noise_q(self->detector);
+    report.q_threshold = graves_det_get_q_threshold(self->detector);
+  }
+
+  clistones_console_push_report(self->console, &report);
+}
+
+/* Report a non-weak event to the console and the event log */
+SUPRIVATE SUBOOL
+clistones_accept_event(
+    clistones_t *self,
+    const struct clistones_chirp_summary *summary)
+{
+  SUBOOL ok = SU_FALSE;
+  SUFLOAT delta_t;
+  struct timeval now = summary->tv;
+  struct timeval sub;
+
+  if (self->console != NULL)
+    clistones_show_event(self, summary);
+
+  SU_TRYCATCH(
+      clistones_writer_append_printf(
+          self->writer,
+          self->log,
+          "%d,%ld,%lu,%.10e,%.10e,%.10e,%.10e\n",
+          summary->index,
+          (long) summary->tv.tv_sec,
+          summary->tv.tv_usec,
+          summary->duration,
+          summary->mean_snr,
+          summary->max_snr,
+          summary->mean_vel),
+      goto done);
+
+  if (self->feed != NULL)
+    clistones_publish_event(self, summary);
+
+  clistones_stats_add_event(
+      self->stats,
+      &summary->tv,
+      summary->duration,
+      SU_POWER_DB(summary->mean_snr),
+      SU_POWER_DB(summary->max_snr),
+      summary->mean_vel);
+
+  ++self->event_count;
+
+  /* Show ZHR notice */
+  if (self->params.cycle_len > 0) {
+    if ((self->event_count % self->params.cycle_len) == 0) {
+      if (self->event_count > 0 && self->console != NULL) {
+        timersub(&now, &self->first, &sub);
+
+        delta_t = (sub.tv_sec + 1e-6 * sub.tv_usec);
+        clistones_show_report(
+            self,
+            &now,
+            3600. * self->params.cycle_len / delta_t);
+      }
+
+      self->first = now;
+    }
+  }
+
+  if (self->on_event != NULL)
+    SU_TRYCATCH((self->on_event)(self->on_event_data, summary), goto done);
+
+  ok = SU_TRUE;
+
+done:
+  return ok;
+}
+
+SUPRIVATE SUBOOL
+clistones_on_chirp(void *privdata, const struct graves_chirp_info *chirp)
+{
+  struct clistones_chirp_summary summary;
+  clistones_t *self = (clistones_t *) privdata;
+  struct timeval now;
+  SUBOOL ok = SU_FALSE;
+
+  gettimeofday(&now, NULL);
+
+  SU_TRYCATCH(clistones_register_chirp(self, &summary, now, chirp), goto done);
+
+  /* We ignore weak chirps (but live feed consumers may want them) */
+  if (!summary.weak) {
+    SU_TRYCATCH(clistones_accept_event(self, &summary), goto done);
+  } else if (self->feed != NULL) {
+    clistones_publish_event(self, &summary);
+  }
+
+  ok = SU_TRUE;
+
+done:
+  return ok;
+}
+
+SUPRIVATE SUBOOL
+clistones_on_wf_event(void *privdata, const struct graves_wf_event_info *event)
+{
+  struct clistones_chirp_summary summary;
+  clistones_t *self = (clistones_t *) privdata;
+  struct timeval now;
+  SUBOOL ok = SU_FALSE;
+
+  gettimeofday(&now, NULL);
+
+  SU_TRYCATCH(
+      clistones_register_wf_event(self, &summary, now, event),
+      goto done);
+
+  if (!summary.weak) {
+    SU_TRYCATCH(clistones_accept_event(self, &summary), goto done);
+  } else if (self->feed != NULL) {
+    clistones_publish_event(self, &summary);
+  }
+
+  ok = SU_TRUE;
+
+done:
+  return ok;
+}
+
+/* Forward a block of samples to the meteorite detector */
+SUPRIVATE SUBOOL
+clistones_feed_block(
+    clistones_t *self,
+    const void *buffer,
+    unsigned int len)
+{
+  const SUCOMPLEX *samples = self->samples;
+  unsigned int i, chunk;
+
+  if (self->recorder != NULL)
+    clistones_recorder_push(self->recorder, buffer, len);
+
+  clistones_convert(
+      clistones_source_get_format(self->source),
+      clistones_source_is_iq(self->source) ? 2 : 1,
+      buffer,
+      self->samples,
+      len);
+
+  if (self->waterfall != NULL) {
+    for (i = 0; i < len; ++i)
+      SU_TRYCATCH(
+          graves_wf_feed(self->waterfall, samples[i]),
+          return SU_FALSE);
+  } else if (self->feed != NULL) {
+    /* Feed whole runs of samples between power publications */
+    for (i = 0; i < len; i += chunk) {
+      chunk = self->params.feed_decim - self->feed_count;
+      if (chunk > len - i)
+        chunk = len - i;
+
+      SU_TRYCATCH(
+          graves_det_feed_block(self->detector, samples + i, chunk),
+          return SU_FALSE);
+
+      self->feed_count += chunk;
+      if (self->feed_count == self->params.feed_decim) {
+        self->feed_count = 0;
+        clistones_publish_power(self);
+      }
+    }
+  } else {
+    SU_TRYCATCH(
+        graves_det_feed_block(self->detector, samples, len),
+        return SU_FALSE);
+  }
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+clistones_write_summary(clistones_t *self)
+{
+  struct timeval now;
+  char *path = NULL;
+  SUBOOL ok = SU_FALSE;
+
+  gettimeofday(&now, NULL);
+  grow_buf_shrink(&self->summary_buf);
+
+  SU_TRYCATCH(
+      clistones_stats_format_summary(self->stats, &now, &self->summary_buf),
+      goto done);
+
+  SU_TRYCATCH(path = strbuild("%s/summary.txt", self->directory), goto done);
+
+  SU_TRYCATCH(
+      clistones_writer_replace_file(
+          self->writer,
+          path,
+          grow_buf_get_buffer(&self->summary_buf),
+          grow_buf_get_size(&self->summary_buf)),
+      goto done);
+
+  ok = SU_TRUE;
+
+done:
+  if (path != NULL)
+    free(path);
+
+  return ok;
+}
+
+/* Queue an atomic replacement of the checkpoint file */
+SUPRIVATE SUBOOL
+clistones_write_checkpoint(clistones_t *self)
+{
+  struct clistones_checkpoint_header header;
+
+  /* Wait for the chirp to end, the next block will try again */
+  if (graves_det_in_chirp(self->detector))
+    return SU_FALSE;
+
+  memset(&header, 0, sizeof(struct clistones_checkpoint_header));
+  memcpy(header.magic, CLISTONES_CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version     = CLISTONES_CHECKPOINT_VERSION;
+  header.event_count = self->event_count;
+
+  grow_buf_shrink(&self->checkpoint_buf);
+
+  SU_TRYCATCH(
+      grow_buf_append(&self->checkpoint_buf, &header, sizeof(header)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_det_save_state(self->detector, &self->checkpoint_buf),
+      return SU_FALSE);
+
+  return clistones_writer_replace_file(
+      self->writer,
+      self->params.checkpoint,
+      grow_buf_get_buffer(&self->checkpoint_buf),
+      grow_buf_get_size(&self->checkpoint_buf));
+}
+
+/* Warm start: a missing or mismatching checkpoint means a cold start */
+SUPRIVATE void
+clistones_load_checkpoint(clistones_t *self)
+{
+  struct clistones_checkpoint_header header;
+  struct stat sbuf;
+  FILE *fp = NULL;
+  void *data = NULL;
+  size_t size;
+
+  if ((fp = fopen(self->params.checkpoint, "rb")) == NULL) {
+    if (errno != ENOENT)
+      SU_WARNING(
+          "Cannot open checkpoint `%s': %s\n",
+          self->params.checkpoint,
+          strerror(errno));
+    goto done;
+  }
+
+  if (fstat(fileno(fp), &sbuf) == -1
+      || (size_t) sbuf.st_size < sizeof(header))
+    goto mismatch;
+
+  size = (size_t) sbuf.st_size - sizeof(header);
+  SU_TRYCATCH(data = malloc(size), goto done);
+
+  if (fread(&header, sizeof(header), 1, fp) < 1
+      || fread(data, size, 1, fp) < 1)
+    goto mismatch;
+
+  if (memcmp(header.magic, CLISTONES_CHECKPOINT_MAGIC, sizeof(header.magic))
+      != 0 || header.version != CLISTONES_CHECKPOINT_VERSION)
+    goto mismatch;
+
+  if (!graves_det_restore_state(self->detector, data, size))
+    goto mismatch;
+
+  self->event_count = header.event_count;
+  goto done;
+
+mismatch:
+  SU_WARNING(
+      "Checkpoint `%s' does not match the current settings, "
+      "starting cold\n",
+      self->params.checkpoint);
+
+done:
+  if (data != NULL)
+    free(data);
+
+  if (fp != NULL)
+    fclose(fp);
+}
+
+/* Work done between sample blocks, outside the detection callbacks */
+SUPRIVATE void
+clistones_housekeeping(clistones_t *self, unsigned int blocks)
+{
+  clistones_writer_poll(self->writer);
+
+  if (self->params.stats_interval > 0) {
+    self->stats_samples += blocks * CLISTONES_READ_SIZE;
+    if (self->stats_samples
+        >= self->params.stats_interval * self->det_params.fs) {
+      self->stats_samples = 0;
+      (void) clistones_write_summary(self);
+    }
+  }
+
+  if (self->params.checkpoint != NULL && self->detector != NULL) {
+    self->checkpoint_samples += blocks * CLISTONES_READ_SIZE;
+    if (self->checkpoint_samples
+        >= self->params.checkpoint_interval * self->det_params.fs)
+      if (clistones_write_checkpoint(self))
+        self->checkpoint_samples = 0;
+  }
+}
+
+/*
+ * Realtime mode: the capture thread only moves blocks from the soundcard
+ * to a lock-free ring, and the detector thread (the caller's) consumes
+ * them. If the detector falls behind, blocks are dropped at the capture
+ * side instead of letting ALSA overrun.
+ */
+SUPRIVATE void *
+clistones_capture_thread(void *data)
+{
+  clistones_t *self = (clistones_t *) data;
+  void *slot;
+
+  clistones_rt_setup_thread(
+      "Capture",
+      self->params.rt.capture_prio,
+      self->params.rt.capture_cpu,
+      &self->capture_report);
+
+  sem_post(&self->capture_ready);
+
+  while (!self->cancelled) {
+    if ((slot = clistones_ring_acquire_write(self->capture_ring)) == NULL)
+      slot = self->buffer; /* Ring full: sample block is lost */
+
+    if (!clistones_source_read(self->source, slot)) {
+      /* The end of a stream is a normal shutdown */
+      self->capture_failed = !clistones_source_is_eof(self->source);
+      break;
+    }
+
+    if (slot != self->buffer) {
+      clock_gettime(
+          CLOCK_MONOTONIC,
+          self->capture_times
+          + clistones_ring_slot_index(self->capture_ring, slot));
+      clistones_ring_commit_write(self->capture_ring);
+    }
+
+    sem_post(&self->capture_avail);
+  }
+
+  self->cancelled = SU_TRUE;
+  sem_post(&self->capture_avail);
+
+  return NULL;
+}
+
+SUPRIVATE SUBOOL
+clistones_prefault(clistones_t *self)
+{
+  SUSCOUNT samples =
+      (SUSCOUNT) (self->params.rt.prefault_secs * self->det_params.fs);
+  void *buf;
+
+  if (self->detector != NULL)
+    SU_TRYCATCH(
+        graves_det_prefault(self->detector, samples),
+        return SU_FALSE);
+
+  if (self->waterfall != NULL)
+    SU_TRYCATCH(
+        graves_wf_prefault(self->waterfall, samples),
+        return SU_FALSE);
+
+  if (self->doppler != NULL)
+    SU_TRYCATCH(
+        graves_doppler_prefault(self->doppler, (unsigned int) samples),
+        return SU_FALSE);
+
+  clistones_ring_prefault(self->capture_ring);
+
+  if (self->console != NULL)
+    clistones_console_prefault(self->console);
+
+  /* Event files are serialized here before being handed to the writer */
+  SU_TRYCATCH(
+      buf = grow_buf_alloc(
+          &self->event_buf,
+          samples * (sizeof(SUCOMPLEX) + 3 * sizeof(SUFLOAT))),
+      return SU_FALSE);
+  memset(buf, 0, grow_buf_get_size(&self->event_buf));
+  grow_buf_shrink(&self->event_buf);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+clistones_loop_rt(clistones_t *self)
+{
+  struct clistones_rt_report detector_report;
+  const void *slot;
+  unsigned int blocks;
+  SUBOOL capture_running = SU_FALSE;
+  SUBOOL ok = SU_FALSE;
+  int err;
+
+  SU_TRYCATCH(clistones_prefault(self), goto done);
+
+  printf("Realtime mode setup:\n");
+
+  if (self->params.rt.lock_memory) {
+    err = clistones_rt_lock_memory();
+    printf("  Memory locking:\n");
+    printf(
+        "    %-22s %s%s%s\n",
+        "mlockall",
+        err == 0 ? "OK" : "FAILED (",
+        err == 0 ? "" : strerror(err),
+        err == 0 ? "" : ")");
+  }
+
+  if ((err = pthread_create(
+      &self->capture_thread,
+      NULL,
+      clistones_capture_thread,
+      self)) != 0) {
+    SU_ERROR("Cannot create capture thread: %s\n", strerror(err));
+    goto done;
+  }
+
+  capture_running = SU_TRUE;
+  sem_wait(&self->capture_ready);
+
+  clistones_rt_setup_thread(
+      "Detector",
+      self->params.rt.detector_prio,
+      self->params.rt.detector_cpu,
+      &detector_report);
+
+  clistones_rt_print_report(&self->capture_report);
+  clistones_rt_print_report(&detector_report);
+  printf("\n");
+
+  while (!self->cancelled) {
+    sem_wait(&self->capture_avail);
+
+    blocks = 0;
+    while ((slot = clistones_ring_acquire_read(self->capture_ring)) != NULL) {
+      self->block_time = self->capture_times[
+          clistones_ring_slot_index(self->capture_ring, slot)];
+      SU_TRYCATCH(
+          clistones_feed_block(self, slot, CLISTONES_READ_SIZE),
+          goto done);
+      clistones_ring_release_read(self->capture_ring);
+      ++blocks;
+    }
+
+    clistones_housekeeping(self, blocks);
+  }
+
+  ok = !self->capture_failed;
+
+done:
+  self->cancelled = SU_TRUE;
+
+  if (capture_running)
+    pthread_join(self->capture_thread, NULL);
+
+  if (clistones_ring_get_overflows(self->capture_ring) > 0)
+    SU_WARNING(
+        "%lu sample blocks were dropped (detector too slow)\n",
+        clistones_ring_get_overflows(self->capture_ring));
+
+  return ok;
+}
+
+SUBOOL
+clistones_loop(clistones_t *self)
+{
+  SUBOOL ok = SU_FALSE;
+
+  if (self->params.realtime)
+    return clistones_loop_rt(self);
+
+  while (!self->cancelled) {
+    /* Read samples from the source */
+    if (!clistones_source_read(self->source, self->buffer)) {
+      if (clistones_source_is_eof(self->source))
+        break;
+      goto done;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &self->block_time);
+
+    SU_TRYCATCH(
+        clistones_feed_block(self, self->buffer, CLISTONES_READ_SIZE),
+        goto done);
+
+    clistones_housekeeping(self, 1);
+  }
+
+  ok = SU_TRUE;
+
+done:
+  self->cancelled = SU_TRUE;
+
+  return ok;
+}
+
+clistones_t *
+clistones_new(const struct clistones_params *params)
+{
+  struct graves_det_params det_params = graves_det_params_INITIALIZER;
+  struct clistones_source_params source_params =
+      clistones_source_params_INITIALIZER;
+  struct clistones_recorder_params recorder_params =
+      clistones_recorder_params_INITIALIZER;
+  struct clistones_writer_params writer_params =
+      clistones_writer_params_INITIALIZER;
+  struct clistones_console_params console_params =
+      clistones_console_params_INITIALIZER;
+  struct graves_wf_params wf_params = graves_wf_params_INITIALIZER;
+  struct graves_doppler_params doppler_params =
+      graves_doppler_params_INITIALIZER;
+  char *default_directory = NULL;
+  const char *directory;
+  char *path = NULL;
+  clistones_t *new = NULL;
+  size_t frame_size;
+  time_t t;
+  struct tm *tm;
+
+  /* Sanity checks */
+  if (SU_ABS(params->freq_offset) >= .5 * CLISTONES_SAMP_RATE) {
+    SU_ERROR("Frequency offset is outside the sampling bandwidth\n");
+    SU_ERROR(
+        "|%g| Hz >= %g Hz\n",
+        params->freq_offset,
+        .5 * CLISTONES_SAMP_RATE);
+    goto fail;
+  }
+
+  /* Allocate object */
+  SU_TRYCATCH(new = calloc(1, sizeof (clistones_t)), goto fail);
+  new->params = *params;
+
+  /* Initialize directory */
+  if (params->output_dir == NULL) {
+    time(&t);
+    tm = gmtime(&t);
+    SU_TRYCATCH(
+        new->directory = strbuild(
+            "clistones_%04d%02d%02d_%02d%02d%02d",
+            tm->tm_year + 1900,
+            tm->tm_mon + 1,
+            tm->tm_mday,
+            tm->tm_hour,
+            tm->tm_min,
+            tm->tm_sec),
+        goto fail);
+  } else {
+    SU_TRYCATCH(new->directory = strdup(params->output_dir), goto fail);
+  }
+
+  directory = new->directory;
+
+  if (strcmp(directory, ".") != 0 && access(directory, F_OK) == -1) {
+    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+      SU_ERROR(
+          "Failed to create output directory `%s': %s\n",
+          directory,
+          strerror(errno));
+      goto fail;
+    }
+  }
+
+  /* Open sample source (audio device or stream) */
+  source_params.device = params->device;
+  source_params.fs     = CLISTONES_SAMP_RATE;
+  source_params.block_size = CLISTONES_READ_SIZE;
+  source_params.channels = params->iq ? 2 : 1;
+  source_params.format = params->input_format;
+  source_params.negotiate = !params->input_format_set;
+
+  if (params->input != NULL) {
+    source_params.type   = CLISTONES_SOURCE_STREAM;
+    source_params.path   = params->input;
+    source_params.stall_timeout = params->stall_timeout;
+  } else if (params->synth != NULL) {
+    source_params.type   = CLISTONES_SOURCE_SYNTH;
+    source_params.synth  = *params->synth;
+  }
+
+  SU_TRYCATCH(new->source = clistones_source_new(&source_params), goto fail);
+
+  frame_size = clistones_source_get_frame_size(new->source);
+
+  /* Initialize sample buffers */
+  SU_TRYCATCH(
+      new->buffer = malloc(frame_size * CLISTONES_READ_SIZE),
+      goto fail);
+
+  SU_TRYCATCH(
+      new->samples = malloc(sizeof(SUCOMPLEX) * CLISTONES_READ_SIZE),
+      goto fail);
+
+  if (params->realtime) {
+    SU_TRYCATCH(
+        new->capture_ring = clistones_ring_new(
+            frame_size * CLISTONES_READ_SIZE,
+            CLISTONES_CAPTURE_RING_SLOTS),
+        goto fail);
+
+    SU_TRYCATCH(
+        new->capture_times = calloc(
+            new->capture_ring->slot_count,
+            sizeof(struct timespec)),
+        goto fail);
+
+    SU_TRYCATCH(sem_init(&new->capture_avail, 0, 0) == 0, goto fail);
+    SU_TRYCATCH(sem_init(&new->capture_ready, 0, 0) == 0, goto fail);
+    new->have_sems = SU_TRUE;
+  }
+
+  /* Initialize echo detector */
+  det_params.fs   = CLISTONES_SAMP_RATE;
+  det_params.fc   = params->freq_offset;
+  det_params.adaptive = params->adaptive;
+  det_params.estimator = params->estimator;
+  det_params.gate = params->gate;
+  det_params.stop = params->stop;
+  det_params.holdoff = params->holdoff;
+  new->det_params = det_params;
+
+  if (params->waterfall) {
+    wf_params.fs          = det_params.fs;
+    wf_params.fc          = det_params.fc;
+    wf_params.max_doppler = det_params.lpf1;
+
+    SU_TRYCATCH(
+        new->waterfall = graves_wf_new(
+            &wf_params,
+            clistones_on_wf_event,
+            new),
+        goto fail);
+  } else {
+    SU_TRYCATCH(
+        new->detector = graves_det_new(
+            &new->det_params,
+            clistones_on_chirp,
+            new),
+        goto fail);
+
+    doppler_params.fs          = det_params.fs;
+    doppler_params.max_doppler = det_params.lpf1;
+
+    SU_TRYCATCH(
+        new->doppler = graves_doppler_new(&doppler_params),
+        goto fail);
+
+    if (params->checkpoint != NULL)
+      clistones_load_checkpoint(new);
+  }
+
+  if (params->checkpoint != NULL && new->detector == NULL)
+    SU_WARNING("Checkpoints are not supported by the waterfall detector\n");
+
+  if (params->gate > 0 && new->detector == NULL)
+    SU_WARNING("The trigger gate is not supported by the waterfall detector\n");
+
+  /* Open shared memory feed */
+  if (params->feed_name != NULL) {
+    if (params->feed_decim == 0) {
+      SU_ERROR("Feed decimation must be greater than 0\n");
+      goto fail;
+    }
+
+    if ((new->feed = clistones_feed_new(
+        params->feed_name,
+        det_params.fs,
+        params->feed_decim,
+        new->detector != NULL
+            ? graves_det_get_ratio(new->detector)
+            : det_params.lpf2 / det_params.lpf1)) == NULL) {
+      SU_ERROR(
+          "Failed to create live feed `%s': %s\n",
+          params->feed_name,
+          strerror(errno));
+      goto fail;
+    }
+  }
+
+  /* Start raw capture recorder */
+  if (params->record) {
+    SU_TRYCATCH(
+        recorder_params.directory = strbuild("%s/raw", directory),
+        goto fail);
+
+    recorder_params.format       = clistones_sample_format_name(
+        clistones_source_get_format(new->source));
+    recorder_params.frame_size   = (unsigned int) frame_size;
+    recorder_params.fs           = CLISTONES_SAMP_RATE;
+    recorder_params.segment_size = params->record_segment_size;
+    recorder_params.keep_hours   = params->record_keep_hours;
+    recorder_params.keep_bytes   = params->record_keep_bytes;
+    recorder_params.direct       = params->record_direct;
+
+    new->recorder = clistones_recorder_new(&recorder_params);
+    free((char *) recorder_params.directory);
+
+    SU_TRYCATCH(new->recorder != NULL, goto fail);
+  }
+
+  /* Start asynchronous output and open event log */
+  writer_params.backend = params->output_backend;
+  SU_TRYCATCH(new->writer = clistones_writer_new(&writer_params), goto fail);
+
+  SU_TRYCATCH(path = strbuild("%s/events.csv", directory), goto fail);
+  SU_TRYCATCH(
+      (new->log = clistones_writer_open_log(new->writer, path)) != -1,
+      goto fail);
+
+  /* Console rendering runs in its own thread */
+  if (!params->headless) {
+    console_params.colors = isatty(STDOUT_FILENO);
+    SU_TRYCATCH(
+        new->console = clistones_console_new(&console_params),
+        goto fail);
+  }
+
+  /* Set the current time and finish */
+  gettimeofday(&new->first, NULL);
+
+  SU_TRYCATCH(new->stats = clistones_stats_new(&new->first), goto fail);
+
+  return new;
+
+fail:
+  if (path != NULL)
+    free(path);
+
+  if (default_directory != NULL)
+    free(default_directory);
+
+  if (new != NULL)
+    clistones_destroy(new);
+
+  return NULL;
+}
+
+void
+clistones_destroy(clistones_t *self)
+{
+  if (self->source != NULL) {
+    if (clistones_source_get_stalls(self->source) > 0)
+      SU_WARNING(
+          "Input stream stalled %lu times\n",
+          (unsigned long) clistones_source_get_stalls(self->source));
+    clistones_source_destroy(self->source);
+  }
+
+  /* Leave an up-to-date summary behind */
+  if (self->stats != NULL && self->writer != NULL
+      && self->params.stats_interval > 0)
+    (void) clistones_write_summary(self);
+
+  /* And the latest detector state, for the next start */
+  if (self->detector != NULL && self->writer != NULL
+      && self->params.checkpoint != NULL)
+    (void) clistones_write_checkpoint(self);
+
+  /* Waits for pending event files and log lines */
+  if (self->writer != NULL)
+    clistones_writer_destroy(self->writer);
+
+  if (self->stats != NULL)
+    clistones_stats_destroy(self->stats);
+
+  /* Renders whatever is still queued */
+  if (self->console != NULL)
+    clistones_console_destroy(self->console);
+
+  grow_buf_clear(&self->event_buf);
+  grow_buf_clear(&self->summary_buf);
+  grow_buf_clear(&self->checkpoint_buf);
+
+  if (self->detector != NULL) {
+    if (self->params.gate > 0)
+      SU_INFO(
+          "Full detector ran on %.1f%% of the samples\n",
+          1e2 * graves_det_get_duty_cycle(self->detector));
+    graves_det_destroy(self->detector);
+  }
+
+  if (self->waterfall != NULL)
+    graves_wf_destroy(self->waterfall);
+
+  if (self->doppler != NULL)
+    graves_doppler_destroy(self->doppler);
+
+  if (self->buffer != NULL)
+    free(self->buffer);
+
+  if (self->samples != NULL)
+    free(self->samples);
+
+  if (self->capture_ring != NULL)
+    clistones_ring_destroy(self->capture_ring);
+
+  if (self->capture_times != NULL)
+    free(self->capture_times);
+
+  if (self->feed != NULL)
+    clistones_feed_destroy(self->feed);
+
+  if (self->recorder != NULL)
+    clistones_recorder_destroy(self->recorder);
+
+  if (self->have_sems) {
+    sem_destroy(&self->capture_avail);
+    sem_destroy(&self->capture_ready);
+  }
+
+  free(self);
+}
@@ -0,0 +1,577 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <coinc.h>
+
+#define CLISTONES_COINC_INITIAL_ALLOC 64
+
+/********************************* Parsing ***********************************/
+static int64_t
+clistones_coinc_start_time(int64_t sec, int64_t usec, float duration)
+{
+  return sec * 1000000 + usec - (int64_t) (duration * 1e6);
+}
+
+/* index,tv_sec,tv_usec,duration,mean_snr,max_snr,mean_vel */
+int
+clistones_coinc_event_from_csv(
+    const char *line,
+    struct clistones_coinc_event *event)
+{
+  const char *p = line;
+  char *end;
+  double fields[4];
+  long long index, sec, usec;
+  unsigned int i;
+
+  index = strtoll(p, &end, 10);
+  if (end == p || *end != ',')
+    return 0;
+  p = end + 1;
+
+  sec = strtoll(p, &end, 10);
+  if (end == p || *end != ',')
+    return 0;
+  p = end + 1;
+
+  usec = strtoll(p, &end, 10);
+  if (end == p || *end != ',')
+    return 0;
+
+  for (i = 0; i < 4; ++i) {
+    p = end + 1;
+    fields[i] = strtod(p, &end);
+    if (end == p || (i < 3 && *end != ','))
+      return 0;
+  }
+
+  event->index    = (uint32_t) index;
+  event->duration = (float) fields[0];
+  event->mean_snr = (float) fields[1];
+  event->max_snr  = (float) fields[2];
+  event->mean_vel = (float) fields[3];
+  event->time     = clistones_coinc_start_time(sec, usec, event->duration);
+
+  return 1;
+}
+
+int
+clistones_coinc_event_from_feed(
+    const struct clistones_feed_event *record,
+    struct clistones_coinc_event *event)
+{
+  if (record->weak)
+    return 0;
+
+  event->index    = record->index;
+  event->duration = record->duration;
+  event->mean_snr = record->mean_snr;
+  event->max_snr  = record->max_snr;
+  event->mean_vel = record->mean_vel;
+  event->time     = clistones_coinc_start_time(
+      record->tv_sec,
+      record->tv_usec,
+      record->duration);
+
+  return 1;
+}
+
+/******************************* Merge heap **********************************/
+static int64_t
+clistones_coinc_head_time(const clistones_coinc_t *coinc, unsigned int station)
+{
+  const struct clistones_coinc_station *st = coinc->stations + station;
+
+  return st->queue[st->head].time;
+}
+
+static int
+clistones_coinc_heap_less(
+    const clistones_coinc_t *coinc,
+    unsigned int a,
+    unsigned int b)
+{
+  int64_t ta = clistones_coinc_head_time(coinc, a);
+  int64_t tb = clistones_coinc_head_time(coinc, b);
+
+  /* Ties are broken by station, so that the output is deterministic */
+  return ta < tb || (ta == tb && a < b);
+}
+
+static void
+clistones_coinc_heap_set(
+    clistones_coinc_t *coinc,
+    unsigned int pos,
+    unsigned int station)
+{
+  coinc->heap[pos] = station;
+  coinc->stations[station].heap_pos = (int) pos;
+}
+
+static void
+clistones_coinc_heap_up(clistones_coinc_t *coinc, unsigned int pos)
+{
+  unsigned int station = coinc->heap[pos];
+  unsigned int parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (!clistones_coinc_heap_less(coinc, station, coinc->heap[parent]))
+      break;
+    clistones_coinc_heap_set(coinc, pos, coinc->heap[parent]);
+    pos = parent;
+  }
+
+  clistones_coinc_heap_set(coinc, pos, station);
+}
+
+static void
+clistones_coinc_heap_down(clistones_coinc_t *coinc, unsigned int pos)
+{
+  unsigned int station = coinc->heap[pos];
+  unsigned int child;
+
+  for (;;) {
+    child = 2 * pos + 1;
+    if (child >= coinc->heap_size)
+      break;
+
+    if (child + 1 < coinc->heap_size
+        && clistones_coinc_heap_less(
+            coinc,
+            coinc->heap[child + 1],
+            coinc->heap[child]))
+      ++child;
+
+    if (!clistones_coinc_heap_less(coinc, coinc->heap[child], station))
+      break;
+
+    clistones_coinc_heap_set(coinc, pos, coinc->heap[child]);
+    pos = child;
+  }
+
+  clistones_coinc_heap_set(coinc, pos, station);
+}
+
+/* The first event of the station at the top of the heap was taken */
+static void
+clistones_coinc_heap_pop(clistones_coinc_t *coinc)
+{
+  unsigned int station = coinc->heap[0];
+
+  if (coinc->stations[station].count > 0) {
+    clistones_coinc_heap_down(coinc, 0);
+    return;
+  }
+
+  coinc->stations[station].heap_pos = -1;
+
+  if (--coinc->heap_size > 0) {
+    clistones_coinc_heap_set(coinc, 0, coinc->heap[coinc->heap_size]);
+    clistones_coinc_heap_down(coinc, 0);
+  }
+}
+
+/******************************** Matching ***********************************/
+static float
+clistones_coinc_gauss(double x, double sigma)
+{
+  if (sigma <= 0)
+    return 1;
+
+  return (float) exp(-.5 * (x / sigma) * (x / sigma));
+}
+
+static int
+clistones_coinc_match(
+    clistones_coinc_t *coinc,
+    const struct clistones_coinc_entry *a,
+    const struct clistones_coinc_entry *b)
+{
+  struct clistones_coinc_match match;
+  double snr_db;
+
+  match.station[0] = a->station;
+  match.station[1] = b->station;
+  match.event[0]   = a->event;
+  match.event[1]   = b->event;
+  match.dt         = 1e-6 * (b->event.time - a->event.time);
+
+  match.time_score = (float) (1 - match.dt / coinc->params.window);
+  match.vel_score  = clistones_coinc_gauss(
+      b->event.mean_vel - a->event.mean_vel,
+      coinc->params.vel_sigma);
+
+  if (a->event.mean_snr > 0 && b->event.mean_snr > 0) {
+    snr_db = 10 * log10(b->event.mean_snr / a->event.mean_snr);
+    match.snr_score = clistones_coinc_gauss(snr_db, coinc->params.snr_sigma);
+  } else {
+    match.snr_score = 0;
+  }
+
+  match.score = match.time_score * match.vel_score * match.snr_score;
+
+  if (match.score < coinc->params.min_score)
+    return 1;
+
+  ++coinc->matches;
+
+  return (coinc->on_match)(coinc->privdata, &match);
+}
+
+static int
+clistones_coinc_ring_grow(clistones_coinc_t *coinc)
+{
+  struct clistones_coinc_entry *ring;
+  size_t alloc = 2 * coinc->ring_alloc;
+  size_t i;
+
+  if ((ring = malloc(alloc * sizeof(struct clistones_coinc_entry))) == NULL)
+    return 0;
+
+  for (i = 0; i < coinc->ring_count; ++i)
+    ring[i] = coinc->ring[(coinc->ring_head + i) % coinc->ring_alloc];
+
+  free(coinc->ring);
+
+  coinc->ring       = ring;
+  coinc->ring_head  = 0;
+  coinc->ring_alloc = alloc;
+
+  return 1;
+}
+
+/* Events arrive here in time order */
+static int
+clistones_coinc_release(
+    clistones_coinc_t *coinc,
+    const struct clistones_coinc_entry *entry)
+{
+  const struct clistones_coinc_entry *old;
+  int64_t since = entry->event.time - coinc->window_us;
+  size_t i;
+
+  /* Forget what fell out of the window */
+  while (coinc->ring_count > 0
+      && coinc->ring[coinc->ring_head].event.time < since) {
+    coinc->ring_head = (coinc->ring_head + 1) % coinc->ring_alloc;
+    --coinc->ring_count;
+  }
+
+  for (i = 0; i < coinc->ring_count; ++i) {
+    old = coinc->ring + (coinc->ring_head + i) % coinc->ring_alloc;
+    if (old->station != entry->station
+        && !clistones_coinc_match(coinc, old, entry)) {
+      coinc->stopped = 1;
+      return 0;
+    }
+  }
+
+  if (coinc->ring_count == coinc->ring_alloc
+      && !clistones_coinc_ring_grow(coinc))
+    return 0;
+
+  coinc->ring[(coinc->ring_head + coinc->ring_count) % coinc->ring_alloc] =
+      *entry;
+  ++coinc->ring_count;
+  ++coinc->released;
+
+  return 1;
+}
+
+/* Release, in time order, every queued event up to `until` */
+static int
+clistones_coinc_drain(clistones_coinc_t *coinc, int64_t until)
+{
+  struct clistones_coinc_station *st;
+  struct clistones_coinc_entry entry;
+
+  while (coinc->heap_size > 0
+      && clistones_coinc_head_time(coinc, coinc->heap[0]) <= until) {
+    entry.station = coinc->heap[0];
+    st = coinc->stations + entry.station;
+    entry.event = st->queue[st->head];
+
+    ++st->head;
+    --st->count;
+    if (st->count == 0)
+      st->head = 0;
+
+    clistones_coinc_heap_pop(coinc);
+
+    if (!clistones_coinc_release(coinc, &entry))
+      return 0;
+  }
+
+  if (until > coinc->watermark)
+    coinc->watermark = until;
+
+  return 1;
+}
+
+static void
+clistones_coinc_update_limit(clistones_coinc_t *coinc)
+{
+  const struct clistones_coinc_station *st;
+  int64_t limit = INT64_MAX;
+  unsigned int i;
+
+  for (i = 0; i < coinc->station_count; ++i) {
+    st = coinc->stations + i;
+    if (st->finished)
+      continue;
+
+    if (!st->has_data) {
+      limit = INT64_MIN;
+      break;
+    }
+
+    if (st->newest - coinc->reorder_us < limit)
+      limit = st->newest - coinc->reorder_us;
+  }
+
+  coinc->limit = limit;
+}
+
+static int
+clistones_coinc_process(clistones_coinc_t *coinc)
+{
+  int64_t until = coinc->limit;
+
+  if (coinc->advanced > until)
+    until = coinc->advanced;
+
+  return clistones_coinc_drain(coinc, until);
+}
+
+/******************************* Public API **********************************/
+int
+clistones_coinc_add_station(clistones_coinc_t *coinc, const char *name)
+{
+  struct clistones_coinc_station *stations, *st;
+  unsigned int *heap;
+
+  if ((stations = realloc(
+      coinc->stations,
+      (coinc->station_count + 1) * sizeof(struct clistones_coinc_station)))
+      == NULL)
+    return -1;
+  coinc->stations = stations;
+
+  if ((heap = realloc(
+      coinc->heap,
+      (coinc->station_count + 1) * sizeof(unsigned int))) == NULL)
+    return -1;
+  coinc->heap = heap;
+
+  st = coinc->stations + coinc->station_count;
+  memset(st, 0, sizeof(struct clistones_coinc_station));
+  st->heap_pos = -1;
+
+  if ((st->name = strdup(name)) == NULL)
+    return -1;
+
+  /* A station without events holds everything back */
+  coinc->limit = INT64_MIN;
+
+  return (int) coinc->station_count++;
+}
+
+static int
+clistones_coinc_reserve(struct clistones_coinc_station *st)
+{
+  struct clistones_coinc_event *queue;
+  size_t alloc;
+
+  if (st->head + st->count < st->alloc)
+    return 1;
+
+  /* Reuse the space of released events before growing */
+  if (st->head > st->alloc / 2) {
+    memmove(
+        st->queue,
+        st->queue + st->head,
+        st->count * sizeof(struct clistones_coinc_event));
+    st->head = 0;
+    return 1;
+  }
+
+  alloc = st->alloc == 0 ? CLISTONES_COINC_INITIAL_ALLOC : 2 * st->alloc;
+  if ((queue = realloc(
+      st->queue,
+      alloc * sizeof(struct clistones_coinc_event))) == NULL)
+    return 0;
+
+  st->queue = queue;
+  st->alloc = alloc;
+
+  return 1;
+}
+
+int
+clistones_coinc_push(
+    clistones_coinc_t *coinc,
+    unsigned int station,
+    const struct clistones_coinc_event *event)
+{
+  struct clistones_coinc_station *st = coinc->stations + station;
+  struct clistones_coinc_event *base;
+  int64_t prev = st->newest;
+  int had_data = st->has_data;
+  size_t pos;
+
+  if (coinc->stopped)
+    return 0;
+
+  if (event->time < coinc->watermark || st->finished) {
+    ++st->late;
+    return 1;
+  }
+
+  if (!clistones_coinc_reserve(st))
+    return 0;
+
+  /* Usually in order: look for the place from the end */
+  base = st->queue + st->head;
+  pos = st->count;
+  while (pos > 0 && base[pos - 1].time > event->time)
+    --pos;
+
+  memmove(
+      base + pos + 1,
+      base + pos,
+      (st->count - pos) * sizeof(struct clistones_coinc_event));
+  base[pos] = *event;
+  ++st->count;
+
+  if (st->heap_pos == -1) {
+    clistones_coinc_heap_set(coinc, coinc->heap_size, station);
+    clistones_coinc_heap_up(coinc, coinc->heap_size++);
+  } else if (pos == 0) {
+    clistones_coinc_heap_up(coinc, (unsigned int) st->heap_pos);
+  }
+
+  if (!had_data || event->time > prev) {
+    st->newest   = event->time;
+    st->has_data = 1;
+
+    /* Only the station that set the limit can move it */
+    if (!had_data || prev - coinc->reorder_us <= coinc->limit)
+      clistones_coinc_update_limit(coinc);
+  }
+
+  return clistones_coinc_process(coinc);
+}
+
+int
+clistones_coinc_finish(clistones_coinc_t *coinc, unsigned int station)
+{
+  coinc->stations[station].finished = 1;
+  clistones_coinc_update_limit(coinc);
+
+  return clistones_coinc_process(coinc);
+}
+
+int
+clistones_coinc_advance(clistones_coinc_t *coinc, int64_t time)
+{
+  if (time > coinc->advanced)
+    coinc->advanced = time;
+
+  return clistones_coinc_process(coinc);
+}
+
+int
+clistones_coinc_flush(clistones_coinc_t *coinc)
+{
+  return clistones_coinc_drain(coinc, INT64_MAX);
+}
+
+void
+clistones_coinc_destroy(clistones_coinc_t *coinc)
+{
+  unsigned int i;
+
+  for (i = 0; i < coinc->station_count; ++i) {
+    if (coinc->stations[i].name != NULL)
+      free(coinc->stations[i].name);
+    if (coinc->stations[i].queue != NULL)
+      free(coinc->stations[i].queue);
+  }
+
+  if (coinc->stations != NULL)
+    free(coinc->stations);
+
+  if (coinc->heap != NULL)
+    free(coinc->heap);
+
+  if (coinc->ring != NULL)
+    free(coinc->ring);
+
+  free(coinc);
+}
+
+clistones_coinc_t *
+clistones_coinc_new(
+    const struct clistones_coinc_params *params,
+    clistones_coinc_match_cb_t on_match,
+    void *privdata)
+{
+  clistones_coinc_t *new = NULL;
+  int saved;
+
+  if (params->window <= 0 || params->reorder < 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  if ((new = calloc(1, sizeof(clistones_coinc_t))) == NULL)
+    goto fail;
+
+  new->params    = *params;
+  new->on_match  = on_match;
+  new->privdata  = privdata;
+  new->window_us = (int64_t) (params->window * 1e6);
+  new->reorder_us = (int64_t) (params->reorder * 1e6);
+  new->limit     = INT64_MIN;
+  new->advanced  = INT64_MIN;
+  new->watermark = INT64_MIN;
+
+  new->ring_alloc = CLISTONES_COINC_INITIAL_ALLOC;
+  if ((new->ring = malloc(
+      new->ring_alloc * sizeof(struct clistones_coinc_entry))) == NULL)
+    goto fail;
+
+  return new;
+
+fail:
+  saved = errno;
+
+  if (new != NULL)
+    clistones_coinc_destroy(new);
+
+  errno = saved;
+
+  return NULL;
+}
@@ -0,0 +1,463 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <coinc.h>
+
+/*
+ * Coincidence tool. Reads the event logs of several stations (events.csv,
+ * or raw event records as written by clistones-feedcat -b) and prints the
+ * pairs of events that matched as CSV to stdout. Logs are read a batch at a
+ * time from the station that is furthest behind, so that the engine only
+ * keeps a few batches per station in memory no matter how long the logs
+ * are. With -f, logs are followed as they grow and the watermark is moved
+ * with the wall clock.
+ */
+
+#define COINC_BATCH       1024
+#define COINC_LINE_MAX    256
+#define COINC_POLL_USEC   200000
+#define COINC_DEFAULT_LAG 30.
+
+struct coinc_input {
+  const char *path;
+  FILE    *fp;
+  int      binary;
+  int      station;
+  int      finished;
+  int64_t  last;       /* Time of the last event read */
+  uint64_t bad;        /* Lines that could not be parsed */
+
+  /* Incomplete line or record at the end of a followed log */
+  char     buf[COINC_LINE_MAX];
+  size_t   fill;
+};
+
+void
+help(const char *a0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s [OPTIONS] [NAME=]LOG [NAME=]LOG...\n\n", a0);
+  fprintf(stderr, "Match the events of several stations\n\n");
+  fprintf(
+      stderr,
+      "Logs ending in .csv are read as events.csv, the rest as raw event\n");
+  fprintf(stderr, "records written by clistones-feedcat -b.\n\n");
+  fprintf(stderr, "OPTIONS:\n");
+  fprintf(stderr, "  -w, --window=SEC      Coincidence window (default 1)\n");
+  fprintf(stderr, "  -r, --reorder=SEC     Longest echo (default 10)\n");
+  fprintf(stderr, "  -v, --vel-sigma=M/S   Velocity agreement width (default 15)\n");
+  fprintf(stderr, "  -s, --snr-sigma=DB    SNR agreement width (default 6)\n");
+  fprintf(stderr, "  -m, --min-score=S     Minimum score to report (default 0)\n");
+  fprintf(stderr, "  -f, --follow          Keep reading the logs as they grow\n");
+  fprintf(
+      stderr,
+      "  -l, --lag=SEC         Longest delay of a log after an echo ends (default %g)\n",
+      COINC_DEFAULT_LAG);
+  fprintf(stderr, "  -h, --help            This help\n");
+}
+
+static struct option long_options[] =
+{
+  {"window",    required_argument, 0, 'w'},
+  {"reorder",   required_argument, 0, 'r'},
+  {"vel-sigma", required_argument, 0, 'v'},
+  {"snr-sigma", required_argument, 0, 's'},
+  {"min-score", required_argument, 0, 'm'},
+  {"follow",    no_argument,       0, 'f'},
+  {"lag",       required_argument, 0, 'l'},
+  {"help",      no_argument,       0, 'h'},
+  {0, 0, 0, 0}
+};
+
+static int
+coinc_on_match(void *privdata, const struct clistones_coinc_match *match)
+{
+  const clistones_coinc_t *coinc = (const clistones_coinc_t *) privdata;
+  int64_t t = match->event[0].time;
+
+  printf(
+      "%lld.%06lld,%s,%u,%s,%u,%.6f,%.2f,%.2f,%.6e,%.6e,%.3f,%.3f,%.3f,%.3f\n",
+      (long long) (t / 1000000),
+      (long long) (t % 1000000),
+      clistones_coinc_get_station_name(coinc, match->station[0]),
+      match->event[0].index,
+      clistones_coinc_get_station_name(coinc, match->station[1]),
+      match->event[1].index,
+      match->dt,
+      match->event[0].mean_vel,
+      match->event[1].mean_vel,
+      match->event[0].mean_snr,
+      match->event[1].mean_snr,
+      match->time_score,
+      match->vel_score,
+      match->snr_score,
+      match->score);
+
+  return 1;
+}
+
+static int
+coinc_has_suffix(const char *str, const char *suffix)
+{
+  size_t len = strlen(str);
+  size_t slen = strlen(suffix);
+
+  return len >= slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+/*
+ * Read the next event of a log. Returns 1 if there was one, 0 if the end
+ * of the log was reached and -1 on read errors.
+ */
+static int
+coinc_read_event(struct coinc_input *input, struct clistones_coinc_event *ev)
+{
+  struct clistones_feed_event record;
+  size_t want, got;
+
+  for (;;) {
+    if (input->binary) {
+      want = sizeof(struct clistones_feed_event) - input->fill;
+      got = fread(input->buf + input->fill, 1, want, input->fp);
+      input->fill += got;
+
+      if (got < want)
+        return ferror(input->fp) ? -1 : 0;
+
+      input->fill = 0;
+      memcpy(&record, input->buf, sizeof(struct clistones_feed_event));
+      if (clistones_coinc_event_from_feed(&record, ev))
+        return 1;
+    } else {
+      if (fgets(
+          input->buf + input->fill,
+          sizeof(input->buf) - input->fill,
+          input->fp) == NULL)
+        return ferror(input->fp) ? -1 : 0;
+
+      input->fill += strlen(input->buf + input->fill);
+
+      /* Wait for the rest of the line (unless it does not fit) */
+      if (input->buf[input->fill - 1] != '\n'
+          && input->fill < sizeof(input->buf) - 1)
+        continue;
+
+      input->fill = 0;
+      if (clistones_coinc_event_from_csv(input->buf, ev))
+        return 1;
+
+      /* The header is expected, anything else is worth reporting */
+      if (strncmp(input->buf, "index,", 6) != 0)
+        ++input->bad;
+    }
+  }
+}
+
+/* Returns the number of events read, or -1 on failure */
+static int
+coinc_read_batch(
+    clistones_coinc_t *coinc,
+    struct coinc_input *input,
+    const char *a0)
+{
+  struct clistones_coinc_event ev;
+  int count = 0;
+  int got;
+
+  while (count < COINC_BATCH) {
+    if ((got = coinc_read_event(input, &ev)) == 1) {
+      if (!clistones_coinc_push(coinc, input->station, &ev)) {
+        fprintf(stderr, "%s: cannot queue event: %s\n", a0, strerror(errno));
+        return -1;
+      }
+      input->last = ev.time;
+      ++count;
+    } else if (got == 0) {
+      clearerr(input->fp);
+      break;
+    } else {
+      fprintf(
+          stderr,
+          "%s: cannot read `%s': %s\n",
+          a0,
+          input->path,
+          strerror(errno));
+      return -1;
+    }
+  }
+
+  return count;
+}
+
+static int
+coinc_run_batch(
+    clistones_coinc_t *coinc,
+    struct coinc_input *inputs,
+    unsigned int count,
+    const char *a0)
+{
+  struct coinc_input *next;
+  unsigned int i, left = count;
+  int got;
+
+  while (left > 0) {
+    /* Read from the log that is furthest behind */
+    next = NULL;
+    for (i = 0; i < count; ++i)
+      if (!inputs[i].finished && (next == NULL || inputs[i].last < next->last))
+        next = inputs + i;
+
+    if ((got = coinc_read_batch(coinc, next, a0)) == -1)
+      return 0;
+
+    if (got < COINC_BATCH) {
+      next->finished = 1;
+      --left;
+      if (!clistones_coinc_finish(coinc, next->station)) {
+        fprintf(stderr, "%s: cannot queue event: %s\n", a0, strerror(errno));
+        return 0;
+      }
+    }
+  }
+
+  return clistones_coinc_flush(coinc);
+}
+
+static int
+coinc_run_follow(
+    clistones_coinc_t *coinc,
+    struct coinc_input *inputs,
+    unsigned int count,
+    double lag,
+    const char *a0)
+{
+  struct timespec now;
+  unsigned int i;
+  int got, total;
+
+  for (;;) {
+    total = 0;
+
+    for (i = 0; i < count; ++i) {
+      if ((got = coinc_read_batch(coinc, inputs + i, a0)) == -1)
+        return 0;
+      total += got;
+    }
+
+    /* Events are logged when they end, and matched by their start */
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!clistones_coinc_advance(
+        coinc,
+        (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000
+        - (int64_t) ((lag + coinc->params.reorder) * 1e6))) {
+      fprintf(stderr, "%s: cannot queue event: %s\n", a0, strerror(errno));
+      return 0;
+    }
+
+    fflush(stdout);
+
+    if (total == 0)
+      usleep(COINC_POLL_USEC);
+  }
+
+  return 1;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct clistones_coinc_params params = clistones_coinc_params_INITIALIZER;
+  clistones_coinc_t *coinc = NULL;
+  struct coinc_input *inputs = NULL;
+  unsigned int i, total, count = 0;
+  double lag = COINC_DEFAULT_LAG;
+  int follow = 0;
+  int ret = EXIT_FAILURE;
+  int option_index = 0;
+  char *name, *eq;
+  int c, ok;
+
+  while ((c = getopt_long(
+      argc,
+      argv,
+      "w:r:v:s:m:fl:h",
+      long_options,
+      &option_index)) != -1) {
+    switch (c) {
+      case 'w':
+        if (sscanf(optarg, "%lg", &params.window) < 1 || params.window <= 0) {
+          fprintf(stderr, "%s: invalid window `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'r':
+        if (sscanf(optarg, "%lg", &params.reorder) < 1 || params.reorder < 0) {
+          fprintf(stderr, "%s: invalid reorder time `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'v':
+        if (sscanf(optarg, "%g", &params.vel_sigma) < 1
+            || params.vel_sigma < 0) {
+          fprintf(stderr, "%s: invalid velocity width `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 's':
+        if (sscanf(optarg, "%g", &params.snr_sigma) < 1
+            || params.snr_sigma < 0) {
+          fprintf(stderr, "%s: invalid SNR width `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'm':
+        if (sscanf(optarg, "%g", &params.min_score) < 1
+            || params.min_score < 0
+            || params.min_score > 1) {
+          fprintf(stderr, "%s: invalid score `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'f':
+        follow = 1;
+        break;
+
+      case 'l':
+        if (sscanf(optarg, "%lg", &lag) < 1 || lag < 0) {
+          fprintf(stderr, "%s: invalid lag `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'h':
+        help(argv[0]);
+        return EXIT_SUCCESS;
+
+      default:
+        help(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind < 2) {
+    help(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if ((coinc = clistones_coinc_new(&params, coinc_on_match, NULL)) == NULL) {
+    fprintf(stderr, "%s: cannot create engine: %s\n", argv[0], strerror(errno));
+    goto done;
+  }
+  coinc->privdata = coinc;
+
+  total = argc - optind;
+  if ((inputs = calloc(total, sizeof(struct coinc_input))) == NULL)
+    goto done;
+
+  for (; optind < argc; ++optind, ++count) {
+    name = argv[optind];
+    if ((eq = strchr(name, '=')) != NULL) {
+      *eq = '\0';
+      inputs[count].path = eq + 1;
+    } else {
+      inputs[count].path = name;
+    }
+
+    inputs[count].binary = !coinc_has_suffix(inputs[count].path, ".csv");
+    inputs[count].last   = INT64_MIN;
+
+    if ((inputs[count].fp = fopen(inputs[count].path, "rb")) == NULL) {
+      fprintf(
+          stderr,
+          "%s: cannot open `%s': %s\n",
+          argv[0],
+          inputs[count].path,
+          strerror(errno));
+      goto done;
+    }
+
+    if ((inputs[count].station = clistones_coinc_add_station(coinc, name))
+        == -1) {
+      fprintf(stderr, "%s: cannot add station: %s\n", argv[0], strerror(errno));
+      goto done;
+    }
+  }
+
+  printf(
+      "time,station_a,index_a,station_b,index_b,dt,"
+      "vel_a,vel_b,snr_a,snr_b,time_score,vel_score,snr_score,score\n");
+
+  if (follow)
+    ok = coinc_run_follow(coinc, inputs, count, lag, argv[0]);
+  else
+    ok = coinc_run_batch(coinc, inputs, count, argv[0]);
+
+  fflush(stdout);
+
+  for (i = 0; i < count; ++i) {
+    if (inputs[i].bad > 0)
+      fprintf(
+          stderr,
+          "%s: %llu malformed lines\n",
+          inputs[i].path,
+          (unsigned long long) inputs[i].bad);
+    if (clistones_coinc_get_late(coinc, i) > 0)
+      fprintf(
+          stderr,
+          "%s: %llu events arrived too late to be matched\n",
+          inputs[i].path,
+          (unsigned long long) clistones_coinc_get_late(coinc, i));
+  }
+
+  fprintf(
+      stderr,
+      "%llu events, %llu matches\n",
+      (unsigned long long) coinc->released,
+      (unsigned long long) coinc->matches);
+
+  if (ok)
+    ret = EXIT_SUCCESS;
+
+done:
+  if (inputs != NULL) {
+    for (i = 0; i < total; ++i)
+      if (inputs[i].fp != NULL)
+        fclose(inputs[i].fp);
+    free(inputs);
+  }
+
+  if (coinc != NULL)
+    clistones_coinc_destroy(coinc);
+
+  return ret;
+}
@@ -0,0 +1,377 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <sigutils/sigutils.h>
+#include <console.h>
+
+/****************************** Producer *************************************/
+void
+clistones_console_push_event(
+    clistones_console_t *console,
+    const struct clistones_console_event *event)
+{
+  struct clistones_console_msg *msg;
+
+  if ((msg = clistones_ring_acquire_write(console->ring)) == NULL)
+    return; /* Accounted by the ring */
+
+  msg->type    = CLISTONES_CONSOLE_MSG_EVENT;
+  msg->u.event = *event;
+
+  clistones_ring_commit_write(console->ring);
+  sem_post(&console->avail);
+}
+
+void
+clistones_console_push_report(
+    clistones_console_t *console,
+    const struct clistones_console_report *report)
+{
+  struct clistones_console_msg *msg;
+
+  if ((msg = clistones_ring_acquire_write(console->ring)) == NULL)
+    return;
+
+  msg->type     = CLISTONES_CONSOLE_MSG_REPORT;
+  msg->u.report = *report;
+
+  clistones_ring_commit_write(console->ring);
+  sem_post(&console->avail);
+}
+
+/****************************** Rendering ************************************/
+SUPRIVATE void
+clistones_console_print_date(const struct timeval *tv)
+{
+  struct tm tm;
+
+  gmtime_r(&tv->tv_sec, &tm);
+
+  printf(
+      "[%04d/%02d/%02d - %02d:%02d:%02d U] ",
+      tm.tm_year + 1900,
+      tm.tm_mon  + 1,
+      tm.tm_mday,
+      tm.tm_hour,
+      tm.tm_min,
+      tm.tm_sec);
+}
+
+SUPRIVATE void
+clistones_console_render_event(
+    const clistones_console_t *console,
+    const struct clistones_console_event *event)
+{
+  SUFLOAT snr;
+  unsigned int ticks, i;
+
+  clistones_console_print_date(&event->tv);
+
+  snr = SU_POWER_DB(event->mean_snr);
+
+  ticks = snr < 1 ? 1 : floor(snr);
+
+  printf(
+      "STONE EVENT %07d %6.2f s (%+6.2f m/s) SNR: %+6.2f dB (max %+6.2f dB) [",
+      event->index + 1,
+      event->duration,
+      event->mean_vel,
+      snr,
+      SU_POWER_DB(event->max_snr));
+
+  if (console->params.colors) {
+    if (ticks >= 10)
+      printf("\033[1;31m");
+    else if (ticks >= 5)
+      printf("\033[1;33m");
+    else
+      printf("\033[1;32m");
+  }
+
+  if (ticks >= 16)
+    ticks = 16;
+
+  for (i = 0; i < ticks; ++i)
+    putchar('|');
+
+  if (console->params.colors)
+    printf("\033[0m");
+
+  if (ticks == 16) {
+    --ticks;
+    putchar('+');
+  }
+
+  for (i = 0; i < 16 - ticks; ++i)
+    putchar(' ');
+  putchar(']');
+  printf("\n");
+}
+
+SUPRIVATE void
+clistones_console_render_coalesced(
+    const struct clistones_console_coalesced *coalesced)
+{
+  clistones_console_print_date(&coalesced->last.tv);
+
+  printf(
+      "STONE EVENTS %07d-%07d (%u events, max SNR %+6.2f dB)\n",
+      coalesced->first + 1,
+      coalesced->last.index + 1,
+      coalesced->count,
+      SU_POWER_DB(coalesced->max_snr));
+}
+
+SUPRIVATE void
+clistones_console_render_report(
+    const struct clistones_console_report *report)
+{
+  clistones_console_print_date(&report->tv);
+  printf("ZHR report update: %g events / hour\n", report->zhr);
+
+  if (report->have_noise)
+    printf(
+        "  Noise floor Q: %g (trigger threshold Q: %g)\n",
+        report->noise_q,
+        report->q_threshold);
+
+  printf(
+      "  Rate (events / hour): %.1f (10 min), %.1f (1 h), %.1f (24 h)\n",
+      report->rates[CLISTONES_STATS_WINDOW_10MIN],
+      report->rates[CLISTONES_STATS_WINDOW_1H],
+      report->rates[CLISTONES_STATS_WINDOW_24H]);
+
+  printf(
+      "  Medians: %.2f s, SNR %+.2f dB (max %+.2f dB), %+.2f m/s\n",
+      report->median_duration,
+      report->median_snr,
+      report->median_max_snr,
+      report->median_vel);
+}
+
+/****************************** Consumer *************************************/
+SUPRIVATE void
+clistones_console_refill(clistones_console_t *console)
+{
+  struct timespec now;
+  SUFLOAT elapsed;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  elapsed = (now.tv_sec - console->last_refill.tv_sec)
+      + 1e-9 * (now.tv_nsec - console->last_refill.tv_nsec);
+
+  console->tokens += elapsed * console->params.lines_per_sec;
+  if (console->tokens > console->params.burst)
+    console->tokens = console->params.burst;
+
+  console->last_refill = now;
+}
+
+SUPRIVATE SUBOOL
+clistones_console_take(clistones_console_t *console, SUBOOL force)
+{
+  if (console->tokens >= 1) {
+    console->tokens -= 1;
+    return SU_TRUE;
+  }
+
+  return force;
+}
+
+SUPRIVATE void
+clistones_console_coalesce(
+    clistones_console_t *console,
+    const struct clistones_console_event *event)
+{
+  struct clistones_console_coalesced *coalesced = &console->coalesced;
+
+  if (coalesced->count == 0) {
+    coalesced->first   = event->index;
+    coalesced->max_snr = event->max_snr;
+  } else if (event->max_snr > coalesced->max_snr) {
+    coalesced->max_snr = event->max_snr;
+  }
+
+  coalesced->last = *event;
+  ++coalesced->count;
+}
+
+/* Render whatever the rate limit allows (everything, if forced) */
+SUPRIVATE void
+clistones_console_process(clistones_console_t *console, SUBOOL force)
+{
+  const struct clistones_console_msg *msg;
+  unsigned long dropped;
+
+  clistones_console_refill(console);
+
+  while ((msg = clistones_ring_acquire_read(console->ring)) != NULL) {
+    if (msg->type == CLISTONES_CONSOLE_MSG_EVENT) {
+      /* Once coalescing, keep coalescing so that lines stay in order */
+      if (console->coalesced.count == 0
+          && clistones_console_take(console, SU_FALSE))
+        clistones_console_render_event(console, &msg->u.event);
+      else
+        clistones_console_coalesce(console, &msg->u.event);
+    } else {
+      console->report      = msg->u.report;
+      console->have_report = SU_TRUE;
+    }
+
+    clistones_ring_release_read(console->ring);
+  }
+
+  if (console->coalesced.count > 0 && clistones_console_take(console, force)) {
+    if (console->coalesced.count == 1)
+      clistones_console_render_event(console, &console->coalesced.last);
+    else
+      clistones_console_render_coalesced(&console->coalesced);
+    console->coalesced.count = 0;
+  }
+
+  if (console->have_report && clistones_console_take(console, force)) {
+    clistones_console_render_report(&console->report);
+    console->have_report = SU_FALSE;
+  }
+
+  dropped = clistones_ring_get_overflows(console->ring);
+  if (dropped != console->dropped_reported
+      && clistones_console_take(console, force)) {
+    printf(
+        "[...] %lu console messages dropped (terminal too slow)\n",
+        dropped - console->dropped_reported);
+    console->dropped_reported = dropped;
+  }
+
+  fflush(stdout);
+}
+
+SUPRIVATE void *
+clistones_console_thread(void *data)
+{
+  clistones_console_t *console = (clistones_console_t *) data;
+  struct sched_param param;
+  struct timespec ts;
+  SUBOOL halting = SU_FALSE;
+
+  /* Rendering is the least important thing we do */
+  memset(&param, 0, sizeof(struct sched_param));
+  (void) pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+  while (!halting) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += CLISTONES_CONSOLE_FLUSH_MS * 1000000l;
+    if (ts.tv_nsec >= 1000000000l) {
+      ts.tv_nsec -= 1000000000l;
+      ++ts.tv_sec;
+    }
+
+    /* Timeouts let coalesced lines out when events stop arriving */
+    (void) sem_timedwait(&console->avail, &ts);
+
+    halting = atomic_load_explicit(&console->halting, memory_order_acquire);
+
+    clistones_console_process(console, halting);
+  }
+
+  return NULL;
+}
+
+void
+clistones_console_destroy(clistones_console_t *console)
+{
+  if (console->thread_running) {
+    atomic_store_explicit(&console->halting, SU_TRUE, memory_order_release);
+    sem_post(&console->avail);
+    pthread_join(console->thread, NULL);
+  }
+
+  if (console->have_sem)
+    sem_destroy(&console->avail);
+
+  if (console->ring != NULL)
+    clistones_ring_destroy(console->ring);
+
+  free(console);
+}
+
+clistones_console_t *
+clistones_console_new(const struct clistones_console_params *params)
+{
+  clistones_console_t *new = NULL;
+  int err;
+
+  if (params->lines_per_sec <= 0 || params->burst == 0) {
+    SU_ERROR("Invalid console rate limit\n");
+    return NULL;
+  }
+
+  SU_TRYCATCH(new = calloc(1, sizeof(clistones_console_t)), goto fail);
+
+  new->params = *params;
+  new->tokens = params->burst;
+  atomic_init(&new->halting, SU_FALSE);
+  clock_gettime(CLOCK_MONOTONIC, &new->last_refill);
+
+  SU_TRYCATCH(
+      new->ring = clistones_ring_new(
+          sizeof(struct clistones_console_msg),
+          params->slots),
+      goto fail);
+
+  SU_TRYCATCH(sem_init(&new->avail, 0, 0) == 0, goto fail);
+  new->have_sem = SU_TRUE;
+
+  if ((err = pthread_create(
+      &new->thread,
+      NULL,
+      clistones_console_thread,
+      new)) != 0) {
+    SU_ERROR("Cannot create console thread: %s\n", strerror(err));
+    goto fail;
+  }
+
+  new->thread_running = SU_TRUE;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_console_destroy(new);
+
+  return NULL;
+}
@@ -0,0 +1,155 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <strings.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <convert.h>
+
+#define CLISTONES_CONVERT_S16_SCALE SU_ADDSFX(3.0517578125e-5)  /* 2^-15 */
+#define CLISTONES_CONVERT_S32_SCALE SU_ADDSFX(4.656612873e-10)  /* 2^-31 */
+
+const char *
+clistones_sample_format_name(enum clistones_sample_format format)
+{
+  switch (format) {
+    case CLISTONES_SAMPLE_FORMAT_S16_LE:
+      return "S16_LE";
+
+    case CLISTONES_SAMPLE_FORMAT_S32_LE:
+      return "S32_LE";
+
+    case CLISTONES_SAMPLE_FORMAT_F32_LE:
+      return "FLOAT_LE";
+  }
+
+  return "UNKNOWN";
+}
+
+SUBOOL
+clistones_sample_format_parse(
+    const char *name,
+    enum clistones_sample_format *format)
+{
+  if (strcasecmp(name, "s16") == 0 || strcasecmp(name, "S16_LE") == 0)
+    *format = CLISTONES_SAMPLE_FORMAT_S16_LE;
+  else if (strcasecmp(name, "s32") == 0 || strcasecmp(name, "S32_LE") == 0)
+    *format = CLISTONES_SAMPLE_FORMAT_S32_LE;
+  else if (strcasecmp(name, "f32") == 0 || strcasecmp(name, "FLOAT_LE") == 0)
+    *format = CLISTONES_SAMPLE_FORMAT_F32_LE;
+  else
+    return SU_FALSE;
+
+  return SU_TRUE;
+}
+
+/*
+ * In the I/Q case, input and output have the same layout (I, Q, I, Q...)
+ * and the block is converted as 2 * len reals. In the real case, every
+ * input value goes to the real part of an output sample.
+ */
+SUPRIVATE void
+clistones_convert_s16(
+    const int16_t *x,
+    SUFLOAT *y,
+    unsigned int channels,
+    unsigned int len)
+{
+  SUSCOUNT i;
+
+  if (channels == 2) {
+    for (i = 0; i < 2 * len; ++i)
+      y[i] = x[i] * CLISTONES_CONVERT_S16_SCALE;
+  } else {
+    for (i = 0; i < len; ++i) {
+      y[2 * i]     = x[i] * CLISTONES_CONVERT_S16_SCALE;
+      y[2 * i + 1] = 0;
+    }
+  }
+}
+
+SUPRIVATE void
+clistones_convert_s32(
+    const int32_t *x,
+    SUFLOAT *y,
+    unsigned int channels,
+    unsigned int len)
+{
+  SUSCOUNT i;
+
+  if (channels == 2) {
+    for (i = 0; i < 2 * len; ++i)
+      y[i] = x[i] * CLISTONES_CONVERT_S32_SCALE;
+  } else {
+    for (i = 0; i < len; ++i) {
+      y[2 * i]     = x[i] * CLISTONES_CONVERT_S32_SCALE;
+      y[2 * i + 1] = 0;
+    }
+  }
+}
+
+SUPRIVATE void
+clistones_convert_f32(
+    const float *x,
+    SUFLOAT *y,
+    unsigned int channels,
+    unsigned int len)
+{
+  SUSCOUNT i;
+
+  if (channels == 2) {
+    for (i = 0; i < 2 * len; ++i)
+      y[i] = x[i];
+  } else {
+    for (i = 0; i < len; ++i) {
+      y[2 * i]     = x[i];
+      y[2 * i + 1] = 0;
+    }
+  }
+}
+
+void
+clistones_convert(
+    enum clistones_sample_format format,
+    unsigned int channels,
+    const void *src,
+    SUCOMPLEX *dst,
+    unsigned int len)
+{
+  /* Complex numbers are laid out as two reals */
+  SUFLOAT *y = (SUFLOAT *) dst;
+
+  switch (format) {
+    case CLISTONES_SAMPLE_FORMAT_S16_LE:
+      clistones_convert_s16((const int16_t *) src, y, channels, len);
+      break;
+
+    case CLISTONES_SAMPLE_FORMAT_S32_LE:
+      clistones_convert_s32((const int32_t *) src, y, channels, len);
+      break;
+
+    case CLISTONES_SAMPLE_FORMAT_F32_LE:
+      clistones_convert_f32((const float *) src, y, channels, len);
+      break;
+  }
+}
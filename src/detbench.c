@@ -0,0 +1,642 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <graves.h>
+#include <bank.h>
+
+/*
+ * Detector benchmark: feeds synthetic noise with periodic tones (so that
+ * the chirp paths are exercised too) at several sample rates, and reports
+ * time and cache misses per sample. Cache misses are read from the
+ * hardware counters of the kernel, if available (see perf_event_paranoid).
+ * Timings can be saved as a baseline, and later runs fail if they are
+ * slower than it by more than a given margin.
+ *
+ * With several channels, every block is fed to that many detectors, one
+ * after the other or (with --pipeline) through a detector bank. Times are
+ * per sample and channel, and include waiting for the bank to finish.
+ * Hardware counters only see the calling thread, so they are not read in
+ * pipelined runs.
+ */
+
+#define DETBENCH_MAGIC                   "# CLISTONES DETBENCH 1"
+#define DETBENCH_DEFAULT_SECONDS         20
+#define DETBENCH_DEFAULT_MAX_REGRESSION  15.
+#define DETBENCH_MAX_RATES               32
+#define DETBENCH_MAX_CHANNELS            256
+
+enum detbench_counter {
+  DETBENCH_COUNTER_CACHE_MISSES,
+  DETBENCH_COUNTER_L1D_MISSES,
+  DETBENCH_COUNTER_COUNT
+};
+
+struct detbench_counters {
+  int fd[DETBENCH_COUNTER_COUNT];
+  int error; /* errno of the first counter that failed to open */
+};
+
+struct detbench_result {
+  SUSCOUNT samples;
+  unsigned int chirps;
+  SUFLOAT  duty;
+  double   seconds;
+  uint64_t counts[DETBENCH_COUNTER_COUNT];
+  SUBOOL   have[DETBENCH_COUNTER_COUNT];
+};
+
+struct detbench_baseline {
+  unsigned int count;
+  SUSCOUNT rate[DETBENCH_MAX_RATES];
+  double   ns[DETBENCH_MAX_RATES];
+};
+
+SUPRIVATE int
+detbench_open_counter(uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(struct perf_event_attr));
+
+  attr.size           = sizeof(struct perf_event_attr);
+  attr.type           = type;
+  attr.config         = config;
+  attr.disabled       = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+SUPRIVATE void
+detbench_counters_open(struct detbench_counters *counters)
+{
+  counters->fd[DETBENCH_COUNTER_CACHE_MISSES] = detbench_open_counter(
+      PERF_TYPE_HARDWARE,
+      PERF_COUNT_HW_CACHE_MISSES);
+  counters->error = counters->fd[DETBENCH_COUNTER_CACHE_MISSES] == -1
+      ? errno
+      : 0;
+
+  counters->fd[DETBENCH_COUNTER_L1D_MISSES] = detbench_open_counter(
+      PERF_TYPE_HW_CACHE,
+      PERF_COUNT_HW_CACHE_L1D
+      | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  if (counters->fd[DETBENCH_COUNTER_L1D_MISSES] == -1 && counters->error == 0)
+    counters->error = errno;
+}
+
+SUPRIVATE void
+detbench_counters_close(struct detbench_counters *counters)
+{
+  int i;
+
+  for (i = 0; i < DETBENCH_COUNTER_COUNT; ++i)
+    if (counters->fd[i] != -1)
+      close(counters->fd[i]);
+}
+
+SUPRIVATE void
+detbench_counters_ioctl(struct detbench_counters *counters, unsigned long req)
+{
+  int i;
+
+  for (i = 0; i < DETBENCH_COUNTER_COUNT; ++i)
+    if (counters->fd[i] != -1)
+      ioctl(counters->fd[i], req, 0);
+}
+
+SUPRIVATE void
+detbench_counters_read(
+    struct detbench_counters *counters,
+    struct detbench_result *result)
+{
+  int i;
+
+  for (i = 0; i < DETBENCH_COUNTER_COUNT; ++i) {
+    result->have[i] = SU_FALSE;
+
+    if (counters->fd[i] != -1) {
+      result->have[i] = read(
+          counters->fd[i],
+          &result->counts[i],
+          sizeof(uint64_t)) == sizeof(uint64_t);
+    }
+  }
+}
+
+SUPRIVATE SUBOOL
+detbench_on_chirp(void *privdata, const struct graves_chirp_info *info)
+{
+  unsigned int *chirps = (unsigned int *) privdata;
+
+  (void) info;
+
+  ++*chirps;
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+detbench_run(
+    SUSCOUNT fs,
+    enum graves_est_type estimator,
+    SUFLOAT gate,
+    unsigned int seconds,
+    unsigned int channels,
+    const struct graves_bank_params *pipeline,
+    struct detbench_counters *counters,
+    struct detbench_result *result)
+{
+  struct graves_det_params params = graves_det_params_INITIALIZER;
+  graves_det_t *dets[DETBENCH_MAX_CHANNELS];
+  unsigned int chirps[DETBENCH_MAX_CHANNELS];
+  graves_bank_t *bank = NULL;
+  SUCOMPLEX *block = NULL;
+  SUSCOUNT block_len = fs / 10;
+  SUSCOUNT i, j, n = 0;
+  unsigned int k;
+  SUFLOAT phase = 0, omega, min_cutoff;
+  uint32_t seed = 12345;
+  struct timespec start, end;
+  SUBOOL ok = SU_FALSE;
+
+  memset(result, 0, sizeof(struct detbench_result));
+  memset(dets, 0, sizeof(dets));
+  memset(chirps, 0, sizeof(chirps));
+
+  params.fs = fs;
+  params.estimator = estimator;
+  params.gate = gate;
+
+  /* Keep the filters above the minimum cutoff at high sample rates */
+  min_cutoff = SU_ADDSFX(1.01) * SU_NORM2ABS_FREQ(fs, GRAVES_MIN_LPF_CUTOFF);
+  if (params.lpf2 < min_cutoff) {
+    params.lpf1 *= min_cutoff / params.lpf2;
+    params.lpf2  = min_cutoff;
+  }
+
+  for (k = 0; k < channels; ++k)
+    SU_TRYCATCH(
+        dets[k] = graves_det_new(&params, detbench_on_chirp, chirps + k),
+        goto done);
+
+  if (pipeline != NULL)
+    SU_TRYCATCH(bank = graves_bank_new(pipeline, dets, channels), goto done);
+
+  SU_TRYCATCH(block = malloc(block_len * sizeof(SUCOMPLEX)), goto done);
+
+  omega = SU_ADDSFX(2.) * SU_PI * (params.fc + 20) / fs;
+
+  detbench_counters_ioctl(counters, PERF_EVENT_IOC_RESET);
+
+  for (i = 0; i < (SUSCOUNT) seconds * 10; ++i) {
+    /* Noise, plus a tone of 0.5 s every 5 s */
+    for (j = 0; j < block_len; ++j, ++n) {
+      seed = seed * 1103515245 + 12345;
+      block[j] = SU_ADDSFX(.3) * ((seed >> 8) / SU_ADDSFX(16777216.) - .5);
+
+      if (n % (5 * fs) < fs / 2) {
+        block[j] += SU_ADDSFX(.8) * SU_SIN(phase);
+        phase += omega;
+        if (phase > SU_2PI)
+          phase -= SU_2PI;
+      }
+    }
+
+    /* Only the detector is measured */
+    detbench_counters_ioctl(counters, PERF_EVENT_IOC_ENABLE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (k = 0; k < channels; ++k) {
+      if (bank != NULL) {
+        SU_TRYCATCH(graves_bank_feed(bank, k, block, block_len), goto done);
+      } else {
+        SU_TRYCATCH(
+            graves_det_feed_block(dets[k], block, block_len),
+            goto done);
+      }
+    }
+
+    /* The bank is still busy with the last blocks */
+    if (bank != NULL && i + 1 == (SUSCOUNT) seconds * 10)
+      SU_TRYCATCH(graves_bank_sync(bank), goto done);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    detbench_counters_ioctl(counters, PERF_EVENT_IOC_DISABLE);
+
+    result->seconds += (end.tv_sec - start.tv_sec)
+        + 1e-9 * (end.tv_nsec - start.tv_nsec);
+  }
+
+  detbench_counters_read(counters, result);
+
+  for (k = 0; k < channels; ++k)
+    result->chirps += chirps[k];
+
+  result->samples = n * channels;
+  result->duty = graves_det_get_duty_cycle(dets[0]);
+
+  ok = SU_TRUE;
+
+done:
+  if (block != NULL)
+    free(block);
+
+  if (bank != NULL)
+    graves_bank_destroy(bank);
+
+  for (k = 0; k < channels; ++k)
+    if (dets[k] != NULL)
+      graves_det_destroy(dets[k]);
+
+  return ok;
+}
+
+SUPRIVATE void
+detbench_print_count(const struct detbench_result *result, int counter)
+{
+  if (result->have[counter])
+    printf(
+        " %12.4f",
+        (double) result->counts[counter] / result->samples);
+  else
+    printf(" %12s", "n/a");
+}
+
+/******************************** Baselines **********************************/
+SUPRIVATE SUBOOL
+detbench_load_baseline(const char *path, struct detbench_baseline *baseline)
+{
+  char line[128];
+  FILE *fp;
+  SUBOOL ok = SU_FALSE;
+
+  baseline->count = 0;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return SU_FALSE;
+  }
+
+  if (fgets(line, sizeof(line), fp) == NULL
+      || strncmp(line, DETBENCH_MAGIC, strlen(DETBENCH_MAGIC)) != 0) {
+    fprintf(stderr, "%s: not a benchmark baseline\n", path);
+    goto done;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (*line == '#' || *line == '\n')
+      continue;
+
+    if (baseline->count == DETBENCH_MAX_RATES) {
+      fprintf(stderr, "%s: too many rates\n", path);
+      goto done;
+    }
+
+    if (sscanf(
+        line,
+        "%lu %lf",
+        &baseline->rate[baseline->count],
+        &baseline->ns[baseline->count]) != 2) {
+      fprintf(stderr, "%s: malformed line `%s'\n", path, line);
+      goto done;
+    }
+
+    ++baseline->count;
+  }
+
+  ok = SU_TRUE;
+
+done:
+  fclose(fp);
+
+  return ok;
+}
+
+SUPRIVATE const double *
+detbench_baseline_lookup(const struct detbench_baseline *baseline, SUSCOUNT fs)
+{
+  unsigned int i;
+
+  for (i = 0; i < baseline->count; ++i)
+    if (baseline->rate[i] == fs)
+      return baseline->ns + i;
+
+  return NULL;
+}
+
+/********************************** Main *************************************/
+void
+help(const char *a0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s [OPTIONS] [RATE [RATE...]]\n\n", a0);
+  fprintf(
+      stderr,
+      "Benchmark the meteor detector at the given sample rates (default:\n"
+      "8000 48000 192000 384000 1000000)\n\n");
+  fprintf(stderr, "OPTIONS:\n");
+  fprintf(
+      stderr,
+      "  -t, --time=SECONDS        Length of the signal to process (default: %d)\n",
+      DETBENCH_DEFAULT_SECONDS);
+  fprintf(stderr, "  -r, --repeat=N            Keep the fastest of N runs (default: 1)\n");
+  fprintf(stderr, "  -e, --estimator=EST       Power estimator: iir (default) or boxcar\n");
+  fprintf(stderr, "  -g, --gate=LEVEL          Two-tier trigger, see clistones --gate\n");
+  fprintf(stderr, "  -c, --channels=N          Detectors fed with the same signal (default: 1)\n");
+  fprintf(stderr, "  -P, --pipeline=THREADS    Run them in a detector bank with THREADS workers\n");
+  fprintf(stderr, "  -s, --save=FILE           Save the timings as a baseline\n");
+  fprintf(stderr, "  -b, --baseline=FILE       Fail if slower than this baseline\n");
+  fprintf(
+      stderr,
+      "  -m, --max-regression=PCT  Allowed slowdown (default: %g%%)\n",
+      DETBENCH_DEFAULT_MAX_REGRESSION);
+  fprintf(stderr, "  -h, --help                This help\n");
+}
+
+static struct option long_options[] =
+{
+  {"time",           required_argument, 0, 't'},
+  {"repeat",         required_argument, 0, 'r'},
+  {"estimator",      required_argument, 0, 'e'},
+  {"gate",           required_argument, 0, 'g'},
+  {"channels",       required_argument, 0, 'c'},
+  {"pipeline",       required_argument, 0, 'P'},
+  {"save",           required_argument, 0, 's'},
+  {"baseline",       required_argument, 0, 'b'},
+  {"max-regression", required_argument, 0, 'm'},
+  {"help",           no_argument,       0, 'h'},
+  {0, 0, 0, 0}
+};
+
+int
+main(int argc, char **argv)
+{
+  static const SUSCOUNT default_rates[] =
+    {8000, 48000, 192000, 384000, 1000000};
+  struct detbench_counters counters;
+  struct detbench_result result, current;
+  struct detbench_baseline baseline;
+  const char *save_path = NULL;
+  const char *baseline_path = NULL;
+  const double *base_ns;
+  FILE *save_fp = NULL;
+  double ns, max_regression = DETBENCH_DEFAULT_MAX_REGRESSION;
+  unsigned int seconds = DETBENCH_DEFAULT_SECONDS;
+  unsigned int repeat = 1, run;
+  enum graves_est_type estimator = GRAVES_EST_IIR;
+  SUFLOAT gate = 0;
+  unsigned int channels = 1;
+  struct graves_bank_params bank_params = graves_bank_params_INITIALIZER;
+  SUBOOL pipeline = SU_FALSE;
+  unsigned int i, count, regressions = 0;
+  SUSCOUNT fs;
+  int ret = EXIT_FAILURE;
+  int option_index = 0;
+  int c;
+
+  for (i = 0; i < DETBENCH_COUNTER_COUNT; ++i)
+    counters.fd[i] = -1;
+
+  while ((c = getopt_long(
+      argc,
+      argv,
+      "t:r:e:g:c:P:s:b:m:h",
+      long_options,
+      &option_index)) != -1) {
+    switch (c) {
+      case 't':
+        if (sscanf(optarg, "%u", &seconds) < 1 || seconds == 0) {
+          fprintf(stderr, "%s: invalid time `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'r':
+        if (sscanf(optarg, "%u", &repeat) < 1 || repeat == 0) {
+          fprintf(stderr, "%s: invalid repeat count `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'e':
+        if (!graves_est_type_from_name(optarg, &estimator)) {
+          fprintf(stderr, "%s: invalid estimator `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'g':
+        if (sscanf(optarg, "%g", &gate) < 1 || gate <= 0 || gate > 1) {
+          fprintf(stderr, "%s: invalid gate level `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'c':
+        if (sscanf(optarg, "%u", &channels) < 1
+            || channels == 0
+            || channels > DETBENCH_MAX_CHANNELS) {
+          fprintf(stderr, "%s: invalid channel count `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'P':
+        if (sscanf(optarg, "%u", &bank_params.threads) < 1
+            || bank_params.threads > GRAVES_BANK_MAX_THREADS) {
+          fprintf(stderr, "%s: invalid thread count `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        pipeline = SU_TRUE;
+        break;
+
+      case 's':
+        save_path = optarg;
+        break;
+
+      case 'b':
+        baseline_path = optarg;
+        break;
+
+      case 'm':
+        if (sscanf(optarg, "%lf", &max_regression) < 1
+            || max_regression < 0) {
+          fprintf(stderr, "%s: invalid regression `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'h':
+        help(argv[0]);
+        return EXIT_SUCCESS;
+
+      default:
+        help(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (pipeline && gate > 0) {
+    fprintf(stderr, "%s: gated detectors cannot be pipelined\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (baseline_path != NULL
+      && !detbench_load_baseline(baseline_path, &baseline))
+    goto done;
+
+  if (save_path != NULL) {
+    if ((save_fp = fopen(save_path, "w")) == NULL) {
+      fprintf(stderr, "Cannot open %s: %s\n", save_path, strerror(errno));
+      goto done;
+    }
+
+    fprintf(save_fp, "%s\n", DETBENCH_MAGIC);
+  }
+
+  if (!pipeline)
+    detbench_counters_open(&counters);
+
+  if (!pipeline && counters.fd[DETBENCH_COUNTER_CACHE_MISSES] == -1)
+    fprintf(
+        stderr,
+        "%s: hardware counters not available (%s), timing only\n",
+        argv[0],
+        strerror(counters.error));
+
+  count = optind < argc
+      ? (unsigned int) (argc - optind)
+      : sizeof(default_rates) / sizeof(default_rates[0]);
+
+  printf(
+      "%10s %8s %8s %6s %10s %12s %12s %10s\n",
+      "rate",
+      "window",
+      "chirps",
+      "duty",
+      "ns/sample",
+      "misses/samp",
+      "L1D/samp",
+      "baseline");
+
+  for (i = 0; i < count; ++i) {
+    if (optind < argc) {
+      if (sscanf(argv[optind + i], "%lu", &fs) < 1 || fs == 0) {
+        fprintf(
+            stderr,
+            "%s: invalid sample rate `%s'\n",
+            argv[0],
+            argv[optind + i]);
+        goto done;
+      }
+    } else {
+      fs = default_rates[i];
+    }
+
+    /* Short runs at low rates are at the mercy of the scheduler */
+    for (run = 0; run < repeat; ++run) {
+      if (!detbench_run(
+          fs,
+          estimator,
+          gate,
+          seconds,
+          channels,
+          pipeline ? &bank_params : NULL,
+          &counters,
+          &current)) {
+        fprintf(stderr, "%s: benchmark at %lu sps failed\n", argv[0], fs);
+        goto done;
+      }
+
+      if (run == 0 || current.seconds < result.seconds)
+        result = current;
+    }
+
+    ns = 1e9 * result.seconds / result.samples;
+
+    printf(
+        "%10lu %8lu %8u %6.2f %10.2f",
+        fs,
+        (unsigned long) SU_CEIL(fs * MIN_CHIRP_DURATION),
+        result.chirps,
+        result.duty,
+        ns);
+    detbench_print_count(&result, DETBENCH_COUNTER_CACHE_MISSES);
+    detbench_print_count(&result, DETBENCH_COUNTER_L1D_MISSES);
+
+    base_ns = baseline_path != NULL
+        ? detbench_baseline_lookup(&baseline, fs)
+        : NULL;
+
+    if (base_ns != NULL) {
+      printf(" %10.2f", *base_ns);
+      if (ns > *base_ns * (1 + 1e-2 * max_regression)) {
+        printf(" REGRESSION (%+.1f%%)", 1e2 * (ns / *base_ns - 1));
+        ++regressions;
+      }
+    } else {
+      printf(" %10s", "-");
+    }
+
+    putchar('\n');
+
+    if (save_fp != NULL)
+      fprintf(save_fp, "%lu %.3f\n", fs, ns);
+  }
+
+  if (regressions > 0) {
+    printf(
+        "%u rates slower than the baseline by more than %g%%\n",
+        regressions,
+        max_regression);
+    goto done;
+  }
+
+  ret = EXIT_SUCCESS;
+
+done:
+  detbench_counters_close(&counters);
+
+  if (save_fp != NULL && fclose(save_fp) != 0) {
+    fprintf(stderr, "Cannot write %s: %s\n", save_path, strerror(errno));
+    ret = EXIT_FAILURE;
+  }
+
+  return ret;
+}
@@ -0,0 +1,719 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <graves.h>
+#include <bank.h>
+#include <convert.h>
+
+/*
+ * Detector regression check. Runs the detector on a deterministic
+ * synthetic signal (or on a raw mono capture made with --record) and either
+ * writes the chirps it emits to a reference file, or compares them against
+ * one written by a trusted build, with the same detector settings. Start,
+ * length and Q statistics of every chirp must match within the given
+ * tolerances. With --pipeline, the detector runs in a detector bank, whose
+ * output must be the same.
+ */
+
+#define DETCHECK_MAGIC          "# CLISTONES DETCHECK 1"
+#define DETCHECK_SYNTH_SECONDS  300
+#define DETCHECK_SYNTH_PERIOD   5     /* Seconds between synthetic echoes */
+#define DETCHECK_BLOCK_SIZE     4096
+
+struct detcheck_chirp {
+  SUSCOUNT start;   /* Sample */
+  unsigned int length;
+  SUFLOAT  mean_q;
+  SUFLOAT  max_q;
+};
+
+struct detcheck_params {
+  SUSCOUNT    fs;
+  SUBOOL      adaptive;
+  enum graves_est_type estimator;
+  SUFLOAT     gate;
+  SUFLOAT     stop;
+  SUFLOAT     holdoff;
+  SUBOOL      pipeline;   /* Run in a detector bank */
+  unsigned int threads;   /* Of the bank */
+  const char *input;      /* Raw mono capture, NULL for synthetic */
+  enum clistones_sample_format format;  /* Of the capture */
+  unsigned int time_tol;  /* Samples */
+  SUFLOAT     q_tol;      /* Relative */
+};
+
+#define detcheck_params_INITIALIZER \
+{                                   \
+  8000,        /* fs */             \
+  SU_FALSE,    /* adaptive */       \
+  GRAVES_EST_IIR, /* estimator */   \
+  0,           /* gate */           \
+  0,           /* stop */           \
+  0,           /* holdoff */        \
+  SU_FALSE,    /* pipeline */       \
+  2,           /* threads */        \
+  NULL,        /* input */          \
+  CLISTONES_SAMPLE_FORMAT_S16_LE,   \
+  1,           /* time_tol */       \
+  1e-4,        /* q_tol */          \
+}
+
+struct detcheck_synth {
+  SUSCOUNT fs;
+  SUSCOUNT n;
+  uint32_t seed;
+  SUFLOAT  phase;
+};
+
+/****************************** Signal sources *******************************/
+SUPRIVATE SUBOOL
+detcheck_feed(
+    graves_det_t *det,
+    graves_bank_t *bank,
+    const SUCOMPLEX *x,
+    SUSCOUNT len)
+{
+  if (bank != NULL)
+    return graves_bank_feed(bank, 0, x, len);
+
+  return graves_det_feed_block(det, x, len);
+}
+
+/*
+ * Noise plus one echo every DETCHECK_SYNTH_PERIOD seconds. Echoes cycle
+ * through different lengths, Doppler shifts and amplitudes, from well
+ * above the threshold to barely detectable.
+ */
+SUPRIVATE SUCOMPLEX
+detcheck_synth_read(struct detcheck_synth *synth, SUFLOAT fc)
+{
+  static const SUFLOAT amplitudes[] = {.8, .4, .2, .12, .08, .05};
+  static const SUFLOAT durations[]  = {.15, .3, .5, .8, 1.2, 2., 4.};
+  SUSCOUNT period = DETCHECK_SYNTH_PERIOD * synth->fs;
+  SUSCOUNT index = synth->n / period;
+  SUSCOUNT t = synth->n % period;
+  SUSCOUNT len;
+  SUFLOAT  doppler;
+  SUCOMPLEX x;
+
+  synth->seed = synth->seed * 1103515245 + 12345;
+  x = SU_ADDSFX(.3) * ((synth->seed >> 8) / SU_ADDSFX(16777216.) - .5);
+
+  len = (SUSCOUNT) (durations[index % 7] * synth->fs);
+  doppler = SU_ASFLOAT((SUSDIFF) (index % 11) - 5) * 8;
+
+  if (t >= synth->fs && t < synth->fs + len) {
+    x += amplitudes[index % 6] * SU_SIN(synth->phase);
+    synth->phase += SU_2PI * (fc + doppler) / synth->fs;
+    if (synth->phase > SU_2PI)
+      synth->phase -= SU_2PI;
+  }
+
+  ++synth->n;
+
+  return x;
+}
+
+SUPRIVATE SUBOOL
+detcheck_run_synth(
+    graves_det_t *det,
+    graves_bank_t *bank,
+    const struct detcheck_params *params)
+{
+  struct detcheck_synth synth;
+  SUCOMPLEX block[DETCHECK_BLOCK_SIZE];
+  SUSCOUNT i, j, count = DETCHECK_SYNTH_SECONDS * params->fs;
+  SUFLOAT fc = graves_det_get_params(det)->fc;
+
+  memset(&synth, 0, sizeof(struct detcheck_synth));
+  synth.fs   = params->fs;
+  synth.seed = 12345;
+
+  for (i = 0; i < count; i += j) {
+    for (j = 0; j < DETCHECK_BLOCK_SIZE && i + j < count; ++j)
+      block[j] = detcheck_synth_read(&synth, fc);
+
+    SU_TRYCATCH(detcheck_feed(det, bank, block, j), return SU_FALSE);
+  }
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+detcheck_run_file(
+    graves_det_t *det,
+    graves_bank_t *bank,
+    const struct detcheck_params *params)
+{
+  int32_t buffer[DETCHECK_BLOCK_SIZE];
+  SUCOMPLEX block[DETCHECK_BLOCK_SIZE];
+  FILE *fp = NULL;
+  size_t size = clistones_sample_format_size(params->format);
+  size_t got;
+  SUBOOL ok = SU_FALSE;
+
+  if ((fp = fopen(params->input, "rb")) == NULL) {
+    fprintf(
+        stderr,
+        "Cannot open %s: %s\n",
+        params->input,
+        strerror(errno));
+    goto done;
+  }
+
+  while ((got = fread(buffer, size, DETCHECK_BLOCK_SIZE, fp)) > 0) {
+    clistones_convert(params->format, 1, buffer, block, got);
+
+    SU_TRYCATCH(detcheck_feed(det, bank, block, got), goto done);
+  }
+
+  if (ferror(fp)) {
+    fprintf(stderr, "Read error in %s\n", params->input);
+    goto done;
+  }
+
+  ok = SU_TRUE;
+
+done:
+  if (fp != NULL)
+    fclose(fp);
+
+  return ok;
+}
+
+/***************************** Chirp collection ******************************/
+SUPRIVATE SUBOOL
+detcheck_on_chirp(void *privdata, const struct graves_chirp_info *info)
+{
+  grow_buf_t *chirps = (grow_buf_t *) privdata;
+  struct detcheck_chirp chirp;
+  unsigned int i;
+  SUFLOAT sum = 0;
+
+  chirp.start  = info->t0 * info->fs
+      + (SUSCOUNT) SU_FLOOR(info->t0f * info->fs + SU_ADDSFX(.5));
+  chirp.length = info->length;
+  chirp.max_q  = 0;
+
+  for (i = 0; i < info->length; ++i) {
+    sum += info->q[i];
+    if (info->q[i] > chirp.max_q)
+      chirp.max_q = info->q[i];
+  }
+
+  chirp.mean_q = sum / info->length;
+
+  return grow_buf_append(chirps, &chirp, sizeof(struct detcheck_chirp)) != -1;
+}
+
+SUPRIVATE SUBOOL
+detcheck_detect(const struct detcheck_params *params, grow_buf_t *chirps)
+{
+  struct graves_det_params det_params = graves_det_params_INITIALIZER;
+  struct graves_bank_params bank_params = graves_bank_params_INITIALIZER;
+  graves_det_t *det = NULL;
+  graves_bank_t *bank = NULL;
+  SUBOOL ok = SU_FALSE;
+
+  det_params.fs       = params->fs;
+  det_params.adaptive = params->adaptive;
+  det_params.estimator = params->estimator;
+  det_params.gate = params->gate;
+  det_params.stop = params->stop;
+  det_params.holdoff = params->holdoff;
+
+  SU_TRYCATCH(
+      det = graves_det_new(&det_params, detcheck_on_chirp, chirps),
+      goto done);
+
+  if (params->pipeline) {
+    bank_params.threads = params->threads;
+    SU_TRYCATCH(bank = graves_bank_new(&bank_params, &det, 1), goto done);
+  }
+
+  if (params->input != NULL) {
+    SU_TRYCATCH(detcheck_run_file(det, bank, params), goto done);
+  } else {
+    SU_TRYCATCH(detcheck_run_synth(det, bank, params), goto done);
+  }
+
+  if (bank != NULL)
+    SU_TRYCATCH(graves_bank_sync(bank), goto done);
+
+  ok = SU_TRUE;
+
+done:
+  if (bank != NULL)
+    graves_bank_destroy(bank);
+
+  if (det != NULL)
+    graves_det_destroy(det);
+
+  return ok;
+}
+
+/******************************* Comparison **********************************/
+SUPRIVATE SUBOOL
+detcheck_close(SUFLOAT a, SUFLOAT b, SUFLOAT tol)
+{
+  return SU_ABS(a - b) <= tol * SU_MAX(SU_ABS(a), SU_ABS(b));
+}
+
+SUPRIVATE SUBOOL
+detcheck_near(SUSCOUNT a, SUSCOUNT b, unsigned int tol)
+{
+  return (a > b ? a - b : b - a) <= tol;
+}
+
+SUPRIVATE unsigned int
+detcheck_compare(
+    const struct detcheck_params *params,
+    const struct detcheck_chirp *ref,
+    unsigned int ref_count,
+    const struct detcheck_chirp *got,
+    unsigned int got_count)
+{
+  unsigned int i, count, failures = 0;
+
+  if (ref_count != got_count) {
+    printf(
+        "FAIL: %u chirps detected, %u expected\n",
+        got_count,
+        ref_count);
+    ++failures;
+  }
+
+  count = SU_MIN(ref_count, got_count);
+
+  for (i = 0; i < count; ++i) {
+    if (!detcheck_near(ref[i].start, got[i].start, params->time_tol)
+        || !detcheck_near(ref[i].length, got[i].length, params->time_tol)
+        || !detcheck_close(ref[i].mean_q, got[i].mean_q, params->q_tol)
+        || !detcheck_close(ref[i].max_q, got[i].max_q, params->q_tol)) {
+      printf(
+          "FAIL: chirp %u: start %lu len %u Q %g/%g "
+          "(expected start %lu len %u Q %g/%g)\n",
+          i,
+          got[i].start,
+          got[i].length,
+          got[i].mean_q,
+          got[i].max_q,
+          ref[i].start,
+          ref[i].length,
+          ref[i].mean_q,
+          ref[i].max_q);
+      ++failures;
+    }
+  }
+
+  return failures;
+}
+
+/***************************** Reference files *******************************/
+SUPRIVATE void
+detcheck_print_settings(FILE *fp, const struct detcheck_params *params)
+{
+  fprintf(
+      fp,
+      "FS=%lu ADAPTIVE=%d ESTIMATOR=%s GATE=%g STOP=%g HOLDOFF=%g "
+      "INPUT=%s\n",
+      params->fs,
+      params->adaptive,
+      graves_est_type_name(params->estimator),
+      params->gate,
+      params->stop,
+      params->holdoff,
+      params->input == NULL ? "synthetic" : params->input);
+}
+
+/* Captures are told apart by name, wherever they were read from */
+SUPRIVATE const char *
+detcheck_input_name(const char *input)
+{
+  const char *slash = strrchr(input, '/');
+
+  return slash == NULL ? input : slash + 1;
+}
+
+/*
+ * Whether a reference was written with the settings of this run. Levels
+ * were saved with 6 significant digits. A gated run may be checked against
+ * an ungated reference, as the gate must not change what is detected.
+ */
+SUPRIVATE SUBOOL
+detcheck_check_settings(
+    const char *path,
+    const char *line,
+    const struct detcheck_params *params)
+{
+  unsigned long fs;
+  int adaptive;
+  char estimator[16];
+  char input[256];
+  float gate, stop, holdoff;
+  SUBOOL ok;
+
+  if (sscanf(
+      line,
+      "# FS=%lu ADAPTIVE=%d ESTIMATOR=%15s GATE=%g STOP=%g HOLDOFF=%g "
+      "INPUT=%255[^\n]",
+      &fs,
+      &adaptive,
+      estimator,
+      &gate,
+      &stop,
+      &holdoff,
+      input) != 7) {
+    fprintf(stderr, "%s: malformed settings line `%s'\n", path, line);
+    return SU_FALSE;
+  }
+
+  ok = fs == params->fs
+      && !adaptive == !params->adaptive
+      && strcmp(estimator, graves_est_type_name(params->estimator)) == 0
+      && (gate == 0 || detcheck_close(gate, params->gate, 1e-5))
+      && detcheck_close(stop, params->stop, 1e-5)
+      && detcheck_close(holdoff, params->holdoff, 1e-5)
+      && (params->input == NULL
+          ? strcmp(input, "synthetic") == 0
+          : strcmp(
+              detcheck_input_name(input),
+              detcheck_input_name(params->input)) == 0);
+
+  if (!ok) {
+    fprintf(stderr, "%s: written with different settings\n", path);
+    fprintf(stderr, "  Reference: %s", line + 2);
+    fprintf(stderr, "  This run:  ");
+    detcheck_print_settings(stderr, params);
+  }
+
+  return ok;
+}
+
+SUPRIVATE SUBOOL
+detcheck_write_reference(
+    const char *path,
+    const struct detcheck_params *params,
+    const struct detcheck_chirp *chirps,
+    unsigned int count)
+{
+  FILE *fp;
+  unsigned int i;
+
+  if ((fp = fopen(path, "w")) == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return SU_FALSE;
+  }
+
+  fprintf(fp, "%s\n# ", DETCHECK_MAGIC);
+  detcheck_print_settings(fp, params);
+
+  for (i = 0; i < count; ++i)
+    fprintf(
+        fp,
+        "%lu %u %.9e %.9e\n",
+        chirps[i].start,
+        chirps[i].length,
+        chirps[i].mean_q,
+        chirps[i].max_q);
+
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+    return SU_FALSE;
+  }
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+detcheck_read_reference(
+    const char *path,
+    const struct detcheck_params *params,
+    grow_buf_t *chirps)
+{
+  char line[512];
+  struct detcheck_chirp chirp;
+  FILE *fp;
+  SUBOOL ok = SU_FALSE;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+    return SU_FALSE;
+  }
+
+  if (fgets(line, sizeof(line), fp) == NULL
+      || strncmp(line, DETCHECK_MAGIC, strlen(DETCHECK_MAGIC)) != 0) {
+    fprintf(stderr, "%s: not a detector reference file\n", path);
+    goto done;
+  }
+
+  if (fgets(line, sizeof(line), fp) == NULL
+      || !detcheck_check_settings(path, line, params))
+    goto done;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (*line == '#' || *line == '\n')
+      continue;
+
+    if (sscanf(
+        line,
+        "%lu %u %g %g",
+        &chirp.start,
+        &chirp.length,
+        &chirp.mean_q,
+        &chirp.max_q) != 4) {
+      fprintf(stderr, "%s: malformed line `%s'\n", path, line);
+      goto done;
+    }
+
+    SU_TRYCATCH(
+        grow_buf_append(chirps, &chirp, sizeof(struct detcheck_chirp)) != -1,
+        goto done);
+  }
+
+  ok = SU_TRUE;
+
+done:
+  fclose(fp);
+
+  return ok;
+}
+
+/********************************** Main *************************************/
+void
+help(const char *a0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s [OPTIONS] REFERENCE\n\n", a0);
+  fprintf(
+      stderr,
+      "Check that the detector emits the chirps recorded in REFERENCE\n\n");
+  fprintf(stderr, "OPTIONS:\n");
+  fprintf(stderr, "  -w, --write            Write REFERENCE instead of checking it\n");
+  fprintf(stderr, "  -i, --input=FILE       Raw mono capture (default: synthetic)\n");
+  fprintf(stderr, "  -F, --format=FMT       Sample format of FILE: s16 (default), s32 or f32\n");
+  fprintf(stderr, "  -r, --rate=RATE        Sample rate (default: 8000)\n");
+  fprintf(stderr, "  -a, --adaptive         Adaptive threshold\n");
+  fprintf(stderr, "  -e, --estimator=EST    Power estimator: iir (default) or boxcar\n");
+  fprintf(stderr, "  -g, --gate=LEVEL       Two-tier trigger, see clistones --gate\n");
+  fprintf(stderr, "  -s, --stop=LEVEL       Chirp end level, see clistones --stop\n");
+  fprintf(stderr, "  -o, --holdoff=SECS     Gap bridging, see clistones --holdoff\n");
+  fprintf(stderr, "  -P, --pipeline=THREADS Run in a detector bank with THREADS workers\n");
+  fprintf(stderr, "  -T, --time-tol=N       Tolerance of start and length, in samples (default: 1)\n");
+  fprintf(stderr, "  -Q, --q-tol=REL        Relative tolerance of Q (default: 1e-4)\n");
+  fprintf(stderr, "  -h, --help             This help\n");
+}
+
+static struct option long_options[] =
+{
+  {"write",    no_argument,       0, 'w'},
+  {"input",    required_argument, 0, 'i'},
+  {"format",   required_argument, 0, 'F'},
+  {"rate",     required_argument, 0, 'r'},
+  {"adaptive", no_argument,       0, 'a'},
+  {"estimator", required_argument, 0, 'e'},
+  {"gate",     required_argument, 0, 'g'},
+  {"stop",     required_argument, 0, 's'},
+  {"holdoff",  required_argument, 0, 'o'},
+  {"pipeline", required_argument, 0, 'P'},
+  {"time-tol", required_argument, 0, 'T'},
+  {"q-tol",    required_argument, 0, 'Q'},
+  {"help",     no_argument,       0, 'h'},
+  {0, 0, 0, 0}
+};
+
+int
+main(int argc, char **argv)
+{
+  struct detcheck_params params = detcheck_params_INITIALIZER;
+  grow_buf_t got, ref;
+  unsigned int got_count, ref_count, failures;
+  SUBOOL write = SU_FALSE;
+  int ret = EXIT_FAILURE;
+  int option_index = 0;
+  int c;
+
+  memset(&got, 0, sizeof(grow_buf_t));
+  memset(&ref, 0, sizeof(grow_buf_t));
+
+  while ((c = getopt_long(
+      argc,
+      argv,
+      "wi:F:r:ae:g:s:o:P:T:Q:h",
+      long_options,
+      &option_index)) != -1) {
+    switch (c) {
+      case 'w':
+        write = SU_TRUE;
+        break;
+
+      case 'i':
+        params.input = optarg;
+        break;
+
+      case 'F':
+        if (!clistones_sample_format_parse(optarg, &params.format)) {
+          fprintf(stderr, "%s: invalid sample format `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'r':
+        if (sscanf(optarg, "%lu", &params.fs) < 1 || params.fs == 0) {
+          fprintf(stderr, "%s: invalid sample rate `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'a':
+        params.adaptive = SU_TRUE;
+        break;
+
+      case 'e':
+        if (!graves_est_type_from_name(optarg, &params.estimator)) {
+          fprintf(stderr, "%s: invalid estimator `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'g':
+        if (sscanf(optarg, "%g", &params.gate) < 1
+            || params.gate <= 0
+            || params.gate > 1) {
+          fprintf(stderr, "%s: invalid gate level `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 's':
+        if (sscanf(optarg, "%g", &params.stop) < 1
+            || params.stop <= 0
+            || params.stop > 1) {
+          fprintf(stderr, "%s: invalid stop level `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'o':
+        if (sscanf(optarg, "%g", &params.holdoff) < 1 || params.holdoff < 0) {
+          fprintf(stderr, "%s: invalid hold-off `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'P':
+        if (sscanf(optarg, "%u", &params.threads) < 1
+            || params.threads > GRAVES_BANK_MAX_THREADS) {
+          fprintf(stderr, "%s: invalid thread count `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        params.pipeline = SU_TRUE;
+        break;
+
+      case 'T':
+        if (sscanf(optarg, "%u", &params.time_tol) < 1) {
+          fprintf(stderr, "%s: invalid tolerance `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'Q':
+        if (sscanf(optarg, "%g", &params.q_tol) < 1 || params.q_tol < 0) {
+          fprintf(stderr, "%s: invalid tolerance `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'h':
+        help(argv[0]);
+        return EXIT_SUCCESS;
+
+      default:
+        help(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1) {
+    help(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (params.pipeline && params.gate > 0) {
+    fprintf(stderr, "%s: gated detectors cannot be pipelined\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!detcheck_detect(&params, &got)) {
+    fprintf(stderr, "%s: detector failed\n", argv[0]);
+    goto done;
+  }
+
+  got_count = grow_buf_get_size(&got) / sizeof(struct detcheck_chirp);
+
+  if (write) {
+    if (!detcheck_write_reference(
+        argv[optind],
+        &params,
+        grow_buf_get_buffer(&got),
+        got_count))
+      goto done;
+
+    printf("%u chirps written to %s\n", got_count, argv[optind]);
+  } else {
+    if (!detcheck_read_reference(argv[optind], &params, &ref))
+      goto done;
+
+    ref_count = grow_buf_get_size(&ref) / sizeof(struct detcheck_chirp);
+
+    failures = detcheck_compare(
+        &params,
+        grow_buf_get_buffer(&ref),
+        ref_count,
+        grow_buf_get_buffer(&got),
+        got_count);
+
+    if (failures > 0) {
+      printf("%u mismatches against %s\n", failures, argv[optind]);
+      goto done;
+    }
+
+    printf("PASS: %u chirps match %s\n", got_count, argv[optind]);
+  }
+
+  ret = EXIT_SUCCESS;
+
+done:
+  grow_buf_clear(&got);
+  grow_buf_clear(&ref);
+
+  return ret;
+}
@@ -0,0 +1,321 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <doppler.h>
+
+struct graves_doppler_weight {
+  SUFLOAT vel;
+  SUFLOAT weight;
+};
+
+void
+graves_doppler_destroy(graves_doppler_t *est)
+{
+  if (est->plan != NULL)
+    SU_FFTW(_destroy_plan)(est->plan);
+
+  if (est->fft_in != NULL)
+    SU_FFTW(_free)(est->fft_in);
+
+  if (est->fft_out != NULL)
+    SU_FFTW(_free)(est->fft_out);
+
+  if (est->window != NULL)
+    free(est->window);
+
+  grow_buf_clear(&est->track);
+  grow_buf_clear(&est->scratch);
+
+  free(est);
+}
+
+SUINLINE SUFLOAT
+graves_doppler_median3(SUFLOAT a, SUFLOAT b, SUFLOAT c)
+{
+  if (a > b) {
+    if (b > c)
+      return b;
+    return a > c ? c : a;
+  } else {
+    if (a > c)
+      return a;
+    return b > c ? c : b;
+  }
+}
+
+SUPRIVATE int
+graves_doppler_weight_cmp(const void *a, const void *b)
+{
+  const struct graves_doppler_weight *wa = a;
+  const struct graves_doppler_weight *wb = b;
+
+  return (wa->vel > wb->vel) - (wa->vel < wb->vel);
+}
+
+/*
+ * Analyze one frame. Frames shorter than the FFT size (i.e. the tail of
+ * the chirp, or chirps shorter than a frame) are zero-padded.
+ */
+SUPRIVATE void
+graves_doppler_analyze_frame(
+    graves_doppler_t *est,
+    const SUCOMPLEX *x,
+    unsigned int avail,
+    struct graves_doppler_point *point)
+{
+  SUCOMPLEX *in  = (SUCOMPLEX *) est->fft_in;
+  SUCOMPLEX *out = (SUCOMPLEX *) est->fft_out;
+  unsigned int i, mask = est->params.fft_size - 1;
+  SUFLOAT pwr, peak_pwr = -1, total = 0, around;
+  SUFLOAT a, b, c, den, delta = 0;
+  int j, peak = 0;
+
+  if (avail > est->params.fft_size)
+    avail = est->params.fft_size;
+
+  for (i = 0; i < avail; ++i)
+    in[i] = x[i] * est->window[i];
+
+  for (; i < est->params.fft_size; ++i)
+    in[i] = 0;
+
+  SU_FFTW(_execute)(est->plan);
+
+  for (j = -est->half; j <= est->half; ++j) {
+    i = (unsigned int) j & mask;
+    pwr = SU_C_REAL(out[i] * SU_C_CONJ(out[i]));
+    total += pwr;
+    if (pwr > peak_pwr) {
+      peak_pwr = pwr;
+      peak = j;
+    }
+  }
+
+  around = peak_pwr;
+
+  if (peak > -est->half && peak < est->half) {
+    a = SU_C_REAL(out[(peak - 1) & mask] * SU_C_CONJ(out[(peak - 1) & mask]));
+    c = SU_C_REAL(out[(peak + 1) & mask] * SU_C_CONJ(out[(peak + 1) & mask]));
+    around += a + c;
+
+    a = SU_LOG(a + SU_FLOAT_THRESHOLD);
+    b = SU_LOG(peak_pwr + SU_FLOAT_THRESHOLD);
+    c = SU_LOG(c + SU_FLOAT_THRESHOLD);
+
+    den = a - 2 * b + c;
+    if (den < 0)
+      delta = SU_ADDSFX(.5) * (a - c) / den;
+  }
+
+  point->vel = graves_doppler_to_vel(
+      (peak + delta) * est->params.fs / est->params.fft_size);
+  point->confidence = total > 0 ? around / total : 0;
+}
+
+SUBOOL
+graves_doppler_estimate(
+    graves_doppler_t *est,
+    const SUCOMPLEX *x,
+    const SUFLOAT *q,
+    unsigned int length,
+    SUFLOAT ratio)
+{
+  struct graves_doppler_point *track;
+  struct graves_doppler_weight *weights;
+  struct graves_doppler_point point;
+  unsigned int i, j, count, avail;
+  SUFLOAT snr, prev, curr, cum_w, half_w;
+
+  grow_buf_shrink(&est->track);
+  est->velocity = 0;
+
+  for (i = 0; i < length; i += est->params.hop) {
+    avail = length - i;
+    graves_doppler_analyze_frame(est, x + i, avail, &point);
+
+    if (avail > est->params.fft_size)
+      avail = est->params.fft_size;
+
+    snr = 0;
+    for (j = 0; j < avail; ++j)
+      snr += q[i + j];
+    snr = graves_det_q_to_snr(ratio, snr / avail);
+
+    /* Timestamp at the center of the frame */
+    point.t   = (i + SU_ADDSFX(.5) * avail) / est->params.fs;
+    point.snr = snr > 0 ? snr : 0;
+
+    SU_TRYCATCH(
+        grow_buf_append(&est->track, &point, sizeof(point)) != -1,
+        return SU_FALSE);
+
+    /* This frame already reached the end of the chirp */
+    if (i + est->params.fft_size >= length)
+      break;
+  }
+
+  track = grow_buf_get_buffer(&est->track);
+  count = (unsigned int) (grow_buf_get_size(&est->track) / sizeof(point));
+
+  /* Robust velocity: weighted median of the raw track */
+  SU_TRYCATCH(
+      weights = grow_buf_alloc(
+          &est->scratch,
+          count * sizeof(struct graves_doppler_weight)),
+      return SU_FALSE);
+  grow_buf_shrink(&est->scratch);
+
+  half_w = 0;
+  for (i = 0; i < count; ++i) {
+    weights[i].vel    = track[i].vel;
+    weights[i].weight = track[i].confidence * (track[i].snr + SU_ADDSFX(1e-3));
+    half_w += weights[i].weight;
+  }
+
+  half_w *= SU_ADDSFX(.5);
+
+  qsort(weights, count, sizeof(struct graves_doppler_weight),
+      graves_doppler_weight_cmp);
+
+  cum_w = 0;
+  for (i = 0; i < count; ++i) {
+    cum_w += weights[i].weight;
+    if (cum_w >= half_w) {
+      est->velocity = weights[i].vel;
+      break;
+    }
+  }
+
+  /* Smooth the track with a running median of 3 */
+  if (count >= 3) {
+    prev = track[0].vel;
+    for (i = 1; i < count - 1; ++i) {
+      curr = track[i].vel;
+      track[i].vel = graves_doppler_median3(prev, curr, track[i + 1].vel);
+      prev = curr;
+    }
+  }
+
+  return SU_TRUE;
+}
+
+SUBOOL
+graves_doppler_prefault(graves_doppler_t *est, unsigned int length)
+{
+  unsigned int count = length / est->params.hop + 1;
+  size_t size;
+  void *data;
+
+  size = count * sizeof(struct graves_doppler_point);
+  SU_TRYCATCH(data = grow_buf_alloc(&est->track, size), return SU_FALSE);
+  memset(data, 0, size);
+  grow_buf_shrink(&est->track);
+
+  size = count * sizeof(struct graves_doppler_weight);
+  SU_TRYCATCH(data = grow_buf_alloc(&est->scratch, size), return SU_FALSE);
+  memset(data, 0, size);
+  grow_buf_shrink(&est->scratch);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+graves_doppler_check_params(const struct graves_doppler_params *params)
+{
+  if (params->fft_size < 16
+      || (params->fft_size & (params->fft_size - 1)) != 0) {
+    SU_ERROR("FFT size must be a power of 2 (and at least 16)\n");
+    return SU_FALSE;
+  }
+
+  if (params->hop == 0 || params->hop > params->fft_size) {
+    SU_ERROR("Invalid Doppler track hop %d\n", params->hop);
+    return SU_FALSE;
+  }
+
+  if (params->max_doppler <= 0 || params->max_doppler >= .5 * params->fs) {
+    SU_ERROR("Doppler search band is outside the sampling bandwidth\n");
+    return SU_FALSE;
+  }
+
+  return SU_TRUE;
+}
+
+graves_doppler_t *
+graves_doppler_new(const struct graves_doppler_params *params)
+{
+  graves_doppler_t *new = NULL;
+  unsigned int i;
+
+  if (!graves_doppler_check_params(params))
+    return NULL;
+
+  SU_TRYCATCH(new = calloc(1, sizeof (graves_doppler_t)), goto fail);
+
+  new->params = *params;
+  new->half = (int) SU_FLOOR(
+      params->max_doppler * params->fft_size / params->fs);
+  if (new->half < 1)
+    new->half = 1;
+
+  SU_TRYCATCH(
+      new->window = malloc(sizeof(SUFLOAT) * params->fft_size),
+      goto fail);
+
+  SU_TRYCATCH(
+      new->fft_in = SU_FFTW(_malloc)(
+          sizeof(SU_FFTW(_complex)) * params->fft_size),
+      goto fail);
+
+  SU_TRYCATCH(
+      new->fft_out = SU_FFTW(_malloc)(
+          sizeof(SU_FFTW(_complex)) * params->fft_size),
+      goto fail);
+
+  SU_TRYCATCH(
+      new->plan = SU_FFTW(_plan_dft_1d)(
+          params->fft_size,
+          new->fft_in,
+          new->fft_out,
+          FFTW_FORWARD,
+          FFTW_ESTIMATE),
+      goto fail);
+
+  /* Hann window */
+  for (i = 0; i < params->fft_size; ++i)
+    new->window[i] =
+        SU_ADDSFX(.5) * (1 - SU_COS(2 * M_PI * i / params->fft_size));
+
+  return new;
+
+fail:
+  if (new != NULL)
+    graves_doppler_destroy(new);
+
+  return NULL;
+}
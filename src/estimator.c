@@ -0,0 +1,353 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <estimator.h>
+
+struct graves_est_iir_state {
+  int32_t   x_ptr;
+  int32_t   y_ptr;
+  SUCOMPLEX curr_y;
+};
+
+struct graves_est_boxcar_state {
+  uint64_t p;
+  int64_t  sum[GRAVES_BOXCAR_STAGES][2];
+};
+
+const char *
+graves_est_type_name(enum graves_est_type type)
+{
+  switch (type) {
+    case GRAVES_EST_IIR:
+      return "iir";
+
+    case GRAVES_EST_BOXCAR:
+      return "boxcar";
+  }
+
+  return "unknown";
+}
+
+SUBOOL
+graves_est_type_from_name(const char *name, enum graves_est_type *type)
+{
+  if (strcmp(name, "iir") == 0)
+    *type = GRAVES_EST_IIR;
+  else if (strcmp(name, "boxcar") == 0)
+    *type = GRAVES_EST_BOXCAR;
+  else
+    return SU_FALSE;
+
+  return SU_TRUE;
+}
+
+/************************************ IIR ************************************/
+SUPRIVATE size_t
+graves_est_iir_state_size(const su_iir_filt_t *filt)
+{
+  return sizeof(struct graves_est_iir_state)
+      + (filt->x_size + filt->y_size) * sizeof(SUCOMPLEX);
+}
+
+SUPRIVATE SUBOOL
+graves_est_iir_save(const su_iir_filt_t *filt, grow_buf_t *buf)
+{
+  struct graves_est_iir_state state;
+
+  memset(&state, 0, sizeof(struct graves_est_iir_state));
+  state.x_ptr  = filt->x_ptr;
+  state.y_ptr  = filt->y_ptr;
+  state.curr_y = filt->curr_y;
+
+  SU_TRYCATCH(
+      grow_buf_append(buf, &state, sizeof(state)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(
+      grow_buf_append(buf, filt->x, filt->x_size * sizeof(SUCOMPLEX)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(
+      grow_buf_append(buf, filt->y, filt->y_size * sizeof(SUCOMPLEX)) != -1,
+      return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE const uint8_t *
+graves_est_iir_restore(su_iir_filt_t *filt, const uint8_t *src)
+{
+  struct graves_est_iir_state state;
+
+  memcpy(&state, src, sizeof(state));
+  src += sizeof(state);
+  memcpy(filt->x, src, filt->x_size * sizeof(SUCOMPLEX));
+  src += filt->x_size * sizeof(SUCOMPLEX);
+  memcpy(filt->y, src, filt->y_size * sizeof(SUCOMPLEX));
+  src += filt->y_size * sizeof(SUCOMPLEX);
+
+  filt->x_ptr  = state.x_ptr;
+  filt->y_ptr  = state.y_ptr;
+  filt->curr_y = state.curr_y;
+
+  return src;
+}
+
+SUPRIVATE void
+graves_est_iir_reset(su_iir_filt_t *filt)
+{
+  memset(filt->x, 0, filt->x_size * sizeof(SUCOMPLEX));
+  memset(filt->y, 0, filt->y_size * sizeof(SUCOMPLEX));
+
+  filt->x_ptr  = 0;
+  filt->y_ptr  = 0;
+  filt->curr_y = 0;
+}
+
+/********************************** BOXCAR ***********************************/
+SUPRIVATE size_t
+graves_boxcar_ring_size(const struct graves_boxcar *box)
+{
+  return GRAVES_BOXCAR_STAGES * 2 * box->length * sizeof(int64_t);
+}
+
+/*
+ * Moving sums of length N have their 3 dB cutoff at x / (pi N) (in units
+ * of fs), where sinc(x)^GRAVES_BOXCAR_STAGES = 1 / sqrt(2). For two
+ * stages x is 1.0 within 0.2%.
+ */
+#define GRAVES_BOXCAR_CUTOFF_X SU_ADDSFX(1.)
+
+SUPRIVATE unsigned int
+graves_boxcar_length(SUFLOAT cutoff)
+{
+  SUFLOAT length = 2 * GRAVES_BOXCAR_CUTOFF_X / (M_PI * cutoff);
+
+  return length < 1 ? 1 : (unsigned int) SU_FLOOR(length + SU_ADDSFX(.5));
+}
+
+/*
+ * Equivalent noise bandwidth (in units of fs) of two cascaded moving sums
+ * of length N. Their impulse response is a triangle, with
+ * sum(h) = N^2 and sum(h^2) = N (2 N^2 + 1) / 3.
+ */
+SUPRIVATE SUFLOAT
+graves_boxcar_enbw(unsigned int length)
+{
+  SUFLOAT n = length;
+
+  return (2 * n * n + 1) / (3 * n * n * n);
+}
+
+SUPRIVATE void
+graves_boxcar_finalize(struct graves_boxcar *box)
+{
+  if (box->ring != NULL)
+    free(box->ring);
+
+  memset(box, 0, sizeof(struct graves_boxcar));
+}
+
+SUPRIVATE SUBOOL
+graves_boxcar_init(struct graves_boxcar *box, unsigned int length)
+{
+  SUFLOAT gain = GRAVES_BOXCAR_SCALE;
+  unsigned int k;
+
+  memset(box, 0, sizeof(struct graves_boxcar));
+
+  box->length = length;
+  SU_TRYCATCH(
+      box->ring = calloc(1, graves_boxcar_ring_size(box)),
+      return SU_FALSE);
+
+  for (k = 0; k < GRAVES_BOXCAR_STAGES; ++k)
+    gain *= length;
+
+  box->gain = 1 / gain;
+
+  return SU_TRUE;
+}
+
+SUPRIVATE void
+graves_boxcar_reset(struct graves_boxcar *box)
+{
+  memset(box->ring, 0, graves_boxcar_ring_size(box));
+  memset(box->sum, 0, sizeof(box->sum));
+
+  box->p = 0;
+}
+
+SUPRIVATE SUBOOL
+graves_boxcar_save(const struct graves_boxcar *box, grow_buf_t *buf)
+{
+  struct graves_est_boxcar_state state;
+
+  memset(&state, 0, sizeof(struct graves_est_boxcar_state));
+  state.p = box->p;
+  memcpy(state.sum, box->sum, sizeof(state.sum));
+
+  SU_TRYCATCH(
+      grow_buf_append(buf, &state, sizeof(state)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(
+      grow_buf_append(buf, box->ring, graves_boxcar_ring_size(box)) != -1,
+      return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE const uint8_t *
+graves_boxcar_restore(struct graves_boxcar *box, const uint8_t *src)
+{
+  struct graves_est_boxcar_state state;
+
+  memcpy(&state, src, sizeof(state));
+  src += sizeof(state);
+  memcpy(box->ring, src, graves_boxcar_ring_size(box));
+  src += graves_boxcar_ring_size(box);
+
+  box->p = (unsigned int) state.p;
+  memcpy(box->sum, state.sum, sizeof(state.sum));
+
+  return src;
+}
+
+/********************************* Common ************************************/
+size_t
+graves_est_state_size(const graves_est_t *est)
+{
+  if (est->type == GRAVES_EST_BOXCAR)
+    return 2 * sizeof(struct graves_est_boxcar_state)
+        + graves_boxcar_ring_size(&est->box1)
+        + graves_boxcar_ring_size(&est->box2);
+
+  return graves_est_iir_state_size(&est->lpf1)
+      + graves_est_iir_state_size(&est->lpf2);
+}
+
+SUBOOL
+graves_est_save_state(const graves_est_t *est, grow_buf_t *buf)
+{
+  if (est->type == GRAVES_EST_BOXCAR) {
+    SU_TRYCATCH(graves_boxcar_save(&est->box1, buf), return SU_FALSE);
+    SU_TRYCATCH(graves_boxcar_save(&est->box2, buf), return SU_FALSE);
+  } else {
+    SU_TRYCATCH(graves_est_iir_save(&est->lpf1, buf), return SU_FALSE);
+    SU_TRYCATCH(graves_est_iir_save(&est->lpf2, buf), return SU_FALSE);
+  }
+
+  return SU_TRUE;
+}
+
+void
+graves_est_restore_state(graves_est_t *est, const void *data)
+{
+  const uint8_t *src = (const uint8_t *) data;
+
+  if (est->type == GRAVES_EST_BOXCAR) {
+    src = graves_boxcar_restore(&est->box1, src);
+    (void) graves_boxcar_restore(&est->box2, src);
+  } else {
+    src = graves_est_iir_restore(&est->lpf1, src);
+    (void) graves_est_iir_restore(&est->lpf2, src);
+  }
+}
+
+void
+graves_est_reset(graves_est_t *est)
+{
+  if (est->type == GRAVES_EST_BOXCAR) {
+    graves_boxcar_reset(&est->box1);
+    graves_boxcar_reset(&est->box2);
+  } else {
+    graves_est_iir_reset(&est->lpf1);
+    graves_est_iir_reset(&est->lpf2);
+  }
+}
+
+void
+graves_est_finalize(graves_est_t *est)
+{
+  if (est->type == GRAVES_EST_BOXCAR) {
+    graves_boxcar_finalize(&est->box1);
+    graves_boxcar_finalize(&est->box2);
+  } else {
+    su_iir_filt_finalize(&est->lpf1);
+    su_iir_filt_finalize(&est->lpf2);
+  }
+}
+
+SUBOOL
+graves_est_init(
+    graves_est_t *est,
+    enum graves_est_type type,
+    SUFLOAT lpf1,
+    SUFLOAT lpf2)
+{
+  unsigned int len1, len2;
+
+  memset(est, 0, sizeof(graves_est_t));
+
+  est->type = type;
+
+  switch (type) {
+    case GRAVES_EST_IIR:
+      SU_TRYCATCH(su_iir_bwlpf_init(&est->lpf1, 4, lpf1), goto fail);
+      SU_TRYCATCH(su_iir_bwlpf_init(&est->lpf2, 4, lpf2), goto fail);
+
+      /* Same order: noise bandwidths are proportional to the cutoffs */
+      est->ratio = lpf2 / lpf1;
+      break;
+
+    case GRAVES_EST_BOXCAR:
+      len1 = graves_boxcar_length(lpf1);
+      len2 = graves_boxcar_length(lpf2);
+
+      if (len2 <= len1) {
+        SU_ERROR("Boxcar filters are too short for these cutoffs\n");
+        goto fail;
+      }
+
+      SU_TRYCATCH(graves_boxcar_init(&est->box1, len1), goto fail);
+      SU_TRYCATCH(graves_boxcar_init(&est->box2, len2), goto fail);
+
+      est->ratio = graves_boxcar_enbw(len2) / graves_boxcar_enbw(len1);
+      break;
+
+    default:
+      SU_ERROR("Unknown power estimator %d\n", type);
+      goto fail;
+  }
+
+  return SU_TRUE;
+
+fail:
+  graves_est_finalize(est);
+
+  return SU_FALSE;
+}
@@ -0,0 +1,531 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <evfile.h>
+
+#define CLISTONES_EVFILE_DATA_MARK  "DATA SECTION START"
+#define CLISTONES_EVFILE_MAX_HEADER (32 * CLISTONES_EVFILE_RECORD_SIZE)
+
+struct clistones_evfile_weight {
+  SUFLOAT vel;
+  SUFLOAT weight;
+};
+
+/*
+ * Look for "KEY   =   VALUE". Records are not always 32 bytes long (the
+ * sample rate of chirp files has a trailing unit), so keys are searched
+ * instead of indexed.
+ */
+SUPRIVATE SUBOOL
+clistones_evfile_field(
+    const char *header,
+    size_t size,
+    const char *key,
+    double *value)
+{
+  size_t len = strlen(key);
+  const char *p = header;
+  const char *end = header + size;
+  char buf[CLISTONES_EVFILE_RECORD_SIZE];
+  char *tail;
+  size_t n;
+
+  while ((p = memmem(p, end - p, key, len)) != NULL) {
+    p += len;
+    while (p < end && *p == ' ')
+      ++p;
+
+    if (p < end && *p == '=') {
+      ++p;
+      n = (size_t) (end - p);
+      if (n > sizeof(buf) - 1)
+        n = sizeof(buf) - 1;
+      memcpy(buf, p, n);
+      buf[n] = '\0';
+
+      *value = strtod(buf, &tail);
+      return tail != buf;
+    }
+  }
+
+  return SU_FALSE;
+}
+
+SUPRIVATE int
+clistones_evfile_weight_cmp(const void *a, const void *b)
+{
+  const struct clistones_evfile_weight *wa = a;
+  const struct clistones_evfile_weight *wb = b;
+
+  return (wa->vel > wb->vel) - (wa->vel < wb->vel);
+}
+
+const SUFLOAT *
+clistones_evfile_get_q(clistones_evfile_t *file)
+{
+  SUFLOAT frac[CLISTONES_EVFILE_Q_SCALE];
+  SUFLOAT octave[CLISTONES_EVFILE_Q_OCTAVES];
+  unsigned int i;
+
+  if (file->q != NULL || file->codes == NULL)
+    return file->q;
+
+  SU_TRYCATCH(file->q = malloc(file->length * sizeof(SUFLOAT)), return NULL);
+
+  /* 1 - q = 2^-(c / Q_SCALE), split in a fractional and an integer power */
+  for (i = 0; i < CLISTONES_EVFILE_Q_SCALE; ++i)
+    frac[i] = SU_POW(2, -(SUFLOAT) i / CLISTONES_EVFILE_Q_SCALE);
+
+  for (i = 0; i < CLISTONES_EVFILE_Q_OCTAVES; ++i)
+    octave[i] = SU_POW(2, -(SUFLOAT) i);
+
+  for (i = 0; i < file->length; ++i)
+    file->q[i] = 1 - octave[file->codes[i] / CLISTONES_EVFILE_Q_SCALE]
+        * frac[file->codes[i] % CLISTONES_EVFILE_Q_SCALE];
+
+  return file->q;
+}
+
+const SUFLOAT *
+clistones_evfile_get_snr(clistones_evfile_t *file)
+{
+  const SUFLOAT *q;
+  SUFLOAT ratio = file->ratio;
+  SUSCOUNT i;
+
+  if (file->snr != NULL || file->type != CLISTONES_EVFILE_COMPACT)
+    return file->snr;
+
+  SU_TRYCATCH(q = clistones_evfile_get_q(file), return NULL);
+  SU_TRYCATCH(
+      file->snr = malloc(file->length * sizeof(SUFLOAT)),
+      return NULL);
+
+  for (i = 0; i < file->length; ++i)
+    file->snr[i] = graves_det_q_to_snr(ratio, q[i]);
+
+  return file->snr;
+}
+
+/* Same weighting as the Doppler estimator */
+SUPRIVATE SUBOOL
+clistones_evfile_median_velocity(clistones_evfile_t *file)
+{
+  struct clistones_evfile_weight *weights = NULL;
+  SUFLOAT cum_w = 0, half_w = 0;
+  unsigned int i;
+
+  file->velocity = 0;
+  if (file->track_len == 0)
+    return SU_TRUE;
+
+  SU_TRYCATCH(
+      weights = malloc(
+          file->track_len * sizeof(struct clistones_evfile_weight)),
+      return SU_FALSE);
+
+  for (i = 0; i < file->track_len; ++i) {
+    weights[i].vel    = file->track[i].vel;
+    weights[i].weight = file->track[i].confidence
+        * (file->track[i].snr + SU_ADDSFX(1e-3));
+    half_w += weights[i].weight;
+  }
+
+  half_w *= SU_ADDSFX(.5);
+
+  qsort(
+      weights,
+      file->track_len,
+      sizeof(struct clistones_evfile_weight),
+      clistones_evfile_weight_cmp);
+
+  for (i = 0; i < file->track_len; ++i) {
+    cum_w += weights[i].weight;
+    if (cum_w >= half_w) {
+      file->velocity = weights[i].vel;
+      break;
+    }
+  }
+
+  free(weights);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+clistones_evfile_derive_track(clistones_evfile_t *file)
+{
+  const SUFLOAT *q;
+
+  SU_TRYCATCH(q = clistones_evfile_get_q(file), return SU_FALSE);
+  SU_TRYCATCH(
+      file->doppler = graves_doppler_new(&file->doppler_params),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      graves_doppler_estimate(
+          file->doppler,
+          file->x,
+          q,
+          file->length,
+          file->ratio),
+      return SU_FALSE);
+
+  file->track = (struct graves_doppler_point *)
+      graves_doppler_get_track(file->doppler, &file->track_len);
+  file->velocity = graves_doppler_get_velocity(file->doppler);
+
+  return SU_TRUE;
+}
+
+/* Chirp files keep the smoothed track, without times nor SNR */
+SUPRIVATE void
+clistones_evfile_complete_track(clistones_evfile_t *file)
+{
+  unsigned int fft_size = file->doppler_params.fft_size;
+  unsigned int i, j, start, avail;
+  SUFLOAT snr;
+
+  for (i = 0; i < file->track_len; ++i) {
+    start = i * file->hop;
+    avail = start < file->length ? file->length - start : 0;
+    if (avail > fft_size)
+      avail = fft_size;
+
+    snr = 0;
+    for (j = 0; j < avail; ++j)
+      snr += file->snr[start + j];
+
+    file->track[i].t   = (start + SU_ADDSFX(.5) * avail) / file->fs;
+    file->track[i].snr = avail > 0 && snr > 0 ? snr / avail : 0;
+  }
+}
+
+const struct graves_doppler_point *
+clistones_evfile_get_track(clistones_evfile_t *file, unsigned int *len)
+{
+  if (!file->have_track) {
+    if (file->type == CLISTONES_EVFILE_COMPACT)
+      SU_TRYCATCH(clistones_evfile_derive_track(file), return NULL);
+
+    file->have_track = SU_TRUE;
+  }
+
+  *len = file->track_len;
+
+  return file->track;
+}
+
+SUBOOL
+clistones_evfile_get_velocity(clistones_evfile_t *file, SUFLOAT *vel)
+{
+  unsigned int len;
+
+  SU_TRYCATCH(clistones_evfile_get_track(file, &len) != NULL, return SU_FALSE);
+
+  *vel = file->velocity;
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+clistones_evfile_parse(
+    clistones_evfile_t *file,
+    const uint8_t *data,
+    size_t size)
+{
+  const char *header = (const char *) data;
+  const char *mark;
+  const uint8_t *p;
+  size_t hsize = size;
+  double value, hop, track_len;
+  SUFLOAT *block = NULL;
+  unsigned int i;
+  SUBOOL ok = SU_FALSE;
+
+  if (hsize > CLISTONES_EVFILE_MAX_HEADER)
+    hsize = CLISTONES_EVFILE_MAX_HEADER;
+
+  if ((mark = memmem(
+      header,
+      hsize,
+      CLISTONES_EVFILE_DATA_MARK,
+      strlen(CLISTONES_EVFILE_DATA_MARK))) == NULL
+      || (size_t) (mark - header) + CLISTONES_EVFILE_RECORD_SIZE > size) {
+    SU_ERROR("Not an event file\n");
+    goto done;
+  }
+
+  hsize = mark - header;
+  p = data + hsize + CLISTONES_EVFILE_RECORD_SIZE;
+  size -= hsize + CLISTONES_EVFILE_RECORD_SIZE;
+
+  SU_TRYCATCH(
+      clistones_evfile_field(header, hsize, "EVENT_INDEX", &value),
+      goto done);
+  file->index = (int) value;
+
+  SU_TRYCATCH(
+      clistones_evfile_field(header, hsize, "TIMESTAMP_SEC", &value),
+      goto done);
+  file->tv.tv_sec = (time_t) value;
+
+  SU_TRYCATCH(
+      clistones_evfile_field(header, hsize, "TIMESTAMP_USEC", &value),
+      goto done);
+  file->tv.tv_usec = (suseconds_t) value;
+
+  SU_TRYCATCH(
+      clistones_evfile_field(header, hsize, "SAMPLE_RATE", &value)
+      && value > 0,
+      goto done);
+  file->fs = (SUSCOUNT) value;
+
+  if (clistones_evfile_field(header, hsize, "TRACK_LEN", &value)) {
+    file->type   = CLISTONES_EVFILE_WATERFALL;
+    file->length = (unsigned int) value;
+
+    SU_TRYCATCH(
+        (uint64_t) file->length * 3 * sizeof(SUFLOAT) <= size,
+        goto done);
+    SU_TRYCATCH(
+        file->track = calloc(
+            file->length,
+            sizeof(struct graves_doppler_point)),
+        goto done);
+    SU_TRYCATCH(
+        block = malloc(3 * file->length * sizeof(SUFLOAT)),
+        goto done);
+
+    /* Time, velocity and SNR blocks */
+    memcpy(block, p, 3 * file->length * sizeof(SUFLOAT));
+
+    value = 0;
+    for (i = 0; i < file->length; ++i) {
+      file->track[i].t          = block[i];
+      file->track[i].vel        = block[file->length + i];
+      file->track[i].snr        = block[2 * file->length + i];
+      file->track[i].confidence = 1;
+
+      file->velocity += file->track[i].vel * file->track[i].snr;
+      value += file->track[i].snr;
+    }
+
+    if (value > 0)
+      file->velocity /= value;
+
+    file->track_len  = file->length;
+    file->have_track = SU_TRUE;
+    ok = SU_TRUE;
+    goto done;
+  }
+
+  SU_TRYCATCH(
+      clistones_evfile_field(header, hsize, "CAPTURE_LEN", &value),
+      goto done);
+  file->length = (unsigned int) value;
+
+  SU_TRYCATCH(
+      (uint64_t) file->length * sizeof(SUCOMPLEX) <= size,
+      goto done);
+  SU_TRYCATCH(file->x = malloc(file->length * sizeof(SUCOMPLEX)), goto done);
+
+  /* The header is not a whole number of samples long: copy them */
+  memcpy(file->x, p, file->length * sizeof(SUCOMPLEX));
+  p    += file->length * sizeof(SUCOMPLEX);
+  size -= file->length * sizeof(SUCOMPLEX);
+
+  if (clistones_evfile_field(header, hsize, "Q_SCALE", &value)) {
+    if ((unsigned int) value != CLISTONES_EVFILE_Q_SCALE) {
+      SU_ERROR("Unsupported q coding (scale %g)\n", value);
+      goto done;
+    }
+
+    file->type = CLISTONES_EVFILE_COMPACT;
+
+    SU_TRYCATCH(
+        clistones_evfile_field(header, hsize, "SNR_RATIO", &value),
+        goto done);
+    file->ratio = value;
+
+    SU_TRYCATCH(
+        clistones_evfile_field(header, hsize, "CENTER_FREQ", &value),
+        goto done);
+    file->center_freq = value;
+
+    file->doppler_params.fs = file->fs;
+
+    SU_TRYCATCH(
+        clistones_evfile_field(header, hsize, "DOPPLER_FFT", &value),
+        goto done);
+    file->doppler_params.fft_size = (unsigned int) value;
+
+    SU_TRYCATCH(
+        clistones_evfile_field(header, hsize, "DOPPLER_HOP", &value),
+        goto done);
+    file->doppler_params.hop = (unsigned int) value;
+    file->hop = file->doppler_params.hop;
+
+    SU_TRYCATCH(
+        clistones_evfile_field(header, hsize, "DOPPLER_MAXDOP", &value),
+        goto done);
+    file->doppler_params.max_doppler = value;
+
+    SU_TRYCATCH(file->length * sizeof(uint16_t) <= size, goto done);
+    SU_TRYCATCH(
+        file->codes = malloc(file->length * sizeof(uint16_t)),
+        goto done);
+    memcpy(file->codes, p, file->length * sizeof(uint16_t));
+  } else {
+    file->type = CLISTONES_EVFILE_CHIRP;
+
+    SU_TRYCATCH(
+        clistones_evfile_field(header, hsize, "DOPPLER_LEN", &track_len)
+        && clistones_evfile_field(header, hsize, "DOPPLER_HOP", &hop)
+        && hop > 0,
+        goto done);
+    file->hop       = (unsigned int) hop;
+    file->track_len = (unsigned int) track_len;
+
+    SU_TRYCATCH(
+        (uint64_t) file->length * sizeof(SUFLOAT)
+        + 2 * (uint64_t) file->track_len * sizeof(SUFLOAT) <= size,
+        goto done);
+
+    SU_TRYCATCH(
+        file->snr = malloc(file->length * sizeof(SUFLOAT)),
+        goto done);
+    memcpy(file->snr, p, file->length * sizeof(SUFLOAT));
+    p += file->length * sizeof(SUFLOAT);
+
+    SU_TRYCATCH(
+        file->track = calloc(
+            file->track_len,
+            sizeof(struct graves_doppler_point)),
+        goto done);
+    SU_TRYCATCH(
+        block = malloc(2 * file->track_len * sizeof(SUFLOAT)),
+        goto done);
+
+    /* Velocity and confidence blocks */
+    memcpy(block, p, 2 * file->track_len * sizeof(SUFLOAT));
+    for (i = 0; i < file->track_len; ++i) {
+      file->track[i].vel        = block[i];
+      file->track[i].confidence = block[file->track_len + i];
+    }
+
+    file->doppler_params.fft_size =
+        ((struct graves_doppler_params) graves_doppler_params_INITIALIZER)
+        .fft_size;
+    clistones_evfile_complete_track(file);
+    SU_TRYCATCH(clistones_evfile_median_velocity(file), goto done);
+    file->have_track = SU_TRUE;
+  }
+
+  ok = SU_TRUE;
+
+done:
+  if (block != NULL)
+    free(block);
+
+  return ok;
+}
+
+void
+clistones_evfile_close(clistones_evfile_t *file)
+{
+  if (file->doppler != NULL)
+    graves_doppler_destroy(file->doppler);
+  else if (file->track != NULL)
+    free(file->track);
+
+  if (file->x != NULL)
+    free(file->x);
+
+  if (file->codes != NULL)
+    free(file->codes);
+
+  if (file->q != NULL)
+    free(file->q);
+
+  if (file->snr != NULL)
+    free(file->snr);
+
+  free(file);
+}
+
+clistones_evfile_t *
+clistones_evfile_open(const char *path)
+{
+  clistones_evfile_t *new = NULL;
+  uint8_t *data = NULL;
+  FILE *fp = NULL;
+  long size;
+
+  if ((fp = fopen(path, "rb")) == NULL) {
+    SU_ERROR("Cannot open %s: %s\n", path, strerror(errno));
+    goto fail;
+  }
+
+  SU_TRYCATCH(fseek(fp, 0, SEEK_END) != -1, goto fail);
+  SU_TRYCATCH((size = ftell(fp)) != -1, goto fail);
+  SU_TRYCATCH(fseek(fp, 0, SEEK_SET) != -1, goto fail);
+
+  SU_TRYCATCH(data = malloc(size + 1), goto fail);
+  SU_TRYCATCH(fread(data, 1, size, fp) == (size_t) size, goto fail);
+
+  SU_TRYCATCH(new = calloc(1, sizeof(clistones_evfile_t)), goto fail);
+
+  if (!clistones_evfile_parse(new, data, size)) {
+    SU_ERROR("Malformed event file %s\n", path);
+    goto fail;
+  }
+
+  free(data);
+  fclose(fp);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_evfile_close(new);
+
+  if (data != NULL)
+    free(data);
+
+  if (fp != NULL)
+    fclose(fp);
+
+  return NULL;
+}
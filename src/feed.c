@@ -0,0 +1,336 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <feed.h>
+
+/*
+ * Slot protocol. For the record at position `pos`, the slot sequence
+ * number is 2 * pos + 1 while it is being written and 2 * pos + 2 once it
+ * is complete. Any other value means the slot now belongs to a different
+ * record.
+ */
+static void
+clistones_feed_write(
+    atomic_uint_fast64_t *head,
+    void *slots,
+    size_t stride,
+    uint32_t count,
+    size_t offset,
+    const void *data,
+    size_t size)
+{
+  uint64_t pos = atomic_load_explicit(head, memory_order_relaxed);
+  uint8_t *slot = (uint8_t *) slots + (pos % count) * stride;
+  atomic_uint_fast64_t *seq = (atomic_uint_fast64_t *) slot;
+
+  atomic_store_explicit(seq, 2 * pos + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  memcpy(slot + offset, data, size);
+
+  atomic_store_explicit(seq, 2 * pos + 2, memory_order_release);
+  atomic_store_explicit(head, pos + 1, memory_order_release);
+}
+
+static int
+clistones_feed_read(
+    const atomic_uint_fast64_t *head,
+    const void *slots,
+    size_t stride,
+    uint32_t count,
+    size_t offset,
+    void *data,
+    size_t size,
+    uint64_t *next,
+    uint64_t *lost)
+{
+  uint64_t pos = atomic_load_explicit(head, memory_order_acquire);
+  const uint8_t *slot;
+  const atomic_uint_fast64_t *seq;
+  uint64_t before, after;
+
+  while (*next < pos) {
+    /* Lapped by the writer: jump to the oldest record still available */
+    if (pos - *next > count) {
+      *lost += pos - count - *next;
+      *next  = pos - count;
+    }
+
+    slot = (const uint8_t *) slots + (*next % count) * stride;
+    seq  = (const atomic_uint_fast64_t *) slot;
+
+    before = atomic_load_explicit(seq, memory_order_acquire);
+    if (before == 2 * *next + 2) {
+      memcpy(data, slot + offset, size);
+      atomic_thread_fence(memory_order_acquire);
+      after = atomic_load_explicit(seq, memory_order_relaxed);
+
+      if (after == before) {
+        ++*next;
+        return 1;
+      }
+    }
+
+    /* Slot reused while we were looking at it */
+    ++*lost;
+    ++*next;
+  }
+
+  return 0;
+}
+
+void
+clistones_feed_publish_event(
+    clistones_feed_t *feed,
+    const struct clistones_feed_event *event)
+{
+  clistones_feed_write(
+      &feed->shm->header.event_head,
+      feed->shm->events,
+      sizeof(struct clistones_feed_event_slot),
+      CLISTONES_FEED_EVENT_SLOTS,
+      offsetof(struct clistones_feed_event_slot, data),
+      event,
+      sizeof(struct clistones_feed_event));
+}
+
+void
+clistones_feed_publish_power(
+    clistones_feed_t *feed,
+    const struct clistones_feed_power *power)
+{
+  clistones_feed_write(
+      &feed->shm->header.power_head,
+      feed->shm->power,
+      sizeof(struct clistones_feed_power_slot),
+      CLISTONES_FEED_POWER_SLOTS,
+      offsetof(struct clistones_feed_power_slot, data),
+      power,
+      sizeof(struct clistones_feed_power));
+}
+
+void
+clistones_feed_destroy(clistones_feed_t *feed)
+{
+  if (feed->shm != NULL) {
+    munmap(feed->shm, sizeof(struct clistones_feed_shm));
+    shm_unlink(feed->name);
+  }
+
+  if (feed->name != NULL)
+    free(feed->name);
+
+  free(feed);
+}
+
+clistones_feed_t *
+clistones_feed_new(
+    const char *name,
+    uint64_t fs,
+    uint32_t power_decim,
+    float ratio)
+{
+  clistones_feed_t *new = NULL;
+  void *map;
+  int fd = -1;
+  int saved;
+
+  if ((new = calloc(1, sizeof(clistones_feed_t))) == NULL)
+    goto fail;
+
+  if ((new->name = strdup(name)) == NULL)
+    goto fail;
+
+  if ((fd = shm_open(name, O_CREAT | O_RDWR, 0644)) == -1)
+    goto fail;
+
+  if (ftruncate(fd, sizeof(struct clistones_feed_shm)) == -1)
+    goto fail;
+
+  map = mmap(
+      NULL,
+      sizeof(struct clistones_feed_shm),
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED,
+      fd,
+      0);
+
+  if (map == MAP_FAILED)
+    goto fail;
+
+  new->shm = map;
+  close(fd);
+  fd = -1;
+
+  /* Readers refuse to attach until the magic is in place */
+  memset(new->shm, 0, sizeof(struct clistones_feed_shm));
+
+  new->shm->header.version     = CLISTONES_FEED_VERSION;
+  new->shm->header.event_slots = CLISTONES_FEED_EVENT_SLOTS;
+  new->shm->header.power_slots = CLISTONES_FEED_POWER_SLOTS;
+  new->shm->header.fs          = fs;
+  new->shm->header.power_decim = power_decim;
+  new->shm->header.ratio_ppm   = (uint32_t) (ratio * 1e6);
+
+  atomic_init(&new->shm->header.event_head, 0);
+  atomic_init(&new->shm->header.power_head, 0);
+  atomic_thread_fence(memory_order_release);
+
+  new->shm->header.magic = CLISTONES_FEED_MAGIC;
+
+  return new;
+
+fail:
+  saved = errno;
+
+  /* Created but never mapped: readers must not find it */
+  if (fd != -1) {
+    close(fd);
+    shm_unlink(name);
+  }
+
+  if (new != NULL)
+    clistones_feed_destroy(new);
+
+  errno = saved;
+
+  return NULL;
+}
+
+clistones_feed_reader_t *
+clistones_feed_reader_open(const char *name)
+{
+  clistones_feed_reader_t *new = NULL;
+  struct stat sbuf;
+  void *map = MAP_FAILED;
+  int fd = -1;
+  int saved;
+
+  if ((new = calloc(1, sizeof(clistones_feed_reader_t))) == NULL)
+    goto fail;
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+    goto fail;
+
+  if (fstat(fd, &sbuf) == -1)
+    goto fail;
+
+  if ((size_t) sbuf.st_size < sizeof(struct clistones_feed_shm)) {
+    errno = EPROTO;
+    goto fail;
+  }
+
+  map = mmap(
+      NULL,
+      sizeof(struct clistones_feed_shm),
+      PROT_READ,
+      MAP_SHARED,
+      fd,
+      0);
+
+  if (map == MAP_FAILED)
+    goto fail;
+
+  close(fd);
+  fd = -1;
+
+  new->shm = map;
+
+  if (new->shm->header.magic != CLISTONES_FEED_MAGIC
+      || new->shm->header.version != CLISTONES_FEED_VERSION) {
+    errno = EPROTO;
+    goto fail;
+  }
+
+  new->next_event = atomic_load_explicit(
+      &new->shm->header.event_head,
+      memory_order_acquire);
+  new->next_power = atomic_load_explicit(
+      &new->shm->header.power_head,
+      memory_order_acquire);
+
+  return new;
+
+fail:
+  saved = errno;
+
+  if (fd != -1)
+    close(fd);
+
+  if (new != NULL)
+    clistones_feed_reader_close(new);
+
+  errno = saved;
+
+  return NULL;
+}
+
+int
+clistones_feed_reader_next_event(
+    clistones_feed_reader_t *reader,
+    struct clistones_feed_event *out)
+{
+  return clistones_feed_read(
+      &reader->shm->header.event_head,
+      reader->shm->events,
+      sizeof(struct clistones_feed_event_slot),
+      CLISTONES_FEED_EVENT_SLOTS,
+      offsetof(struct clistones_feed_event_slot, data),
+      out,
+      sizeof(struct clistones_feed_event),
+      &reader->next_event,
+      &reader->lost_events);
+}
+
+int
+clistones_feed_reader_next_power(
+    clistones_feed_reader_t *reader,
+    struct clistones_feed_power *out)
+{
+  return clistones_feed_read(
+      &reader->shm->header.power_head,
+      reader->shm->power,
+      sizeof(struct clistones_feed_power_slot),
+      CLISTONES_FEED_POWER_SLOTS,
+      offsetof(struct clistones_feed_power_slot, data),
+      out,
+      sizeof(struct clistones_feed_power),
+      &reader->next_power,
+      &reader->lost_power);
+}
+
+void
+clistones_feed_reader_close(clistones_feed_reader_t *reader)
+{
+  if (reader->shm != NULL)
+    munmap((void *) reader->shm, sizeof(struct clistones_feed_shm));
+
+  free(reader);
+}
@@ -0,0 +1,155 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <feed.h>
+
+#define FEEDCAT_POLL_USEC 50000
+
+/*
+ * Example consumer of the live feed: dumps it as CSV to stdout, or as raw
+ * event records (a binary event log, as read by clistones-coinc).
+ */
+
+void
+help(const char *a0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s [OPTIONS] NAME\n\n", a0);
+  fprintf(stderr, "Dump the live feed published by clistones --feed=NAME\n\n");
+  fprintf(stderr, "OPTIONS:\n");
+  fprintf(stderr, "  -p, --power       Dump power levels too\n");
+  fprintf(
+      stderr,
+      "  -b, --binary      Write events as raw records (no power levels)\n");
+  fprintf(stderr, "  -h, --help        This help\n");
+}
+
+static struct option long_options[] =
+{
+  {"power",  no_argument, 0, 'p'},
+  {"binary", no_argument, 0, 'b'},
+  {"help",   no_argument, 0, 'h'},
+  {0, 0, 0, 0}
+};
+
+int
+main(int argc, char **argv)
+{
+  clistones_feed_reader_t *reader = NULL;
+  struct clistones_feed_event event;
+  struct clistones_feed_power power;
+  int show_power = 0;
+  int binary = 0;
+  int ret = EXIT_FAILURE;
+  int option_index = 0;
+  int c, got;
+
+  while ((c = getopt_long(argc, argv, "pbh", long_options, &option_index))
+      != -1) {
+    switch (c) {
+      case 'p':
+        show_power = 1;
+        break;
+
+      case 'b':
+        binary = 1;
+        break;
+
+      case 'h':
+        help(argv[0]);
+        return EXIT_SUCCESS;
+
+      default:
+        help(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1) {
+    help(argv[0]);
+    goto done;
+  }
+
+  if ((reader = clistones_feed_reader_open(argv[optind])) == NULL) {
+    fprintf(
+        stderr,
+        "%s: cannot attach to feed `%s': %s\n",
+        argv[0],
+        argv[optind],
+        strerror(errno));
+    goto done;
+  }
+
+  for (;;) {
+    got = 0;
+
+    while (clistones_feed_reader_next_event(reader, &event)) {
+      got = 1;
+
+      if (binary) {
+        if (fwrite(&event, sizeof(event), 1, stdout) != 1)
+          goto done;
+        continue;
+      }
+
+      printf(
+          "E,%u,%d,%ld,%06ld,%.6e,%.6e,%.6e,%.6e\n",
+          event.index,
+          event.weak,
+          (long) event.tv_sec,
+          (long) event.tv_usec,
+          event.duration,
+          event.mean_snr,
+          event.max_snr,
+          event.mean_vel);
+    }
+
+    while (show_power && !binary && clistones_feed_reader_next_power(reader, &power)) {
+      printf(
+          "P,%llu,%.6e,%.6e,%.6e,%.6e\n",
+          (unsigned long long) power.sample,
+          power.p_n,
+          power.p_w,
+          power.q,
+          power.noise_q);
+      got = 1;
+    }
+
+    if (got)
+      fflush(stdout);
+    else
+      usleep(FEEDCAT_POLL_USEC);
+  }
+
+  ret = EXIT_SUCCESS;
+
+done:
+  if (reader != NULL)
+    clistones_feed_reader_close(reader);
+
+  return ret;
+}
@@ -0,0 +1,186 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <gate.h>
+
+struct graves_gate_state {
+  SUCOMPLEX sum;
+  SUFLOAT   power;
+  SUFLOAT   r_sum;
+  uint64_t  count;
+  uint64_t  p;
+  uint64_t  quiet;
+  uint32_t  open;
+};
+
+void
+graves_gate_push_block(graves_gate_t *gate)
+{
+  SUFLOAT r = 0;
+  SUFLOAT mean;
+  SUSCOUNT i;
+
+  if (gate->power > 0)
+    r = SU_C_REAL(gate->sum * SU_C_CONJ(gate->sum))
+        / (gate->decim * gate->power);
+
+  gate->sum   = 0;
+  gate->power = 0;
+  gate->count = 0;
+
+  gate->r_sum += r - gate->r[gate->p];
+  gate->r[gate->p] = r;
+
+  /* Once per turn, get rid of the rounding error of the running sum */
+  if (++gate->p == gate->window) {
+    gate->p = 0;
+    gate->r_sum = 0;
+    for (i = 0; i < gate->window; ++i)
+      gate->r_sum += gate->r[i];
+  }
+
+  (void) graves_nf_feed(gate->floor, r);
+
+  mean = gate->r_sum / gate->window;
+
+  if (!graves_nf_is_ready(gate->floor)
+      || mean > gate->level * graves_nf_get_estimate(gate->floor)) {
+    gate->open  = SU_TRUE;
+    gate->quiet = 0;
+  } else if (gate->open && ++gate->quiet >= gate->window) {
+    gate->open  = SU_FALSE;
+  }
+}
+
+size_t
+graves_gate_state_size(const graves_gate_t *gate)
+{
+  return sizeof(struct graves_gate_state)
+      + gate->window * sizeof(SUFLOAT)
+      + graves_nf_state_size(gate->floor);
+}
+
+SUBOOL
+graves_gate_save_state(const graves_gate_t *gate, grow_buf_t *buf)
+{
+  struct graves_gate_state state;
+
+  memset(&state, 0, sizeof(struct graves_gate_state));
+  state.sum   = gate->sum;
+  state.power = gate->power;
+  state.r_sum = gate->r_sum;
+  state.count = gate->count;
+  state.p     = gate->p;
+  state.quiet = gate->quiet;
+  state.open  = gate->open;
+
+  SU_TRYCATCH(
+      grow_buf_append(buf, &state, sizeof(state)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(
+      grow_buf_append(buf, gate->r, gate->window * sizeof(SUFLOAT)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(graves_nf_save_state(gate->floor, buf), return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+void
+graves_gate_restore_state(graves_gate_t *gate, const void *data)
+{
+  struct graves_gate_state state;
+  const uint8_t *src = (const uint8_t *) data;
+
+  memcpy(&state, src, sizeof(state));
+  src += sizeof(state);
+  memcpy(gate->r, src, gate->window * sizeof(SUFLOAT));
+  src += gate->window * sizeof(SUFLOAT);
+  graves_nf_restore_state(gate->floor, src);
+
+  gate->sum   = state.sum;
+  gate->power = state.power;
+  gate->r_sum = state.r_sum;
+  gate->count = (SUSCOUNT) state.count;
+  gate->p     = (SUSCOUNT) state.p;
+  gate->quiet = (SUSCOUNT) state.quiet;
+  gate->open  = state.open;
+}
+
+void
+graves_gate_destroy(graves_gate_t *gate)
+{
+  if (gate->floor != NULL)
+    graves_nf_destroy(gate->floor);
+
+  if (gate->r != NULL)
+    free(gate->r);
+
+  free(gate);
+}
+
+graves_gate_t *
+graves_gate_new(
+    SUSCOUNT decim,
+    SUSCOUNT window,
+    SUFLOAT level,
+    SUSCOUNT length)
+{
+  graves_gate_t *new = NULL;
+
+  if (decim == 0 || window == 0 || level <= 1) {
+    SU_ERROR("Invalid trigger gate parameters\n");
+    return NULL;
+  }
+
+  SU_TRYCATCH(new = calloc(1, sizeof (graves_gate_t)), goto fail);
+
+  new->decim = decim;
+  new->window = window;
+  new->level = level;
+  new->open = SU_TRUE;
+
+  SU_TRYCATCH(new->r = calloc(sizeof(SUFLOAT), window), goto fail);
+
+  SU_TRYCATCH(
+      new->floor = graves_nf_new(
+          0,
+          GRAVES_GATE_FLOOR_SPAN / decim,
+          SU_ADDSFX(.5),
+          window,
+          length),
+      goto fail);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    graves_gate_destroy(new);
+
+  return NULL;
+}
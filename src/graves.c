@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #ifndef FILENAME
 #  define FILENAME __FILENAME__
@@ -28,149 +29,325 @@
 
 #include <graves.h>
 
+/*
+ * History windows replayed before Q is trusted again, when the full
+ * detector restarts after a long pause of the gate: the filters settle and
+ * the power averages start over in the first one, and the second one fills
+ * the delay line with valid Qs.
+ */
+#define GRAVES_DET_GATE_WARMUP 2
+
+/*
+ * History windows the gate may open after the point where the full
+ * detector would have triggered: its own window has to fill with the echo
+ * first, and it only decides at the end of its blocks. The restart goes
+ * back this much further than the warmup, so that Q is already valid there.
+ */
+#define GRAVES_DET_GATE_LATENCY 2
+
+/* Noise floor surveys behind the gate, every this many gate windows */
+#define GRAVES_DET_GATE_SURVEY 32
+
+#define GRAVES_ALIGN(size) \
+  (((size) + GRAVES_CACHE_LINE - 1) & ~((size_t) GRAVES_CACHE_LINE - 1))
+
 void
 graves_det_destroy(graves_det_t *detect)
 {
-  if (detect->q_hist != NULL)
-    free(detect->q_hist);
+  if (detect->nf != NULL)
+    graves_nf_destroy(detect->nf);
 
-  if (detect->p_n_hist != NULL)
-    free(detect->p_n_hist);
+  if (detect->gate != NULL)
+    graves_gate_destroy(detect->gate);
 
-  if (detect->p_w_hist != NULL)
-    free(detect->p_w_hist);
+  if (detect->replay != NULL)
+    free(detect->replay);
 
-  if (detect->samp_hist != NULL)
-    free(detect->samp_hist);
+  graves_est_finalize(&detect->est);
 
-  su_iir_filt_finalize(&detect->lpf1);
-  su_iir_filt_finalize(&detect->lpf2);
+  if (detect->chirp != NULL)
+    graves_chirp_unref(detect->chirp);
 
-  grow_buf_clear(&detect->chirp);
-  grow_buf_clear(&detect->q);
-  grow_buf_clear(&detect->p_n_buf);
-  grow_buf_clear(&detect->p_w_buf);
+  if (detect->pool != NULL)
+    graves_chirp_pool_unref(detect->pool);
 
   free(detect);
 }
 
-SUPRIVATE void
-graves_det_filt_back(graves_det_t *md)
+/*
+ * Smooth the chirp powers backwards and compute Q, in a single pass. The
+ * first hist_len entries (the pre-trigger part) only matter as the end of
+ * the backward run, so the pass stops there and the results are exposed
+ * as views starting at hist_len instead of being shifted down.
+ */
+SUPRIVATE SUBOOL
+graves_det_filt_back(
+    graves_det_t *md,
+    SUSCOUNT len,
+    SUFLOAT p_n,
+    SUFLOAT p_w)
 {
-  int i;
-  int shift = (int) md->hist_len;
-  int len = (int) (grow_buf_get_size(&md->p_n_buf) / sizeof (SUFLOAT));
-  SUFLOAT *p_n_ptr = grow_buf_get_buffer(&md->p_n_buf);
-  SUFLOAT *p_w_ptr = grow_buf_get_buffer(&md->p_w_buf);
+  SUSCOUNT i;
+  SUSCOUNT shift = md->hist_len;
+  SUFLOAT *p_n_ptr = grow_buf_get_buffer(&md->chirp->p_n);
+  SUFLOAT *p_w_ptr = grow_buf_get_buffer(&md->chirp->p_w);
   SUFLOAT *q_ptr;
-  SUFLOAT  p_n = md->p_n;
-  SUFLOAT  p_w = md->p_w;
+  SUFLOAT  alpha = md->alpha;
 
-  grow_buf_alloc(&md->q, (unsigned) len * sizeof (SUFLOAT));
-  q_ptr = grow_buf_get_buffer(&md->q);
+  /* Reuses the allocation of a previous chirp (or the prefaulted one) */
+  SU_TRYCATCH(
+      q_ptr = grow_buf_alloc(&md->chirp->q, (len - shift) * sizeof(SUFLOAT)),
+      return SU_FALSE);
 
-  memset(q_ptr, 0, (unsigned) len * sizeof (SUFLOAT));
+  p_n_ptr += shift;
+  p_w_ptr += shift;
 
-  /* Apply filters in reverse order. */
-  for (i = len - 1; i >= 0; --i) {
-    p_w += md->alpha * (p_w_ptr[i] - p_w);
-    p_n += md->alpha * (p_n_ptr[i] - p_n);
+  for (i = len - shift; i-- > 0;) {
+    p_w += alpha * (p_w_ptr[i] - p_w);
+    p_n += alpha * (p_n_ptr[i] - p_n);
 
     p_n_ptr[i] = p_n;
     p_w_ptr[i] = p_w;
+    q_ptr[i]   = p_n / p_w;
   }
 
-  /* Shift */
-  for (i = 0; i < len - shift; ++i) {
-    p_n_ptr[i] = p_n_ptr[i + shift];
-    p_w_ptr[i] = p_w_ptr[i + shift];
-    q_ptr[i]   = p_n_ptr[i] / p_w_ptr[i];
-  }
+  return SU_TRUE;
 }
 
-SUBOOL
-graves_det_feed(graves_det_t *md, SUCOMPLEX x)
+/*
+ * In adaptive mode, the threshold is expressed as an excess SNR over the
+ * apparent SNR of the noise floor. When the floor sits exactly at the ratio
+ * (white noise in the band), this is the same as the fixed threshold.
+ */
+SUPRIVATE void
+graves_det_update_threshold(graves_det_t *md)
+{
+  SUFLOAT noise_snr = graves_det_q_to_snr(
+      md->ratio,
+      graves_nf_get_estimate(md->nf));
+
+  if (noise_snr < 0)
+    noise_snr = 0;
+
+  md->energy_thres = md->hist_len * graves_det_snr_to_q(
+      md->ratio,
+      noise_snr + md->snr_thres);
+
+  if (md->stop_snr_thres < md->snr_thres)
+    md->stop_thres = md->hist_len * graves_det_snr_to_q(
+        md->ratio,
+        noise_snr + md->stop_snr_thres);
+  else
+    md->stop_thres = md->energy_thres;
+}
+
+/* Exact sum of the Qs in the delay line, in chronological order */
+SUPRIVATE void
+graves_det_sum_hist(graves_det_t *md)
+{
+  SUSCOUNT i;
+  SUDOUBLE energy = 0;
+
+  for (i = md->p - md->hist_len; i != md->p; ++i)
+    energy += md->q_hist[i & md->hist_mask];
+
+  md->energy = energy;
+}
+
+/* Append the delay line of a quantity, oldest first: at most two memcpys */
+SUPRIVATE SUBOOL
+graves_det_copy_hist(
+    const graves_det_t *md,
+    grow_buf_t *buf,
+    const void *plane,
+    size_t elem_size)
 {
-  SUCOMPLEX y;
+  const uint8_t *src = (const uint8_t *) plane;
+  uint8_t *dest;
+  SUSCOUNT first = (md->p - md->hist_len) & md->hist_mask;
+  SUSCOUNT head = md->hist_mask + 1 - first;
+
+  if (head > md->hist_len)
+    head = md->hist_len;
+
+  SU_TRYCATCH(
+      dest = grow_buf_alloc(buf, md->hist_len * elem_size),
+      return SU_FALSE);
+
+  memcpy(dest, src + first * elem_size, head * elem_size);
+
+  if (head < md->hist_len)
+    memcpy(
+        dest + head * elem_size,
+        src,
+        (md->hist_len - head) * elem_size);
+
+  return SU_TRUE;
+}
+
+/* Front end: filters, power averages and Q of a mixed sample */
+SUINLINE void
+graves_det_front(
+    graves_det_t *md,
+    SUCOMPLEX x,
+    struct graves_det_sample *s)
+{
+  SUCOMPLEX y, y_w;
   SUFLOAT   Q;
-  SUFLOAT   energy;
-  struct graves_chirp_info info;
-  unsigned int i;
+  SUFLOAT   alpha = md->alpha;
 
-  x *= SU_C_CONJ(su_ncqo_read(&md->lo));
+  graves_est_feed(&md->est, x, &y_w, &y);
 
-  y = su_iir_filt_feed(&md->lpf1, x);
-  md->p_w += md->alpha * (SU_C_REAL(y * SU_C_CONJ(y)) - md->p_w);
+  /* Plain means after a restart, until they weigh as much as the decay */
+  if (md->fresh > 0) {
+    /* Stale levels would cancel out the first (maybe weak) powers */
+    if (md->fresh == 1)
+      md->p_w = md->p_n = 0;
+
+    if (md->fresh * md->alpha < 1)
+      alpha = SU_ADDSFX(1.) / md->fresh++;
+    else
+      md->fresh = 0;
+  }
 
-  y = su_iir_filt_feed(&md->lpf2, x);
-  md->p_n += md->alpha * (SU_C_REAL(y * SU_C_CONJ(y)) - md->p_n);
+  md->p_w += alpha * (SU_C_REAL(y_w * SU_C_CONJ(y_w)) - md->p_w);
+  md->p_n += alpha * (SU_C_REAL(y * SU_C_CONJ(y)) - md->p_n);
 
   /* Compute power quotient */
   Q = md->p_n / md->p_w;
 
-  if (Q >= 1 || Q < md->ratio)
+  /* Written so that 0 / 0 (digital silence) is rejected too */
+  if (!(Q < 1 && Q >= md->ratio))
     Q = md->last_good_q;
   else
     md->last_good_q = Q;
 
-  /* Update histories */
-  md->p_n_hist[md->p]  = md->p_n;
-  md->p_w_hist[md->p]  = md->p_w;
-  md->q_hist[md->p]    = Q;
-  md->samp_hist[md->p] = y;
+  s->y   = y;
+  s->p_n = md->p_n;
+  s->p_w = md->p_w;
+  s->q   = Q;
+}
+
+/* Back end: delay line, noise floor, trigger and chirp assembly */
+SUINLINE SUBOOL
+graves_det_back(graves_det_t *md, const struct graves_det_sample *s)
+{
+  SUFLOAT   energy, p_n, p_w;
+  struct graves_chirp_info *info;
+  SUSCOUNT  w, len, gap, start;
+  SUBOOL    below, ok;
+
+  /* Update histories. The Q leaving the window is read before writing. */
+  md->energy -= md->q_hist[(md->p - md->hist_len) & md->hist_mask];
+  md->energy += s->q;
+
+  w = md->p & md->hist_mask;
+  md->p_n_hist[w]  = s->p_n;
+  md->p_w_hist[w]  = s->p_w;
+  md->q_hist[w]    = s->q;
+  md->samp_hist[w] = s->y;
+
+  /* Once per turn, get rid of the rounding error of the running sum */
+  if ((++md->p & md->hist_mask) == 0)
+    graves_det_sum_hist(md);
+
+  /* Restarted after a pause of the gate, Q is not valid yet */
+  if (md->settle > 0) {
+    --md->settle;
+    ++md->n;
+    return SU_TRUE;
+  }
 
-  if (++md->p == md->hist_len)
-    md->p = 0;
+  /* Track the noise floor only outside chirps (and surveys, if gated) */
+  if (md->nf != NULL && !md->in_chirp)
+    if (md->gate == NULL || md->survey > 0 || !graves_nf_is_ready(md->nf))
+      if (graves_nf_feed(md->nf, s->q) && graves_nf_is_ready(md->nf))
+        graves_det_update_threshold(md);
 
-  /* md->p now points to the OLDEST sample */
+  if (md->survey > 0)
+    --md->survey;
 
   /* Compute cross-correlation */
-  energy = 0;
-  for (i = 0; i < md->hist_len; ++i)
-    energy += md->q_hist[i];
+  energy = md->energy;
 
-  /* Detect chirp limits */
+  /* Detect chirp limits. Within a gap, only a new trigger resumes it. */
   if (md->in_chirp) {
-    if (energy < md->energy_thres) {
+    below = energy < md->stop_thres
+        || (md->quiet > 0 && energy < md->energy_thres);
+
+    if (below && md->quiet == md->holdoff) {
       /* DETECTED: CHIRP END */
       md->in_chirp = SU_FALSE;
 
-      graves_det_filt_back(md);
+      info = &md->chirp->info;
+
+      /* The gap is not part of the chirp */
+      len = grow_buf_get_size(&md->chirp->x) / sizeof(SUCOMPLEX);
+      gap = md->quiet;
+      len -= gap;
+      info->length = (unsigned int) (len - md->hist_len);
+      start = md->n - gap - info->length;
+      md->quiet = 0;
+
+      if (info->length > 0) {
+        /* Nor may it leak into the backward pass through its seed */
+        if (gap > 0) {
+          p_n = ((SUFLOAT *) grow_buf_get_buffer(&md->chirp->p_n))[len - 1];
+          p_w = ((SUFLOAT *) grow_buf_get_buffer(&md->chirp->p_w))[len - 1];
+        } else {
+          p_n = s->p_n;
+          p_w = s->p_w;
+        }
 
-      info.length = (unsigned int) grow_buf_get_size(&md->chirp) / sizeof(SUCOMPLEX);
-      info.length -= md->hist_len;
-
-      if (info.length > 0) {
-        info.t0     = (md->n - info.length) / md->params.fs;
-        info.t0f    = SU_ASFLOAT((md->n - info.length) % md->params.fs) / md->params.fs;
-        info.x      = (const SUCOMPLEX *) grow_buf_get_buffer(&md->chirp);
-        info.q      = (const SUFLOAT *) grow_buf_get_buffer(&md->q);
-        info.p_n    = (const SUFLOAT *) grow_buf_get_buffer(&md->p_n_buf);
-        info.p_w    = (const SUFLOAT *) grow_buf_get_buffer(&md->p_w_buf);
+        SU_TRYCATCH(
+            graves_det_filt_back(md, len, p_n, p_w),
+            return SU_FALSE);
+
+        info->t0     = start / md->params.fs;
+        info->t0f    = SU_ASFLOAT(start % md->params.fs) / md->params.fs;
+        info->x      = (const SUCOMPLEX *) grow_buf_get_buffer(&md->chirp->x);
+        info->q      = (const SUFLOAT *) grow_buf_get_buffer(&md->chirp->q);
+        info->p_n    = (const SUFLOAT *) grow_buf_get_buffer(&md->chirp->p_n)
+                       + md->hist_len;
+        info->p_w    = (const SUFLOAT *) grow_buf_get_buffer(&md->chirp->p_w)
+                       + md->hist_len;
+
+        info->fs     = md->params.fs;
+        info->rbw    = md->ratio;
+
+        ok = (md->on_chirp) (md->privdata, info);
+      } else {
+        ok = SU_TRUE;
+      }
 
-        info.fs     = md->params.fs;
-        info.rbw    = md->ratio;
+      /* Back to the pool, unless the callback took a reference */
+      graves_chirp_unref(md->chirp);
+      md->chirp = NULL;
 
-        SU_TRYCATCH((md->on_chirp) (md->privdata, &info), return SU_FALSE);
-      }
+      SU_TRYCATCH(ok, return SU_FALSE);
 #ifdef DEBUG
       printf(
           "Chirp of length %5d detected (at %02d:%02d:%02d)\n",
-          grow_buf_get_size(&md->chirp) / sizeof(SUCOMPLEX),
+          (unsigned int) (len - md->hist_len),
           start / 3600,
           (start / 60) % 60,
           start % 60);
 #endif
     } else {
+      if (below)
+        ++md->quiet;
+      else
+        md->quiet = 0;
+
       /* Sample belongs to chirp. Save it for later processing */
       SU_TRYCATCH(
-          grow_buf_append(&md->chirp, &y, sizeof(SUCOMPLEX)) != -1,
+          grow_buf_append(&md->chirp->x, &s->y, sizeof(SUCOMPLEX)) != -1,
           return SU_FALSE)
       SU_TRYCATCH(
-          grow_buf_append(&md->p_n_buf, &md->p_n, sizeof(SUFLOAT)) != -1,
+          grow_buf_append(&md->chirp->p_n, &s->p_n, sizeof(SUFLOAT)) != -1,
           return SU_FALSE)
       SU_TRYCATCH(
-          grow_buf_append(&md->p_w_buf, &md->p_w, sizeof(SUFLOAT)) != -1,
+          grow_buf_append(&md->chirp->p_w, &s->p_w, sizeof(SUFLOAT)) != -1,
           return SU_FALSE)
     }
   } else {
@@ -178,32 +355,32 @@ graves_det_feed(graves_det_t *md, SUCOMPLEX x)
       /* DETECTED: CHIRP START */
       md->in_chirp = SU_TRUE;
 
-      /* Save all samples in the delay line to the grow buffer */
-      grow_buf_shrink(&md->chirp);
-      grow_buf_shrink(&md->q);
-      grow_buf_shrink(&md->p_n_buf);
-      grow_buf_shrink(&md->p_w_buf);
+      /* Save all samples in the delay line to a fresh chirp */
+      SU_TRYCATCH(
+          md->chirp = graves_chirp_pool_acquire(md->pool),
+          return SU_FALSE);
 
-      for (i = 0; i < md->hist_len; ++i) {
-        SU_TRYCATCH(
-            grow_buf_append(
-                &md->chirp,
-                md->samp_hist + (i + md->p) % md->hist_len,
-                sizeof(SUCOMPLEX)) != -1,
-            return SU_FALSE)
-        SU_TRYCATCH(
-            grow_buf_append(
-                &md->p_n_buf,
-                md->p_n_hist + (i + md->p) % md->hist_len,
-                sizeof(SUCOMPLEX)) != -1,
-            return SU_FALSE)
-        SU_TRYCATCH(
-            grow_buf_append(
-                &md->p_w_buf,
-                md->p_w_hist + (i + md->p) % md->hist_len,
-                sizeof(SUCOMPLEX)) != -1,
-            return SU_FALSE)
-      }
+      SU_TRYCATCH(
+          graves_det_copy_hist(
+              md,
+              &md->chirp->x,
+              md->samp_hist,
+              sizeof(SUCOMPLEX)),
+          return SU_FALSE)
+      SU_TRYCATCH(
+          graves_det_copy_hist(
+              md,
+              &md->chirp->p_n,
+              md->p_n_hist,
+              sizeof(SUFLOAT)),
+          return SU_FALSE)
+      SU_TRYCATCH(
+          graves_det_copy_hist(
+              md,
+              &md->chirp->p_w,
+              md->p_w_hist,
+              sizeof(SUFLOAT)),
+          return SU_FALSE)
     }
   }
 
@@ -211,12 +388,420 @@ graves_det_feed(graves_det_t *md, SUCOMPLEX x)
   return SU_TRUE;
 }
 
+/* Feed a sample that has already been mixed down */
+SUPRIVATE SUBOOL
+graves_det_feed_mixed(graves_det_t *md, SUCOMPLEX x)
+{
+  struct graves_det_sample s;
+
+  graves_det_front(md, x, &s);
+
+  return graves_det_back(md, &s);
+}
+
+/* Run the full detector over the replay ring, up to the last sample fed */
+SUPRIVATE SUBOOL
+graves_det_catch_up(graves_det_t *md)
+{
+  md->processed += md->fed - md->n;
+
+  while (md->n != md->fed)
+    SU_TRYCATCH(
+        graves_det_feed_mixed(md, md->replay[md->n & md->replay_mask]),
+        return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+/* Called at the end of every gate block */
+SUPRIVATE SUBOOL
+graves_det_update_gate(graves_det_t *md)
+{
+  SUBOOL open;
+
+  if (md->nf != NULL
+      && ++md->since_survey == GRAVES_DET_GATE_SURVEY * md->gate->window) {
+    md->since_survey = 0;
+    md->survey = md->hist_len;
+  }
+
+  /* The noise floor only learns from the full detector */
+  open = graves_gate_is_open(md->gate)
+      || md->survey > 0
+      || (md->nf != NULL && !graves_nf_is_ready(md->nf));
+
+  if (open && !md->awake) {
+    if (md->fed - md->n > md->replay_len) {
+      md->n      = md->fed - md->replay_len;
+      md->settle = GRAVES_DET_GATE_WARMUP * md->hist_len;
+      md->fresh  = 1;
+
+      /* Whatever was there before would ring in the output or stick in Q */
+      graves_est_reset(&md->est);
+      md->last_good_q = md->ratio;
+    }
+
+    md->awake = SU_TRUE;
+  } else if (!open && md->awake) {
+    /* Stop right here, but never in the middle of a chirp or a survey */
+    SU_TRYCATCH(graves_det_catch_up(md), return SU_FALSE);
+    md->awake = md->in_chirp || md->survey > 0;
+  }
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+graves_det_feed_gated(graves_det_t *md, const SUCOMPLEX *x, SUSCOUNT len)
+{
+  SUSCOUNT i;
+
+  for (i = 0; i < len; ++i) {
+    md->replay[md->fed++ & md->replay_mask] = x[i];
+
+    if (graves_gate_feed(md->gate, x[i]))
+      SU_TRYCATCH(graves_det_update_gate(md), return SU_FALSE);
+  }
+
+  if (md->awake)
+    SU_TRYCATCH(graves_det_catch_up(md), return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+SUBOOL
+graves_det_feed(graves_det_t *md, SUCOMPLEX x)
+{
+  /* Complex baseband input already centered at 0 Hz needs no mixing */
+  if (md->mix)
+    x = graves_mixer_mix_one(&md->lo, x);
+
+  if (md->gate != NULL)
+    return graves_det_feed_gated(md, &x, 1);
+
+  return graves_det_feed_mixed(md, x);
+}
+
+SUBOOL
+graves_det_feed_block(graves_det_t *md, const SUCOMPLEX *x, SUSCOUNT len)
+{
+  SUCOMPLEX mixed[GRAVES_DET_MIX_BLOCK];
+  const SUCOMPLEX *src = x;
+  SUSCOUNT i, chunk;
+
+  while (len > 0) {
+    chunk = len < GRAVES_DET_MIX_BLOCK ? len : GRAVES_DET_MIX_BLOCK;
+
+    if (md->mix) {
+      graves_mixer_mix(&md->lo, x, mixed, chunk);
+      src = mixed;
+    } else {
+      src = x;
+    }
+
+    if (md->gate != NULL) {
+      SU_TRYCATCH(graves_det_feed_gated(md, src, chunk), return SU_FALSE);
+    } else {
+      for (i = 0; i < chunk; ++i)
+        SU_TRYCATCH(graves_det_feed_mixed(md, src[i]), return SU_FALSE);
+    }
+
+    x   += chunk;
+    len -= chunk;
+  }
+
+  return SU_TRUE;
+}
+
+void
+graves_det_feed_front(
+    graves_det_t *md,
+    const SUCOMPLEX *x,
+    struct graves_det_sample *out,
+    SUSCOUNT len)
+{
+  SUCOMPLEX mixed[GRAVES_DET_MIX_BLOCK];
+  const SUCOMPLEX *src = x;
+  SUSCOUNT i, chunk;
+
+  while (len > 0) {
+    chunk = len < GRAVES_DET_MIX_BLOCK ? len : GRAVES_DET_MIX_BLOCK;
+
+    if (md->mix) {
+      graves_mixer_mix(&md->lo, x, mixed, chunk);
+      src = mixed;
+    } else {
+      src = x;
+    }
+
+    for (i = 0; i < chunk; ++i)
+      graves_det_front(md, src[i], out + i);
+
+    x   += chunk;
+    out += chunk;
+    len -= chunk;
+  }
+}
+
+SUBOOL
+graves_det_feed_back(
+    graves_det_t *md,
+    const struct graves_det_sample *s,
+    SUSCOUNT len)
+{
+  SUSCOUNT i;
+
+  for (i = 0; i < len; ++i)
+    SU_TRYCATCH(graves_det_back(md, s + i), return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+SUBOOL
+graves_det_prefault(graves_det_t *md, SUSCOUNT samples)
+{
+  SU_TRYCATCH(md->in_chirp == SU_FALSE, return SU_FALSE);
+
+  /* The next chirp gets the most recently released handle */
+  return graves_chirp_pool_reserve(md->pool, 1, samples + md->hist_len);
+}
+
+/****************************** State checkpoints *****************************/
+struct graves_det_state_header {
+  char     magic[8];
+  uint32_t version;
+  uint32_t sample_size;  /* sizeof(SUCOMPLEX) */
+  uint64_t fs;
+  SUFLOAT  fc;
+  SUFLOAT  lpf1;
+  SUFLOAT  lpf2;
+  SUFLOAT  threshold;
+  SUFLOAT  nf_window;
+  uint32_t adaptive;
+  uint64_t hist_size;
+  uint32_t estimator;
+  uint64_t est_size;
+  uint64_t nf_length;
+  SUFLOAT  gate;
+  uint64_t gate_size;
+  SUFLOAT  stop;
+  uint64_t holdoff;
+};
+
+struct graves_det_state_levels {
+  SUFLOAT  p_w;
+  SUFLOAT  p_n;
+  SUFLOAT  last_good_q;
+  SUFLOAT  energy_thres;
+  SUFLOAT  snr_thres;
+  SUFLOAT  stop_thres;
+  SUFLOAT  stop_snr_thres;
+  SUCOMPLEX lo;
+  SUDOUBLE energy;
+  uint64_t p;
+  uint64_t settle;
+  uint64_t survey;
+  uint64_t since_survey;
+};
+
+SUPRIVATE void
+graves_det_state_header_init(
+    const graves_det_t *md,
+    struct graves_det_state_header *header)
+{
+  memset(header, 0, sizeof(struct graves_det_state_header));
+
+  memcpy(header->magic, GRAVES_DET_STATE_MAGIC, sizeof(header->magic));
+  header->version     = GRAVES_DET_STATE_VERSION;
+  header->sample_size = sizeof(SUCOMPLEX);
+  header->fs          = md->params.fs;
+  header->fc          = md->params.fc;
+  header->lpf1        = md->params.lpf1;
+  header->lpf2        = md->params.lpf2;
+  header->threshold   = md->params.threshold;
+  header->nf_window   = md->params.nf_window;
+  header->adaptive    = md->nf != NULL;
+  header->hist_size   = md->hist_mask + 1;
+  header->estimator   = md->est.type;
+  header->est_size    = graves_est_state_size(&md->est);
+  header->nf_length   = md->nf != NULL ? md->nf->length : 0;
+  header->gate        = md->params.gate;
+  header->gate_size   =
+      md->gate != NULL ? graves_gate_state_size(md->gate) : 0;
+  header->stop        = md->params.stop;
+  header->holdoff     = md->holdoff;
+}
+
+/* The state is a fixed-size record for a given configuration */
+SUPRIVATE size_t
+graves_det_state_size(const graves_det_t *md)
+{
+  size_t hist_size = md->hist_mask + 1;
+  size_t size;
+
+  size  = sizeof(struct graves_det_state_header);
+  size += sizeof(struct graves_det_state_levels);
+  size += hist_size * (sizeof(SUCOMPLEX) + 3 * sizeof(SUFLOAT));
+  size += graves_est_state_size(&md->est);
+
+  if (md->nf != NULL)
+    size += graves_nf_state_size(md->nf);
+
+  if (md->gate != NULL)
+    size += graves_gate_state_size(md->gate);
+
+  return size;
+}
+
+SUPRIVATE SUBOOL
+graves_det_state_put(grow_buf_t *buf, const void *data, size_t size)
+{
+  return grow_buf_append(buf, data, size) != -1;
+}
+
+SUPRIVATE const uint8_t *
+graves_det_state_get(const uint8_t *src, void *data, size_t size)
+{
+  memcpy(data, src, size);
+  return src + size;
+}
+
+SUBOOL
+graves_det_save_state(const graves_det_t *md, grow_buf_t *buf)
+{
+  struct graves_det_state_header header;
+  struct graves_det_state_levels levels;
+  SUSCOUNT hist_size = md->hist_mask + 1;
+
+  /* Chirps being recorded are not part of the state */
+  if (md->in_chirp)
+    return SU_FALSE;
+
+  graves_det_state_header_init(md, &header);
+
+  memset(&levels, 0, sizeof(struct graves_det_state_levels));
+  levels.p_w          = md->p_w;
+  levels.p_n          = md->p_n;
+  levels.last_good_q  = md->last_good_q;
+  levels.energy_thres = md->energy_thres;
+  levels.snr_thres    = md->snr_thres;
+  levels.stop_thres   = md->stop_thres;
+  levels.stop_snr_thres = md->stop_snr_thres;
+  levels.lo           = graves_mixer_get_phasor(&md->lo);
+  levels.energy       = md->energy;
+  levels.p            = md->p;
+
+  /*
+   * The replay ring is not saved: if the full detector is behind, it will
+   * be restored as paused for long.
+   */
+  levels.settle = md->gate != NULL && md->fed != md->n
+      ? GRAVES_DET_GATE_WARMUP * md->hist_len
+      : md->settle;
+  levels.survey       = md->survey;
+  levels.since_survey = md->since_survey;
+
+  SU_TRYCATCH(
+      graves_det_state_put(buf, &header, sizeof(header)),
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_det_state_put(buf, &levels, sizeof(levels)),
+      return SU_FALSE);
+
+  SU_TRYCATCH(
+      graves_det_state_put(buf, md->samp_hist, hist_size * sizeof(SUCOMPLEX)),
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_det_state_put(buf, md->q_hist, hist_size * sizeof(SUFLOAT)),
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_det_state_put(buf, md->p_n_hist, hist_size * sizeof(SUFLOAT)),
+      return SU_FALSE);
+  SU_TRYCATCH(
+      graves_det_state_put(buf, md->p_w_hist, hist_size * sizeof(SUFLOAT)),
+      return SU_FALSE);
+
+  SU_TRYCATCH(graves_est_save_state(&md->est, buf), return SU_FALSE);
+
+  if (md->nf != NULL)
+    SU_TRYCATCH(graves_nf_save_state(md->nf, buf), return SU_FALSE);
+
+  if (md->gate != NULL)
+    SU_TRYCATCH(graves_gate_save_state(md->gate, buf), return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+SUBOOL
+graves_det_restore_state(graves_det_t *md, const void *data, size_t size)
+{
+  struct graves_det_state_header expected, header;
+  struct graves_det_state_levels levels;
+  SUSCOUNT hist_size = md->hist_mask + 1;
+  const uint8_t *src = (const uint8_t *) data;
+
+  SU_TRYCATCH(md->in_chirp == SU_FALSE, return SU_FALSE);
+
+  /* Everything is checked before touching the detector */
+  if (size != graves_det_state_size(md))
+    return SU_FALSE;
+
+  graves_det_state_header_init(md, &expected);
+  src = graves_det_state_get(src, &header, sizeof(header));
+  if (memcmp(&header, &expected, sizeof(header)) != 0)
+    return SU_FALSE;
+
+  src = graves_det_state_get(src, &levels, sizeof(levels));
+
+  src = graves_det_state_get(
+      src,
+      md->samp_hist,
+      hist_size * sizeof(SUCOMPLEX));
+  src = graves_det_state_get(src, md->q_hist, hist_size * sizeof(SUFLOAT));
+  src = graves_det_state_get(src, md->p_n_hist, hist_size * sizeof(SUFLOAT));
+  src = graves_det_state_get(src, md->p_w_hist, hist_size * sizeof(SUFLOAT));
+
+  graves_est_restore_state(&md->est, src);
+  src += graves_est_state_size(&md->est);
+
+  md->p_w          = levels.p_w;
+  md->p_n          = levels.p_n;
+  md->last_good_q  = levels.last_good_q;
+  md->energy_thres = levels.energy_thres;
+  md->snr_thres    = levels.snr_thres;
+  md->stop_thres   = levels.stop_thres;
+  md->stop_snr_thres = levels.stop_snr_thres;
+  md->energy       = levels.energy;
+  md->p            = (SUSCOUNT) levels.p;
+  md->settle       = (SUSCOUNT) levels.settle;
+  md->fresh        = md->settle > 0;
+  md->survey       = (SUSCOUNT) levels.survey;
+  md->since_survey = (SUSCOUNT) levels.since_survey;
+  graves_mixer_set_phasor(&md->lo, levels.lo);
+
+  /* Resume right where the restored state left it */
+  if (md->gate != NULL) {
+    md->n     = md->fed;
+    md->awake = SU_FALSE;
+  }
+
+  if (md->nf != NULL) {
+    graves_nf_restore_state(md->nf, src);
+    src += graves_nf_state_size(md->nf);
+  }
+
+  if (md->gate != NULL)
+    graves_gate_restore_state(md->gate, src);
+
+  return SU_TRUE;
+}
+
 void
 graves_det_set_center_freq(graves_det_t *md, SUFLOAT fc)
 {
-  su_ncqo_set_freq(
-        &md->lo,
-        SU_ABS2NORM_FREQ(md->params.fs, fc));
+  md->params.fc = fc;
+  md->mix = fc != 0;
+  graves_mixer_set_freq(&md->lo, SU_ABS2NORM_FREQ(md->params.fs, fc));
 }
 
 SUPRIVATE SUBOOL
@@ -236,6 +821,26 @@ graves_det_check_params(const struct graves_det_params *params)
     return SU_FALSE;
   }
 
+  if (params->gate < 0 || params->gate > 1) {
+    SU_ERROR("Gate level must be between 0 and 1\n");
+    return SU_FALSE;
+  }
+
+  if (params->stop < 0 || params->stop > 1) {
+    SU_ERROR("Stop level must be between 0 and 1\n");
+    return SU_FALSE;
+  }
+
+  if (params->holdoff < 0) {
+    SU_ERROR("Negative hold-off time\n");
+    return SU_FALSE;
+  }
+
+  if (params->adaptive && params->nf_window < MIN_CHIRP_DURATION) {
+    SU_ERROR("Noise floor window is too short\n");
+    return SU_FALSE;
+  }
+
   if (SU_ABS2NORM_FREQ(
         params->fs,
         params->lpf2) < GRAVES_MIN_LPF_CUTOFF) {
@@ -255,41 +860,74 @@ graves_det_new(
     void *privdata)
 {
   graves_det_t *new = NULL;
+  void *alloc = NULL;
+  SUSCOUNT hist_len, hist_size;
+  SUSCOUNT decim, window, replay_size, nf_length;
+  size_t offset;
 
   if (!graves_det_check_params(params))
     return NULL;
 
-  SU_TRYCATCH(new = calloc(1, sizeof (graves_det_t)), goto fail)
+  hist_len = (SUSCOUNT) (SU_CEIL(params->fs * MIN_CHIRP_DURATION));
+
+  hist_size = 1;
+  while (hist_size < hist_len)
+    hist_size <<= 1;
+
+  /* Detector first, then one plane per quantity, each on its own lines */
+  offset = GRAVES_ALIGN(sizeof(graves_det_t));
+  offset += GRAVES_ALIGN(hist_size * sizeof(SUCOMPLEX));
+  offset += 3 * GRAVES_ALIGN(hist_size * sizeof(SUFLOAT));
+
+  SU_TRYCATCH(
+      posix_memalign(&alloc, GRAVES_CACHE_LINE, offset) == 0,
+      goto fail);
+
+  memset(alloc, 0, offset);
+  new = (graves_det_t *) alloc;
+
+  offset = GRAVES_ALIGN(sizeof(graves_det_t));
+  new->samp_hist = (SUCOMPLEX *) ((uint8_t *) alloc + offset);
+  offset += GRAVES_ALIGN(hist_size * sizeof(SUCOMPLEX));
+  new->q_hist = (SUFLOAT *) ((uint8_t *) alloc + offset);
+  offset += GRAVES_ALIGN(hist_size * sizeof(SUFLOAT));
+  new->p_n_hist = (SUFLOAT *) ((uint8_t *) alloc + offset);
+  offset += GRAVES_ALIGN(hist_size * sizeof(SUFLOAT));
+  new->p_w_hist = (SUFLOAT *) ((uint8_t *) alloc + offset);
+
+  new->hist_len  = hist_len;
+  new->hist_mask = hist_size - 1;
 
   new->params = *params;
-  new->ratio  = params->lpf2 / params->lpf1;
   new->alpha = 1 - SU_EXP(-SU_ADDSFX(1.) / (params->fs * MIN_CHIRP_DURATION));
   new->on_chirp = chrp_fn;
   new->privdata = privdata;
 
-  su_ncqo_init(&new->lo, SU_ABS2NORM_FREQ(params->fs, params->fc));
+  if (params->pool != NULL)
+    new->pool = graves_chirp_pool_ref(params->pool);
+  else
+    SU_TRYCATCH(new->pool = graves_chirp_pool_new(), goto fail);
 
-  SU_TRYCATCH(
-      su_iir_bwlpf_init(
-          &new->lpf1,
-          4,
-          SU_ABS2NORM_FREQ(params->fs, params->lpf1)),
-      goto fail)
+  graves_mixer_init(&new->lo, SU_ABS2NORM_FREQ(params->fs, params->fc));
+  new->mix = params->fc != 0;
 
   SU_TRYCATCH(
-      su_iir_bwlpf_init(
-          &new->lpf2,
-          4,
+      graves_est_init(
+          &new->est,
+          params->estimator,
+          SU_ABS2NORM_FREQ(params->fs, params->lpf1),
           SU_ABS2NORM_FREQ(params->fs, params->lpf2)),
       goto fail)
 
+  new->ratio = new->est.ratio;
+
 # if 0
   int i = 0;
   SUCOMPLEX y1, y2;
   SUCOMPLEX e1, e2;
 
-  y1 = su_iir_filt_feed(&new->lpf1, 1);
-  y2 = su_iir_filt_feed(&new->lpf2, 1);
+  y1 = su_iir_filt_feed(&new->est.lpf1, 1);
+  y2 = su_iir_filt_feed(&new->est.lpf2, 1);
 
   e1 = SU_C_CONJ(y1) * y1;
   e2 = SU_C_CONJ(y2) * y2;
@@ -297,37 +935,91 @@ graves_det_new(
   for (i = 0; i < 1000; ++i) {
     printf("Ratio: %g, measured: %g\n", new->ratio, SU_C_REAL(e2 / e1));
 
-    y1 = su_iir_filt_feed(&new->lpf1, 0);
-    y2 = su_iir_filt_feed(&new->lpf2, 0);
+    y1 = su_iir_filt_feed(&new->est.lpf1, 0);
+    y2 = su_iir_filt_feed(&new->est.lpf2, 0);
 
     e1 += SU_C_CONJ(y1) * y1;
     e2 += SU_C_CONJ(y2) * y2;
   }
 #endif
 
-  new->hist_len = (SUSCOUNT) (SU_CEIL(params->fs * MIN_CHIRP_DURATION));
   new->energy_thres = params->threshold * new->ratio * new->hist_len;
+  new->snr_thres    = graves_det_q_to_snr(
+      new->ratio,
+      params->threshold * new->ratio);
+
+  /* Without hysteresis, both levels are the very same number */
+  if (params->stop > 0 && params->stop < 1) {
+    new->stop_snr_thres = params->stop * new->snr_thres;
+    new->stop_thres     = new->hist_len * graves_det_snr_to_q(
+        new->ratio,
+        new->stop_snr_thres);
+  } else {
+    new->stop_snr_thres = new->snr_thres;
+    new->stop_thres     = new->energy_thres;
+  }
 
-  SU_TRYCATCH(
-      new->q_hist   = calloc(sizeof(SUFLOAT), new->hist_len),
-      goto fail)
+  new->holdoff = (SUSCOUNT) SU_FLOOR(params->holdoff * params->fs + .5);
 
-  SU_TRYCATCH(
-      new->samp_hist = calloc(sizeof(SUCOMPLEX), new->hist_len),
-      goto fail)
+  if (params->adaptive) {
+    nf_length = (SUSCOUNT) SU_CEIL(params->nf_window / MIN_CHIRP_DURATION);
 
-  SU_TRYCATCH(
-      new->p_n_hist = calloc(sizeof(SUFLOAT), new->hist_len),
-      goto fail)
+    /* Behind the gate, the noise floor gets one block per survey */
+    if (params->gate > 0) {
+      nf_length /= GRAVES_DET_GATE_SURVEY;
+      if (nf_length < GRAVES_NF_MIN_BLOCKS)
+        nf_length = GRAVES_NF_MIN_BLOCKS;
+    }
+
+    SU_TRYCATCH(
+        new->nf = graves_nf_new(
+            new->ratio,
+            1,
+            SU_ADDSFX(.5),
+            new->hist_len,
+            nf_length),
+        goto fail);
+  }
+
+  /*
+   * The gate channel is about as wide as the narrow filter, so that the
+   * SNR it sees is the trigger SNR divided by the ratio. Its window spans
+   * the history window.
+   */
+  if (params->gate > 0) {
+    decim = (SUSCOUNT) SU_FLOOR(params->fs / (2 * params->lpf2) + .5);
+    if (decim < 1)
+      decim = 1;
+
+    window = (hist_len + decim - 1) / decim;
+
+    SU_TRYCATCH(
+        new->gate = graves_gate_new(
+            decim,
+            window,
+            1 + params->gate * new->snr_thres / new->ratio,
+            (SUSCOUNT) SU_CEIL(
+                params->nf_window * params->fs / (decim * window))),
+        goto fail);
+
+    /* Room for one more mixing block, which is caught up at its end */
+    new->replay_len =
+        (GRAVES_DET_GATE_WARMUP + GRAVES_DET_GATE_LATENCY) * hist_len;
+    replay_size = 1;
+    while (replay_size < new->replay_len + GRAVES_DET_MIX_BLOCK)
+      replay_size <<= 1;
+
+    new->replay_mask = replay_size - 1;
+    SU_TRYCATCH(
+        new->replay = malloc(replay_size * sizeof(SUCOMPLEX)),
+        goto fail);
+  }
 
-  SU_TRYCATCH(
-      new->p_w_hist = calloc(sizeof(SUFLOAT), new->hist_len),
-      goto fail)
   return new;
 
 fail:
   if (new != NULL)
     graves_det_destroy(new);
 
-  return new;
+  return NULL;
 }
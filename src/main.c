@@ -24,499 +24,9 @@
 
 #include <stdio.h>
 #include <clistones.h>
-#include <errno.h>
 #include <sigutils/sigutils.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <getopt.h>
 
-SUPRIVATE SUBOOL
-clistones_register_chirp(
-    clistones_t *self,
-    struct clistones_chirp_summary *summary,
-    struct timeval tv,
-    const struct graves_chirp_info *chirp)
-{
-  FILE *fp = NULL;
-  unsigned int i;
-  char *path = NULL;
-  SUFLOAT K, offset, snr, doppler;
-  SUFLOAT cum_doppler = 0;
-  SUFLOAT cum_snr = 0;
-  SUFLOAT max_snr = 0;
-  SUFLOAT val;
-  SUCOMPLEX prev = 0;
-  SUBOOL ok = SU_FALSE;
-
-  SU_TRYCATCH(
-      path = strbuild("%s/event_%06d.dat", self->directory, self->event_count),
-      goto done);
-
-  if ((fp = fopen(path, "wb")) == NULL) {
-    SU_ERROR("Failed to open `%s' for writing: %s\n", path, strerror(errno));
-    goto done;
-  }
-
-  /* Save data */
-  SU_TRYCATCH(
-      fprintf(fp, "EVENT_INDEX     =%15d", (int) self->event_count) > 0,
-      goto done);
-
-  SU_TRYCATCH(
-      fprintf(fp, "TIMESTAMP_SEC   =%15lu", tv.tv_sec) > 0,
-      goto done);
-
-  SU_TRYCATCH(
-      fprintf(fp, "TIMESTAMP_USEC  =%15lu", tv.tv_usec) > 0,
-      goto done);
-
-  SU_TRYCATCH(
-      fprintf(fp, "SAMPLE_RATE     =%15luu", self->det_params.fs) > 0,
-      goto done);
-
-  SU_TRYCATCH(
-      fprintf(fp, "CAPTURE_LEN     =%15d", chirp->length) > 0,
-      goto done);
-
-  SU_TRYCATCH(fprintf(fp, "DATA SECTION START              ") > 0, goto done);
-
-  /* Save I/Q block */
-  SU_TRYCATCH(
-      fwrite(chirp->x, chirp->length * sizeof(SUCOMPLEX), 1, fp) == 1,
-      goto done);
-
-  /* Save SNR block */
-  for (i = 0; i < chirp->length; ++i) {
-    val = graves_det_q_to_snr(
-            self->det_params.lpf2 / self->det_params.lpf1,
-            chirp->q[i]);
-    SU_TRYCATCH(fwrite(&val, sizeof(SUFLOAT), 1, fp) == 1, goto done);
-  }
-
-  /* Do some post processing on the chirp data */
-  K = self->det_params.fs * SU_ADDSFX(.25) * SPEED_OF_LIGHT /
-      (GRAVES_CENTER_FREQ * SU_ADDSFX(M_PI));
-
-  /* Save Doppler block */
-  max_snr = 0;
-  for (i = 0; i < chirp->length; ++i) {
-    offset = SU_C_ARG(chirp->x[i] * SU_C_CONJ(prev));
-    prev = chirp->x[i];
-    doppler = K * offset;
-
-    snr = graves_det_q_to_snr(
-            self->det_params.lpf2 / self->det_params.lpf1,
-            chirp->q[i]);
-    cum_snr += snr;
-    if (snr > max_snr)
-      max_snr = snr;
-
-    cum_doppler += doppler * snr;
-    SU_TRYCATCH(fwrite(&doppler, sizeof(SUFLOAT), 1, fp) == 1, goto done);
-  }
-
-  summary->index    = self->event_count;
-  summary->tv       = tv;
-  summary->duration = chirp->length / SU_ASFLOAT(self->det_params.fs);
-  summary->mean_snr = cum_snr / chirp->length;
-  summary->max_snr  = max_snr;
-  summary->mean_vel = cum_doppler / cum_snr;
-
-  summary->weak     = summary->max_snr < self->params.snr_threshold ||
-      summary->duration < self->params.duration_threshold;
-
-  if (summary->weak)
-    (void) unlink(path);
-
-  ok = SU_TRUE;
-
-done:
-  if (fp != NULL)
-    fclose(fp);
-
-  if (path != NULL)
-    free(path);
-
-  return ok;
-}
-
-void
-clistones_cancel(clistones_t *self)
-{
-  self->cancelled = SU_TRUE;
-}
-
-SUPRIVATE SUBOOL
-clistones_on_chirp(void *privdata, const struct graves_chirp_info *chirp)
-{
-  struct clistones_chirp_summary summary;
-  clistones_t *self = (clistones_t *) privdata;
-  SUBOOL ok = SU_FALSE;
-  SUFLOAT snr, delta_t;
-  unsigned int ticks, i;
-
-  struct timeval now, prev, sub;
-  struct tm *tm;
-
-  gettimeofday(&now, NULL);
-
-  SU_TRYCATCH(clistones_register_chirp(self, &summary, now, chirp), goto done);
-
-  /* We ignore weak chirps */
-  if (!summary.weak) {
-    tm = gmtime(&now.tv_sec);
-
-    printf(
-        "[%04d/%02d/%02d - %02d:%02d:%02d U] ",
-        tm->tm_year + 1900,
-        tm->tm_mon  + 1,
-        tm->tm_mday,
-        tm->tm_hour,
-        tm->tm_min,
-        tm->tm_sec);
-
-        snr = SU_POWER_DB(summary.mean_snr);
-
-        ticks = snr < 1 ? 1 : floor(snr);
-
-        printf(
-            "STONE EVENT %07d %6.2f s (%+6.2f m/s) SNR: %+6.2f dB (max %+6.2f dB) [",
-            self->event_count + 1,
-            summary.duration,
-            summary.mean_vel,
-            snr,
-            SU_POWER_DB(summary.max_snr));
-
-        if (ticks >= 10)
-          printf("\033[1;31m");
-        else if (ticks >= 5)
-          printf("\033[1;33m");
-        else
-          printf("\033[1;32m");
-
-        if (ticks >= 16)
-          ticks = 16;
-
-        for (i = 0; i < ticks; ++i)
-          putchar('|');
-
-        printf("\033[0m");
-
-        if (ticks == 16) {
-          --ticks;
-          putchar('+');
-        }
-
-        for (i = 0; i < 16 - ticks; ++i)
-          putchar(' ');
-        putchar(']');
-        printf("\n");
-
-    SU_TRYCATCH(
-        fprintf(
-            self->logfp,
-            "%d,%ld,%lu,%.10e,%.10e,%.10e,%.10e\n",
-            summary.index,
-            (long) summary.tv.tv_sec,
-            summary.tv.tv_usec,
-            summary.duration,
-            summary.mean_snr,
-            summary.max_snr,
-            summary.mean_vel) > 0,
-        goto done);
-
-    fflush(self->logfp);
-
-    ++self->event_count;
-
-    /* Show ZHR notice */
-    if (self->params.cycle_len > 0) {
-      if ((self->event_count % self->params.cycle_len) == 0) {
-        if (self->event_count > 0) {
-          timersub(&now, &self->first, &sub);
-
-          delta_t = (sub.tv_sec + 1e-6 * sub.tv_usec);
-          printf(
-              "[%04d/%02d/%02d - %02d:%02d:%02d U] ",
-              tm->tm_year + 1900,
-              tm->tm_mon  + 1,
-              tm->tm_mday,
-              tm->tm_hour,
-              tm->tm_min,
-              tm->tm_sec);
-          printf(
-              "ZHR report update: %g events / hour\n",
-              3600. * self->params.cycle_len / delta_t);
-        }
-
-        self->first = now;
-      }
-    }
-  }
-
-  ok = SU_TRUE;
-
-done:
-  return ok;
-}
-
-SUBOOL
-clistones_loop(clistones_t *self)
-{
-  int err;
-  unsigned int i;
-  SUBOOL ok = SU_FALSE;
-
-  while (!self->cancelled) {
-    /* Read samples from soundcard */
-    if ((err = snd_pcm_readi(self->pcm, self->buffer, CLISTONES_READ_SIZE))
-        != CLISTONES_READ_SIZE) {
-      SU_ERROR(
-          "Error %d while capturing samples: %s\n",
-          err,
-          snd_strerror (err));
-      goto done;
-    }
-
-    /* Forward them to meteorite detector */
-    for (i = 0; i < CLISTONES_READ_SIZE; ++i)
-      SU_TRYCATCH(
-          graves_det_feed(self->detector, self->buffer[i] / 65535.),
-          goto done);
-  }
-
-  ok = SU_TRUE;
-
-done:
-  self->cancelled = SU_TRUE;
-
-  return ok;
-}
-
-SUPRIVATE snd_pcm_t *
-clistones_open_audio(const struct clistones_params *params)
-{
-  int i, err;
-  unsigned int rate = CLISTONES_SAMP_RATE;
-  snd_pcm_t *capture_handle = NULL;
-  snd_pcm_hw_params_t *hw_params = NULL;
-  snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
-  SUBOOL ok = SU_FALSE;
-
-  if ((err = snd_pcm_open(
-      &capture_handle,
-      params->device,
-      SND_PCM_STREAM_CAPTURE,
-      0)) < 0) {
-    SU_ERROR(
-        "Cannot open audio device `%s' (%s)\n",
-        params->device,
-        snd_strerror(err));
-    goto done;
-  }
-
-  if ((err = snd_pcm_hw_params_malloc(&hw_params)) < 0) {
-    SU_ERROR(
-        "Cannot allocate hardware parameter structure (%s)\n",
-        snd_strerror(err));
-    goto done;
-  }
-
-  if ((err = snd_pcm_hw_params_any(capture_handle, hw_params)) < 0) {
-    SU_ERROR(
-        "Cannot initialize hardware parameter structure (%s)\n",
-        snd_strerror(err));
-    goto done;
-  }
-
-  if ((err = snd_pcm_hw_params_set_access(
-      capture_handle,
-      hw_params,
-      SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-    SU_ERROR("Cannot set access type (%s)\n", snd_strerror (err));
-    goto done;
-  }
-
-  if ((err = snd_pcm_hw_params_set_format(
-      capture_handle,
-      hw_params,
-      format)) < 0) {
-    SU_ERROR("Cannot set sample format (%s)\n", snd_strerror (err));
-    goto done;
-  }
-
-  if ((err = snd_pcm_hw_params_set_rate_near(
-      capture_handle,
-      hw_params,
-      &rate,
-      0)) < 0) {
-    SU_ERROR("Cannot set sample rate (%s)\n", snd_strerror (err));
-    goto done;
-  }
-
-  if (rate != CLISTONES_SAMP_RATE) {
-    SU_ERROR(
-        "Sample rate %d Hz not supported (offered %d instead)\n",
-        CLISTONES_SAMP_RATE,
-        rate);
-    goto done;
-  }
-
-  if ((err = snd_pcm_hw_params_set_channels(
-      capture_handle,
-      hw_params,
-      1)) < 0) {
-    SU_ERROR("Cannot set channel count (%s)\n", snd_strerror(err));
-    goto done;
-  }
-
-  if ((err = snd_pcm_hw_params(capture_handle, hw_params)) < 0) {
-    SU_ERROR("Cannot set parameters (%s)\n", snd_strerror(err));
-    goto done;
-  }
-
-  if ((err = snd_pcm_prepare (capture_handle)) < 0) {
-    SU_ERROR(
-        "Cannot prepare audio interface for use (%s)\n",
-        snd_strerror(err));
-    goto done;
-  }
-
-  ok = SU_TRUE;
-
-done:
-  if (hw_params != NULL)
-    snd_pcm_hw_params_free(hw_params);
-
-  if (!ok && capture_handle != NULL) {
-    snd_pcm_close(capture_handle);
-    capture_handle = NULL;
-  }
-
-  return capture_handle;
-}
-
-clistones_t *
-clistones_new(const struct clistones_params *params)
-{
-  struct graves_det_params det_params = graves_det_params_INITIALIZER;
-  char *default_directory = NULL;
-  const char *directory;
-  char *path = NULL;
-  clistones_t *new = NULL;
-  time_t t;
-  struct tm *tm;
-
-  /* Sanity checks */
-  if (SU_ABS(params->freq_offset) >= .5 * CLISTONES_SAMP_RATE) {
-    SU_ERROR("Frequency offset is outside the sampling bandwidth\n");
-    SU_ERROR(
-        "|%g| Hz >= %g Hz\n",
-        params->freq_offset,
-        .5 * CLISTONES_SAMP_RATE);
-    goto fail;
-  }
-
-  /* Allocate object */
-  SU_TRYCATCH(new = calloc(1, sizeof (clistones_t)), goto fail);
-  new->params = *params;
-
-  /* Initialize directory */
-  if (params->output_dir == NULL) {
-    time(&t);
-    tm = gmtime(&t);
-    SU_TRYCATCH(
-        new->directory = strbuild(
-            "clistones_%04d%02d%02d_%02d%02d%02d",
-            tm->tm_year + 1900,
-            tm->tm_mon + 1,
-            tm->tm_mday,
-            tm->tm_hour,
-            tm->tm_min,
-            tm->tm_sec),
-        goto fail);
-  } else {
-    SU_TRYCATCH(new->directory = strdup(params->output_dir), goto fail);
-  }
-
-  directory = new->directory;
-
-  if (strcmp(directory, ".") != 0 && access(directory, F_OK) == -1) {
-    if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
-      SU_ERROR(
-          "Failed to create output directory `%s': %s\n",
-          directory,
-          strerror(errno));
-      goto fail;
-    }
-  }
-
-  /* Initialize audio sample buffer */
-  SU_TRYCATCH(
-      new->buffer = malloc(sizeof(uint16_t) * CLISTONES_READ_SIZE),
-      goto fail);
-
-  /* Initialize echo detector */
-  det_params.fs   = CLISTONES_SAMP_RATE;
-  det_params.fc   = params->freq_offset;
-  new->det_params = det_params;
-
-  SU_TRYCATCH(
-      new->detector = graves_det_new(
-          &new->det_params,
-          clistones_on_chirp,
-          new),
-      goto fail);
-
-  /* Open audio capture device */
-  SU_TRYCATCH(new->pcm = clistones_open_audio(params), goto fail);
-
-  /* Open event log */
-  SU_TRYCATCH(path = strbuild("%s/events.csv", directory), goto fail);
-  if ((new->logfp = fopen(path, "w")) == NULL) {
-    SU_ERROR(
-        "Failed to create event log file `%s': %s\n",
-        path,
-        strerror(errno));
-    goto fail;
-  }
-
-  /* Set the current time and finish */
-  gettimeofday(&new->first, NULL);
-
-  return new;
-
-fail:
-  if (path != NULL)
-    free(path);
-
-  if (default_directory != NULL)
-    free(default_directory);
-
-  if (new != NULL)
-    clistones_destroy(new);
-
-  return NULL;
-}
-
-void
-clistones_destroy(clistones_t *self)
-{
-  if (self->pcm != NULL)
-    snd_pcm_close(self->pcm);
-
-  if (self->logfp != NULL)
-    fclose(self->logfp);
-
-  if (self->detector != NULL)
-    graves_det_destroy(self->detector);
-
-  if (self->buffer != NULL)
-    free(self->buffer);
-
-  free(self);
-}
-
 void
 help(const char *a0)
 {
@@ -524,26 +34,189 @@ help(const char *a0)
   fprintf(stderr, "  %s [OPTIONS]\n\n", a0);
   fprintf(stderr, "OPTIONS:\n");
   fprintf(stderr, "  -d, --device=DEV  Sets ALSA capture device to DEV\n");
+  fprintf(stderr, "  -i, --input=PATH  Read samples from a stream (- for stdin, or a\n");
+  fprintf(stderr, "                    named pipe) at %d sps instead of ALSA\n", CLISTONES_SAMP_RATE);
   fprintf(stderr, "  -o, --dir=DIR     Sets the output data directory to DIR\n");
   fprintf(stderr, "  -f, --shift=HZ    Sets the frequency shift to Hz (default is 1000 Hz)\n");
+  fprintf(stderr, "      --iq          Stereo input is complex baseband (I/Q). The\n");
+  fprintf(stderr, "                    shift may then be negative, or 0 for no mixing\n");
   fprintf(stderr, "  -s, --snr=SNR_DB  Sets the SNR threshold for detection (dB)\n");
   fprintf(stderr, "  -t, --duration=T  Sets the duration threshold in seconds\n");
-  fprintf(stderr, "  -Z, --zhr=EVENTS  Sets the ZHR report update interval\n\n");
+  fprintf(stderr, "  -Z, --zhr=EVENTS  Sets the ZHR report update interval\n");
+  fprintf(stderr, "  -a, --adaptive    Adapt the trigger threshold to the noise floor\n");
+  fprintf(stderr, "      --estimator=E Power estimator: iir (default) or boxcar\n");
+  fprintf(stderr, "                    (cheaper, but less selective)\n");
+  fprintf(stderr, "      --gate[=L]    Run the full detector only when a cheap first\n");
+  fprintf(stderr, "                    stage sees L times the threshold SNR (default %g)\n",
+      CLISTONES_DEFAULT_GATE);
+  fprintf(stderr, "      --stop=L      End chirps when the SNR falls below L times the\n");
+  fprintf(stderr, "                    trigger SNR (default 1, no hysteresis)\n");
+  fprintf(stderr, "      --holdoff=S   Gaps shorter than S seconds do not end a chirp\n");
+  fprintf(stderr, "                    (default 0)\n");
+  fprintf(stderr, "  -W, --waterfall   Use the STFT waterfall detector (separates\n");
+  fprintf(stderr, "                    echoes overlapping in time)\n");
+  fprintf(stderr, "  -R, --rt          Realtime mode: separate capture and detector\n");
+  fprintf(stderr, "                    threads with SCHED_FIFO, locked memory\n");
+  fprintf(stderr, "  -H, --headless    No console output at all\n");
+  fprintf(stderr, "      --input-format=F   Sample format: s16, s32 or f32. Streams are s16\n");
+  fprintf(stderr, "                         by default, sound cards the widest available\n");
+  fprintf(stderr, "      --stall-timeout=S  Report input stalls after S seconds (default 5)\n");
+  fprintf(stderr, "      --capture-prio=P   SCHED_FIFO priority of the capture thread\n");
+  fprintf(stderr, "      --detector-prio=P  SCHED_FIFO priority of the detector thread\n");
+  fprintf(stderr, "      --capture-cpu=N    Pin the capture thread to CPU N\n");
+  fprintf(stderr, "      --detector-cpu=N   Pin the detector thread to CPU N\n");
+  fprintf(stderr, "      --no-mlock         Do not lock process memory in realtime mode\n");
+  fprintf(stderr, "      --feed=NAME        Publish events and power levels in the shared\n");
+  fprintf(stderr, "                         memory object NAME (e.g. /clistones)\n");
+  fprintf(stderr, "      --feed-decim=N     Publish power levels every N samples (default %d)\n",
+      CLISTONES_FEED_DEFAULT_DECIM);
+  fprintf(stderr, "      --record           Continuously record raw samples to DIR/raw\n");
+  fprintf(stderr, "      --record-segment=MB    Size of each raw segment file (default 64)\n");
+  fprintf(stderr, "      --record-keep-hours=H  Delete raw segments older than H hours\n");
+  fprintf(stderr, "      --record-keep-gb=G     Keep at most G GiB of raw segments\n");
+  fprintf(stderr, "      --record-direct        Write raw segments with O_DIRECT\n");
+  fprintf(stderr, "      --compact          Leave SNR and Doppler out of event files (the\n");
+  fprintf(stderr, "                         evfile reader derives them from I/Q and q)\n");
+  fprintf(stderr, "      --output-backend=B Event output backend: auto, threads or uring\n");
+  fprintf(stderr, "      --stats-interval=S Rewrite DIR/summary.txt every S seconds\n");
+  fprintf(stderr, "                         (default 60, 0 disables it)\n");
+  fprintf(stderr, "      --checkpoint=FILE  Save the detector state to FILE and restore\n");
+  fprintf(stderr, "                         it on startup if the settings match\n");
+  fprintf(stderr, "      --checkpoint-interval=S  Save the state every S seconds\n");
+  fprintf(stderr, "                         (default 60)\n\n");
   fprintf(stderr, "  -h, --help        This help\n");
 }
 
+enum {
+  OPT_CAPTURE_PRIO = 256,
+  OPT_DETECTOR_PRIO,
+  OPT_CAPTURE_CPU,
+  OPT_DETECTOR_CPU,
+  OPT_NO_MLOCK,
+  OPT_FEED,
+  OPT_FEED_DECIM,
+  OPT_RECORD,
+  OPT_RECORD_SEGMENT,
+  OPT_RECORD_KEEP_HOURS,
+  OPT_RECORD_KEEP_GB,
+  OPT_RECORD_DIRECT,
+  OPT_OUTPUT_BACKEND,
+  OPT_STATS_INTERVAL,
+  OPT_INPUT_FORMAT,
+  OPT_STALL_TIMEOUT,
+  OPT_IQ,
+  OPT_CHECKPOINT,
+  OPT_CHECKPOINT_INTERVAL,
+  OPT_ESTIMATOR,
+  OPT_GATE,
+  OPT_COMPACT,
+  OPT_STOP,
+  OPT_HOLDOFF
+};
+
 static struct option long_options[] =
 {
   {"device",   required_argument, 0, 'd'},
+  {"input",    required_argument, 0, 'i'},
   {"dir",      required_argument, 0, 'o'},
   {"shift",    required_argument, 0, 'f'},
   {"snr",      required_argument, 0, 's'},
   {"duration", required_argument, 0, 't'},
   {"zhr",      required_argument, 0, 'Z'},
+  {"waterfall", no_argument,      0, 'W'},
+  {"adaptive", no_argument,       0, 'a'},
+  {"rt",       no_argument,       0, 'R'},
+  {"headless", no_argument,       0, 'H'},
+  {"capture-prio",  required_argument, 0, OPT_CAPTURE_PRIO},
+  {"detector-prio", required_argument, 0, OPT_DETECTOR_PRIO},
+  {"capture-cpu",   required_argument, 0, OPT_CAPTURE_CPU},
+  {"detector-cpu",  required_argument, 0, OPT_DETECTOR_CPU},
+  {"no-mlock",      no_argument,       0, OPT_NO_MLOCK},
+  {"feed",          required_argument, 0, OPT_FEED},
+  {"feed-decim",    required_argument, 0, OPT_FEED_DECIM},
+  {"record",        no_argument,       0, OPT_RECORD},
+  {"record-segment", required_argument, 0, OPT_RECORD_SEGMENT},
+  {"record-keep-hours", required_argument, 0, OPT_RECORD_KEEP_HOURS},
+  {"record-keep-gb", required_argument, 0, OPT_RECORD_KEEP_GB},
+  {"record-direct", no_argument,       0, OPT_RECORD_DIRECT},
+  {"output-backend", required_argument, 0, OPT_OUTPUT_BACKEND},
+  {"stats-interval", required_argument, 0, OPT_STATS_INTERVAL},
+  {"input-format",  required_argument, 0, OPT_INPUT_FORMAT},
+  {"stall-timeout", required_argument, 0, OPT_STALL_TIMEOUT},
+  {"iq",            no_argument,       0, OPT_IQ},
+  {"checkpoint",    required_argument, 0, OPT_CHECKPOINT},
+  {"checkpoint-interval", required_argument, 0, OPT_CHECKPOINT_INTERVAL},
+  {"estimator",     required_argument, 0, OPT_ESTIMATOR},
+  {"gate",          optional_argument, 0, OPT_GATE},
+  {"compact",       no_argument,       0, OPT_COMPACT},
+  {"stop",          required_argument, 0, OPT_STOP},
+  {"holdoff",       required_argument, 0, OPT_HOLDOFF},
   {"help",     no_argument, 0, 'h'},
   {0, 0, 0, 0}
 };
 
+SUPRIVATE void
+clistones_print_banner(const clistones_t *self)
+{
+  char source[256];
+
+  printf(
+      "Welcome to...\n"
+      "   _____ _ _  _____ _                        \n"
+      "  / ____| (_)/ ____| |                       \n"
+      " | |    | |_| (___ | |_ ___  _ __   ___  ___ \n"
+      " | |    | | |\\___ \\| __/ _ \\| '_ \\ / _ \\/ __|\n"
+      " | |____| | |____) | || (_) | | | |  __/\\__ \\\n"
+      "  \\_____|_|_|_____/ \\__\\___/|_| |_|\\___||___/\n"
+      "                                             \n"
+      "      The automatic meteor echo detector\n");
+  printf("\n");
+  printf("Brought to you with love and kindness by Gonzalo J. Carracedo\n\n");
+  clistones_source_describe(self->source, source, sizeof(source));
+  printf("  Listening samples from %s\n", source);
+  printf("  Data directory:  %s\n", clistones_data_directory(self));
+  printf("  Frequency shift: %g Hz\n", self->params.freq_offset);
+  printf("  SNR threshold:   %g dB\n", SU_POWER_DB(self->params.snr_threshold));
+  printf("  Min duration:    %g seconds\n", self->params.duration_threshold);
+  printf(
+      "  Detector:        %s\n",
+      self->params.waterfall ? "STFT waterfall" : "power ratio");
+  if (self->params.adaptive && !self->params.waterfall)
+    printf("  Adaptive trigger threshold enabled\n");
+  if (!self->params.waterfall)
+    printf(
+        "  Power estimator: %s\n",
+        graves_est_type_name(self->params.estimator));
+  if (self->params.gate > 0 && !self->params.waterfall)
+    printf("  Trigger gate:    %g x threshold SNR\n", self->params.gate);
+  if ((self->params.stop > 0 || self->params.holdoff > 0)
+      && !self->params.waterfall)
+    printf(
+        "  Chirp end:       %g x trigger SNR, %g s hold-off\n",
+        self->params.stop > 0 ? self->params.stop : 1,
+        self->params.holdoff);
+  if (self->params.compact_events && !self->params.waterfall)
+    printf("  Compact event files (I/Q and q only)\n");
+  if (self->params.realtime)
+    printf("  Realtime mode enabled\n");
+  if (self->params.feed_name != NULL)
+    printf("  Live feed:       %s\n", self->params.feed_name);
+  printf(
+      "  Output backend:  %s\n",
+      clistones_writer_get_backend_name(self->writer));
+  if (self->params.record)
+    printf(
+        "  Raw capture:     %s/raw (%u MiB segments)\n",
+        clistones_data_directory(self),
+        (unsigned int) (self->params.record_segment_size >> 20));
+  if (self->params.cycle_len != 0)
+    printf("  ZHR report update every %d events\n", self->params.cycle_len);
+  else
+    printf("  ZHR reports disabled\n");
+
+  printf("\n");
+}
+
 int
 main(int argc, char **argv, char **envp)
 {
@@ -551,6 +224,8 @@ main(int argc, char **argv, char **envp)
   struct clistones_params params = clistones_params_INITIALIZER;
   int ret = EXIT_FAILURE;
   int option_index = 0;
+  unsigned int megs;
+  SUFLOAT gigs;
   int c;
 
   if (!su_lib_init()) {
@@ -559,7 +234,7 @@ main(int argc, char **argv, char **envp)
   }
 
   for (;;) {
-    c = getopt_long(argc, argv, "d:o:f:s:t:Z:h", long_options, &option_index);
+    c = getopt_long(argc, argv, "d:i:o:f:s:t:Z:WaRHh", long_options, &option_index);
 
     if (c == -1)
       break;
@@ -569,6 +244,10 @@ main(int argc, char **argv, char **envp)
         params.device = optarg;
         break;
 
+      case 'i':
+        params.input = optarg;
+        break;
+
       case 'o':
         params.output_dir = optarg;
         break;
@@ -607,6 +286,204 @@ main(int argc, char **argv, char **envp)
         }
         break;
 
+      case 'W':
+        params.waterfall = SU_TRUE;
+        break;
+
+      case 'a':
+        params.adaptive = SU_TRUE;
+        break;
+
+      case 'R':
+        params.realtime = SU_TRUE;
+        break;
+
+      case 'H':
+        params.headless = SU_TRUE;
+        break;
+
+      case OPT_CAPTURE_PRIO:
+        if (sscanf(optarg, "%d", &params.rt.capture_prio) < 1) {
+          fprintf(stderr, "%s: invalid capture priority\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_DETECTOR_PRIO:
+        if (sscanf(optarg, "%d", &params.rt.detector_prio) < 1) {
+          fprintf(stderr, "%s: invalid detector priority\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_CAPTURE_CPU:
+        if (sscanf(optarg, "%d", &params.rt.capture_cpu) < 1) {
+          fprintf(stderr, "%s: invalid capture CPU\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_DETECTOR_CPU:
+        if (sscanf(optarg, "%d", &params.rt.detector_cpu) < 1) {
+          fprintf(stderr, "%s: invalid detector CPU\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_NO_MLOCK:
+        params.rt.lock_memory = SU_FALSE;
+        break;
+
+      case OPT_FEED:
+        params.feed_name = optarg;
+        break;
+
+      case OPT_FEED_DECIM:
+        if (sscanf(optarg, "%u", &params.feed_decim) < 1) {
+          fprintf(stderr, "%s: invalid feed decimation\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_RECORD:
+        params.record = SU_TRUE;
+        break;
+
+      case OPT_RECORD_SEGMENT:
+        if (sscanf(optarg, "%u", &megs) < 1 || megs == 0) {
+          fprintf(stderr, "%s: invalid segment size\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        params.record_segment_size = (uint64_t) megs << 20;
+        break;
+
+      case OPT_RECORD_KEEP_HOURS:
+        if (sscanf(optarg, "%g", &params.record_keep_hours) < 1) {
+          fprintf(stderr, "%s: invalid retention time\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_RECORD_KEEP_GB:
+        if (sscanf(optarg, "%g", &gigs) < 1 || gigs < 0) {
+          fprintf(stderr, "%s: invalid retention size\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        params.record_keep_bytes = (uint64_t) (gigs * (1ull << 30));
+        break;
+
+      case OPT_RECORD_DIRECT:
+        params.record_direct = SU_TRUE;
+        break;
+
+      case OPT_OUTPUT_BACKEND:
+        if (strcmp(optarg, "auto") == 0) {
+          params.output_backend = CLISTONES_WRITER_BACKEND_AUTO;
+        } else if (strcmp(optarg, "threads") == 0) {
+          params.output_backend = CLISTONES_WRITER_BACKEND_THREADS;
+        } else if (strcmp(optarg, "uring") == 0) {
+          params.output_backend = CLISTONES_WRITER_BACKEND_URING;
+        } else {
+          fprintf(stderr, "%s: invalid output backend\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_STATS_INTERVAL:
+        if (sscanf(optarg, "%u", &params.stats_interval) < 1) {
+          fprintf(stderr, "%s: invalid statistics interval\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_INPUT_FORMAT:
+        if (clistones_sample_format_parse(optarg, &params.input_format)) {
+          params.input_format_set = SU_TRUE;
+        } else {
+          fprintf(stderr, "%s: invalid input format\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_STALL_TIMEOUT:
+        if (sscanf(optarg, "%g", &params.stall_timeout) < 1
+            || params.stall_timeout <= 0) {
+          fprintf(stderr, "%s: invalid stall timeout\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_IQ:
+        params.iq = SU_TRUE;
+        break;
+
+      case OPT_CHECKPOINT:
+        params.checkpoint = optarg;
+        break;
+
+      case OPT_ESTIMATOR:
+        if (!graves_est_type_from_name(optarg, &params.estimator)) {
+          fprintf(stderr, "%s: invalid power estimator\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_STOP:
+        if (sscanf(optarg, "%g", &params.stop) < 1
+            || params.stop <= 0
+            || params.stop > 1) {
+          fprintf(stderr, "%s: invalid stop level\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_HOLDOFF:
+        if (sscanf(optarg, "%g", &params.holdoff) < 1 || params.holdoff < 0) {
+          fprintf(stderr, "%s: invalid hold-off time\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_COMPACT:
+        params.compact_events = SU_TRUE;
+        break;
+
+      case OPT_GATE:
+        params.gate = CLISTONES_DEFAULT_GATE;
+        if (optarg != NULL
+            && (sscanf(optarg, "%g", &params.gate) < 1
+                || params.gate <= 0
+                || params.gate > 1)) {
+          fprintf(stderr, "%s: invalid gate level\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
+      case OPT_CHECKPOINT_INTERVAL:
+        if (sscanf(optarg, "%u", &params.checkpoint_interval) < 1
+            || params.checkpoint_interval == 0) {
+          fprintf(stderr, "%s: invalid checkpoint interval\n\n", argv[0]);
+          help(argv[0]);
+          goto done;
+        }
+        break;
+
       case 'h':
         help(argv[0]);
         ret = EXIT_SUCCESS;
@@ -627,29 +504,8 @@ main(int argc, char **argv, char **envp)
     goto done;
   }
 
-  printf(
-      "Welcome to...\n"
-      "   _____ _ _  _____ _                        \n"
-      "  / ____| (_)/ ____| |                       \n"
-      " | |    | |_| (___ | |_ ___  _ __   ___  ___ \n"
-      " | |    | | |\\___ \\| __/ _ \\| '_ \\ / _ \\/ __|\n"
-      " | |____| | |____) | || (_) | | | |  __/\\__ \\\n"
-      "  \\_____|_|_|_____/ \\__\\___/|_| |_|\\___||___/\n"
-      "                                             \n"
-      "      The automatic meteor echo detector\n");
-  printf("\n");
-  printf("Brought to you with love and kindness by Gonzalo J. Carracedo\n\n");
-  printf("  Listening samples from audio device \"%s\"\n", params.device);
-  printf("  Data directory:  %s\n", clistones_data_directory(clistones));
-  printf("  Frequency shift: %g Hz\n", params.freq_offset);
-  printf("  SNR threshold:   %g dB\n", SU_POWER_DB(params.snr_threshold));
-  printf("  Min duration:    %g seconds\n", params.duration_threshold);
-  if (params.cycle_len != 0)
-    printf("  ZHR report update every %d events\n", params.cycle_len);
-  else
-    printf("  ZHR reports disabled\n");
-
-  printf("\n");
+  if (!params.headless)
+    clistones_print_banner(clistones);
 
   SU_TRYCATCH(clistones_loop(clistones), goto done);
 
@@ -0,0 +1,120 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <string.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <mixer.h>
+
+void
+graves_mixer_mix(
+    graves_mixer_t *mixer,
+    const SUCOMPLEX *x,
+    SUCOMPLEX *y,
+    SUSCOUNT len)
+{
+  /* Complex numbers are laid out as two reals */
+  const SUFLOAT *in = (const SUFLOAT *) x;
+  SUFLOAT *out = (SUFLOAT *) y;
+  SUFLOAT lr[GRAVES_MIXER_LANES], li[GRAVES_MIXER_LANES];
+  SUFLOAT sr = SU_C_REAL(mixer->lane_step);
+  SUFLOAT si = SU_C_IMAG(mixer->lane_step);
+  SUFLOAT xr, xi, t, g;
+  SUCOMPLEX p = mixer->phasor;
+  SUSCOUNT i = 0;
+  unsigned int l, steps = 0;
+
+  if (len >= GRAVES_MIXER_LANES) {
+    for (l = 0; l < GRAVES_MIXER_LANES; ++l) {
+      lr[l] = SU_C_REAL(p * mixer->powers[l]);
+      li[l] = SU_C_IMAG(p * mixer->powers[l]);
+    }
+
+    for (; i + GRAVES_MIXER_LANES <= len; i += GRAVES_MIXER_LANES) {
+      for (l = 0; l < GRAVES_MIXER_LANES; ++l) {
+        xr = in[2 * (i + l)];
+        xi = in[2 * (i + l) + 1];
+        out[2 * (i + l)]     = xr * lr[l] - xi * li[l];
+        out[2 * (i + l) + 1] = xr * li[l] + xi * lr[l];
+      }
+
+      for (l = 0; l < GRAVES_MIXER_LANES; ++l) {
+        t     = lr[l] * sr - li[l] * si;
+        li[l] = lr[l] * si + li[l] * sr;
+        lr[l] = t;
+      }
+
+      if (++steps == GRAVES_MIXER_RENORM) {
+        steps = 0;
+        for (l = 0; l < GRAVES_MIXER_LANES; ++l) {
+          g = SU_ADDSFX(.5) * (3 - (lr[l] * lr[l] + li[l] * li[l]));
+          lr[l] *= g;
+          li[l] *= g;
+        }
+      }
+    }
+
+    /* Lane 0 is where the remaining samples start */
+    p = lr[0] + SU_I * li[0];
+  }
+
+  mixer->phasor = p;
+  for (; i < len; ++i)
+    y[i] = graves_mixer_mix_one(mixer, x[i]);
+
+  mixer->phasor = graves_mixer_renorm(mixer->phasor);
+}
+
+void
+graves_mixer_set_freq(graves_mixer_t *mixer, SUFLOAT fnor)
+{
+  SUFLOAT omega = -SU_NORM2ANG_FREQ(fnor);
+  unsigned int l;
+
+  mixer->fnor = fnor;
+  mixer->step = SU_COS(omega) + SU_I * SU_SIN(omega);
+
+  /* Powers are computed directly, not by repeated multiplication */
+  for (l = 0; l < GRAVES_MIXER_LANES; ++l)
+    mixer->powers[l] = SU_COS(l * omega) + SU_I * SU_SIN(l * omega);
+
+  mixer->lane_step =
+      SU_COS(GRAVES_MIXER_LANES * omega)
+      + SU_I * SU_SIN(GRAVES_MIXER_LANES * omega);
+}
+
+void
+graves_mixer_set_phasor(graves_mixer_t *mixer, SUCOMPLEX phasor)
+{
+  mixer->phasor = graves_mixer_renorm(phasor);
+  mixer->count  = 0;
+}
+
+void
+graves_mixer_init(graves_mixer_t *mixer, SUFLOAT fnor)
+{
+  memset(mixer, 0, sizeof(graves_mixer_t));
+
+  mixer->phasor = 1;
+  graves_mixer_set_freq(mixer, fnor);
+}
@@ -0,0 +1,223 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <noisefloor.h>
+
+struct graves_nf_state {
+  SUFLOAT  acc;
+  SUFLOAT  estimate;
+  uint64_t acc_count;
+  uint64_t p;
+  uint64_t count;
+  uint64_t below;
+  uint32_t cursor;
+};
+
+SUINLINE unsigned int
+graves_nf_to_bin(const graves_nf_t *nf, SUFLOAT value)
+{
+  SUFLOAT bin =
+      (value - nf->min) / (nf->max - nf->min) * GRAVES_NF_BINS;
+
+  if (bin < 0)
+    return 0;
+  else if (bin >= GRAVES_NF_BINS)
+    return GRAVES_NF_BINS - 1;
+
+  return (unsigned int) bin;
+}
+
+/* Move the cursor until it points to the bin holding the target rank */
+SUPRIVATE void
+graves_nf_update_cursor(graves_nf_t *nf)
+{
+  SUSCOUNT rank = (SUSCOUNT) (nf->quantile * (nf->count - 1));
+  SUFLOAT  frac;
+
+  while (nf->cursor > 0 && nf->below > rank) {
+    --nf->cursor;
+    nf->below -= nf->hist[nf->cursor];
+  }
+
+  while (nf->cursor < GRAVES_NF_BINS - 1
+      && nf->below + nf->hist[nf->cursor] <= rank) {
+    nf->below += nf->hist[nf->cursor];
+    ++nf->cursor;
+  }
+
+  /* Interpolate inside the bin */
+  frac = nf->hist[nf->cursor] > 0
+      ? (rank - nf->below + SU_ADDSFX(.5)) / nf->hist[nf->cursor]
+      : SU_ADDSFX(.5);
+
+  nf->estimate = nf->min
+      + (nf->cursor + frac) * (nf->max - nf->min) / GRAVES_NF_BINS;
+}
+
+void
+graves_nf_push_block(graves_nf_t *nf, SUFLOAT value)
+{
+  unsigned int bin = graves_nf_to_bin(nf, value);
+  unsigned int old;
+
+  if (nf->count == nf->length) {
+    /* Window full: forget the oldest block */
+    old = nf->ring[nf->p];
+    --nf->hist[old];
+    if (old < nf->cursor)
+      --nf->below;
+  } else {
+    ++nf->count;
+  }
+
+  nf->ring[nf->p] = (uint16_t) bin;
+  ++nf->hist[bin];
+  if (bin < nf->cursor)
+    ++nf->below;
+
+  if (++nf->p == nf->length)
+    nf->p = 0;
+
+  graves_nf_update_cursor(nf);
+}
+
+void
+graves_nf_reset(graves_nf_t *nf)
+{
+  memset(nf->hist, 0, sizeof(nf->hist));
+
+  nf->acc       = 0;
+  nf->acc_count = 0;
+  nf->p         = 0;
+  nf->count     = 0;
+  nf->cursor    = 0;
+  nf->below     = 0;
+  nf->estimate  = nf->min;
+}
+
+size_t
+graves_nf_state_size(const graves_nf_t *nf)
+{
+  return sizeof(struct graves_nf_state)
+      + nf->length * sizeof(uint16_t)
+      + sizeof(nf->hist);
+}
+
+SUBOOL
+graves_nf_save_state(const graves_nf_t *nf, grow_buf_t *buf)
+{
+  struct graves_nf_state state;
+
+  memset(&state, 0, sizeof(struct graves_nf_state));
+  state.acc       = nf->acc;
+  state.estimate  = nf->estimate;
+  state.acc_count = nf->acc_count;
+  state.p         = nf->p;
+  state.count     = nf->count;
+  state.below     = nf->below;
+  state.cursor    = nf->cursor;
+
+  SU_TRYCATCH(
+      grow_buf_append(buf, &state, sizeof(state)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(
+      grow_buf_append(buf, nf->ring, nf->length * sizeof(uint16_t)) != -1,
+      return SU_FALSE);
+  SU_TRYCATCH(
+      grow_buf_append(buf, nf->hist, sizeof(nf->hist)) != -1,
+      return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+void
+graves_nf_restore_state(graves_nf_t *nf, const void *data)
+{
+  struct graves_nf_state state;
+  const uint8_t *src = (const uint8_t *) data;
+
+  memcpy(&state, src, sizeof(state));
+  src += sizeof(state);
+  memcpy(nf->ring, src, nf->length * sizeof(uint16_t));
+  src += nf->length * sizeof(uint16_t);
+  memcpy(nf->hist, src, sizeof(nf->hist));
+
+  nf->acc       = state.acc;
+  nf->estimate  = state.estimate;
+  nf->acc_count = (SUSCOUNT) state.acc_count;
+  nf->p         = (SUSCOUNT) state.p;
+  nf->count     = (SUSCOUNT) state.count;
+  nf->below     = (SUSCOUNT) state.below;
+  nf->cursor    = state.cursor;
+}
+
+void
+graves_nf_destroy(graves_nf_t *nf)
+{
+  if (nf->ring != NULL)
+    free(nf->ring);
+
+  free(nf);
+}
+
+graves_nf_t *
+graves_nf_new(
+    SUFLOAT min,
+    SUFLOAT max,
+    SUFLOAT quantile,
+    SUSCOUNT decim,
+    SUSCOUNT length)
+{
+  graves_nf_t *new = NULL;
+
+  if (min >= max || quantile < 0 || quantile > 1 || decim == 0 || length == 0) {
+    SU_ERROR("Invalid noise floor estimator parameters\n");
+    return NULL;
+  }
+
+  SU_TRYCATCH(new = calloc(1, sizeof (graves_nf_t)), goto fail);
+
+  new->min      = min;
+  new->max      = max;
+  new->quantile = quantile;
+  new->decim    = decim;
+  new->length   = length;
+
+  SU_TRYCATCH(new->ring = calloc(sizeof(uint16_t), length), goto fail);
+
+  graves_nf_reset(new);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    graves_nf_destroy(new);
+
+  return NULL;
+}
@@ -0,0 +1,437 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <recorder.h>
+
+/************************** Capture side *************************************/
+void
+clistones_recorder_push_slow(
+    clistones_recorder_t *rec,
+    const void *data,
+    size_t frames)
+{
+  const uint8_t *bytes = (const uint8_t *) data;
+  size_t size = frames * rec->params.frame_size;
+  size_t avail;
+
+  while (size > 0) {
+    if (rec->current == NULL) {
+      if ((rec->current = clistones_ring_acquire_write(rec->ring)) == NULL) {
+        /* Writer is behind. Keep counting so that the index shows the gap */
+        rec->dropped += size / rec->params.frame_size;
+        rec->samples += size / rec->params.frame_size;
+        return;
+      }
+
+      rec->current_data = rec->pool
+          + clistones_ring_slot_index(rec->ring, rec->current)
+            * rec->params.chunk_size;
+      rec->current->first_sample = rec->samples;
+      rec->current->used = 0;
+      gettimeofday(&rec->current->tv, NULL);
+    }
+
+    avail = rec->params.chunk_size - rec->current->used;
+    if (avail > size)
+      avail = size;
+
+    memcpy(rec->current_data + rec->current->used, bytes, avail);
+    rec->current->used += avail;
+    rec->samples       += avail / rec->params.frame_size;
+    bytes              += avail;
+    size               -= avail;
+
+    if (rec->current->used == rec->params.chunk_size) {
+      clistones_ring_commit_write(rec->ring);
+      sem_post(&rec->avail);
+      rec->current = NULL;
+    }
+  }
+}
+
+/************************** Writer side **************************************/
+SUPRIVATE char *
+clistones_recorder_segment_path(
+    const clistones_recorder_t *rec,
+    unsigned int index,
+    const char *ext)
+{
+  return strbuild("%s/raw_%06u.%s", rec->directory, index, ext);
+}
+
+SUPRIVATE void
+clistones_recorder_remove_segment(
+    clistones_recorder_t *rec,
+    const struct clistones_recorder_segment *seg)
+{
+  char *path;
+
+  if ((path = clistones_recorder_segment_path(rec, seg->index, "bin")) != NULL) {
+    (void) unlink(path);
+    free(path);
+  }
+
+  if ((path = clistones_recorder_segment_path(rec, seg->index, "idx")) != NULL) {
+    (void) unlink(path);
+    free(path);
+  }
+
+  rec->total_bytes -= seg->size;
+}
+
+SUPRIVATE void
+clistones_recorder_apply_retention(clistones_recorder_t *rec)
+{
+  time_t now = time(NULL);
+  unsigned int expired = 0;
+  const struct clistones_recorder_segment *oldest;
+
+  while (expired < rec->segment_count) {
+    oldest = rec->segments + expired;
+
+    if (rec->params.keep_bytes > 0
+        && rec->total_bytes > rec->params.keep_bytes) {
+      clistones_recorder_remove_segment(rec, oldest);
+    } else if (rec->params.keep_hours > 0
+        && now - oldest->closed > rec->params.keep_hours * 3600) {
+      clistones_recorder_remove_segment(rec, oldest);
+    } else {
+      break;
+    }
+
+    ++expired;
+  }
+
+  if (expired > 0) {
+    rec->segment_count -= expired;
+    memmove(
+        rec->segments,
+        rec->segments + expired,
+        rec->segment_count * sizeof(struct clistones_recorder_segment));
+  }
+}
+
+SUPRIVATE SUBOOL
+clistones_recorder_close_segment(clistones_recorder_t *rec)
+{
+  struct clistones_recorder_segment *tmp;
+  unsigned int alloc;
+
+  if (rec->fd == -1)
+    return SU_TRUE;
+
+  close(rec->fd);
+  rec->fd = -1;
+
+  if (rec->index_fp != NULL) {
+    fclose(rec->index_fp);
+    rec->index_fp = NULL;
+  }
+
+  if (rec->segment_count == rec->segment_alloc) {
+    alloc = rec->segment_alloc == 0 ? 16 : 2 * rec->segment_alloc;
+    SU_TRYCATCH(
+        tmp = realloc(
+            rec->segments,
+            alloc * sizeof(struct clistones_recorder_segment)),
+        return SU_FALSE);
+    rec->segments = tmp;
+    rec->segment_alloc = alloc;
+  }
+
+  rec->current_segment.closed = time(NULL);
+  rec->segments[rec->segment_count++] = rec->current_segment;
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+clistones_recorder_open_segment(clistones_recorder_t *rec)
+{
+  char *path = NULL;
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  SUBOOL ok = SU_FALSE;
+
+  SU_TRYCATCH(clistones_recorder_close_segment(rec), goto done);
+
+  rec->current_segment.index = rec->next_segment++;
+  rec->current_segment.size  = 0;
+
+  if (rec->params.direct)
+    flags |= O_DIRECT;
+
+  SU_TRYCATCH(
+      path = clistones_recorder_segment_path(
+          rec,
+          rec->current_segment.index,
+          "bin"),
+      goto done);
+
+  if ((rec->fd = open(path, flags, 0644)) == -1) {
+    SU_ERROR("Cannot create raw segment `%s': %s\n", path, strerror(errno));
+    goto done;
+  }
+
+  free(path);
+  SU_TRYCATCH(
+      path = clistones_recorder_segment_path(
+          rec,
+          rec->current_segment.index,
+          "idx"),
+      goto done);
+
+  if ((rec->index_fp = fopen(path, "w")) == NULL) {
+    SU_ERROR("Cannot create segment index `%s': %s\n", path, strerror(errno));
+    goto done;
+  }
+
+  SU_TRYCATCH(
+      fprintf(
+          rec->index_fp,
+          "# FORMAT=%s FRAME_SIZE=%u SAMPLE_RATE=%lu\n"
+          "# OFFSET FIRST_SAMPLE TIMESTAMP_SEC TIMESTAMP_USEC\n",
+          rec->params.format,
+          rec->params.frame_size,
+          (unsigned long) rec->params.fs) > 0,
+      goto done);
+
+  ok = SU_TRUE;
+
+done:
+  if (path != NULL)
+    free(path);
+
+  return ok;
+}
+
+SUPRIVATE SUBOOL
+clistones_recorder_write_chunk(
+    clistones_recorder_t *rec,
+    const struct clistones_recorder_chunk *chunk,
+    const uint8_t *data)
+{
+  size_t left = chunk->used;
+  ssize_t got;
+  int flags;
+
+  if (rec->fd == -1
+      || rec->current_segment.size + chunk->used > rec->params.segment_size)
+    SU_TRYCATCH(clistones_recorder_open_segment(rec), return SU_FALSE);
+
+  /* Partial chunks (only the last one) cannot go through O_DIRECT */
+  if (rec->params.direct && (chunk->used % CLISTONES_RECORDER_ALIGN) != 0) {
+    flags = fcntl(rec->fd, F_GETFL);
+    if (flags != -1)
+      (void) fcntl(rec->fd, F_SETFL, flags & ~O_DIRECT);
+  }
+
+  SU_TRYCATCH(
+      fprintf(
+          rec->index_fp,
+          "%llu %llu %ld %06ld\n",
+          (unsigned long long) rec->current_segment.size,
+          (unsigned long long) chunk->first_sample,
+          (long) chunk->tv.tv_sec,
+          (long) chunk->tv.tv_usec) > 0,
+      return SU_FALSE);
+
+  fflush(rec->index_fp);
+
+  while (left > 0) {
+    if ((got = write(rec->fd, data, left)) == -1) {
+      if (errno == EINTR)
+        continue;
+      SU_ERROR("Cannot write raw samples: %s\n", strerror(errno));
+      return SU_FALSE;
+    }
+
+    data += got;
+    left -= got;
+  }
+
+  rec->current_segment.size += chunk->used;
+  rec->total_bytes          += chunk->used;
+
+  clistones_recorder_apply_retention(rec);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE void *
+clistones_recorder_thread(void *data)
+{
+  clistones_recorder_t *rec = (clistones_recorder_t *) data;
+  const struct clistones_recorder_chunk *chunk;
+  SUBOOL halting = SU_FALSE;
+
+  while (!halting) {
+    sem_wait(&rec->avail);
+
+    /* Read before draining: everything committed before halting is seen */
+    halting = atomic_load_explicit(&rec->halting, memory_order_acquire);
+
+    while ((chunk = clistones_ring_acquire_read(rec->ring)) != NULL) {
+      if (!rec->failed)
+        rec->failed = !clistones_recorder_write_chunk(
+            rec,
+            chunk,
+            rec->pool + clistones_ring_slot_index(rec->ring, chunk)
+              * rec->params.chunk_size);
+
+      clistones_ring_release_read(rec->ring);
+    }
+  }
+
+  (void) clistones_recorder_close_segment(rec);
+
+  return NULL;
+}
+
+void
+clistones_recorder_destroy(clistones_recorder_t *rec)
+{
+  if (rec->thread_running) {
+    if (rec->current != NULL && rec->current->used > 0) {
+      clistones_ring_commit_write(rec->ring);
+      rec->current = NULL;
+    }
+
+    atomic_store_explicit(&rec->halting, SU_TRUE, memory_order_release);
+    sem_post(&rec->avail);
+    pthread_join(rec->thread, NULL);
+  }
+
+  if (rec->dropped > 0)
+    SU_WARNING(
+        "Raw recorder dropped %llu samples (storage too slow)\n",
+        (unsigned long long) rec->dropped);
+
+  if (rec->fd != -1)
+    close(rec->fd);
+
+  if (rec->index_fp != NULL)
+    fclose(rec->index_fp);
+
+  if (rec->have_sem)
+    sem_destroy(&rec->avail);
+
+  if (rec->ring != NULL)
+    clistones_ring_destroy(rec->ring);
+
+  if (rec->pool != NULL)
+    free(rec->pool);
+
+  if (rec->segments != NULL)
+    free(rec->segments);
+
+  if (rec->directory != NULL)
+    free(rec->directory);
+
+  free(rec);
+}
+
+clistones_recorder_t *
+clistones_recorder_new(const struct clistones_recorder_params *params)
+{
+  clistones_recorder_t *new = NULL;
+  size_t pool_size;
+  int err;
+
+  if (params->frame_size == 0
+      || params->chunk_size == 0
+      || (params->chunk_size % CLISTONES_RECORDER_ALIGN) != 0
+      || (params->chunk_size % params->frame_size) != 0
+      || params->segment_size < params->chunk_size) {
+    SU_ERROR("Invalid raw recorder chunk or segment sizes\n");
+    return NULL;
+  }
+
+  SU_TRYCATCH(new = calloc(1, sizeof(clistones_recorder_t)), goto fail);
+
+  new->params = *params;
+  new->fd     = -1;
+  atomic_init(&new->halting, SU_FALSE);
+
+  SU_TRYCATCH(new->directory = strdup(params->directory), goto fail);
+  new->params.directory = new->directory;
+
+  if (mkdir(new->directory, 0755) == -1 && errno != EEXIST) {
+    SU_ERROR(
+        "Failed to create raw capture directory `%s': %s\n",
+        new->directory,
+        strerror(errno));
+    goto fail;
+  }
+
+  SU_TRYCATCH(
+      new->ring = clistones_ring_new(
+          sizeof(struct clistones_recorder_chunk),
+          params->chunks),
+      goto fail);
+
+  /* Chunks are page aligned (O_DIRECT) and touched upfront */
+  pool_size = params->chunk_size * clistones_ring_get_slot_count(new->ring);
+  SU_TRYCATCH(
+      posix_memalign(
+          (void **) &new->pool,
+          CLISTONES_RECORDER_ALIGN,
+          pool_size) == 0,
+      goto fail);
+  memset(new->pool, 0, pool_size);
+
+  SU_TRYCATCH(sem_init(&new->avail, 0, 0) == 0, goto fail);
+  new->have_sem = SU_TRUE;
+
+  if ((err = pthread_create(
+      &new->thread,
+      NULL,
+      clistones_recorder_thread,
+      new)) != 0) {
+    SU_ERROR("Cannot create raw recorder thread: %s\n", strerror(err));
+    goto fail;
+  }
+
+  new->thread_running = SU_TRUE;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_recorder_destroy(new);
+
+  return NULL;
+}
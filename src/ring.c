@@ -0,0 +1,93 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <ring.h>
+
+void
+clistones_ring_prefault(clistones_ring_t *ring)
+{
+  memset(ring->slots, 0, ring->slot_size * ring->slot_count);
+}
+
+void
+clistones_ring_destroy(clistones_ring_t *ring)
+{
+  if (ring->slots != NULL)
+    free(ring->slots);
+
+  free(ring);
+}
+
+clistones_ring_t *
+clistones_ring_new(size_t slot_size, unsigned int slot_count)
+{
+  clistones_ring_t *new = NULL;
+  unsigned int count = 1;
+
+  if (slot_size == 0 || slot_count == 0) {
+    SU_ERROR("Invalid ring dimensions\n");
+    return NULL;
+  }
+
+  while (count < slot_count)
+    count <<= 1;
+
+  SU_TRYCATCH(
+      posix_memalign(
+          (void **) &new,
+          CLISTONES_RING_CACHE_LINE,
+          sizeof(clistones_ring_t)) == 0,
+      goto fail);
+
+  memset(new, 0, sizeof(clistones_ring_t));
+
+  new->slot_size  = slot_size;
+  new->slot_count = count;
+  new->mask       = count - 1;
+
+  atomic_init(&new->head, 0);
+  atomic_init(&new->tail, 0);
+  atomic_init(&new->overflows, 0);
+  atomic_init(&new->high_water, 0);
+
+  SU_TRYCATCH(
+      posix_memalign(
+          (void **) &new->slots,
+          CLISTONES_RING_CACHE_LINE,
+          slot_size * count) == 0,
+      goto fail);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_ring_destroy(new);
+
+  return NULL;
+}
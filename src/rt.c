@@ -0,0 +1,111 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include <rt.h>
+
+SUPRIVATE void
+clistones_rt_print_outcome(const char *what, SUBOOL requested, int err)
+{
+  if (!requested)
+    printf("    %-22s not requested\n", what);
+  else if (err == 0)
+    printf("    %-22s OK\n", what);
+  else
+    printf("    %-22s FAILED (%s)\n", what, strerror(err));
+}
+
+void
+clistones_rt_print_report(const struct clistones_rt_report *report)
+{
+  printf("  %s thread:\n", report->name);
+  clistones_rt_print_outcome(
+      "SCHED_FIFO priority",
+      report->sched_requested,
+      report->sched_err);
+  clistones_rt_print_outcome(
+      "CPU affinity",
+      report->affinity_requested,
+      report->affinity_err);
+}
+
+void
+clistones_rt_setup_thread(
+    const char *name,
+    int prio,
+    int cpu,
+    struct clistones_rt_report *report)
+{
+  struct sched_param param;
+  cpu_set_t set;
+
+  memset(report, 0, sizeof(struct clistones_rt_report));
+  report->name = name;
+
+  if (prio >= 0) {
+    report->sched_requested = SU_TRUE;
+    memset(&param, 0, sizeof(struct sched_param));
+    param.sched_priority = prio;
+    report->sched_err =
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  }
+
+  if (cpu >= 0) {
+    report->affinity_requested = SU_TRUE;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    report->affinity_err =
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+  }
+
+  clistones_rt_prefault_stack();
+}
+
+int
+clistones_rt_lock_memory(void)
+{
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+    return errno;
+
+  return 0;
+}
+
+void
+clistones_rt_prefault_stack(void)
+{
+  volatile unsigned char stack[CLISTONES_RT_STACK_PREFAULT];
+  unsigned int i;
+
+  for (i = 0; i < CLISTONES_RT_STACK_PREFAULT; i += 4096)
+    stack[i] = 0;
+
+  (void) stack;
+}
@@ -0,0 +1,542 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/sigutils.h>
+#include <clistones.h>
+
+/*
+ * Soak test: runs the whole clistones pipeline (detector, event files, CSV
+ * log, statistics and ZHR reports) in realtime mode on a synthetic signal
+ * with echoes at a given rate, paced to several times real time, so that a
+ * night of a meteor shower peak can be checked in minutes. A monitor thread
+ * samples memory and file descriptor use, and every accepted event is
+ * timed from the capture of the block that completed it to the moment it
+ * was queued for writing. It fails if any sample was dropped or any write
+ * failed.
+ */
+
+#define SOAK_DEFAULT_RATE      3000.
+#define SOAK_DEFAULT_SPEED     20.
+#define SOAK_DEFAULT_HOURS     12.
+#define SOAK_MONITOR_MS        250
+#define SOAK_PROGRESS_SECONDS  60
+#define SOAK_WARMUP_SECONDS    10  /* Before the memory and fd baseline */
+
+struct soak_usage {
+  SUBOOL   valid;
+  uint64_t rss;       /* Bytes */
+  unsigned int fds;
+};
+
+struct soak_results {
+  SUBOOL   loop_ok;
+  double   wall;      /* Seconds */
+  double   signal;    /* Seconds */
+  uint64_t echoes;
+  unsigned int events;
+  unsigned long dropped;  /* Blocks */
+  unsigned int high_water;
+  unsigned int slots;
+  unsigned int backlog;
+  uint64_t errors;
+};
+
+struct soak_state {
+  clistones_t *clistones;
+  grow_buf_t latencies;  /* SUFLOAT, milliseconds */
+  atomic_bool stop;
+  atomic_uint events;    /* Counted here for the monitor thread */
+  struct timespec t0;
+
+  /* Written by the monitor thread */
+  struct soak_usage baseline;
+  struct soak_usage peak;
+  struct soak_usage last;
+
+  struct soak_results results;
+};
+
+SUPRIVATE double
+soak_elapsed(const struct timespec *since, const struct timespec *now)
+{
+  return (now->tv_sec - since->tv_sec) + 1e-9 * (now->tv_nsec - since->tv_nsec);
+}
+
+/***************************** Resource usage ********************************/
+SUPRIVATE SUBOOL
+soak_get_usage(struct soak_usage *usage)
+{
+  unsigned long size, resident;
+  struct dirent *ent;
+  FILE *fp;
+  DIR *dir;
+
+  if ((fp = fopen("/proc/self/statm", "r")) == NULL)
+    return SU_FALSE;
+
+  if (fscanf(fp, "%lu %lu", &size, &resident) < 2) {
+    fclose(fp);
+    return SU_FALSE;
+  }
+
+  fclose(fp);
+
+  if ((dir = opendir("/proc/self/fd")) == NULL)
+    return SU_FALSE;
+
+  /* Do not count ".", ".." and the descriptor of dir itself */
+  usage->fds = 0;
+  while ((ent = readdir(dir)) != NULL)
+    if (ent->d_name[0] != '.')
+      ++usage->fds;
+
+  closedir(dir);
+
+  usage->rss   = (uint64_t) resident * sysconf(_SC_PAGESIZE);
+  usage->fds  -= 1;
+  usage->valid = SU_TRUE;
+
+  return SU_TRUE;
+}
+
+SUPRIVATE void *
+soak_monitor_thread(void *data)
+{
+  struct soak_state *state = (struct soak_state *) data;
+  struct soak_usage usage;
+  struct timespec now, delay;
+  double elapsed, last_progress = 0;
+
+  delay.tv_sec  = 0;
+  delay.tv_nsec = SOAK_MONITOR_MS * 1000000l;
+
+  while (!atomic_load(&state->stop)) {
+    nanosleep(&delay, NULL);
+
+    if (!soak_get_usage(&usage))
+      continue;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = soak_elapsed(&state->t0, &now);
+
+    state->last = usage;
+
+    if (elapsed < SOAK_WARMUP_SECONDS)
+      continue;
+
+    if (!state->baseline.valid)
+      state->baseline = state->peak = usage;
+
+    if (usage.rss > state->peak.rss)
+      state->peak.rss = usage.rss;
+
+    if (usage.fds > state->peak.fds)
+      state->peak.fds = usage.fds;
+
+    if (elapsed - last_progress >= SOAK_PROGRESS_SECONDS) {
+      last_progress = elapsed;
+      fprintf(
+          stderr,
+          "soak: %.0f s, %u events, RSS %.1f MiB, %u fds\n",
+          elapsed,
+          atomic_load_explicit(&state->events, memory_order_relaxed),
+          usage.rss / 1048576.,
+          usage.fds);
+    }
+  }
+
+  return NULL;
+}
+
+/******************************** Latency ************************************/
+SUPRIVATE SUBOOL
+soak_on_event(void *privdata, const struct clistones_chirp_summary *summary)
+{
+  struct soak_state *state = (struct soak_state *) privdata;
+  struct timespec now;
+  SUFLOAT ms;
+
+  (void) summary;
+
+  atomic_fetch_add_explicit(&state->events, 1, memory_order_relaxed);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ms = 1e3 * soak_elapsed(clistones_get_block_time(state->clistones), &now);
+
+  return grow_buf_append(&state->latencies, &ms, sizeof(SUFLOAT)) != -1;
+}
+
+SUPRIVATE int
+soak_compare_floats(const void *a, const void *b)
+{
+  SUFLOAT x = *(const SUFLOAT *) a;
+  SUFLOAT y = *(const SUFLOAT *) b;
+
+  return (x > y) - (x < y);
+}
+
+SUPRIVATE SUFLOAT
+soak_percentile(const SUFLOAT *sorted, size_t count, SUFLOAT p)
+{
+  size_t i = (size_t) (p * (count - 1) + SU_ADDSFX(.5));
+
+  return sorted[i];
+}
+
+/******************************** Report *************************************/
+/* Taken before the pipeline is destroyed, printed after its last output */
+SUPRIVATE void
+soak_collect(struct soak_state *state, double wall, SUBOOL loop_ok)
+{
+  struct soak_results *res = &state->results;
+  clistones_t *self = state->clistones;
+  const clistones_synth_t *synth = clistones_source_get_synth(self->source);
+
+  /* Wait for every event file and log line before looking at errors */
+  clistones_writer_drain(self->writer);
+
+  res->loop_ok    = loop_ok;
+  res->wall       = wall;
+  res->signal     = synth->n / (double) CLISTONES_SAMP_RATE;
+  res->echoes     = clistones_synth_get_echoes(synth);
+  res->events     = self->event_count;
+  res->dropped    = clistones_ring_get_overflows(self->capture_ring);
+  res->high_water = clistones_ring_get_high_water(self->capture_ring);
+  res->slots      = self->capture_ring->slot_count;
+  res->backlog    = clistones_writer_get_peak_backlog(self->writer);
+  res->errors     = clistones_writer_get_errors(self->writer);
+}
+
+SUPRIVATE SUBOOL
+soak_report(struct soak_state *state)
+{
+  const struct soak_results *res = &state->results;
+  SUFLOAT *lat = grow_buf_get_buffer(&state->latencies);
+  size_t count = grow_buf_get_size(&state->latencies) / sizeof(SUFLOAT);
+
+  printf("\nSoak test summary\n");
+  printf(
+      "  Signal:            %.2f h in %.1f min (%.1fx real time)\n",
+      res->signal / 3600,
+      res->wall / 60,
+      res->signal / res->wall);
+  printf(
+      "  Echoes:            %lu injected, %u events accepted (%.1f%%)\n",
+      (unsigned long) res->echoes,
+      res->events,
+      res->echoes > 0 ? 1e2 * res->events / res->echoes : 0.);
+  printf(
+      "  Dropped samples:   %lu (%lu blocks)\n",
+      res->dropped * CLISTONES_READ_SIZE,
+      res->dropped);
+  printf(
+      "  Capture ring:      %u of %u slots at most\n",
+      res->high_water,
+      res->slots);
+  printf(
+      "  Writer backlog:    %u requests at most, %lu errors\n",
+      res->backlog,
+      (unsigned long) res->errors);
+
+  if (state->baseline.valid) {
+    printf(
+        "  Memory (RSS):      %.1f MiB after warm-up, %.1f MiB peak, "
+        "%+.1f MiB at the end\n",
+        state->baseline.rss / 1048576.,
+        state->peak.rss / 1048576.,
+        ((double) state->last.rss - (double) state->baseline.rss) / 1048576.);
+    printf(
+        "  File descriptors:  %u after warm-up, %u peak, %u at the end\n",
+        state->baseline.fds,
+        state->peak.fds,
+        state->last.fds);
+  } else {
+    printf("  Memory and file descriptors: run too short to measure\n");
+  }
+
+  if (count > 0) {
+    qsort(lat, count, sizeof(SUFLOAT), soak_compare_floats);
+    printf(
+        "  Event latency:     p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+        "max %.2f ms\n",
+        soak_percentile(lat, count, .5),
+        soak_percentile(lat, count, .9),
+        soak_percentile(lat, count, .99),
+        lat[count - 1]);
+  }
+
+  if (!res->loop_ok)
+    printf("FAIL: the pipeline stopped with an error\n");
+  if (res->dropped > 0)
+    printf("FAIL: samples were dropped (the detector fell behind)\n");
+  if (res->errors > 0)
+    printf("FAIL: some output could not be written\n");
+
+  return res->loop_ok && res->dropped == 0 && res->errors == 0;
+}
+
+/********************************** Main *************************************/
+void
+help(const char *a0)
+{
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, "  %s [OPTIONS]\n\n", a0);
+  fprintf(
+      stderr,
+      "Run the clistones pipeline on synthetic echoes at many times real\n"
+      "time, and report dropped samples, output backlog, memory and file\n"
+      "descriptor use and event latency\n\n");
+  fprintf(stderr, "OPTIONS:\n");
+  fprintf(
+      stderr,
+      "  -r, --rate=N          Echoes per hour (default: %g)\n",
+      SOAK_DEFAULT_RATE);
+  fprintf(
+      stderr,
+      "  -x, --speed=X         Times real time (default: %g)\n",
+      SOAK_DEFAULT_SPEED);
+  fprintf(
+      stderr,
+      "  -t, --hours=H         Hours of signal (default: %g)\n",
+      SOAK_DEFAULT_HOURS);
+  fprintf(stderr, "  -o, --output=DIR      Output directory (a tmpfs, or a throttled disk)\n");
+  fprintf(stderr, "  -S, --seed=N          Seed of the synthetic signal (default: 1)\n");
+  fprintf(stderr, "  -a, --adaptive        Adaptive threshold\n");
+  fprintf(stderr, "  -e, --estimator=EST   Power estimator: iir (default) or boxcar\n");
+  fprintf(stderr, "  -g, --gate=LEVEL      Two-tier trigger, see clistones --gate\n");
+  fprintf(stderr, "  -W, --waterfall       STFT waterfall detector\n");
+  fprintf(stderr, "  -b, --backend=B       Output backend: auto, threads or uring\n");
+  fprintf(stderr, "  -H, --headless        No console output (events and ZHR reports)\n");
+  fprintf(stderr, "  -h, --help            This help\n");
+}
+
+static struct option long_options[] =
+{
+  {"rate",      required_argument, 0, 'r'},
+  {"speed",     required_argument, 0, 'x'},
+  {"hours",     required_argument, 0, 't'},
+  {"output",    required_argument, 0, 'o'},
+  {"seed",      required_argument, 0, 'S'},
+  {"adaptive",  no_argument,       0, 'a'},
+  {"estimator", required_argument, 0, 'e'},
+  {"gate",      required_argument, 0, 'g'},
+  {"waterfall", no_argument,       0, 'W'},
+  {"backend",   required_argument, 0, 'b'},
+  {"headless",  no_argument,       0, 'H'},
+  {"help",      no_argument,       0, 'h'},
+  {0, 0, 0, 0}
+};
+
+int
+main(int argc, char **argv)
+{
+  struct clistones_params params = clistones_params_INITIALIZER;
+  struct clistones_synth_params synth = clistones_synth_params_INITIALIZER;
+  struct soak_state state;
+  struct timespec end;
+  pthread_t monitor;
+  SUBOOL monitor_running = SU_FALSE;
+  SUBOOL loop_ok;
+  SUFLOAT hours = SOAK_DEFAULT_HOURS;
+  int ret = EXIT_FAILURE;
+  int option_index = 0;
+  int c;
+
+  memset(&state, 0, sizeof(struct soak_state));
+  atomic_init(&state.stop, SU_FALSE);
+  atomic_init(&state.events, 0);
+
+  synth.rate  = SOAK_DEFAULT_RATE;
+  synth.speed = SOAK_DEFAULT_SPEED;
+
+  while ((c = getopt_long(
+      argc,
+      argv,
+      "r:x:t:o:S:ae:g:Wb:Hh",
+      long_options,
+      &option_index)) != -1) {
+    switch (c) {
+      case 'r':
+        if (sscanf(optarg, "%g", &synth.rate) < 1 || synth.rate <= 0) {
+          fprintf(stderr, "%s: invalid rate `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'x':
+        if (sscanf(optarg, "%g", &synth.speed) < 1 || synth.speed <= 0) {
+          fprintf(stderr, "%s: invalid speed `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 't':
+        if (sscanf(optarg, "%g", &hours) < 1 || hours <= 0) {
+          fprintf(stderr, "%s: invalid length `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'o':
+        params.output_dir = optarg;
+        break;
+
+      case 'S':
+        if (sscanf(optarg, "%u", &synth.seed) < 1) {
+          fprintf(stderr, "%s: invalid seed `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'a':
+        params.adaptive = SU_TRUE;
+        break;
+
+      case 'e':
+        if (!graves_est_type_from_name(optarg, &params.estimator)) {
+          fprintf(stderr, "%s: invalid estimator `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'g':
+        if (sscanf(optarg, "%g", &params.gate) < 1
+            || params.gate <= 0
+            || params.gate > 1) {
+          fprintf(stderr, "%s: invalid gate level `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'W':
+        params.waterfall = SU_TRUE;
+        break;
+
+      case 'b':
+        if (strcmp(optarg, "auto") == 0) {
+          params.output_backend = CLISTONES_WRITER_BACKEND_AUTO;
+        } else if (strcmp(optarg, "threads") == 0) {
+          params.output_backend = CLISTONES_WRITER_BACKEND_THREADS;
+        } else if (strcmp(optarg, "uring") == 0) {
+          params.output_backend = CLISTONES_WRITER_BACKEND_URING;
+        } else {
+          fprintf(stderr, "%s: invalid backend `%s'\n", argv[0], optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+
+      case 'H':
+        params.headless = SU_TRUE;
+        break;
+
+      case 'h':
+        help(argv[0]);
+        return EXIT_SUCCESS;
+
+      default:
+        help(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (!su_lib_init()) {
+    fprintf(stderr, "%s: failed to initialize library\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  /* Realtime mode, for the capture ring, without privileged setup */
+  synth.fs     = CLISTONES_SAMP_RATE;
+  synth.fc     = params.freq_offset;
+  synth.length = 3600 * hours;
+
+  params.synth    = &synth;
+  params.realtime = SU_TRUE;
+  params.rt.capture_prio  = -1;
+  params.rt.detector_prio = -1;
+  params.rt.lock_memory   = SU_FALSE;
+
+  if ((state.clistones = clistones_new(&params)) == NULL) {
+    fprintf(stderr, "%s: failed to create clistones object\n", argv[0]);
+    goto done;
+  }
+
+  clistones_set_event_callback(state.clistones, soak_on_event, &state);
+
+  printf(
+      "Soak test: %g echoes per hour, %g hours at %gx real time, in %s\n",
+      synth.rate,
+      hours,
+      synth.speed,
+      clistones_data_directory(state.clistones));
+
+  clock_gettime(CLOCK_MONOTONIC, &state.t0);
+
+  if (pthread_create(&monitor, NULL, soak_monitor_thread, &state) != 0) {
+    fprintf(stderr, "%s: cannot create monitor thread\n", argv[0]);
+    goto done;
+  }
+
+  monitor_running = SU_TRUE;
+
+  loop_ok = clistones_loop(state.clistones);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  atomic_store(&state.stop, SU_TRUE);
+  pthread_join(monitor, NULL);
+  monitor_running = SU_FALSE;
+
+  soak_collect(&state, soak_elapsed(&state.t0, &end), loop_ok);
+
+  /* Flushes the console before the report */
+  clistones_destroy(state.clistones);
+  state.clistones = NULL;
+
+  if (soak_report(&state))
+    ret = EXIT_SUCCESS;
+
+done:
+  if (monitor_running) {
+    atomic_store(&state.stop, SU_TRUE);
+    pthread_join(monitor, NULL);
+  }
+
+  if (state.clistones != NULL)
+    clistones_destroy(state.clistones);
+
+  grow_buf_clear(&state.latencies);
+
+  return ret;
+}
@@ -0,0 +1,469 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+#endif /* _GNU_SOURCE */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <source.h>
+
+/******************************* ALSA backend ********************************/
+/* Formats tried when negotiating, widest first */
+SUPRIVATE const enum clistones_sample_format clistones_source_alsa_formats[] = {
+  CLISTONES_SAMPLE_FORMAT_S32_LE,
+  CLISTONES_SAMPLE_FORMAT_F32_LE,
+  CLISTONES_SAMPLE_FORMAT_S16_LE
+};
+
+SUPRIVATE snd_pcm_format_t
+clistones_source_alsa_format(enum clistones_sample_format format)
+{
+  switch (format) {
+    case CLISTONES_SAMPLE_FORMAT_S32_LE:
+      return SND_PCM_FORMAT_S32_LE;
+
+    case CLISTONES_SAMPLE_FORMAT_F32_LE:
+      return SND_PCM_FORMAT_FLOAT_LE;
+
+    default:
+      return SND_PCM_FORMAT_S16_LE;
+  }
+}
+
+SUPRIVATE snd_pcm_t *
+clistones_source_open_alsa(struct clistones_source_params *params)
+{
+  int err;
+  unsigned int i, count;
+  unsigned int rate = params->fs;
+  snd_pcm_t *capture_handle = NULL;
+  snd_pcm_hw_params_t *hw_params = NULL;
+  SUBOOL ok = SU_FALSE;
+
+  if ((err = snd_pcm_open(
+      &capture_handle,
+      params->device,
+      SND_PCM_STREAM_CAPTURE,
+      0)) < 0) {
+    SU_ERROR(
+        "Cannot open audio device `%s' (%s)\n",
+        params->device,
+        snd_strerror(err));
+    goto done;
+  }
+
+  if ((err = snd_pcm_hw_params_malloc(&hw_params)) < 0) {
+    SU_ERROR(
+        "Cannot allocate hardware parameter structure (%s)\n",
+        snd_strerror(err));
+    goto done;
+  }
+
+  if ((err = snd_pcm_hw_params_any(capture_handle, hw_params)) < 0) {
+    SU_ERROR(
+        "Cannot initialize hardware parameter structure (%s)\n",
+        snd_strerror(err));
+    goto done;
+  }
+
+  if ((err = snd_pcm_hw_params_set_access(
+      capture_handle,
+      hw_params,
+      SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+    SU_ERROR("Cannot set access type (%s)\n", snd_strerror (err));
+    goto done;
+  }
+
+  if (params->negotiate) {
+    count = sizeof(clistones_source_alsa_formats)
+        / sizeof(clistones_source_alsa_formats[0]);
+
+    for (i = 0; i < count; ++i)
+      if (snd_pcm_hw_params_test_format(
+          capture_handle,
+          hw_params,
+          clistones_source_alsa_format(clistones_source_alsa_formats[i]))
+          == 0)
+        break;
+
+    if (i == count) {
+      SU_ERROR("The audio device offers no supported sample format\n");
+      goto done;
+    }
+
+    params->format = clistones_source_alsa_formats[i];
+  }
+
+  if ((err = snd_pcm_hw_params_set_format(
+      capture_handle,
+      hw_params,
+      clistones_source_alsa_format(params->format))) < 0) {
+    SU_ERROR("Cannot set sample format (%s)\n", snd_strerror (err));
+    goto done;
+  }
+
+  if ((err = snd_pcm_hw_params_set_rate_near(
+      capture_handle,
+      hw_params,
+      &rate,
+      0)) < 0) {
+    SU_ERROR("Cannot set sample rate (%s)\n", snd_strerror (err));
+    goto done;
+  }
+
+  if (rate != params->fs) {
+    SU_ERROR(
+        "Sample rate %d Hz not supported (offered %d instead)\n",
+        params->fs,
+        rate);
+    goto done;
+  }
+
+  if ((err = snd_pcm_hw_params_set_channels(
+      capture_handle,
+      hw_params,
+      params->channels)) < 0) {
+    SU_ERROR("Cannot set channel count (%s)\n", snd_strerror(err));
+    goto done;
+  }
+
+  if ((err = snd_pcm_hw_params(capture_handle, hw_params)) < 0) {
+    SU_ERROR("Cannot set parameters (%s)\n", snd_strerror(err));
+    goto done;
+  }
+
+  if ((err = snd_pcm_prepare (capture_handle)) < 0) {
+    SU_ERROR(
+        "Cannot prepare audio interface for use (%s)\n",
+        snd_strerror(err));
+    goto done;
+  }
+
+  ok = SU_TRUE;
+
+done:
+  if (hw_params != NULL)
+    snd_pcm_hw_params_free(hw_params);
+
+  if (!ok && capture_handle != NULL) {
+    snd_pcm_close(capture_handle);
+    capture_handle = NULL;
+  }
+
+  return capture_handle;
+}
+
+SUPRIVATE SUBOOL
+clistones_source_read_alsa(clistones_source_t *source, void *block)
+{
+  snd_pcm_sframes_t err;
+
+  if ((err = snd_pcm_readi(source->pcm, block, source->params.block_size))
+      != source->params.block_size) {
+    SU_ERROR(
+        "Error %d while capturing samples: %s\n",
+        (int) err,
+        snd_strerror((int) err));
+    return SU_FALSE;
+  }
+
+  return SU_TRUE;
+}
+
+/****************************** Stream backend *******************************/
+SUPRIVATE SUBOOL
+clistones_source_open_stream(clistones_source_t *source)
+{
+  struct stat sbuf;
+
+  if (strcmp(source->params.path, CLISTONES_SOURCE_STDIN) == 0) {
+    source->fd = STDIN_FILENO;
+  } else if ((source->fd = open(source->params.path, O_RDONLY)) == -1) {
+    SU_ERROR(
+        "Cannot open input stream `%s': %s\n",
+        source->params.path,
+        strerror(errno));
+    return SU_FALSE;
+  }
+
+  if (fstat(source->fd, &sbuf) == 0 && S_ISFIFO(sbuf.st_mode)) {
+    /* Give the writer some slack if we are late. Not fatal if refused. */
+    (void) fcntl(source->fd, F_SETPIPE_SZ, CLISTONES_SOURCE_PIPE_SIZE);
+    source->is_fifo = source->fd != STDIN_FILENO;
+  }
+
+  return SU_TRUE;
+}
+
+/* Wait for more data. Returns SU_FALSE on errors and at the end of input. */
+SUPRIVATE SUBOOL
+clistones_source_fill(clistones_source_t *source)
+{
+  struct pollfd pfd;
+  int timeout = (int) (source->params.stall_timeout * 1000);
+  ssize_t got;
+  int ret;
+
+  for (;;) {
+    pfd.fd      = source->fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    if ((ret = poll(&pfd, 1, timeout > 0 ? timeout : -1)) == -1) {
+      if (errno == EINTR)
+        continue;
+
+      SU_ERROR("Cannot poll input stream: %s\n", strerror(errno));
+      return SU_FALSE;
+    }
+
+    if (ret == 0) {
+      if (!source->stalled) {
+        SU_WARNING(
+            "Input stream stalled: no samples for %g seconds\n",
+            source->params.stall_timeout);
+        source->stalled = SU_TRUE;
+        ++source->stalls;
+      }
+      continue;
+    }
+
+    if ((got = read(
+        source->fd,
+        source->buffer,
+        CLISTONES_SOURCE_READ_SIZE)) == -1) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+
+      SU_ERROR("Cannot read input stream: %s\n", strerror(errno));
+      return SU_FALSE;
+    }
+
+    if (got == 0) {
+      if (!source->is_fifo) {
+        source->eof = SU_TRUE;
+        return SU_FALSE;
+      }
+
+      /* Writer gone: wait for the next one */
+      SU_WARNING(
+          "Writer of `%s' went away, reopening\n",
+          source->params.path);
+      close(source->fd);
+      source->fd = -1;
+      ++source->reopens;
+      SU_TRYCATCH(clistones_source_open_stream(source), return SU_FALSE);
+      continue;
+    }
+
+    if (source->stalled) {
+      SU_INFO("Input stream resumed\n");
+      source->stalled = SU_FALSE;
+    }
+
+    source->buf_len = (size_t) got;
+    source->buf_pos = 0;
+
+    return SU_TRUE;
+  }
+}
+
+SUPRIVATE SUBOOL
+clistones_source_read_stream(clistones_source_t *source, void *block)
+{
+  uint8_t *dest = (uint8_t *) block;
+  size_t size = source->params.block_size * source->frame_size;
+  size_t chunk;
+
+  /* Frames may be split across reads: this works on bytes */
+  while (size > 0) {
+    if (source->buf_pos == source->buf_len)
+      if (!clistones_source_fill(source))
+        return SU_FALSE;
+
+    chunk = source->buf_len - source->buf_pos;
+    if (chunk > size)
+      chunk = size;
+
+    memcpy(dest, source->buffer + source->buf_pos, chunk);
+
+    source->buf_pos += chunk;
+    dest += chunk;
+    size -= chunk;
+  }
+
+  return SU_TRUE;
+}
+
+/**************************** Synthetic backend ******************************/
+SUPRIVATE SUBOOL
+clistones_source_read_synth(clistones_source_t *source, void *block)
+{
+  if (!clistones_synth_read(
+      source->synth,
+      (int16_t *) block,
+      source->params.block_size)) {
+    source->eof = clistones_synth_is_done(source->synth);
+    return SU_FALSE;
+  }
+
+  return SU_TRUE;
+}
+
+/********************************* Common ************************************/
+void
+clistones_source_describe(
+    const clistones_source_t *source,
+    char *buf,
+    size_t size)
+{
+  const char *mode = clistones_source_is_iq(source) ? ", I/Q" : "";
+
+  if (source->params.type == CLISTONES_SOURCE_SYNTH)
+    snprintf(
+        buf,
+        size,
+        "synthetic echoes (%g per hour, %gx real time)",
+        source->params.synth.rate,
+        source->params.synth.speed);
+  else if (source->params.type == CLISTONES_SOURCE_ALSA)
+    snprintf(
+        buf,
+        size,
+        "audio device \"%s\" (%s%s)",
+        source->params.device,
+        clistones_sample_format_name(source->params.format),
+        mode);
+  else if (strcmp(source->params.path, CLISTONES_SOURCE_STDIN) == 0)
+    snprintf(
+        buf,
+        size,
+        "standard input (%s%s)",
+        clistones_sample_format_name(source->params.format),
+        mode);
+  else
+    snprintf(
+        buf,
+        size,
+        "%s \"%s\" (%s%s)",
+        source->is_fifo ? "named pipe" : "file",
+        source->params.path,
+        clistones_sample_format_name(source->params.format),
+        mode);
+}
+
+SUBOOL
+clistones_source_read(clistones_source_t *source, void *block)
+{
+  if (source->params.type == CLISTONES_SOURCE_ALSA)
+    return clistones_source_read_alsa(source, block);
+
+  if (source->params.type == CLISTONES_SOURCE_SYNTH)
+    return clistones_source_read_synth(source, block);
+
+  return clistones_source_read_stream(source, block);
+}
+
+void
+clistones_source_destroy(clistones_source_t *source)
+{
+  if (source->pcm != NULL)
+    snd_pcm_close(source->pcm);
+
+  if (source->synth != NULL)
+    clistones_synth_destroy(source->synth);
+
+  if (source->fd != -1 && source->fd != STDIN_FILENO)
+    close(source->fd);
+
+  if (source->buffer != NULL)
+    free(source->buffer);
+
+  free(source);
+}
+
+clistones_source_t *
+clistones_source_new(const struct clistones_source_params *params)
+{
+  clistones_source_t *new = NULL;
+
+  if (params->block_size == 0) {
+    SU_ERROR("Invalid source block size\n");
+    return NULL;
+  }
+
+  if (params->channels != 1 && params->channels != 2) {
+    SU_ERROR("Sources must have either 1 (real) or 2 (I/Q) channels\n");
+    return NULL;
+  }
+
+  SU_TRYCATCH(new = calloc(1, sizeof(clistones_source_t)), goto fail);
+
+  new->params = *params;
+  new->fd     = -1;
+
+  if (params->type == CLISTONES_SOURCE_ALSA) {
+    /* Sets the negotiated format in new->params */
+    SU_TRYCATCH(
+        new->pcm = clistones_source_open_alsa(&new->params),
+        goto fail);
+  } else if (params->type == CLISTONES_SOURCE_SYNTH) {
+    if (params->channels != 1) {
+      SU_ERROR("The synthetic source is real (one channel) only\n");
+      goto fail;
+    }
+
+    new->params.format   = CLISTONES_SAMPLE_FORMAT_S16_LE;
+    new->params.synth.fs = params->fs;
+    SU_TRYCATCH(
+        new->synth = clistones_synth_new(&new->params.synth),
+        goto fail);
+  } else {
+    SU_TRYCATCH(
+        new->buffer = malloc(CLISTONES_SOURCE_READ_SIZE),
+        goto fail);
+    SU_TRYCATCH(clistones_source_open_stream(new), goto fail);
+  }
+
+  new->frame_size =
+      clistones_sample_format_size(new->params.format) * params->channels;
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_source_destroy(new);
+
+  return NULL;
+}
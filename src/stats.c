@@ -0,0 +1,436 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <stats.h>
+
+/************************** Sliding windows **********************************/
+/* Timestamps need double precision */
+SUPRIVATE double
+clistones_stats_tv_to_secs(const struct timeval *tv)
+{
+  return tv->tv_sec + 1e-6 * tv->tv_usec;
+}
+
+SUPRIVATE void
+clistones_stats_window_init(
+    struct clistones_stats_window *window,
+    const char *name,
+    double span,
+    const struct timeval *start)
+{
+  memset(window, 0, sizeof(struct clistones_stats_window));
+
+  window->name         = name;
+  window->span         = span;
+  window->bucket_width = span / CLISTONES_STATS_WINDOW_BUCKETS;
+  window->head_epoch   = (int64_t) floor(
+      clistones_stats_tv_to_secs(start) / window->bucket_width);
+}
+
+/* Moves the head to `epoch`, expiring the buckets left behind */
+SUPRIVATE void
+clistones_stats_window_advance(
+    struct clistones_stats_window *window,
+    int64_t epoch)
+{
+  int64_t n = epoch - window->head_epoch;
+  unsigned int i;
+
+  if (n <= 0)
+    return;
+
+  if (n >= CLISTONES_STATS_WINDOW_BUCKETS) {
+    memset(window->buckets, 0, sizeof(window->buckets));
+    window->sum = 0;
+    window->head = 0;
+  } else {
+    for (i = 0; i < n; ++i) {
+      window->head = (window->head + 1) % CLISTONES_STATS_WINDOW_BUCKETS;
+      window->sum -= window->buckets[window->head];
+      window->buckets[window->head] = 0;
+    }
+  }
+
+  window->head_epoch = epoch;
+}
+
+SUPRIVATE void
+clistones_stats_window_add(struct clistones_stats_window *window, double t)
+{
+  int64_t epoch = (int64_t) floor(t / window->bucket_width);
+  int64_t age;
+
+  clistones_stats_window_advance(window, epoch);
+
+  /* Slightly out-of-order events land in their own bucket */
+  age = window->head_epoch - epoch;
+  if (age >= CLISTONES_STATS_WINDOW_BUCKETS)
+    return;
+
+  ++window->buckets[
+      (window->head + CLISTONES_STATS_WINDOW_BUCKETS - age)
+      % CLISTONES_STATS_WINDOW_BUCKETS];
+  ++window->sum;
+}
+
+/****************************** Histograms ***********************************/
+SUPRIVATE void
+clistones_stats_hist_init(
+    struct clistones_stats_hist *hist,
+    const char *name,
+    const char *units,
+    SUFLOAT min,
+    SUFLOAT max,
+    SUBOOL log_scale)
+{
+  memset(hist, 0, sizeof(struct clistones_stats_hist));
+
+  hist->name      = name;
+  hist->units     = units;
+  hist->min       = min;
+  hist->max       = max;
+  hist->log_scale = log_scale;
+}
+
+SUPRIVATE SUFLOAT
+clistones_stats_hist_edge(const struct clistones_stats_hist *hist, int i)
+{
+  SUFLOAT x = (SUFLOAT) i / CLISTONES_STATS_HIST_BINS;
+
+  if (hist->log_scale)
+    return hist->min * SU_POW(hist->max / hist->min, x);
+
+  return hist->min + x * (hist->max - hist->min);
+}
+
+SUPRIVATE void
+clistones_stats_hist_add(struct clistones_stats_hist *hist, SUFLOAT value)
+{
+  SUFLOAT x, delta;
+  int bin;
+
+  if (!isfinite(value))
+    return;
+
+  if (hist->log_scale)
+    x = value > hist->min
+        ? SU_LOG(value / hist->min) / SU_LOG(hist->max / hist->min)
+        : 0;
+  else
+    x = (value - hist->min) / (hist->max - hist->min);
+
+  /* Out of range values are accounted in the edge bins */
+  bin = (int) floor(x * CLISTONES_STATS_HIST_BINS);
+  if (bin < 0)
+    bin = 0;
+  else if (bin >= CLISTONES_STATS_HIST_BINS)
+    bin = CLISTONES_STATS_HIST_BINS - 1;
+
+  ++hist->bins[bin];
+
+  if (hist->count == 0) {
+    hist->lowest = hist->highest = value;
+  } else {
+    if (value < hist->lowest)
+      hist->lowest = value;
+    if (value > hist->highest)
+      hist->highest = value;
+  }
+
+  ++hist->count;
+  delta = value - hist->mean;
+  hist->mean += delta / hist->count;
+  hist->m2   += delta * (value - hist->mean);
+}
+
+SUPRIVATE SUFLOAT
+clistones_stats_hist_quantile(
+    const struct clistones_stats_hist *hist,
+    SUFLOAT q)
+{
+  SUFLOAT target, value, lo, hi;
+  uint64_t cum = 0;
+  int i;
+
+  if (hist->count == 0)
+    return 0;
+
+  target = q * hist->count;
+
+  for (i = 0; i < CLISTONES_STATS_HIST_BINS; ++i) {
+    if (hist->bins[i] > 0 && cum + hist->bins[i] >= target) {
+      lo = clistones_stats_hist_edge(hist, i);
+      hi = clistones_stats_hist_edge(hist, i + 1);
+      value = lo + (hi - lo) * (target - cum) / hist->bins[i];
+
+      /* Edge bins are open: stay within the observed range */
+      if (value < hist->lowest)
+        value = hist->lowest;
+      else if (value > hist->highest)
+        value = hist->highest;
+
+      return value;
+    }
+
+    cum += hist->bins[i];
+  }
+
+  return hist->highest;
+}
+
+/******************************** API ****************************************/
+void
+clistones_stats_add_event(
+    clistones_stats_t *stats,
+    const struct timeval *tv,
+    SUFLOAT duration,
+    SUFLOAT mean_snr_db,
+    SUFLOAT max_snr_db,
+    SUFLOAT velocity)
+{
+  double t = clistones_stats_tv_to_secs(tv);
+  unsigned int i;
+
+  for (i = 0; i < CLISTONES_STATS_WINDOW_COUNT; ++i)
+    clistones_stats_window_add(stats->windows + i, t);
+
+  clistones_stats_hist_add(
+      stats->hists + CLISTONES_STATS_HIST_DURATION,
+      duration);
+  clistones_stats_hist_add(
+      stats->hists + CLISTONES_STATS_HIST_MEAN_SNR,
+      mean_snr_db);
+  clistones_stats_hist_add(
+      stats->hists + CLISTONES_STATS_HIST_MAX_SNR,
+      max_snr_db);
+  clistones_stats_hist_add(
+      stats->hists + CLISTONES_STATS_HIST_VELOCITY,
+      velocity);
+
+  ++stats->total;
+}
+
+SUFLOAT
+clistones_stats_get_rate(
+    clistones_stats_t *stats,
+    enum clistones_stats_window_id id,
+    const struct timeval *now)
+{
+  struct clistones_stats_window *window = stats->windows + id;
+  double t = clistones_stats_tv_to_secs(now);
+  double covered, elapsed;
+
+  clistones_stats_window_advance(
+      window,
+      (int64_t) floor(t / window->bucket_width));
+
+  /* The oldest bucket may be partially expired */
+  covered = (CLISTONES_STATS_WINDOW_BUCKETS - 1) * window->bucket_width
+      + (t - window->head_epoch * window->bucket_width);
+  elapsed = t - clistones_stats_tv_to_secs(&stats->start);
+
+  if (elapsed < covered)
+    covered = elapsed;
+
+  if (covered <= 0)
+    return 0;
+
+  return 3600. * window->sum / covered;
+}
+
+SUFLOAT
+clistones_stats_get_quantile(
+    const clistones_stats_t *stats,
+    enum clistones_stats_hist_id hist,
+    SUFLOAT q)
+{
+  return clistones_stats_hist_quantile(stats->hists + hist, q);
+}
+
+SUPRIVATE SUBOOL
+clistones_stats_printf(grow_buf_t *out, const char *fmt, ...)
+{
+  char line[256];
+  va_list ap;
+  int size;
+
+  va_start(ap, fmt);
+  size = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+
+  SU_TRYCATCH(size >= 0 && size < (int) sizeof(line), return SU_FALSE);
+
+  return grow_buf_append(out, line, size) != -1;
+}
+
+SUBOOL
+clistones_stats_format_summary(
+    clistones_stats_t *stats,
+    const struct timeval *now,
+    grow_buf_t *out)
+{
+  const struct clistones_stats_hist *hist;
+  struct timeval sub;
+  unsigned int i, j;
+
+  timersub(now, &stats->start, &sub);
+
+  SU_TRYCATCH(
+      clistones_stats_printf(
+          out,
+          "# clistones statistics summary\n"
+          "TIMESTAMP_SEC = %ld\n"
+          "UPTIME        = %ld\n"
+          "EVENTS        = %llu\n\n"
+          "# Hourly rates (events / hour)\n",
+          (long) now->tv_sec,
+          (long) sub.tv_sec,
+          (unsigned long long) stats->total),
+      return SU_FALSE);
+
+  for (i = 0; i < CLISTONES_STATS_WINDOW_COUNT; ++i)
+    SU_TRYCATCH(
+        clistones_stats_printf(
+            out,
+            "RATE_%-8s = %.3f\n",
+            stats->windows[i].name,
+            clistones_stats_get_rate(stats, i, now)),
+        return SU_FALSE);
+
+  SU_TRYCATCH(
+      clistones_stats_printf(
+          out,
+          "\n# NAME UNITS COUNT MEAN STDDEV MIN P10 P50 P90 MAX\n"),
+      return SU_FALSE);
+
+  for (i = 0; i < CLISTONES_STATS_HIST_COUNT; ++i) {
+    hist = stats->hists + i;
+    SU_TRYCATCH(
+        clistones_stats_printf(
+            out,
+            "%s %s %llu %g %g %g %g %g %g %g\n",
+            hist->name,
+            hist->units,
+            (unsigned long long) hist->count,
+            hist->mean,
+            hist->count > 1 ? SU_SQRT(hist->m2 / (hist->count - 1)) : 0,
+            hist->lowest,
+            clistones_stats_hist_quantile(hist, .1),
+            clistones_stats_hist_quantile(hist, .5),
+            clistones_stats_hist_quantile(hist, .9),
+            hist->highest),
+        return SU_FALSE);
+  }
+
+  SU_TRYCATCH(
+      clistones_stats_printf(out, "\n# HISTOGRAM NAME LOWER UPPER COUNT\n"),
+      return SU_FALSE);
+
+  for (i = 0; i < CLISTONES_STATS_HIST_COUNT; ++i) {
+    hist = stats->hists + i;
+    for (j = 0; j < CLISTONES_STATS_HIST_BINS; ++j)
+      if (hist->bins[j] > 0)
+        SU_TRYCATCH(
+            clistones_stats_printf(
+                out,
+                "%s %g %g %llu\n",
+                hist->name,
+                clistones_stats_hist_edge(hist, j),
+                clistones_stats_hist_edge(hist, j + 1),
+                (unsigned long long) hist->bins[j]),
+            return SU_FALSE);
+  }
+
+  return SU_TRUE;
+}
+
+void
+clistones_stats_destroy(clistones_stats_t *stats)
+{
+  free(stats);
+}
+
+clistones_stats_t *
+clistones_stats_new(const struct timeval *start)
+{
+  clistones_stats_t *new = NULL;
+
+  SU_TRYCATCH(new = calloc(1, sizeof(clistones_stats_t)), return NULL);
+
+  new->start = *start;
+
+  clistones_stats_window_init(
+      new->windows + CLISTONES_STATS_WINDOW_10MIN,
+      "10MIN",
+      600,
+      start);
+  clistones_stats_window_init(
+      new->windows + CLISTONES_STATS_WINDOW_1H,
+      "1H",
+      3600,
+      start);
+  clistones_stats_window_init(
+      new->windows + CLISTONES_STATS_WINDOW_24H,
+      "24H",
+      86400,
+      start);
+
+  clistones_stats_hist_init(
+      new->hists + CLISTONES_STATS_HIST_DURATION,
+      "DURATION",
+      "s",
+      .05,
+      100,
+      SU_TRUE);
+  clistones_stats_hist_init(
+      new->hists + CLISTONES_STATS_HIST_MEAN_SNR,
+      "MEAN_SNR",
+      "dB",
+      0,
+      48,
+      SU_FALSE);
+  clistones_stats_hist_init(
+      new->hists + CLISTONES_STATS_HIST_MAX_SNR,
+      "MAX_SNR",
+      "dB",
+      0,
+      64,
+      SU_FALSE);
+  clistones_stats_hist_init(
+      new->hists + CLISTONES_STATS_HIST_VELOCITY,
+      "VELOCITY",
+      "m/s",
+      -320,
+      320,
+      SU_FALSE);
+
+  return new;
+}
@@ -0,0 +1,169 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <synth.h>
+
+SUPRIVATE const SUFLOAT clistones_synth_amplitudes[] = {.4, .2, .1};
+
+/* Uniform in (0, 1] */
+SUPRIVATE SUFLOAT
+clistones_synth_uniform(clistones_synth_t *synth)
+{
+  synth->seed = synth->seed * 1103515245 + 12345;
+
+  return ((synth->seed >> 8) + 1) / SU_ADDSFX(16777216.);
+}
+
+SUPRIVATE void
+clistones_synth_schedule(clistones_synth_t *synth)
+{
+  SUFLOAT fs = synth->params.fs;
+  SUFLOAT mean_len = SU_ADDSFX(.5) *
+      (CLISTONES_SYNTH_MIN_LEN + CLISTONES_SYNTH_MAX_LEN);
+  SUFLOAT mean_gap = 3600 / synth->params.rate - mean_len;
+  SUFLOAT gap, len, doppler;
+  unsigned int count = sizeof(clistones_synth_amplitudes)
+      / sizeof(clistones_synth_amplitudes[0]);
+
+  /* Exponential gaps, so that echoes arrive as a Poisson process */
+  gap = -mean_gap * SU_LOG(clistones_synth_uniform(synth));
+  if (gap < CLISTONES_SYNTH_MIN_GAP)
+    gap = CLISTONES_SYNTH_MIN_GAP;
+
+  len = CLISTONES_SYNTH_MIN_LEN + clistones_synth_uniform(synth)
+      * (CLISTONES_SYNTH_MAX_LEN - CLISTONES_SYNTH_MIN_LEN);
+  doppler = CLISTONES_SYNTH_DOPPLER
+      * (2 * clistones_synth_uniform(synth) - 1);
+
+  synth->start = synth->end + (SUSCOUNT) (gap * fs);
+  synth->end   = synth->start + (SUSCOUNT) (len * fs);
+  synth->omega = SU_2PI * (synth->params.fc + doppler) / fs;
+  synth->phase = 0;
+  synth->amplitude = clistones_synth_amplitudes[
+      (unsigned int) (clistones_synth_uniform(synth) * count) % count];
+}
+
+/* Sleep until the block that ends at sample n is due */
+SUPRIVATE void
+clistones_synth_pace(clistones_synth_t *synth)
+{
+  struct timespec due;
+  SUFLOAT t = synth->n / (synth->params.fs * synth->params.speed);
+
+  due.tv_sec  = synth->t0.tv_sec + (time_t) t;
+  due.tv_nsec = synth->t0.tv_nsec + (long) (1e9 * (t - (time_t) t));
+  if (due.tv_nsec >= 1000000000) {
+    due.tv_nsec -= 1000000000;
+    ++due.tv_sec;
+  }
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+      == EINTR)
+    continue;
+}
+
+SUBOOL
+clistones_synth_read(
+    clistones_synth_t *synth,
+    int16_t *block,
+    unsigned int len)
+{
+  SUFLOAT x;
+  unsigned int i;
+
+  if (clistones_synth_is_done(synth))
+    return SU_FALSE;
+
+  if (synth->n == 0 && synth->params.speed > 0)
+    clock_gettime(CLOCK_MONOTONIC, &synth->t0);
+
+  for (i = 0; i < len; ++i) {
+    x = CLISTONES_SYNTH_NOISE
+        * (clistones_synth_uniform(synth) - SU_ADDSFX(.5));
+
+    if (synth->n >= synth->start) {
+      if (synth->n == synth->start)
+        ++synth->echoes;
+
+      x += synth->amplitude * SU_SIN(synth->phase);
+      synth->phase += synth->omega;
+      if (synth->phase > SU_2PI)
+        synth->phase -= SU_2PI;
+
+      if (synth->n + 1 == synth->end)
+        clistones_synth_schedule(synth);
+    }
+
+    block[i] = (int16_t) (32767 * x);
+    ++synth->n;
+  }
+
+  if (synth->params.speed > 0)
+    clistones_synth_pace(synth);
+
+  return SU_TRUE;
+}
+
+void
+clistones_synth_destroy(clistones_synth_t *synth)
+{
+  free(synth);
+}
+
+clistones_synth_t *
+clistones_synth_new(const struct clistones_synth_params *params)
+{
+  clistones_synth_t *new = NULL;
+
+  if (params->fs == 0 || params->rate <= 0 || params->speed < 0
+      || params->length < 0) {
+    SU_ERROR("Invalid synthetic signal parameters\n");
+    return NULL;
+  }
+
+  if (SU_ABS(params->fc) + CLISTONES_SYNTH_DOPPLER >= .5 * params->fs) {
+    SU_ERROR("Synthetic echoes fall outside the sampling bandwidth\n");
+    return NULL;
+  }
+
+  SU_TRYCATCH(new = calloc(1, sizeof(clistones_synth_t)), goto fail);
+
+  new->params = *params;
+  new->seed   = params->seed;
+  new->total  = (SUSCOUNT) (params->length * params->fs);
+
+  clistones_synth_schedule(new);
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_synth_destroy(new);
+
+  return NULL;
+}
@@ -0,0 +1,493 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <waterfall.h>
+
+/* Bins marked as signal still update the floor, but much slower */
+#define GRAVES_WF_SIGNAL_BETA_DIV SU_ADDSFX(16.)
+
+void
+graves_wf_destroy(graves_wf_t *wf)
+{
+  unsigned int i;
+
+  for (i = 0; i < GRAVES_WF_MAX_COMPONENTS; ++i)
+    grow_buf_clear(&wf->components[i].track);
+
+  if (wf->plan != NULL)
+    SU_FFTW(_destroy_plan)(wf->plan);
+
+  if (wf->fft_in != NULL)
+    SU_FFTW(_free)(wf->fft_in);
+
+  if (wf->fft_out != NULL)
+    SU_FFTW(_free)(wf->fft_out);
+
+  if (wf->buffer != NULL)
+    free(wf->buffer);
+
+  if (wf->window != NULL)
+    free(wf->window);
+
+  if (wf->power != NULL)
+    free(wf->power);
+
+  if (wf->floor != NULL)
+    free(wf->floor);
+
+  free(wf);
+}
+
+void
+graves_wf_set_center_freq(graves_wf_t *wf, SUFLOAT fc)
+{
+  wf->params.fc = fc;
+  wf->mix = fc != 0;
+  graves_mixer_set_freq(&wf->lo, SU_ABS2NORM_FREQ(wf->params.fs, fc));
+}
+
+SUINLINE SUFLOAT
+graves_wf_bin_to_freq(const graves_wf_t *wf, SUFLOAT bin)
+{
+  return (bin - wf->half) * wf->params.fs / wf->params.fft_size;
+}
+
+/* Compute the power spectrum of the search band, lowest frequency first */
+SUPRIVATE void
+graves_wf_compute_frame(graves_wf_t *wf)
+{
+  unsigned int i;
+  unsigned int mask = wf->params.fft_size - 1;
+  SUCOMPLEX *in  = (SUCOMPLEX *) wf->fft_in;
+  SUCOMPLEX *out = (SUCOMPLEX *) wf->fft_out;
+  int j;
+
+  /* wf->p points to the oldest sample */
+  for (i = 0; i < wf->params.fft_size; ++i)
+    in[i] = wf->buffer[(wf->p + i) & mask] * wf->window[i];
+
+  SU_FFTW(_execute)(wf->plan);
+
+  for (j = 0; j < wf->bins; ++j) {
+    i = (unsigned int) (j - wf->half) & mask;
+    wf->power[j] = SU_C_REAL(out[i] * SU_C_CONJ(out[i]));
+  }
+}
+
+/* Parabolic interpolation of the peak over the logarithm of the power */
+SUPRIVATE SUFLOAT
+graves_wf_interpolate_peak(const graves_wf_t *wf, int peak)
+{
+  SUFLOAT a, b, c, den;
+
+  if (peak == 0 || peak == wf->bins - 1)
+    return peak;
+
+  a = SU_LOG(wf->power[peak - 1] + SU_FLOAT_THRESHOLD);
+  b = SU_LOG(wf->power[peak]     + SU_FLOAT_THRESHOLD);
+  c = SU_LOG(wf->power[peak + 1] + SU_FLOAT_THRESHOLD);
+
+  den = a - 2 * b + c;
+
+  if (den >= 0)
+    return peak;
+
+  return peak + SU_ADDSFX(.5) * (a - c) / den;
+}
+
+/* Find runs of bins above the noise floor and update the floor */
+SUPRIVATE void
+graves_wf_find_segments(graves_wf_t *wf)
+{
+  struct graves_wf_segment *seg = NULL;
+  SUFLOAT thres, snr;
+  SUBOOL marked;
+  int j;
+
+  wf->segment_count = 0;
+
+  for (j = 0; j < wf->bins; ++j) {
+    thres  = wf->params.threshold * wf->floor[j];
+    marked = wf->power[j] > thres;
+
+    if (marked) {
+      snr = wf->power[j] / wf->floor[j] - 1;
+
+      if (seg == NULL && wf->segment_count < GRAVES_WF_MAX_COMPONENTS) {
+        seg = wf->segments + wf->segment_count++;
+        seg->lo    = j;
+        seg->peak  = j;
+        seg->snr   = snr;
+        seg->owner = NULL;
+      }
+
+      if (seg != NULL) {
+        seg->hi = j;
+        if (snr > seg->snr) {
+          seg->snr  = snr;
+          seg->peak = j;
+        }
+      }
+
+      wf->floor[j] +=
+          wf->beta / GRAVES_WF_SIGNAL_BETA_DIV * (wf->power[j] - wf->floor[j]);
+    } else {
+      seg = NULL;
+      wf->floor[j] += wf->beta * (wf->power[j] - wf->floor[j]);
+    }
+  }
+
+  for (j = 0; j < (int) wf->segment_count; ++j)
+    wf->segments[j].freq = graves_wf_bin_to_freq(
+        wf,
+        graves_wf_interpolate_peak(wf, wf->segments[j].peak));
+}
+
+SUPRIVATE SUBOOL
+graves_wf_close_component(graves_wf_t *wf, struct graves_wf_component *comp)
+{
+  struct graves_wf_event_info info;
+  SUSCOUNT start;
+
+  comp->active = SU_FALSE;
+
+  info.duration = (SUFLOAT) (comp->last_frame - comp->first_frame + 1)
+      * wf->hop / wf->params.fs;
+
+  if (info.duration < wf->params.min_duration)
+    return SU_TRUE;
+
+  /* Events are timestamped at the center of their first frame */
+  start = comp->first_frame * wf->hop + wf->params.fft_size / 2;
+
+  info.t0     = start / wf->params.fs;
+  info.t0f    = SU_ASFLOAT(start % wf->params.fs) / wf->params.fs;
+  info.fs     = wf->params.fs;
+  info.hop    = wf->hop;
+  info.f_lo   = graves_wf_bin_to_freq(wf, comp->min_bin);
+  info.f_hi   = graves_wf_bin_to_freq(wf, comp->max_bin);
+  info.length =
+      (unsigned int) (grow_buf_get_size(&comp->track)
+        / sizeof(struct graves_wf_point));
+  info.track  =
+      (const struct graves_wf_point *) grow_buf_get_buffer(&comp->track);
+
+  SU_TRYCATCH((wf->on_event) (wf->privdata, &info), return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+graves_wf_open_component(graves_wf_t *wf, struct graves_wf_segment *seg)
+{
+  struct graves_wf_component *comp = NULL;
+  unsigned int i;
+
+  for (i = 0; i < GRAVES_WF_MAX_COMPONENTS; ++i)
+    if (!wf->components[i].active) {
+      comp = wf->components + i;
+      break;
+    }
+
+  /* All slots busy. Too many simultaneous echoes: drop this one. */
+  if (comp == NULL)
+    return SU_FALSE;
+
+  comp->active      = SU_TRUE;
+  comp->first_frame = wf->frames;
+  comp->min_bin     = seg->lo;
+  comp->max_bin     = seg->hi;
+  grow_buf_shrink(&comp->track);
+
+  seg->owner = comp;
+
+  return SU_TRUE;
+}
+
+/*
+ * Every segment of the current frame is attached to the active component
+ * whose last segment overlaps (or touches) it. When several segments
+ * overlap the same component, the strongest one continues it and the rest
+ * start components of their own.
+ */
+SUPRIVATE SUBOOL
+graves_wf_update_components(graves_wf_t *wf)
+{
+  struct graves_wf_component *comp, *best;
+  struct graves_wf_segment *seg;
+  struct graves_wf_point point;
+  unsigned int i, j;
+  int dist, best_dist;
+
+  for (i = 0; i < wf->segment_count; ++i) {
+    seg = wf->segments + i;
+    best = NULL;
+    best_dist = wf->bins;
+
+    for (j = 0; j < GRAVES_WF_MAX_COMPONENTS; ++j) {
+      comp = wf->components + j;
+      if (!comp->active)
+        continue;
+
+      if (seg->lo > comp->hi + 1 || seg->hi < comp->lo - 1)
+        continue;
+
+      dist = abs(seg->peak - comp->peak);
+      if (dist < best_dist) {
+        best_dist = dist;
+        best = comp;
+      }
+    }
+
+    if (best != NULL) {
+      for (j = 0; j < i; ++j)
+        if (wf->segments[j].owner == best) {
+          if (wf->segments[j].snr < seg->snr)
+            wf->segments[j].owner = NULL;
+          else
+            best = NULL;
+          break;
+        }
+
+      seg->owner = best;
+    }
+  }
+
+  for (i = 0; i < wf->segment_count; ++i) {
+    seg = wf->segments + i;
+    if (seg->owner == NULL)
+      (void) graves_wf_open_component(wf, seg);
+  }
+
+  /* Extend continued components, close the ones that faded out */
+  for (j = 0; j < GRAVES_WF_MAX_COMPONENTS; ++j) {
+    comp = wf->components + j;
+    if (comp->active)
+      ++comp->gap;
+  }
+
+  for (i = 0; i < wf->segment_count; ++i) {
+    seg  = wf->segments + i;
+    comp = seg->owner;
+    if (comp == NULL)
+      continue;
+
+    comp->gap        = 0;
+    comp->last_frame = wf->frames;
+    comp->lo         = seg->lo;
+    comp->hi         = seg->hi;
+    comp->peak       = seg->peak;
+
+    if (seg->lo < comp->min_bin)
+      comp->min_bin = seg->lo;
+    if (seg->hi > comp->max_bin)
+      comp->max_bin = seg->hi;
+
+    point.t    = (SUFLOAT) (wf->frames - comp->first_frame)
+        * wf->hop / wf->params.fs;
+    point.freq = seg->freq;
+    point.snr  = seg->snr;
+
+    SU_TRYCATCH(
+        grow_buf_append(&comp->track, &point, sizeof(point)) != -1,
+        return SU_FALSE);
+  }
+
+  for (j = 0; j < GRAVES_WF_MAX_COMPONENTS; ++j) {
+    comp = wf->components + j;
+    if (comp->active && comp->gap > wf->params.max_gap)
+      SU_TRYCATCH(graves_wf_close_component(wf, comp), return SU_FALSE);
+  }
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+graves_wf_process_frame(graves_wf_t *wf)
+{
+  int j;
+
+  graves_wf_compute_frame(wf);
+
+  if (wf->frames < GRAVES_WF_WARMUP_FRAMES) {
+    /* Initial noise floor: plain average of the first frames */
+    for (j = 0; j < wf->bins; ++j)
+      wf->floor[j] += (wf->power[j] - wf->floor[j]) / (wf->frames + 1);
+  } else {
+    graves_wf_find_segments(wf);
+    SU_TRYCATCH(graves_wf_update_components(wf), return SU_FALSE);
+  }
+
+  ++wf->frames;
+
+  return SU_TRUE;
+}
+
+SUBOOL
+graves_wf_feed(graves_wf_t *wf, SUCOMPLEX x)
+{
+  if (wf->mix)
+    x = graves_mixer_mix_one(&wf->lo, x);
+
+  wf->buffer[wf->p] = x;
+  wf->p = (wf->p + 1) & (wf->params.fft_size - 1);
+  ++wf->n;
+
+  if (++wf->since_frame == wf->hop) {
+    wf->since_frame = 0;
+    if (wf->n >= wf->params.fft_size)
+      SU_TRYCATCH(graves_wf_process_frame(wf), return SU_FALSE);
+  }
+
+  return SU_TRUE;
+}
+
+SUBOOL
+graves_wf_prefault(graves_wf_t *wf, SUSCOUNT samples)
+{
+  size_t size =
+      (samples / wf->hop + 1) * sizeof(struct graves_wf_point);
+  unsigned int i;
+  void *data;
+
+  for (i = 0; i < GRAVES_WF_MAX_COMPONENTS; ++i) {
+    if (wf->components[i].active)
+      continue;
+
+    SU_TRYCATCH(
+        data = grow_buf_alloc(&wf->components[i].track, size),
+        return SU_FALSE);
+    memset(data, 0, size);
+    grow_buf_shrink(&wf->components[i].track);
+  }
+
+  return SU_TRUE;
+}
+
+SUPRIVATE SUBOOL
+graves_wf_check_params(const struct graves_wf_params *params)
+{
+  if (params->fft_size < 16
+      || (params->fft_size & (params->fft_size - 1)) != 0) {
+    SU_ERROR("FFT size must be a power of 2 (and at least 16)\n");
+    return SU_FALSE;
+  }
+
+  if (params->overlap == 0
+      || params->overlap > params->fft_size
+      || (params->fft_size % params->overlap) != 0) {
+    SU_ERROR("Invalid overlap factor %d\n", params->overlap);
+    return SU_FALSE;
+  }
+
+  if (params->max_doppler <= 0 || params->max_doppler >= .5 * params->fs) {
+    SU_ERROR("Doppler search band is outside the sampling bandwidth\n");
+    return SU_FALSE;
+  }
+
+  if (params->threshold <= 1) {
+    SU_ERROR("Per-bin threshold must be greater than 1\n");
+    return SU_FALSE;
+  }
+
+  return SU_TRUE;
+}
+
+graves_wf_t *
+graves_wf_new(
+    const struct graves_wf_params *params,
+    graves_wf_event_cb_t event_fn,
+    void *privdata)
+{
+  graves_wf_t *new = NULL;
+  unsigned int i;
+
+  if (!graves_wf_check_params(params))
+    return NULL;
+
+  SU_TRYCATCH(new = calloc(1, sizeof (graves_wf_t)), goto fail)
+
+  new->params   = *params;
+  new->hop      = params->fft_size / params->overlap;
+  new->on_event = event_fn;
+  new->privdata = privdata;
+
+  new->half = (int) SU_FLOOR(
+      params->max_doppler * params->fft_size / params->fs);
+  if (new->half < 1)
+    new->half = 1;
+  new->bins = 2 * new->half + 1;
+
+  new->beta = 1 - SU_EXP(-SU_ASFLOAT(new->hop) / (params->fs * params->tau));
+
+  graves_mixer_init(&new->lo, SU_ABS2NORM_FREQ(params->fs, params->fc));
+  new->mix = params->fc != 0;
+
+  SU_TRYCATCH(
+      new->buffer = calloc(sizeof(SUCOMPLEX), params->fft_size),
+      goto fail);
+
+  SU_TRYCATCH(
+      new->window = malloc(sizeof(SUFLOAT) * params->fft_size),
+      goto fail);
+
+  SU_TRYCATCH(new->power = calloc(sizeof(SUFLOAT), new->bins), goto fail);
+  SU_TRYCATCH(new->floor = calloc(sizeof(SUFLOAT), new->bins), goto fail);
+
+  SU_TRYCATCH(
+      new->fft_in = SU_FFTW(_malloc)(
+          sizeof(SU_FFTW(_complex)) * params->fft_size),
+      goto fail);
+
+  SU_TRYCATCH(
+      new->fft_out = SU_FFTW(_malloc)(
+          sizeof(SU_FFTW(_complex)) * params->fft_size),
+      goto fail);
+
+  SU_TRYCATCH(
+      new->plan = SU_FFTW(_plan_dft_1d)(
+          params->fft_size,
+          new->fft_in,
+          new->fft_out,
+          FFTW_FORWARD,
+          FFTW_ESTIMATE),
+      goto fail);
+
+  /* Hann window */
+  for (i = 0; i < params->fft_size; ++i)
+    new->window[i] =
+        SU_ADDSFX(.5) * (1 - SU_COS(2 * M_PI * i / params->fft_size));
+
+  return new;
+
+fail:
+  if (new != NULL)
+    graves_wf_destroy(new);
+
+  return NULL;
+}
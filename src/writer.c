@@ -0,0 +1,851 @@
+/*
+
+  Copyright (C) 2021 Gonzalo José Carracedo Carballal
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Lesser General Public License as
+  published by the Free Software Foundation, either version 3 of the
+  License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this program.  If not, see
+  <http://www.gnu.org/licenses/>
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef FILENAME
+#  define FILENAME __FILENAME__
+#endif /* FILENAME */
+
+#include <sigutils/log.h>
+#include <writer.h>
+
+/**************************** Jobs *******************************************/
+SUPRIVATE void
+clistones_writer_job_destroy(struct clistones_writer_job *job)
+{
+  if (job->path != NULL)
+    free(job->path);
+
+  if (job->final_path != NULL)
+    free(job->final_path);
+
+  if (job->data != NULL)
+    free(job->data);
+
+  free(job);
+}
+
+SUPRIVATE struct clistones_writer_job *
+clistones_writer_job_new(
+    enum clistones_writer_job_type type,
+    const void *data,
+    size_t size)
+{
+  struct clistones_writer_job *new = NULL;
+
+  SU_TRYCATCH(new = calloc(1, sizeof(struct clistones_writer_job)), goto fail);
+
+  new->type = type;
+  new->file = -1;
+  new->log  = -1;
+  new->fd   = -1;
+  new->size = size;
+
+  if (size > 0) {
+    SU_TRYCATCH(new->data = malloc(size), goto fail);
+    memcpy(new->data, data, size);
+  }
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_writer_job_destroy(new);
+
+  return NULL;
+}
+
+SUPRIVATE void
+clistones_writer_enqueue(
+    clistones_writer_t *writer,
+    struct clistones_writer_job *job)
+{
+  job->next = NULL;
+
+  if (writer->pending_tail == NULL)
+    writer->pending_head = job;
+  else
+    writer->pending_tail->next = job;
+
+  writer->pending_tail = job;
+  ++writer->pending_count;
+
+  if (writer->pending_count + writer->in_flight > writer->peak_backlog)
+    writer->peak_backlog = writer->pending_count + writer->in_flight;
+}
+
+SUPRIVATE struct clistones_writer_job *
+clistones_writer_dequeue(clistones_writer_t *writer)
+{
+  struct clistones_writer_job *job;
+
+  if ((job = writer->pending_head) != NULL) {
+    writer->pending_head = job->next;
+    if (writer->pending_head == NULL)
+      writer->pending_tail = NULL;
+    --writer->pending_count;
+  }
+
+  return job;
+}
+
+SUPRIVATE void
+clistones_writer_complete(
+    clistones_writer_t *writer,
+    struct clistones_writer_job *job)
+{
+  const char *path;
+
+  if (job->err != 0) {
+    path = job->type == CLISTONES_WRITER_JOB_APPEND
+        ? writer->logs[job->log].path
+        : job->path;
+
+    ++writer->errors;
+    SU_ERROR("Failed to write `%s': %s\n", path, strerror(job->err));
+  }
+
+  if (job->type == CLISTONES_WRITER_JOB_APPEND)
+    writer->logs[job->log].busy = SU_FALSE;
+  else if (job->file != -1)
+    writer->files[job->file].busy = SU_FALSE;
+
+  --writer->in_flight;
+
+  clistones_writer_job_destroy(job);
+}
+
+/*
+ * Turn the staged appends of every idle log into a single job. Since a log
+ * has at most one append in flight, appends are never reordered.
+ */
+SUPRIVATE void
+clistones_writer_stage_logs(clistones_writer_t *writer)
+{
+  struct clistones_writer_job *job;
+  struct clistones_writer_log *log;
+  unsigned int i;
+
+  for (i = 0; i < writer->log_count; ++i) {
+    log = writer->logs + i;
+
+    if (log->busy || grow_buf_get_size(&log->staging) == 0)
+      continue;
+
+    if ((job = clistones_writer_job_new(
+        CLISTONES_WRITER_JOB_APPEND,
+        grow_buf_get_buffer(&log->staging),
+        grow_buf_get_size(&log->staging))) == NULL)
+      continue; /* Retry in the next submission */
+
+    job->log  = (int) i;
+    job->fd   = log->fd;
+    log->busy = SU_TRUE;
+    grow_buf_shrink(&log->staging);
+
+    clistones_writer_enqueue(writer, job);
+  }
+}
+
+/*
+ * Queue the latest replacement of every file that has none in flight.
+ * Otherwise, two of them would write the same temporary file at once.
+ */
+SUPRIVATE void
+clistones_writer_stage_files(clistones_writer_t *writer)
+{
+  struct clistones_writer_file *file;
+  unsigned int i;
+
+  for (i = 0; i < writer->file_count; ++i) {
+    file = writer->files + i;
+
+    if (file->busy || file->next == NULL)
+      continue;
+
+    file->busy = SU_TRUE;
+    clistones_writer_enqueue(writer, file->next);
+    file->next = NULL;
+  }
+}
+
+SUPRIVATE int
+clistones_writer_lookup_file(clistones_writer_t *writer, const char *path)
+{
+  struct clistones_writer_file *file;
+  unsigned int i;
+
+  for (i = 0; i < writer->file_count; ++i)
+    if (strcmp(writer->files[i].path, path) == 0)
+      return (int) i;
+
+  if (writer->file_count == CLISTONES_WRITER_MAX_FILES) {
+    SU_ERROR("Too many replaced files\n");
+    return -1;
+  }
+
+  file = writer->files + writer->file_count;
+  SU_TRYCATCH(file->path = strdup(path), return -1);
+
+  return (int) writer->file_count++;
+}
+
+/************************ Thread pool backend ********************************/
+SUPRIVATE int
+clistones_writer_write_all(int fd, const uint8_t *data, size_t size)
+{
+  ssize_t got;
+
+  while (size > 0) {
+    if ((got = write(fd, data, size)) == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+
+    data += got;
+    size -= got;
+  }
+
+  return 0;
+}
+
+SUPRIVATE void
+clistones_writer_perform(struct clistones_writer_job *job)
+{
+  int fd;
+
+  if (job->type == CLISTONES_WRITER_JOB_CREATE) {
+    if ((fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+      job->err = errno;
+      return;
+    }
+
+    job->err = clistones_writer_write_all(fd, job->data, job->size);
+
+    if (close(fd) == -1 && job->err == 0)
+      job->err = errno;
+
+    if (job->err == 0
+        && job->final_path != NULL
+        && rename(job->path, job->final_path) == -1)
+      job->err = errno;
+  } else {
+    job->err = clistones_writer_write_all(job->fd, job->data, job->size);
+  }
+}
+
+SUPRIVATE void *
+clistones_writer_worker(void *data)
+{
+  clistones_writer_t *writer = (clistones_writer_t *) data;
+  struct clistones_writer_job *job;
+
+  for (;;) {
+    pthread_mutex_lock(&writer->mutex);
+
+    while (writer->queue_head == NULL && !writer->halting)
+      pthread_cond_wait(&writer->queue_cond, &writer->mutex);
+
+    if ((job = writer->queue_head) == NULL) {
+      pthread_mutex_unlock(&writer->mutex);
+      break;
+    }
+
+    writer->queue_head = job->next;
+    if (writer->queue_head == NULL)
+      writer->queue_tail = NULL;
+
+    pthread_mutex_unlock(&writer->mutex);
+
+    clistones_writer_perform(job);
+
+    pthread_mutex_lock(&writer->mutex);
+    job->next = writer->done;
+    writer->done = job;
+    pthread_cond_signal(&writer->done_cond);
+    pthread_mutex_unlock(&writer->mutex);
+  }
+
+  return NULL;
+}
+
+SUPRIVATE void
+clistones_writer_threads_submit(clistones_writer_t *writer)
+{
+  if (writer->pending_head == NULL)
+    return;
+
+  pthread_mutex_lock(&writer->mutex);
+
+  if (writer->queue_tail == NULL)
+    writer->queue_head = writer->pending_head;
+  else
+    writer->queue_tail->next = writer->pending_head;
+
+  writer->queue_tail = writer->pending_tail;
+
+  pthread_cond_broadcast(&writer->queue_cond);
+  pthread_mutex_unlock(&writer->mutex);
+
+  writer->in_flight    += writer->pending_count;
+  writer->pending_head  = writer->pending_tail = NULL;
+  writer->pending_count = 0;
+}
+
+SUPRIVATE void
+clistones_writer_threads_reap(clistones_writer_t *writer, SUBOOL wait)
+{
+  struct clistones_writer_job *job, *next;
+
+  pthread_mutex_lock(&writer->mutex);
+
+  if (wait)
+    while (writer->done == NULL)
+      pthread_cond_wait(&writer->done_cond, &writer->mutex);
+
+  job = writer->done;
+  writer->done = NULL;
+
+  pthread_mutex_unlock(&writer->mutex);
+
+  while (job != NULL) {
+    next = job->next;
+    clistones_writer_complete(writer, job);
+    job = next;
+  }
+}
+
+SUPRIVATE SUBOOL
+clistones_writer_threads_init(clistones_writer_t *writer)
+{
+  unsigned int i;
+  int err;
+
+  SU_TRYCATCH(writer->params.threads > 0, return SU_FALSE);
+
+  if (pthread_mutex_init(&writer->mutex, NULL) != 0
+      || pthread_cond_init(&writer->queue_cond, NULL) != 0
+      || pthread_cond_init(&writer->done_cond, NULL) != 0) {
+    SU_ERROR("Cannot initialize writer thread pool\n");
+    return SU_FALSE;
+  }
+
+  writer->have_sync = SU_TRUE;
+
+  SU_TRYCATCH(
+      writer->workers = calloc(writer->params.threads, sizeof(pthread_t)),
+      return SU_FALSE);
+
+  for (i = 0; i < writer->params.threads; ++i) {
+    if ((err = pthread_create(
+        writer->workers + i,
+        NULL,
+        clistones_writer_worker,
+        writer)) != 0) {
+      SU_ERROR("Cannot create writer thread: %s\n", strerror(err));
+      return SU_FALSE;
+    }
+
+    ++writer->worker_count;
+  }
+
+  return SU_TRUE;
+}
+
+/************************** io_uring backend *********************************/
+#ifdef HAVE_LIBURING
+SUPRIVATE SUBOOL
+clistones_writer_uring_reserve(clistones_writer_t *writer, unsigned int sqes)
+{
+  if (io_uring_sq_space_left(&writer->ring) < sqes)
+    (void) io_uring_submit(&writer->ring);
+
+  return io_uring_sq_space_left(&writer->ring) >= sqes;
+}
+
+/*
+ * Event files are created with a hard-linked open / write / close chain
+ * on a fixed file slot, so the three operations cost a single submission
+ * and no file descriptor ever goes back to userspace.
+ */
+SUPRIVATE SUBOOL
+clistones_writer_uring_prepare(
+    clistones_writer_t *writer,
+    struct clistones_writer_job *job)
+{
+  struct io_uring_sqe *sqe;
+
+  if (job->type == CLISTONES_WRITER_JOB_CREATE) {
+    if (writer->free_count == 0
+        || !clistones_writer_uring_reserve(writer, 3))
+      return SU_FALSE;
+
+    job->slot    = writer->free_slots[--writer->free_count];
+    job->pending = 3;
+
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_openat_direct(
+        sqe,
+        AT_FDCWD,
+        job->path,
+        O_WRONLY | O_CREAT | O_TRUNC,
+        0644,
+        job->slot);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+    io_uring_sqe_set_data(sqe, job);
+
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_write(sqe, job->slot, job->data, job->size, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK);
+    io_uring_sqe_set_data(sqe, job);
+
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_close_direct(sqe, job->slot);
+    io_uring_sqe_set_data(sqe, job);
+  } else if (job->type == CLISTONES_WRITER_JOB_RENAME) {
+    if (!clistones_writer_uring_reserve(writer, 1))
+      return SU_FALSE;
+
+    job->pending = 1;
+
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_renameat(
+        sqe,
+        AT_FDCWD,
+        job->path,
+        AT_FDCWD,
+        job->final_path,
+        0);
+    io_uring_sqe_set_data(sqe, job);
+  } else {
+    if (!clistones_writer_uring_reserve(writer, 1))
+      return SU_FALSE;
+
+    job->pending = 1;
+
+    /* Offset -1: current position, i.e. the end of an O_APPEND file */
+    sqe = io_uring_get_sqe(&writer->ring);
+    io_uring_prep_write(sqe, job->fd, job->data, job->size, (__u64) -1);
+    io_uring_sqe_set_data(sqe, job);
+  }
+
+  return SU_TRUE;
+}
+
+SUPRIVATE void
+clistones_writer_uring_submit(clistones_writer_t *writer)
+{
+  /* Requests that do not fit now stay pending, in order */
+  while (writer->pending_head != NULL
+      && clistones_writer_uring_prepare(writer, writer->pending_head)) {
+    (void) clistones_writer_dequeue(writer);
+    ++writer->in_flight;
+  }
+
+  (void) io_uring_submit(&writer->ring);
+}
+
+SUPRIVATE void
+clistones_writer_uring_on_cqe(
+    clistones_writer_t *writer,
+    const struct io_uring_cqe *cqe)
+{
+  struct clistones_writer_job *job = io_uring_cqe_get_data(cqe);
+
+  if (job->err == 0) {
+    if (cqe->res < 0)
+      job->err = -cqe->res;
+    else if (cqe->res > 0 && (size_t) cqe->res != job->size)
+      job->err = EIO; /* Short write */
+  }
+
+  if (--job->pending == 0) {
+    if (job->type == CLISTONES_WRITER_JOB_CREATE) {
+      writer->free_slots[writer->free_count++] = job->slot;
+
+      /* Replacements are renamed once the contents are safely written */
+      if (job->final_path != NULL && job->err == 0) {
+        job->type = CLISTONES_WRITER_JOB_RENAME;
+        job->next = writer->pending_head;
+        writer->pending_head = job;
+        if (writer->pending_tail == NULL)
+          writer->pending_tail = job;
+        ++writer->pending_count;
+        --writer->in_flight;
+        return;
+      }
+    }
+
+    clistones_writer_complete(writer, job);
+  }
+}
+
+SUPRIVATE void
+clistones_writer_uring_reap(clistones_writer_t *writer, SUBOOL wait)
+{
+  struct io_uring_cqe *cqe;
+
+  if (wait && io_uring_wait_cqe(&writer->ring, &cqe) == 0) {
+    clistones_writer_uring_on_cqe(writer, cqe);
+    io_uring_cqe_seen(&writer->ring, cqe);
+  }
+
+  while (io_uring_peek_cqe(&writer->ring, &cqe) == 0) {
+    clistones_writer_uring_on_cqe(writer, cqe);
+    io_uring_cqe_seen(&writer->ring, cqe);
+  }
+}
+
+SUPRIVATE SUBOOL
+clistones_writer_uring_init(clistones_writer_t *writer)
+{
+  unsigned int i;
+
+  if (io_uring_queue_init(
+      3 * writer->params.depth + CLISTONES_WRITER_MAX_LOGS,
+      &writer->ring,
+      0) < 0)
+    return SU_FALSE;
+
+  /* Sparse fixed file tables need Linux 5.19 */
+  if (io_uring_register_files_sparse(&writer->ring, writer->params.depth) < 0)
+    goto fail;
+
+  SU_TRYCATCH(
+      writer->free_slots = malloc(writer->params.depth * sizeof(unsigned int)),
+      goto fail);
+
+  for (i = 0; i < writer->params.depth; ++i)
+    writer->free_slots[i] = writer->params.depth - i - 1;
+
+  writer->free_count = writer->params.depth;
+  writer->have_ring  = SU_TRUE;
+
+  return SU_TRUE;
+
+fail:
+  io_uring_queue_exit(&writer->ring);
+
+  return SU_FALSE;
+}
+#endif /* HAVE_LIBURING */
+
+/***************************** API *******************************************/
+const char *
+clistones_writer_get_backend_name(const clistones_writer_t *writer)
+{
+  return writer->backend == CLISTONES_WRITER_BACKEND_URING
+      ? "io_uring"
+      : "thread pool";
+}
+
+int
+clistones_writer_open_log(clistones_writer_t *writer, const char *path)
+{
+  struct clistones_writer_log *log;
+
+  if (writer->log_count == CLISTONES_WRITER_MAX_LOGS) {
+    SU_ERROR("Too many log files\n");
+    return -1;
+  }
+
+  log = writer->logs + writer->log_count;
+
+  SU_TRYCATCH(log->path = strdup(path), return -1);
+
+  if ((log->fd = open(
+      path,
+      O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+      0644)) == -1) {
+    SU_ERROR("Failed to create log file `%s': %s\n", path, strerror(errno));
+    free(log->path);
+    log->path = NULL;
+    return -1;
+  }
+
+  return (int) writer->log_count++;
+}
+
+SUBOOL
+clistones_writer_create_file(
+    clistones_writer_t *writer,
+    const char *path,
+    const void *data,
+    size_t size)
+{
+  struct clistones_writer_job *job = NULL;
+
+  SU_TRYCATCH(
+      job = clistones_writer_job_new(CLISTONES_WRITER_JOB_CREATE, data, size),
+      goto fail);
+
+  SU_TRYCATCH(job->path = strdup(path), goto fail);
+
+  clistones_writer_enqueue(writer, job);
+
+  if (writer->pending_count >= writer->params.batch)
+    clistones_writer_submit(writer);
+
+  return SU_TRUE;
+
+fail:
+  if (job != NULL)
+    clistones_writer_job_destroy(job);
+
+  return SU_FALSE;
+}
+
+SUBOOL
+clistones_writer_replace_file(
+    clistones_writer_t *writer,
+    const char *path,
+    const void *data,
+    size_t size)
+{
+  struct clistones_writer_file *file;
+  struct clistones_writer_job *job = NULL;
+  int index;
+
+  SU_TRYCATCH(
+      (index = clistones_writer_lookup_file(writer, path)) != -1,
+      goto fail);
+
+  SU_TRYCATCH(
+      job = clistones_writer_job_new(CLISTONES_WRITER_JOB_CREATE, data, size),
+      goto fail);
+
+  SU_TRYCATCH(job->path = strbuild("%s.tmp", path), goto fail);
+  SU_TRYCATCH(job->final_path = strdup(path), goto fail);
+  job->file = index;
+
+  /* Superseded before it could be submitted */
+  file = writer->files + index;
+  if (file->next != NULL)
+    clistones_writer_job_destroy(file->next);
+
+  file->next = job;
+
+  return SU_TRUE;
+
+fail:
+  if (job != NULL)
+    clistones_writer_job_destroy(job);
+
+  return SU_FALSE;
+}
+
+SUBOOL
+clistones_writer_append(
+    clistones_writer_t *writer,
+    int log,
+    const void *data,
+    size_t size)
+{
+  SU_TRYCATCH(log >= 0 && log < (int) writer->log_count, return SU_FALSE);
+
+  SU_TRYCATCH(
+      grow_buf_append(&writer->logs[log].staging, data, size) != -1,
+      return SU_FALSE);
+
+  return SU_TRUE;
+}
+
+SUBOOL
+clistones_writer_append_printf(
+    clistones_writer_t *writer,
+    int log,
+    const char *fmt,
+    ...)
+{
+  char line[CLISTONES_WRITER_MAX_LINE];
+  va_list ap;
+  int size;
+
+  va_start(ap, fmt);
+  size = vsnprintf(line, sizeof(line), fmt, ap);
+  va_end(ap);
+
+  SU_TRYCATCH(size >= 0 && size < (int) sizeof(line), return SU_FALSE);
+
+  return clistones_writer_append(writer, log, line, size);
+}
+
+void
+clistones_writer_submit(clistones_writer_t *writer)
+{
+  clistones_writer_stage_logs(writer);
+  clistones_writer_stage_files(writer);
+
+#ifdef HAVE_LIBURING
+  if (writer->backend == CLISTONES_WRITER_BACKEND_URING) {
+    clistones_writer_uring_submit(writer);
+    return;
+  }
+#endif /* HAVE_LIBURING */
+
+  clistones_writer_threads_submit(writer);
+}
+
+SUPRIVATE void
+clistones_writer_reap(clistones_writer_t *writer, SUBOOL wait)
+{
+#ifdef HAVE_LIBURING
+  if (writer->backend == CLISTONES_WRITER_BACKEND_URING) {
+    clistones_writer_uring_reap(writer, wait);
+    return;
+  }
+#endif /* HAVE_LIBURING */
+
+  clistones_writer_threads_reap(writer, wait);
+}
+
+void
+clistones_writer_poll(clistones_writer_t *writer)
+{
+  if (writer->in_flight > 0)
+    clistones_writer_reap(writer, SU_FALSE);
+
+  clistones_writer_submit(writer);
+}
+
+void
+clistones_writer_drain(clistones_writer_t *writer)
+{
+  for (;;) {
+    clistones_writer_submit(writer);
+
+    if (writer->in_flight == 0)
+      break;
+
+    clistones_writer_reap(writer, SU_TRUE);
+  }
+}
+
+void
+clistones_writer_destroy(clistones_writer_t *writer)
+{
+  struct clistones_writer_job *job;
+  unsigned int i;
+
+  if (writer->backend != CLISTONES_WRITER_BACKEND_AUTO)
+    clistones_writer_drain(writer);
+
+  if (writer->worker_count > 0) {
+    pthread_mutex_lock(&writer->mutex);
+    writer->halting = SU_TRUE;
+    pthread_cond_broadcast(&writer->queue_cond);
+    pthread_mutex_unlock(&writer->mutex);
+
+    for (i = 0; i < writer->worker_count; ++i)
+      pthread_join(writer->workers[i], NULL);
+  }
+
+  if (writer->workers != NULL)
+    free(writer->workers);
+
+  if (writer->have_sync) {
+    pthread_cond_destroy(&writer->done_cond);
+    pthread_cond_destroy(&writer->queue_cond);
+    pthread_mutex_destroy(&writer->mutex);
+  }
+
+#ifdef HAVE_LIBURING
+  if (writer->have_ring)
+    io_uring_queue_exit(&writer->ring);
+
+  if (writer->free_slots != NULL)
+    free(writer->free_slots);
+#endif /* HAVE_LIBURING */
+
+  while ((job = clistones_writer_dequeue(writer)) != NULL)
+    clistones_writer_job_destroy(job);
+
+  for (i = 0; i < writer->log_count; ++i) {
+    if (writer->logs[i].fd != -1)
+      close(writer->logs[i].fd);
+
+    if (writer->logs[i].path != NULL)
+      free(writer->logs[i].path);
+
+    grow_buf_clear(&writer->logs[i].staging);
+  }
+
+  for (i = 0; i < writer->file_count; ++i) {
+    if (writer->files[i].next != NULL)
+      clistones_writer_job_destroy(writer->files[i].next);
+
+    free(writer->files[i].path);
+  }
+
+  free(writer);
+}
+
+clistones_writer_t *
+clistones_writer_new(const struct clistones_writer_params *params)
+{
+  clistones_writer_t *new = NULL;
+
+  if (params->depth == 0 || params->batch == 0) {
+    SU_ERROR("Writer depth and batch size must be greater than 0\n");
+    return NULL;
+  }
+
+  SU_TRYCATCH(new = calloc(1, sizeof(clistones_writer_t)), goto fail);
+
+  new->params  = *params;
+  new->backend = CLISTONES_WRITER_BACKEND_AUTO;
+
+#ifdef HAVE_LIBURING
+  if (params->backend != CLISTONES_WRITER_BACKEND_THREADS) {
+    if (clistones_writer_uring_init(new)) {
+      new->backend = CLISTONES_WRITER_BACKEND_URING;
+    } else if (params->backend == CLISTONES_WRITER_BACKEND_URING) {
+      SU_ERROR("io_uring is not available in this system\n");
+      goto fail;
+    }
+  }
+#else
+  if (params->backend == CLISTONES_WRITER_BACKEND_URING) {
+    SU_ERROR("io_uring support was not enabled at build time\n");
+    goto fail;
+  }
+#endif /* HAVE_LIBURING */
+
+  if (new->backend == CLISTONES_WRITER_BACKEND_AUTO) {
+    SU_TRYCATCH(clistones_writer_threads_init(new), goto fail);
+    new->backend = CLISTONES_WRITER_BACKEND_THREADS;
+  }
+
+  return new;
+
+fail:
+  if (new != NULL)
+    clistones_writer_destroy(new);
+
+  return NULL;
+}